@@ -11,386 +11,608 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
 #include <linux/types.h>
-#include <dirent.h>
 
-#include "nvme-tcp.h"
+#include "acdc.h"
+#include "crc32c.h"
+#include "cdc.h"
+#include "host.h"
+#include "wheel.h"
+#include "auth.h"
 
-int icreq(int sfd)
+void icreq_init(struct nvme_tcp_icreq_pdu *icreq, __u8 digest)
 {
-	struct nvme_tcp_icreq_pdu icreq;
-	ssize_t len;
-	char buf[1024];
-
-	memset(&icreq, 0, sizeof(icreq));
-	icreq.hdr.type = nvme_tcp_icreq;
-	icreq.hdr.hlen = sizeof(icreq);
-	icreq.hdr.plen = htole32(sizeof(icreq));
-	icreq.hdr.flags = NVME_TCP_F_KDCONN;
-	icreq.pfv = htole16(NVME_TCP_PFV_1_0);
-	len = write(sfd, &icreq, sizeof(icreq));
-	if (len < sizeof(icreq)) {
-		perror("send icreq");
-		return len;
-	}
-	len = read(sfd, buf, sizeof(buf));
-	if (len > 0) {
-		struct nvme_tcp_icresp_pdu *icresp;
-
-		icresp = (struct nvme_tcp_icresp_pdu *)buf;
-		if (icresp->hdr.type != nvme_tcp_icresp) {
-			fprintf(stderr, "Not an icresp PDU\n");
-			return -1;
-		}
-		if (le32toh(icresp->hdr.plen) != sizeof(*icresp)) {
-			fprintf(stderr, "Invalid icresp PDU len\n");
-			return -1;
-		}
-		if (icresp->pfv != NVME_TCP_PFV_1_0) {
-			fprintf(stderr, "Unhandled icresp PFV %d\n",
-				icresp->pfv);
-			return -1;
-		}
-	}
-	return len;
+	memset(icreq, 0, sizeof(*icreq));
+	icreq->hdr.type = nvme_tcp_icreq;
+	icreq->hdr.hlen = sizeof(*icreq);
+	icreq->hdr.plen = htole32(sizeof(*icreq));
+	icreq->hdr.flags = NVME_TCP_F_KDCONN;
+	icreq->pfv = htole16(NVME_TCP_PFV_1_0);
+	icreq->digest = digest;
 }
 
-char *kdreq(int sfd, char **reg, int numreg)
+int icresp_check(struct nvme_tcp_icresp_pdu *icresp)
 {
-	char buf[1024], *ptr;
-	struct nvme_tcp_kdreq_pdu *kdreq;
-	struct nvme_tcp_kickstart_rec *krec;
-	struct nvme_tcp_kdresp_pdu *kdresp;
-	unsigned int krec_offset, kdreq_len = sizeof(*kdreq);
-	int i, nr = 0;
-	ssize_t len;
-
-	krec_offset = kdreq_len;
-	memset(buf, 0, sizeof(buf));
-	kdreq = (struct nvme_tcp_kdreq_pdu *)buf;
-	kdreq->hdr.type = nvme_tcp_kdreq;
-	kdreq->hdr.hlen = krec_offset;
-	kdreq->hdr.flags = (1 << 6);
-	kdreq->hdr.pdo = krec_offset;
-	kdreq_len += sizeof(*krec) * numreg;
-	kdreq->hdr.plen = htole16(kdreq_len);
-	kdreq->numdie = htole16(1);
-	for (i = 0; i < numreg; i++) {
-		char *rec = reg[i], *reg_addr, *index;
-		const char *reg_port = "8009";
-
-		krec = (struct nvme_tcp_kickstart_rec *)(buf + krec_offset);
-		memset(krec, 0, sizeof(*krec));
-		index = strsep(&rec, ",");
-		if (!index)
-			index = "<>";
-		ptr = strsep(&rec, ",");
-		if (!strncmp(ptr, "tcp", 3)) {
-			krec->trtype = NVMF_TRTYPE_TCP;
-			krec->adrfam = NVMF_ADDR_FAMILY_IP4;
-		} else if (!strncmp(ptr, "fc", 2)) {
-			krec->trtype = NVMF_TRTYPE_FC;
-			krec->adrfam = NVMF_ADDR_FAMILY_FC;
-		} else if (!strncmp(ptr, "rdma", 4)) {
-			krec->trtype = NVMF_TRTYPE_RDMA;
-			krec->adrfam = NVMF_ADDR_FAMILY_IP4;
-		} else {
-			fprintf(stderr,
-				"rec %d (port %s): unhandled trtype %s\n",
-				i, index, ptr);
-			continue;
-		}
-		if (!rec) {
-			fprintf(stderr,
-				"rec %d (port %s): no traddr specified\n",
-				i, index);
-			continue;
-		}
-		reg_addr = strsep(&rec, ",");
-		if (!rec) {
-			if (strchr(reg_addr,':'))
-				krec->adrfam = NVMF_ADDR_FAMILY_IP6;
-			else
-				krec->adrfam = NVMF_ADDR_FAMILY_IP4;
-		} else {
-			ptr = strsep(&rec, ",");
-			if (!strncmp(ptr, "ipv4", 4))
-				krec->adrfam = NVMF_ADDR_FAMILY_IP4;
-			else if (!strncmp(ptr, "ipv6", 4))
-				krec->adrfam = NVMF_ADDR_FAMILY_IP6;
-			else if (!strncmp(ptr, "fc", 2))
-				krec->adrfam = NVMF_ADDR_FAMILY_FC;
-			else if (!strncmp(ptr, "ib", 2))
-				krec->adrfam = NVMF_ADDR_FAMILY_IB;
-			ptr = rec;
-		}
-		if (ptr && strlen(ptr))
-			reg_port = ptr;
-
-		memcpy(krec->trsvcid, reg_port, strlen(reg_port));
-		memcpy(krec->traddr, reg_addr, strlen(reg_addr));
-		krec_offset += sizeof(*krec);
-		nr++;
+	if (icresp->hdr.type != nvme_tcp_icresp) {
+		fprintf(stderr, "Not an icresp PDU\n");
+		return -1;
 	}
-	kdreq->numkr = htole16(nr);
-	len = write(sfd, kdreq, kdreq_len);
-	if (len < kdreq_len) {
-		perror("send kdreq");
-		return NULL;
+	if (le32toh(icresp->hdr.plen) != sizeof(*icresp)) {
+		fprintf(stderr, "Invalid icresp PDU len\n");
+		return -1;
 	}
-	memset(buf, 0, sizeof(buf));
-	len = read(sfd, buf, sizeof(buf));
-	if (len < 0) {
-		perror("read kdresp");
-		return NULL;
+	if (icresp->pfv != NVME_TCP_PFV_1_0) {
+		fprintf(stderr, "Unhandled icresp PFV %d\n",
+			icresp->pfv);
+		return -1;
 	}
-	if (!len) {
-		fprintf(stderr, "Connection closed by peer\n");
+	return 0;
+}
+
+/*
+ * Validate a KDResp PDU carrying @nqn_len bytes of NQN in @nqn.
+ * Returns the CDC NQN on success.
+ */
+char *kdresp_check(struct nvme_tcp_kdresp_pdu *kdresp,
+		   const char *nqn, size_t nqn_len)
+{
+	if (kdresp->ksstat != 0) {
+		fprintf(stderr, "Kickstart failed, reason %d\n",
+			kdresp->failrsn);
 		return NULL;
 	}
-	kdresp = (struct nvme_tcp_kdresp_pdu *)buf;
-	if (kdresp->hdr.type != nvme_tcp_kdresp) {
-		fprintf(stderr, "Invalid kdresp PDU type %d\n",
-			kdresp->hdr.type);
-		return NULL;
+	if (nqn_len > NVMF_NQN_FIELD_LEN)
+		nqn_len = NVMF_NQN_FIELD_LEN;
+	return strndup(nqn, nqn_len);
+}
+
+static int cdc_icresp_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			      void *data, size_t data_len)
+{
+	struct cdc_ctx *cdc = ctx;
+
+	if (cdc->state != CDC_ICREQ) {
+		fprintf(stderr, "Unexpected icresp PDU\n");
+		return -EPROTO;
 	}
-	if (kdresp->hdr.hlen != 10) {
-		fprintf(stderr, "Invalid kdresp PDU hdr len %d\n",
-			kdresp->hdr.hlen);
-		return NULL;
+	if (icresp_check(&pdu->icresp) < 0)
+		return -EPROTO;
+	if (pdu->icresp.digest != cdc->digest) {
+		fprintf(stderr, "Digest mismatch, requested %#x got %#x\n",
+			cdc->digest, pdu->icresp.digest);
+		return -EPROTO;
 	}
-	if (le32toh(kdresp->hdr.plen) != 274) {
-		fprintf(stderr, "Invalid kdresp PDU len %d\n",
-		       le32toh(kdresp->hdr.plen));
-		return NULL;
+	cdc->pb.digest = pdu->icresp.digest;
+	cdc->maxdata = le32toh(pdu->icresp.maxdata);
+	cdc->state = CDC_KDREQ;
+	return 0;
+}
+
+static int cdc_kdresp_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			      void *data, size_t data_len)
+{
+	struct cdc_ctx *cdc = ctx;
+	char *nqn;
+
+	if (cdc->state != CDC_KDREQ || cdc->num_resp == cdc->num_pdus) {
+		fprintf(stderr, "Unexpected kdresp PDU\n");
+		return -EPROTO;
 	}
-	if (kdresp->ksstat != 0) {
-		fprintf(stderr, "Kickstart failed, reason %d\n",
-			kdresp->failrsn);
-		return NULL;
+	cdc->num_resp++;
+	nqn = kdresp_check(&pdu->kdresp, data, data_len);
+	if (!nqn) {
+		cdc->num_failed++;
+		return 0;
 	}
-	return strdup(buf + 10);
+	cdc->nqn = kdresp_merge(cdc->nqn, nqn);
+	if (!cdc->nqn)
+		return -EPROTO;
+	return 0;
 }
 
-int open_socket(char *cdc_addr, char *cdc_port)
+static int cdc_term_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			    void *data, size_t data_len)
+{
+	fprintf(stderr, "Connection terminated by CDC, fes %d fei %u\n",
+		le16toh(pdu->term.fes), le32toh(pdu->term.fei));
+	return -ECONNRESET;
+}
+
+const struct pdu_ops cdc_pdu_ops = {
+	.handler = {
+		[nvme_tcp_icresp] = cdc_icresp_handler,
+		[nvme_tcp_c2h_term] = cdc_term_handler,
+		[nvme_tcp_kdresp] = cdc_kdresp_handler,
+	},
+};
+
+static int cdc_recv(struct cdc_ctx *cdc)
 {
-	struct addrinfo hints, *result, *rp;
-	int err, sfd = -1;
-
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-	err = getaddrinfo(cdc_addr, cdc_port, &hints, &result);
-	if (err) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+	int ret;
+
+	ret = pdu_recv(cdc->sfd, &cdc->pb, &cdc_pdu_ops, cdc);
+	if (ret == -ECONNRESET)
+		fprintf(stderr, "Connection closed by peer\n");
+	else if (ret < 0 && ret != -EPROTO)
+		fprintf(stderr, "read pdu: %s\n", strerror(-ret));
+	return ret;
+}
+
+int icreq(struct cdc_ctx *cdc)
+{
+	struct nvme_tcp_icreq_pdu icreq;
+	ssize_t len;
+
+	icreq_init(&icreq, cdc->digest);
+	len = write(cdc->sfd, &icreq, sizeof(icreq));
+	if (len < sizeof(icreq)) {
+		perror("send icreq");
 		return -1;
 	}
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		char *adrfam = "ipv4";
-
-		if (rp->ai_family != AF_INET)
-			adrfam = "ipv6";
-		sfd = socket(rp->ai_family, rp->ai_socktype,
-			     rp->ai_protocol);
-		if (sfd == -1) {
-			fprintf(stderr, "failed to create %s socket\n",
-				adrfam);
-			continue;
-		}
-		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
-			char hbuf[NI_MAXHOST];
-
-			err = getnameinfo(rp->ai_addr, rp->ai_addrlen,
-					  hbuf, sizeof(hbuf), NULL, 0,
-					  NI_NUMERICHOST);
-			if (!err)
-				printf("Connected to tcp:%s:%s:%s\n",
-				       hbuf, adrfam, cdc_port);
-			break;
-		}
-		close(sfd);
-		sfd = -1;
+	cdc->state = CDC_ICREQ;
+	while (cdc->state == CDC_ICREQ) {
+		if (cdc_recv(cdc) < 0)
+			return -1;
 	}
-	return sfd;
+	return 0;
+}
+
+/*
+ * Encode @rec into the kickstart record @krec.
+ */
+static void kdreq_encode_rec(struct nvme_tcp_kickstart_rec *krec,
+			     struct port_rec *rec)
+{
+	krec->trtype = rec->trtype;
+	krec->adrfam = rec->adrfam;
+	memcpy(krec->trsvcid, rec->trsvcid, sizeof(krec->trsvcid));
+	memcpy(krec->traddr, rec->traddr, sizeof(krec->traddr));
 }
 
-char *nvmet_port_attr(const char *prefix, const char *port, const char *attr)
+/*
+ * Format @num_recs records from @recs into KDReq PDUs with @per_pdu
+ * records each at @buf + @offset. Returns the new offset.
+ */
+static size_t kdreq_format(char *buf, size_t offset, struct port_rec *recs,
+			   int num_recs, unsigned int per_pdu, __u8 digest,
+			   __u8 flags, int *num_pdus)
+{
+	struct nvme_tcp_kdreq_pdu *kdreq;
+	struct nvme_tcp_kickstart_rec *krec;
+	int i = 0;
+
+	do {
+		unsigned int num = num_recs - i, n;
+
+		if (num > per_pdu)
+			num = per_pdu;
+		kdreq = (struct nvme_tcp_kdreq_pdu *)(buf + offset);
+		kdreq->hdr.flags = (1 << 6) | flags;
+		offset += pdu_init_hdr(&kdreq->hdr, nvme_tcp_kdreq,
+				       sizeof(*kdreq), num * sizeof(*krec),
+				       digest);
+		kdreq->numkr = htole16(num);
+		kdreq->numdie = htole16(1);
+		krec = pdu_data(&kdreq->hdr);
+		for (n = 0; n < num; n++)
+			kdreq_encode_rec(&krec[n], &recs[i++]);
+		pdu_set_digests(&kdreq->hdr);
+		(*num_pdus)++;
+	} while (i < num_recs);
+	return offset;
+}
+
+/*
+ * Format the changes in @pd into a sequence of KDReq PDUs of at most
+ * @max_pdu_len bytes each, laid out back to back so that they can be
+ * pipelined with a single write. Deregistrations are sent first, with
+ * NVME_TCP_F_KDDEREG set, so that a port which changed its address is
+ * removed before it is registered again.
+ * Returns the buffer, with the total length in @buflen and the number
+ * of PDUs in @num_pdus.
+ */
+char *kdreq_alloc(struct port_delta *pd, size_t max_pdu_len, __u8 digest,
+		  size_t *buflen, int *num_pdus)
 {
-	char attrname[PATH_MAX];
-	char attrbuf[256], *value = NULL;
-	int fd, len;
+	size_t overhead = sizeof(struct nvme_tcp_kdreq_pdu), offset = 0;
+	size_t rec_len = sizeof(struct nvme_tcp_kickstart_rec);
+	unsigned int per_pdu, max_pdus;
+	int num_recs = pd->num_add + pd->num_del;
+	char *buf;
 
-	sprintf(attrname, "%s/%s/%s", prefix, port, attr);
-	fd = open(attrname, O_RDONLY);
-	if (fd < 0)
+	if (digest & NVME_TCP_HDR_DIGEST_ENABLE)
+		overhead += NVME_TCP_DIGEST_LENGTH;
+	if (digest & NVME_TCP_DATA_DIGEST_ENABLE)
+		overhead += NVME_TCP_DIGEST_LENGTH;
+	if (max_pdu_len < overhead + rec_len)
+		max_pdu_len = overhead + rec_len;
+	per_pdu = (max_pdu_len - overhead) / rec_len;
+	if (per_pdu > 0xffff)
+		per_pdu = 0xffff;
+	max_pdus = (pd->num_add + per_pdu - 1) / per_pdu +
+		(pd->num_del + per_pdu - 1) / per_pdu;
+	if (!max_pdus)
+		max_pdus = 1;
+
+	buf = calloc(1, max_pdus * overhead + num_recs * rec_len);
+	if (!buf) {
+		perror("calloc");
 		return NULL;
-	memset(attrbuf, 0, 256);
-	len = read(fd, attrbuf, 256);
-	if (len > 0) {
-		value = strdup(attrbuf);
-		if (value[len - 1] == '\n')
-			value[len - 1] = '\0';
-	}
-	close(fd);
-	return value;
+	}
+	*num_pdus = 0;
+	if (pd->num_del)
+		offset = kdreq_format(buf, offset, pd->del, pd->num_del,
+				      per_pdu, digest, NVME_TCP_F_KDDEREG,
+				      num_pdus);
+	if (pd->num_add || !pd->num_del)
+		offset = kdreq_format(buf, offset, pd->add, pd->num_add,
+				      per_pdu, digest, 0, num_pdus);
+	*buflen = offset;
+	return buf;
 }
 
-char **lookup_nvmet(int *numreg)
+/*
+ * Merge the result of one KDResp into @nqn.
+ * Returns the updated NQN, or NULL if @resp_nqn is inconsistent.
+ */
+char *kdresp_merge(char *nqn, char *resp_nqn)
 {
-	char **reg = NULL;
-	int nr = 0;
-	DIR *nvmet_dir;
-	struct dirent *nvmet_dirent;
-	const char prefix[] = "/sys/kernel/config/nvmet/ports";
-
-	nvmet_dir = opendir(prefix);
-	if (!nvmet_dir) {
-		perror("opendir");
-		*numreg = nr;
+	if (!nqn)
+		return resp_nqn;
+	if (strcmp(nqn, resp_nqn)) {
+		fprintf(stderr, "KDResp NQN mismatch: '%s' vs '%s'\n",
+			nqn, resp_nqn);
+		free(resp_nqn);
+		free(nqn);
 		return NULL;
 	}
-	while ((nvmet_dirent = readdir(nvmet_dir))) {
-		char rec[1024];
-		char *trtype, *adrfam, *traddr, *trsvcid;
-
-		if (!strcmp(nvmet_dirent->d_name, ".") ||
-		    !strcmp(nvmet_dirent->d_name, ".."))
-			continue;
-		trtype = nvmet_port_attr(prefix, nvmet_dirent->d_name,
-					 "addr_trtype");
-		if (!trtype) {
-			printf("Cannot read %s/%s/attr_trtype\n",
-			       prefix, nvmet_dirent->d_name);
-			continue;
-		}
-		if (!strlen(trtype) ||
-		    !strcmp(trtype, "loop") || !strcmp(trtype, "pci")) {
-			free(trtype);
-			continue;
-		}
-		adrfam = nvmet_port_attr(prefix, nvmet_dirent->d_name,
-				       "addr_adrfam");
-		traddr = nvmet_port_attr(prefix, nvmet_dirent->d_name,
-					 "addr_traddr");
-		trsvcid = nvmet_port_attr(prefix, nvmet_dirent->d_name,
-					  "addr_trsvcid");
-		sprintf(rec, "%s,%s,%s,%s,%s", nvmet_dirent->d_name,
-			trtype, traddr, adrfam, trsvcid);
-		reg = realloc(reg, sizeof(char *) * (nr + 1));
-		if (!reg) {
-			perror("realloc");
+	free(resp_nqn);
+	return nqn;
+}
+
+char *kdreq(struct cdc_ctx *cdc, struct port_delta *pd)
+{
+	unsigned int maxdata = cdc->maxdata;
+	char *kdreq_buf;
+	size_t kdreq_len;
+	ssize_t len;
+
+	if (!maxdata || maxdata > NVME_TCP_KDREQ_MAX_PDU_LEN)
+		maxdata = NVME_TCP_KDREQ_MAX_PDU_LEN;
+	kdreq_buf = kdreq_alloc(pd, maxdata, cdc->digest,
+				&kdreq_len, &cdc->num_pdus);
+	if (!kdreq_buf)
+		return NULL;
+	len = write(cdc->sfd, kdreq_buf, kdreq_len);
+	free(kdreq_buf);
+	if (len < kdreq_len) {
+		perror("send kdreq");
+		return NULL;
+	}
+	while (cdc->num_resp < cdc->num_pdus) {
+		if (cdc_recv(cdc) < 0)
 			break;
-		}
-		reg[nr] = strdup(rec);
-		printf("Registering record %d: %s\n", nr, reg[nr]);
-		nr++;
-		if (trsvcid)
-			free(trsvcid);
-		if (traddr)
-			free(traddr);
-		if (adrfam)
-			free(adrfam);
-		free(trtype);
-	}
-	closedir(nvmet_dir);
-	*numreg = nr;
-	return reg;
+	}
+	if (cdc->num_resp < cdc->num_pdus || cdc->num_failed) {
+		fprintf(stderr, "%d of %d KDReq PDUs failed\n",
+			cdc->num_pdus - cdc->num_resp + cdc->num_failed,
+			cdc->num_pdus);
+		free(cdc->nqn);
+		cdc->nqn = NULL;
+	}
+	return cdc->nqn;
 }
 
-int nvmet_set_port_attr(const char *prefix, const char *attr, const char *value)
+int open_socket(char *cdc_addr, char *cdc_port, int stagger_ms, int tmo_ms)
 {
-	char attrname[PATH_MAX];
-	int fd, len;
+	struct he_conn hc;
+	struct addrinfo *rp;
+	char hbuf[NI_MAXHOST];
+	int err, sfd;
 
-	sprintf(attrname, "%s/%s", prefix, attr);
-	fd = open(attrname, O_RDWR);
-	if (fd < 0)
+	if (he_resolve(&hc, cdc_addr, cdc_port, stagger_ms, tmo_ms) < 0)
+		return -1;
+	sfd = he_connect(&hc);
+	if (sfd < 0) {
+		fprintf(stderr, "connect: %s\n", strerror(hc.err));
+		he_free(&hc);
 		return -1;
-	len = write(fd, value, strlen(value));
-	if (len < strlen(value)) {
-		if (len > 0) {
-			errno = EBUSY;
-			len = -1;
-		}
-		perror("write");
 	}
-	close(fd);
-	return len;
+	/* Blocking I/O from here on */
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) & ~O_NONBLOCK);
+	rp = hc.ai[hc.winner];
+	err = getnameinfo(rp->ai_addr, rp->ai_addrlen,
+			  hbuf, sizeof(hbuf), NULL, 0,
+			  NI_NUMERICHOST);
+	if (!err)
+		printf("Connected to tcp:%s:%s:%s\n", hbuf,
+		       rp->ai_family == AF_INET ? "ipv4" : "ipv6", cdc_port);
+	he_free(&hc);
+	return sfd;
 }
 
-int register_parent(char **reg, int numreg,
-		    char *cdc_addr, char *cdc_port, char *cdc_nqn)
+/*
+ * Print the discovery log of each CDC in @cdcs. With @interval, poll
+ * the CDCs every @interval seconds over the same sessions and print
+ * the logs which changed; a CDC whose session failed is connected
+ * again on the next poll. Sessions are authenticated with @auth if
+ * set.
+ */
+static int disc_host_discover(struct cdc_ctx *cdcs, int num_cdcs, __u8 digest,
+			      struct auth_ctx *auth, int interval)
 {
-	const char prefix[] = "/sys/kernel/config/nvmet/ports";
-	char refname[PATH_MAX];
-	int i, err;
-
-	for (i = 0; i < numreg; i++) {
-		char *rec = reg[i];
-		char *port;
-
-		port = strsep(&rec, ",");
-		sprintf(refname, "%s/%s/referrals/parent",
-			prefix, port);
-		err = mkdir(refname, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-		if (err && errno != -EEXIST) {
-			perror("mkdir");
-			continue;
-		}
+	struct disc_host *hosts, *h;
+	int i, ret, kato_ms = DISC_HOST_KATO_MS, num_failed;
 
-		nvmet_set_port_attr(refname, "addr_traddr",
-				    cdc_addr);
-		nvmet_set_port_attr(refname, "addr_trsvcid",
-				    cdc_port);
-		nvmet_set_port_attr(refname, "addr_trtype", "tcp");
-		if (strchr(cdc_addr, ':'))
-			nvmet_set_port_attr(refname, "addr_adrfam", "ipv6");
-		else
-			nvmet_set_port_attr(refname, "addr_adrfam", "ipv4");
-		nvmet_set_port_attr(refname, "addr_subtype", "parent");
+	/*
+	 * No Keep Alive commands are sent, and polls only reset the keep
+	 * alive timer of controllers with traffic based keep alive
+	 */
+	if (interval && interval * 2000 > kato_ms)
+		kato_ms = interval * 2000;
+	hosts = calloc(num_cdcs, sizeof(*hosts));
+	if (!hosts) {
+		perror("calloc");
+		return 1;
 	}
-	return 0;
+	for (i = 0; i < num_cdcs; i++)
+		disc_host_init(&hosts[i], digest, auth);
+	for (;;) {
+		num_failed = 0;
+		for (i = 0; i < num_cdcs; i++) {
+			h = &hosts[i];
+			ret = 0;
+			if (h->fd < 0)
+				ret = disc_host_connect(h, cdcs[i].addr,
+							cdcs[i].port, kato_ms);
+			if (!ret)
+				ret = disc_host_get_log(h, NVME_AQ_DEPTH);
+			if (ret < 0) {
+				printf("CDC %s:%s: %s\n", cdcs[i].addr,
+				       cdcs[i].port, strerror(-ret));
+				if (ret != -EAGAIN) {
+					disc_host_close(h);
+					disc_host_init(h, digest, auth);
+				}
+				num_failed++;
+				continue;
+			}
+			if (ret) {
+				printf("CDC %s:%s: ", cdcs[i].addr,
+				       cdcs[i].port);
+				disc_host_print_log(h->log);
+			}
+		}
+		fflush(stdout);
+		if (!interval)
+			break;
+		sleep(interval);
+	}
+	for (i = 0; i < num_cdcs; i++)
+		disc_host_close(&hosts[i]);
+	free(hosts);
+	return num_failed ? 1 : 0;
 }
 
 int main(int argc, char **argv)
 {
 	char *cdc_addr = NULL, *cdc_port = "8009", *ptr, *nqn = NULL;
-	char **reg = NULL;
-	int opt, err, sfd = -1;
-	int numreg = 0, use_nvmet = 0;
+	struct port_rec *recs = NULL;
+	struct cdc_ctx *cdcs = NULL, *cdc;
+	int opt;
+	int num_recs = 0, use_nvmet = 0, num_cdcs = 0;
+	struct kickstart_opts opts = {
+		.tmo = 10,
+		.stagger_ms = HE_STAGGER_MS,
+		.connect_tmo_ms = HE_CONNECT_TMO_MS,
+		.kato = 30,
+	};
+	const char *bench = NULL, *root = NULL;
+	enum nvmet_scan_mode scan_mode = NVMET_SCAN_SYNC;
+	struct port_delta pd = { 0 };
+	int watch_interval = 0, daemon_mode = 0;
+	const char *ctrl_path = ACDC_CTRL_PATH, *ctrl_cmd = NULL;
+	char *listen_addr = NULL, *listen_port = "8009";
+	const char *cdc_nqn = NVME_DISC_SUBSYS_NAME;
+	int server_mode = 0, num_workers = 0, pin_workers = 0, discover = 0;
+	unsigned int aen_window = CDC_AEN_WINDOW;
+	const char *snap_path = NULL, *wal_path = NULL;
+	char *repl_addr = NULL, *repl_port = NULL, **peers = NULL;
+	int num_peers = 0;
+	const char *host_secret = NULL, *ctrl_secret = NULL;
+	struct auth_ctx auth;
+	int ret;
 
-	while ((opt = getopt(argc, argv, "c:r:h")) != -1) {
+	while ((opt = getopt(argc, argv, "a:A:B:c:C:dDf:gGj:k:K:l:L:n:p:Pr:R:St:T:u:UW:w:x:h")) != -1) {
 		switch (opt) {
+		case 'a':
+			opts.stagger_ms = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0') {
+				fprintf(stderr, "%s: Invalid delay '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			bench = optarg;
+			break;
 		case 'c':
+			cdcs = realloc(cdcs, sizeof(*cdcs) * (num_cdcs + 1));
+			if (!cdcs) {
+				perror("realloc");
+				return 1;
+			}
+			memset(&cdcs[num_cdcs], 0, sizeof(*cdcs));
 			cdc_addr = strdup(optarg);
+			cdc_port = "8009";
 			ptr = strrchr(cdc_addr, ':');
 			if (ptr) {
 				*ptr = '\0';
 				cdc_port = ptr + 1;
 			}
+			cdcs[num_cdcs].addr = cdc_addr;
+			cdcs[num_cdcs].port = cdc_port;
+			num_cdcs++;
+			break;
+		case 'C':
+			ctrl_secret = optarg;
+			break;
+		case 'd':
+			daemon_mode = 1;
+			break;
+		case 'D':
+			discover = 1;
+			break;
+		case 'f':
+			snap_path = optarg;
+			break;
+		case 'g':
+			opts.digest |= NVME_TCP_HDR_DIGEST_ENABLE;
+			break;
+		case 'G':
+			opts.digest |= NVME_TCP_DATA_DIGEST_ENABLE;
+			break;
+		case 'j':
+			wal_path = optarg;
+			break;
+		case 'k':
+			opts.kato = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0' || !opts.kato) {
+				fprintf(stderr, "%s: Invalid keep-alive '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'K':
+			host_secret = optarg;
+			break;
+		case 'l':
+			listen_addr = strdup(optarg);
+			ptr = strrchr(listen_addr, ':');
+			if (ptr) {
+				*ptr = '\0';
+				listen_port = ptr + 1;
+			}
+			if (!*listen_addr)
+				listen_addr = NULL;
+			break;
+		case 'L':
+			repl_addr = strdup(optarg);
+			repl_port = GOSSIP_PORT;
+			ptr = strrchr(repl_addr, ':');
+			if (ptr) {
+				*ptr = '\0';
+				repl_port = ptr + 1;
+			}
+			if (!*repl_addr)
+				repl_addr = NULL;
+			break;
+		case 'n':
+			cdc_nqn = optarg;
+			break;
+		case 'p':
+			root = optarg;
+			break;
+		case 'P':
+			pin_workers = 1;
 			break;
 		case 'r':
-			reg = realloc(reg, sizeof(const char *) * (numreg + 1));
-			if (!reg) {
+			recs = realloc(recs, sizeof(*recs) * (num_recs + 1));
+			if (!recs) {
+				perror("realloc");
+				return 1;
+			}
+			if (port_rec_parse(&recs[num_recs], optarg) < 0) {
+				fprintf(stderr, "%s: Invalid record '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			num_recs++;
+			break;
+		case 'R':
+			peers = realloc(peers, sizeof(*peers) * (num_peers + 1));
+			if (!peers) {
 				perror("realloc");
 				return 1;
 			}
-			reg[numreg] = malloc(strlen(optarg) + 10);
-			if (!reg[numreg]) {
-				perror("malloc");
+			peers[num_peers++] = optarg;
+			break;
+		case 'S':
+			server_mode = 1;
+			break;
+		case 't':
+			opts.tmo = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0' || !opts.tmo) {
+				fprintf(stderr, "%s: Invalid timeout '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			opts.connect_tmo_ms = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0' || !opts.connect_tmo_ms) {
+				fprintf(stderr, "%s: Invalid timeout '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'A':
+			aen_window = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0') {
+				fprintf(stderr, "%s: Invalid window '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'u':
+			ctrl_path = optarg;
+			break;
+		case 'U':
+			scan_mode = NVMET_SCAN_URING;
+			break;
+		case 'W':
+			num_workers = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0' || num_workers < 0 ||
+			    num_workers > CDC_MAX_WORKERS) {
+				fprintf(stderr, "%s: Invalid number of workers '%s'\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'w':
+			watch_interval = strtoul(optarg, &ptr, 10);
+			if (*ptr != '\0' || !watch_interval) {
+				fprintf(stderr, "%s: Invalid interval '%s'\n",
+					argv[0], optarg);
 				return 1;
 			}
-			sprintf(reg[numreg], ",%s", optarg);
-			numreg++;
+			break;
+		case 'x':
+			ctrl_cmd = optarg;
 			break;
 		case 'h':
-			printf("Usage: %s -c <address[:port]> -r <address[:port]>\n", argv[0]);
+			printf("Usage: %s -c <address[:port]> [-c <address[:port]> ...] "
+			       "[-g] [-G] [-t <timeout>] [-T <connect timeout ms>] "
+			       "[-a <attempt delay ms>] [-p <nvmet ports dir>] [-U] "
+			       "[-w <interval>] "
+			       "[-r <trtype,traddr[,adrfam[,trsvcid]]> ...]\n"
+			       "       %s -d -c <address[:port]> ... [-k <keep-alive>] "
+			       "[-u <control socket>] [-r <record> ...]\n"
+			       "       %s [-u <control socket>] -x '<request>'\n"
+			       "       %s -D -c <address[:port]> ... [-g] [-G] [-w <interval>] "
+			       "[-K <host secret> [-C <controller secret>]]\n"
+			       "       %s -S [-l <[address][:port]>] [-n <nqn>] "
+			       "[-W <workers>] [-P] [-U] [-A <AEN window ms>] "
+			       "[-f <snapshot file>] [-j <write-ahead log>] "
+			       "[-L <[address][:port]>] [-R <address[:port]> ...] "
+			       "[-K <host secret> [-C <controller secret>]]\n"
+			       "       %s -B crc32c|connect|configfs|server|registry|logpage|scale|aen|snapshot|wal|gossip|host|wheel|auth [-p <dir>]\n",
+			       argv[0], argv[0], argv[0], argv[0], argv[0],
+			       argv[0]);
 			return 0;
 			break;
 		default:
@@ -399,33 +621,194 @@ int main(int argc, char **argv)
 			return 1;
 		}
 	}
-	if (!cdc_addr) {
+	if (bench) {
+		if (!strcmp(bench, "crc32c"))
+			return crc32c_bench();
+		if (!strcmp(bench, "connect"))
+			return he_bench(opts.stagger_ms, opts.connect_tmo_ms);
+		if (!strcmp(bench, "configfs"))
+			return nvmet_scan_bench(root ? root : "/dev/shm",
+						NVMET_BENCH_PORTS);
+		if (!strcmp(bench, "server"))
+			return cdc_server_bench(CDC_BENCH_CONNS);
+		if (!strcmp(bench, "registry"))
+			return registry_bench(REG_BENCH_RECS);
+		if (!strcmp(bench, "logpage"))
+			return disc_log_bench(DISC_LOG_BENCH_RECS,
+					      DISC_LOG_BENCH_REQS);
+		if (!strcmp(bench, "scale"))
+			return cdc_scale_bench(32, CDC_SCALE_CONNS);
+		if (!strcmp(bench, "snapshot"))
+			return cdc_snap_bench(root ? root : "/dev/shm",
+					      SNAP_BENCH_RECS);
+		if (!strcmp(bench, "wal"))
+			return wal_bench(root ? root : "/var/tmp",
+					 WAL_BENCH_RECS);
+		if (!strcmp(bench, "gossip"))
+			return gossip_bench(GOSSIP_BENCH_NODES,
+					    GOSSIP_BENCH_RECS);
+		if (!strcmp(bench, "wheel"))
+			return wheel_bench(WHEEL_BENCH_TIMERS);
+		if (!strcmp(bench, "host"))
+			return cdc_host_bench(DISC_HOST_BENCH_RECS,
+					      DISC_HOST_BENCH_READS);
+		if (!strcmp(bench, "aen"))
+			return cdc_aen_bench(CDC_AEN_BENCH_HOSTS,
+					     CDC_AEN_BENCH_RECS);
+		if (!strcmp(bench, "auth"))
+			return cdc_auth_bench(AUTH_BENCH_HANDSHAKES);
+		fprintf(stderr, "%s: Invalid benchmark '%s'\n",
+			argv[0], bench);
+		return 1;
+	}
+	if (ctrl_cmd)
+		return acdc_ctrl(ctrl_path, ctrl_cmd);
+	if (ctrl_secret && !host_secret) {
+		fprintf(stderr, "%s: -C requires -K\n", argv[0]);
+		return 1;
+	}
+	if (host_secret && !server_mode && !discover) {
+		fprintf(stderr, "%s: -K requires -S or -D\n", argv[0]);
+		return 1;
+	}
+	if (server_mode) {
+		struct cdc_server srv;
+		int i;
+
+		/*
+		 * Hosts reconnecting after a failover all authenticate at
+		 * once, so DH keys are generated ahead and shared
+		 */
+		if (host_secret &&
+		    auth_ctx_init(&auth, host_secret, ctrl_secret,
+				  DH_POOL_DEPTH, AUTH_KEY_MAX_USES) < 0)
+			return 1;
+		cdc_server_init(&srv, cdc_nqn);
+		srv.aen_window = aen_window;
+		srv.auth = host_secret ? &auth : NULL;
+		if (snap_path) {
+			ret = cdc_snap_load(&srv, snap_path);
+			if (ret < 0) {
+				fprintf(stderr, "%s: cannot restore snapshot "
+					"%s: %s\n", argv[0], snap_path,
+					strerror(-ret));
+				cdc_server_free(&srv);
+				return 1;
+			}
+		}
+		if (wal_path) {
+			ret = cdc_wal_open(&srv, wal_path);
+			if (ret < 0) {
+				fprintf(stderr, "%s: cannot open write-ahead "
+					"log %s: %s\n", argv[0], wal_path,
+					strerror(-ret));
+				cdc_server_free(&srv);
+				return 1;
+			}
+			printf("replayed %d registry changes from %s\n",
+			       ret, wal_path);
+		}
+		if (repl_port || num_peers) {
+			ret = cdc_gossip_init(&srv, repl_addr, repl_port);
+			for (i = 0; i < num_peers && !ret; i++) {
+				ptr = strrchr(peers[i], ':');
+				if (ptr)
+					*ptr = '\0';
+				ret = gossip_add_peer(srv.gossip, peers[i],
+						      ptr ? ptr + 1 :
+						      GOSSIP_PORT);
+			}
+			if (ret < 0) {
+				fprintf(stderr, "%s: cannot set up "
+					"replication: %s\n", argv[0],
+					strerror(-ret));
+				cdc_server_free(&srv);
+				return 1;
+			}
+		}
+		ret = cdc_serve(&srv, listen_addr, listen_port,
+				scan_mode == NVMET_SCAN_URING ?
+				CDC_IO_URING : CDC_IO_EPOLL,
+				num_workers, pin_workers);
+		cdc_server_free(&srv);
+		if (host_secret)
+			auth_ctx_free(&auth);
+		return ret;
+	}
+	if (!root)
+		root = NVMET_CONFIGFS_PORTS;
+	if (!num_cdcs) {
 		fprintf(stderr, "%s: no CDC address specified\n", argv[0]);
 		return 1;
 	}
-	if (!reg) {
-		reg = lookup_nvmet(&numreg);
+	if (discover) {
+		/* A fresh DH key for each session a host sets up */
+		if (host_secret &&
+		    auth_ctx_init(&auth, host_secret, ctrl_secret, 0, 1) < 0)
+			return 1;
+		ret = disc_host_discover(cdcs, num_cdcs, opts.digest,
+					 host_secret ? &auth : NULL,
+					 watch_interval);
+		if (host_secret)
+			auth_ctx_free(&auth);
+		return ret;
+	}
+	if (daemon_mode) {
+		if (watch_interval) {
+			fprintf(stderr, "%s: -d cannot be combined with -w\n",
+				argv[0]);
+			return 1;
+		}
+		return acdc_daemon(ctrl_path, cdcs, num_cdcs,
+				   recs, num_recs, &opts);
+	}
+	if (watch_interval) {
+		if (recs) {
+			fprintf(stderr, "%s: -w cannot be combined with -r\n",
+				argv[0]);
+			return 1;
+		}
+		return nvmet_watch(root, scan_mode, cdcs, num_cdcs,
+				   &opts, watch_interval);
+	}
+	if (!recs) {
+		recs = lookup_nvmet(root, scan_mode, &num_recs);
 		use_nvmet = 1;
 	}
-	if (!numreg) {
+	if (!num_recs) {
 		fprintf(stderr, "No ports to register\n");
 		return 1;
 	}
-	sfd = open_socket(cdc_addr, cdc_port);
-	if (sfd < 0) {
+	pd.add = recs;
+	pd.num_add = num_recs;
+	if (num_cdcs > 1) {
+		if (kickstart_cdcs(cdcs, num_cdcs, &pd, &opts) <= 0)
+			return 1;
+		if (use_nvmet)
+			kickstart_referrals(root, cdcs, num_cdcs,
+					    recs, num_recs);
+		return 0;
+	}
+	cdc = &cdcs[0];
+	cdc->digest = opts.digest;
+	pdu_buf_init(&cdc->pb, 0);
+	cdc->sfd = open_socket(cdc_addr, cdc_port, opts.stagger_ms,
+			       opts.connect_tmo_ms);
+	if (cdc->sfd < 0) {
 		fprintf(stderr, "Failed to connect to %s\n", cdc_addr);
 		return 1;
 	}
-	err = icreq(sfd);
-	if (err > 0)
-		nqn = kdreq(sfd, reg, numreg);
+	if (!icreq(cdc))
+		nqn = kdreq(cdc, &pd);
 	if (nqn) {
 		if (use_nvmet)
-			register_parent(reg, numreg, cdc_addr, cdc_port, nqn);
+			register_parent(root, recs, num_recs, "parent",
+					cdc_addr, cdc_port);
 		else
 			printf("Registered with CDC %s\n", nqn);
 	}
-	close(sfd);
+	close(cdc->sfd);
+	pdu_buf_free(&cdc->pb);
 
 	return 0;
 }
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * acdc - Asynchronous (de-)centralized discovery controller
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _ACDC_H
+#define _ACDC_H
+
+#include <time.h>
+#include <endian.h>
+#include <netdb.h>
+#include <linux/types.h>
+
+#include "nvme-tcp.h"
+#include "pdu.h"
+#include "connect.h"
+#include "nvmet.h"
+#include "wheel.h"
+
+/* KDResp: common header, ksstat/failrsn, CDC NQN, reserved */
+#define NVME_TCP_KDRESP_PDU_LEN	274
+
+/* KDReq PDU size limit if the CDC does not announce one in the ICResp */
+#define NVME_TCP_KDREQ_MAX_PDU_LEN	8192
+
+static inline void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static inline long timespec_diff_ms(struct timespec *start,
+				    struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000 +
+		(end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static inline long timespec_diff_ns(struct timespec *start,
+				    struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000L +
+		end->tv_nsec - start->tv_nsec;
+}
+
+void icreq_init(struct nvme_tcp_icreq_pdu *icreq, __u8 digest);
+int icresp_check(struct nvme_tcp_icresp_pdu *icresp);
+char *kdreq_alloc(struct port_delta *pd, size_t max_pdu_len, __u8 digest,
+		  size_t *buflen, int *num_pdus);
+char *kdresp_check(struct nvme_tcp_kdresp_pdu *kdresp,
+		   const char *nqn, size_t nqn_len);
+char *kdresp_merge(char *nqn, char *resp_nqn);
+
+enum cdc_state {
+	CDC_CONNECTING,
+	CDC_ICREQ,
+	CDC_KDREQ,
+	CDC_READY,
+	CDC_DONE,
+	CDC_FAILED,
+	CDC_BACKOFF,
+};
+
+/* Purpose of the KDReq in flight on a persistent session */
+enum cdc_req {
+	CDC_REQ_NONE,
+	CDC_REQ_SYNC,
+	CDC_REQ_DELTA,
+	CDC_REQ_KEEPALIVE,
+};
+
+/**
+ * struct cdc_ctx - per-CDC state of the kickstart engine
+ *
+ * @addr:          CDC address
+ * @port:          CDC port
+ * @sfd:           socket, -1 if not connected
+ * @efd:           epoll instance of the kickstart engine
+ * @state:         current protocol state
+ * @hc:            connection attempts in progress
+ * @txbuf:         PDU currently being sent
+ * @txlen:         length of @txbuf
+ * @txoff:         bytes of @txbuf already sent
+ * @digest:        digests to request in the ICReq
+ * @pb:            PDU receive buffer
+ * @maxdata:       PDU data limit announced in the ICResp
+ * @kdreq_buf:     KDReq PDUs formatted for this CDC, if its ICResp
+ *                 announced a lower limit than the default
+ * @num_pdus:      number of KDReq PDUs sent
+ * @num_resp:      number of KDResp PDUs received
+ * @num_failed:    number of KDResp PDUs reporting a failure
+ * @nqn:           CDC NQN returned in the KDResp
+ * @err:           errno value if the kickstart failed
+ * @errstr:        failure description
+ * @t_start:       time the kickstart was started
+ * @t_end:         time the kickstart completed or failed
+ * @req:           purpose of the KDReq in flight (daemon mode)
+ * @delta_pending: the current change still has to be sent once the
+ *                 KDReq in flight completes (daemon mode)
+ * @backoff_ms:    delay before the next reconnect (daemon mode)
+ * @t_next:        time of the next reconnect or keep-alive (daemon mode)
+ * @t_deadline:    time by which the KDReq in flight has to complete
+ *                 (daemon mode)
+ * @timer:         next reconnect, keep-alive, connection attempt or
+ *                 deadline (daemon mode)
+ */
+struct cdc_ctx {
+	char *addr;
+	char *port;
+	int sfd;
+	int efd;
+	enum cdc_state state;
+	struct he_conn hc;
+	const char *txbuf;
+	size_t txlen;
+	size_t txoff;
+	__u8 digest;
+	struct pdu_buf pb;
+	unsigned int maxdata;
+	char *kdreq_buf;
+	int num_pdus;
+	int num_resp;
+	int num_failed;
+	char *nqn;
+	int err;
+	const char *errstr;
+	struct timespec t_start;
+	struct timespec t_end;
+	enum cdc_req req;
+	int delta_pending;
+	int backoff_ms;
+	struct timespec t_next;
+	struct timespec t_deadline;
+	struct wheel_timer timer;
+};
+
+extern const struct pdu_ops cdc_pdu_ops;
+
+int icreq(struct cdc_ctx *cdc);
+char *kdreq(struct cdc_ctx *cdc, struct port_delta *pd);
+int open_socket(char *cdc_addr, char *cdc_port, int stagger_ms, int tmo_ms);
+
+/**
+ * struct kickstart_opts - kickstart engine parameters
+ *
+ * @digest:        digests to request
+ * @tmo:           overall timeout in seconds
+ * @stagger_ms:    delay between parallel connection attempts
+ * @connect_tmo_ms: connection setup timeout
+ * @kato:          keep-alive interval of persistent sessions in seconds
+ */
+struct kickstart_opts {
+	__u8 digest;
+	int tmo;
+	int stagger_ms;
+	int connect_tmo_ms;
+	int kato;
+};
+
+int kickstart_cdcs(struct cdc_ctx *cdcs, int num_cdcs,
+		   struct port_delta *pd, struct kickstart_opts *opts);
+const char *cdc_state_str(enum cdc_state state);
+void cdc_start(int efd, struct cdc_ctx *cdc, struct kickstart_opts *opts);
+void cdc_fail(int efd, struct cdc_ctx *cdc, int err, const char *msg);
+void cdc_send_pdu(int efd, struct cdc_ctx *cdc,
+		  enum cdc_state state, const char *buf, size_t len);
+void cdc_handle_connect(int efd, struct cdc_ctx *cdc, const char *icreq_buf);
+void cdc_handle_output(int efd, struct cdc_ctx *cdc);
+void kickstart_referral(const char *root, struct cdc_ctx *cdc, int i,
+			struct port_rec *recs, int num_recs);
+void kickstart_referrals(const char *root, struct cdc_ctx *cdcs, int num_cdcs,
+			 struct port_rec *recs, int num_recs);
+int nvmet_watch(const char *root, enum nvmet_scan_mode mode,
+		struct cdc_ctx *cdcs, int num_cdcs,
+		struct kickstart_opts *opts, int interval);
+
+/* Default control socket of the daemon */
+#define ACDC_CTRL_PATH		"/run/acdc.sock"
+
+/* Maximum length of a control request line */
+#define ACDC_CTRL_LINE_MAX	8192
+
+int acdc_daemon(const char *ctrl_path, struct cdc_ctx *cdcs, int num_cdcs,
+		struct port_rec *recs, int num_recs,
+		struct kickstart_opts *opts);
+int acdc_ctrl(const char *ctrl_path, const char *cmd);
+
+#endif /* _ACDC_H */
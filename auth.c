@@ -0,0 +1,695 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * auth.c - NVMe in-band authentication with DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Builds and checks the DH-HMAC-CHAP messages of both sides, which
+ * the host sends with Authentication Send and fetches with
+ * Authentication Receive commands after the Connect command:
+ *
+ *   host                               controller
+ *   Negotiate: hashes, DH groups  -->
+ *                                 <--  Challenge: hash, group, C1,
+ *                                      S1, DH public value
+ *   Reply: R1, C2, S2, DH value   -->
+ *                                 <--  Success1: R2 if C2 was sent
+ *   Success2, if R2 was checked   -->
+ *
+ * A response is the HMAC of the challenge, augmented by the DH shared
+ * secret, the sequence number, the transaction id and both NQNs,
+ * keyed by the secret of the side answering; sending C2 asks the
+ * controller to authenticate as well. Secrets are given in the
+ * DHHC-1 representation of nvme-cli.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/random.h>
+#include <linux/types.h>
+
+#include "auth.h"
+
+/* Hashes and groups offered by the host, in order of preference */
+static const __u8 auth_hashes[] = {
+	NVME_AUTH_HASH_SHA256,
+	NVME_AUTH_HASH_SHA384,
+	NVME_AUTH_HASH_SHA512,
+};
+
+static const __u8 auth_dhgroups[] = {
+	NVME_AUTH_DHGROUP_NULL,
+	NVME_AUTH_DHGROUP_2048,
+	NVME_AUTH_DHGROUP_3072,
+	NVME_AUTH_DHGROUP_4096,
+	NVME_AUTH_DHGROUP_6144,
+	NVME_AUTH_DHGROUP_8192,
+};
+
+/* Offset of the DH group ids in the idlist of a protocol descriptor */
+#define AUTH_IDLIST_DHGROUPS	30
+
+static int auth_base64_val(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/* Decode @len characters of base64 at @s; returns the length or -1 */
+static int auth_base64_decode(const char *s, size_t len, __u8 *out,
+			      size_t size)
+{
+	__u32 acc = 0;
+	int bits = 0, n = 0, v;
+	size_t i;
+
+	for (i = 0; i < len && s[i] != '='; i++) {
+		v = auth_base64_val(s[i]);
+		if (v < 0)
+			return -1;
+		acc = acc << 6 | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == size)
+				return -1;
+			out[n++] = acc >> bits;
+		}
+	}
+	return n;
+}
+
+/* CRC-32 (IEEE 802.3), as appended to the DHHC-1 key */
+static __u32 auth_crc32(const __u8 *buf, size_t len)
+{
+	__u32 crc = ~0U;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+	return ~crc;
+}
+
+/*
+ * Parse the secret @str in the representation
+ * 'DHHC-1:<hash>:<base64 of the key and its CRC-32>:'.
+ * Returns 0 or -EINVAL.
+ */
+int auth_secret_parse(struct auth_secret *secret, const char *str)
+{
+	__u8 buf[SHA2_MAX_DIGEST + 4];
+	const char *b64, *end;
+	__le32 crc;
+	int hashid, len;
+
+	memset(secret, 0, sizeof(*secret));
+	if (strncmp(str, "DHHC-1:", 7) || sscanf(str + 7, "%2x", &hashid) != 1 ||
+	    str[9] != ':')
+		return -EINVAL;
+	b64 = str + 10;
+	end = strchr(b64, ':');
+	if (!end || end[1] != '\0')
+		return -EINVAL;
+	if (hashid && !sha2_len(hashid))
+		return -EINVAL;
+	len = auth_base64_decode(b64, end - b64, buf, sizeof(buf)) - 4;
+	if (len != 32 && len != 48 && len != 64)
+		return -EINVAL;
+	crc = htole32(auth_crc32(buf, len));
+	if (memcmp(&crc, buf + len, sizeof(crc)))
+		return -EINVAL;
+	memcpy(secret->key, buf, len);
+	secret->len = len;
+	secret->hashid = hashid;
+	memset(buf, 0, sizeof(buf));
+	return 0;
+}
+
+/*
+ * Set up @ctx with the DHHC-1 secrets @host_secret and, for
+ * bidirectional authentication, @ctrl_secret, which may be NULL.
+ * The DH key pool keeps @depth keys ready and hands each key to
+ * @max_uses sessions. Returns 0 or a negative errno.
+ */
+int auth_ctx_init(struct auth_ctx *ctx, const char *host_secret,
+		  const char *ctrl_secret, int depth, unsigned int max_uses)
+{
+	int ret;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ret = auth_secret_parse(&ctx->host_secret, host_secret);
+	if (ret < 0) {
+		fprintf(stderr, "Invalid host secret '%s'\n", host_secret);
+		return ret;
+	}
+	if (ctrl_secret) {
+		ret = auth_secret_parse(&ctx->ctrl_secret, ctrl_secret);
+		if (ret < 0) {
+			fprintf(stderr, "Invalid controller secret '%s'\n",
+				ctrl_secret);
+			return ret;
+		}
+	}
+	ctx->hashid = NVME_AUTH_HASH_SHA256;
+	ctx->dhgid = NVME_AUTH_DHGROUP_2048;
+	return dh_pool_start(&ctx->pool, depth, max_uses, AUTH_KEY_MAX_AGE_MS);
+}
+
+void auth_ctx_free(struct auth_ctx *ctx)
+{
+	dh_pool_stop(&ctx->pool);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void auth_session_init(struct auth_session *s, struct auth_ctx *ctx,
+		       const char *hostnqn, const char *subsysnqn,
+		       __u16 t_id)
+{
+	s->ctx = ctx;
+	snprintf(s->hostnqn, sizeof(s->hostnqn), "%.*s",
+		 NVMF_NQN_FIELD_LEN, hostnqn);
+	snprintf(s->subsysnqn, sizeof(s->subsysnqn), "%.*s",
+		 NVMF_NQN_FIELD_LEN, subsysnqn);
+	s->step = AUTH_NEGOTIATE;
+	s->t_id = t_id;
+	s->hashid = 0;
+	s->dhgid = 0;
+	s->hl = 0;
+	s->s1 = s->s2 = 0;
+	s->key = NULL;
+	s->rescode_exp = 0;
+	s->msg_len = 0;
+}
+
+void auth_session_free(struct auth_session *s)
+{
+	dh_key_put(s->key);
+	s->key = NULL;
+	memset(s->hskey, 0, sizeof(s->hskey));
+}
+
+static void auth_random(void *buf, size_t len)
+{
+	if (getrandom(buf, len, 0) != len)
+		perror("getrandom");
+}
+
+/* Nonzero sequence number */
+static __u32 auth_seqnum(void)
+{
+	__u32 seq = 0;
+
+	while (!seq)
+		auth_random(&seq, sizeof(seq));
+	return seq;
+}
+
+/*
+ * Compute the response to challenge @c with sequence number @seq:
+ * the host response if @host is set, the controller response
+ * otherwise.
+ */
+static void auth_response(struct auth_session *s, int host, const __u8 *c,
+			  __u32 seq, __u8 *resp)
+{
+	const struct auth_secret *secret = host ? &s->ctx->host_secret :
+		&s->ctx->ctrl_secret;
+	const char *nqn1 = host ? s->hostnqn : s->subsysnqn;
+	const char *nqn2 = host ? s->subsysnqn : s->hostnqn;
+	__u8 key[SHA2_MAX_DIGEST], ca[SHA2_MAX_DIGEST], zero = 0;
+	struct hmac_key hk;
+	struct sha2_ctx ctx;
+	size_t klen = secret->len;
+	__le32 seq_le = htole32(seq);
+	__le16 t_id = htole16(s->t_id);
+
+	/* The secret is transformed with the NQN of its owner */
+	if (secret->hashid) {
+		hmac_setkey(&hk, secret->hashid, secret->key, secret->len);
+		hmac_init(&hk, &ctx);
+		sha2_update(&ctx, nqn1, strlen(nqn1));
+		sha2_update(&ctx, "NVMe-over-Fabrics", 17);
+		hmac_final(&hk, &ctx, key);
+		klen = sha2_len(secret->hashid);
+	} else {
+		memcpy(key, secret->key, klen);
+	}
+	/* The challenge is augmented by the DH shared secret */
+	if (s->key) {
+		hmac_setkey(&hk, s->hashid, s->hskey, s->hl);
+		hmac_init(&hk, &ctx);
+		sha2_update(&ctx, c, s->hl);
+		hmac_final(&hk, &ctx, ca);
+	} else {
+		memcpy(ca, c, s->hl);
+	}
+	hmac_setkey(&hk, s->hashid, key, klen);
+	hmac_init(&hk, &ctx);
+	sha2_update(&ctx, ca, s->hl);
+	sha2_update(&ctx, &seq_le, sizeof(seq_le));
+	sha2_update(&ctx, &t_id, sizeof(t_id));
+	/* No secure channel concatenation */
+	sha2_update(&ctx, &zero, 1);
+	if (host)
+		sha2_update(&ctx, "HostHost", 8);
+	else
+		sha2_update(&ctx, "Controller", 10);
+	sha2_update(&ctx, nqn1, strlen(nqn1));
+	sha2_update(&ctx, &zero, 1);
+	sha2_update(&ctx, nqn2, strlen(nqn2));
+	hmac_final(&hk, &ctx, resp);
+	memset(key, 0, sizeof(key));
+	memset(&hk, 0, sizeof(hk));
+}
+
+/* Compare responses without returning early on a mismatch */
+static int auth_response_equal(const __u8 *a, const __u8 *b, size_t len)
+{
+	__u8 diff = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		diff |= a[i] ^ b[i];
+	return !diff;
+}
+
+/*
+ * Compute the hash of the secret shared with the peer public value
+ * @pub of @len bytes. Returns 0 or -EINVAL.
+ */
+static int auth_shared(struct auth_session *s, const __u8 *pub, size_t len)
+{
+	__u8 skey[DH_MAX_BYTES];
+	int ret;
+
+	ret = dh_shared(s->key, pub, len, skey);
+	if (!ret)
+		sha2_digest(s->hashid, skey, dh_len(s->dhgid), s->hskey);
+	memset(skey, 0, sizeof(skey));
+	return ret;
+}
+
+/* Fill in a Failure1 or Failure2 message; returns its length */
+static size_t auth_failure(struct auth_session *s, __u8 auth_id, void *buf)
+{
+	struct nvmf_auth_dhchap_failure_data *f = buf;
+
+	memset(f, 0, sizeof(*f));
+	f->auth_type = NVME_AUTH_COMMON_MESSAGES;
+	f->auth_id = auth_id;
+	f->t_id = htole16(s->t_id);
+	f->rescode = NVME_AUTH_DHCHAP_FAILURE_REASON_FAILED;
+	f->rescode_exp = s->rescode_exp;
+	return sizeof(*f);
+}
+
+/* Fail the host side of @s, returning the Failure2 message in @buf */
+static size_t auth_host_fail(struct auth_session *s, __u8 rescode_exp,
+			     void *buf)
+{
+	s->rescode_exp = rescode_exp;
+	s->step = AUTH_FAILED;
+	__atomic_add_fetch(&s->ctx->num_failed, 1, __ATOMIC_RELAXED);
+	return auth_failure(s, NVME_AUTH_DHCHAP_MESSAGE_FAILURE2, buf);
+}
+
+/*
+ * Check whether @msg of @len bytes is a @auth_id message of the
+ * transaction of @s, at least @size bytes long.
+ */
+static int auth_msg_check(struct auth_session *s, const void *msg,
+			  size_t len, __u8 auth_type, __u8 auth_id,
+			  size_t size)
+{
+	const struct nvmf_auth_dhchap_success2_data *hdr = msg;
+
+	return len >= size && hdr->auth_type == auth_type &&
+		hdr->auth_id == auth_id && le16toh(hdr->t_id) == s->t_id;
+}
+
+/* Whether @msg is a Failure1 message for @s */
+static int auth_is_failure1(struct auth_session *s, const void *msg,
+			    size_t len)
+{
+	return auth_msg_check(s, msg, len, NVME_AUTH_COMMON_MESSAGES,
+			      NVME_AUTH_DHCHAP_MESSAGE_FAILURE1,
+			      sizeof(struct nvmf_auth_dhchap_failure_data));
+}
+
+/* The controller failed the session with the Failure1 @msg */
+static size_t auth_host_rejected(struct auth_session *s, const void *msg)
+{
+	const struct nvmf_auth_dhchap_failure_data *f = msg;
+
+	s->rescode_exp = f->rescode_exp;
+	s->step = AUTH_FAILED;
+	__atomic_add_fetch(&s->ctx->num_failed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Fill in the host Negotiate message; returns its length */
+size_t auth_host_negotiate(struct auth_session *s, void *buf)
+{
+	struct nvmf_auth_dhchap_negotiate_data *neg = buf;
+	struct nvmf_auth_dhchap_protocol_descriptor *desc;
+	size_t len = sizeof(*neg) + sizeof(union nvmf_auth_protocol);
+
+	memset(neg, 0, len);
+	neg->auth_type = NVME_AUTH_COMMON_MESSAGES;
+	neg->auth_id = NVME_AUTH_DHCHAP_MESSAGE_NEGOTIATE;
+	neg->t_id = htole16(s->t_id);
+	neg->napd = 1;
+	desc = &neg->auth_protocol[0].dhchap;
+	desc->authid = NVME_AUTH_DHCHAP_AUTH_ID;
+	desc->halen = sizeof(auth_hashes);
+	memcpy(desc->idlist, auth_hashes, sizeof(auth_hashes));
+	desc->dhlen = sizeof(auth_dhgroups);
+	memcpy(desc->idlist + AUTH_IDLIST_DHGROUPS, auth_dhgroups,
+	       sizeof(auth_dhgroups));
+	s->step = AUTH_CHALLENGE;
+	return len;
+}
+
+/*
+ * Answer the Challenge @msg of @len bytes with a Reply in @buf.
+ * Returns the length of the message in @buf to be sent, a Failure2
+ * if the session failed, or 0 if the controller sent a Failure1.
+ */
+size_t auth_host_reply(struct auth_session *s, const void *msg, size_t len,
+		       void *buf)
+{
+	const struct nvmf_auth_dhchap_challenge_data *chal = msg;
+	struct nvmf_auth_dhchap_reply_data *reply = buf;
+	size_t dhvlen, hl;
+	int bidi = s->ctx->ctrl_secret.len > 0;
+
+	if (auth_is_failure1(s, msg, len))
+		return auth_host_rejected(s, msg);
+	if (s->step != AUTH_CHALLENGE ||
+	    !auth_msg_check(s, msg, len, NVME_AUTH_DHCHAP_MESSAGES,
+			    NVME_AUTH_DHCHAP_MESSAGE_CHALLENGE, sizeof(*chal)))
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_MESSAGE,
+				      buf);
+	hl = sha2_len(chal->hashid);
+	if (!hl || chal->hl != hl)
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_HASH_UNUSABLE,
+				      buf);
+	dhvlen = le16toh(chal->dhvlen);
+	if (chal->dhgid != NVME_AUTH_DHGROUP_NULL &&
+	    (!dh_len(chal->dhgid) || dhvlen != dh_len(chal->dhgid)))
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_DHGROUP_UNUSABLE,
+				      buf);
+	if ((chal->dhgid == NVME_AUTH_DHGROUP_NULL && dhvlen) ||
+	    len < sizeof(*chal) + hl + dhvlen)
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_PAYLOAD,
+				      buf);
+	s->hashid = chal->hashid;
+	s->dhgid = chal->dhgid;
+	s->hl = hl;
+	s->s1 = le32toh(chal->seqnum);
+	memcpy(s->c1, chal->cval, hl);
+	if (s->dhgid != NVME_AUTH_DHGROUP_NULL) {
+		s->key = dh_pool_get(&s->ctx->pool, s->dhgid);
+		if (!s->key)
+			return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_FAILED,
+					      buf);
+		if (auth_shared(s, chal->cval + hl, dhvlen) < 0)
+			return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_PAYLOAD,
+					      buf);
+	}
+
+	memset(reply, 0, sizeof(*reply) + 2 * hl);
+	reply->auth_type = NVME_AUTH_DHCHAP_MESSAGES;
+	reply->auth_id = NVME_AUTH_DHCHAP_MESSAGE_REPLY;
+	reply->t_id = htole16(s->t_id);
+	reply->hl = hl;
+	auth_response(s, 1, s->c1, s->s1, reply->rval);
+	if (bidi) {
+		auth_random(s->c2, hl);
+		s->s2 = auth_seqnum();
+		reply->cvalid = NVME_AUTH_DHCHAP_RESPONSE_VALID;
+		reply->seqnum = htole32(s->s2);
+		memcpy(reply->rval + hl, s->c2, hl);
+	}
+	dhvlen = 0;
+	if (s->key) {
+		dhvlen = dh_len(s->dhgid);
+		memcpy(reply->rval + 2 * hl, s->key->pub, dhvlen);
+	}
+	reply->dhvlen = htole16(dhvlen);
+	s->step = AUTH_SUCCESS1;
+	return sizeof(*reply) + 2 * hl + dhvlen;
+}
+
+/*
+ * Check the Success1 @msg of @len bytes, including the controller
+ * response for bidirectional authentication. Returns the length of
+ * the Success2 or Failure2 message in @buf to be sent, or 0 if there
+ * is none; the session is AUTH_DONE or AUTH_FAILED then.
+ */
+size_t auth_host_success(struct auth_session *s, const void *msg,
+			 size_t len, void *buf)
+{
+	const struct nvmf_auth_dhchap_success1_data *succ = msg;
+	struct nvmf_auth_dhchap_success2_data *succ2 = buf;
+	__u8 resp[SHA2_MAX_DIGEST];
+
+	if (auth_is_failure1(s, msg, len))
+		return auth_host_rejected(s, msg);
+	if (s->step != AUTH_SUCCESS1 ||
+	    !auth_msg_check(s, msg, len, NVME_AUTH_DHCHAP_MESSAGES,
+			    NVME_AUTH_DHCHAP_MESSAGE_SUCCESS1,
+			    sizeof(*succ) + s->hl) ||
+	    succ->hl != s->hl)
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_MESSAGE,
+				      buf);
+	if (!s->s2) {
+		s->step = AUTH_DONE;
+		__atomic_add_fetch(&s->ctx->num_ok, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	auth_response(s, 0, s->c2, s->s2, resp);
+	if (!succ->rvalid || !auth_response_equal(resp, succ->rval, s->hl))
+		return auth_host_fail(s, NVME_AUTH_DHCHAP_FAILURE_FAILED, buf);
+	memset(succ2, 0, sizeof(*succ2));
+	succ2->auth_type = NVME_AUTH_DHCHAP_MESSAGES;
+	succ2->auth_id = NVME_AUTH_DHCHAP_MESSAGE_SUCCESS2;
+	succ2->t_id = htole16(s->t_id);
+	s->step = AUTH_DONE;
+	__atomic_add_fetch(&s->ctx->num_ok, 1, __ATOMIC_RELAXED);
+	return sizeof(*succ2);
+}
+
+/* Fail the controller side of @s; Failure1 is returned next */
+static int auth_ctrl_fail(struct auth_session *s, __u8 rescode_exp)
+{
+	s->rescode_exp = rescode_exp;
+	s->msg_len = auth_failure(s, NVME_AUTH_DHCHAP_MESSAGE_FAILURE1,
+				  s->msg);
+	s->step = AUTH_FAILURE1;
+	return 0;
+}
+
+/* Whether @id is among the @num ids at @list */
+static int auth_offered(const __u8 *list, int num, __u8 id)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (list[i] == id)
+			return 1;
+	}
+	return 0;
+}
+
+/* Select the hash and DH group from @neg, and prepare the Challenge */
+static int auth_ctrl_negotiate(struct auth_session *s, const void *msg,
+			       size_t len)
+{
+	const struct nvmf_auth_dhchap_negotiate_data *neg = msg;
+	const struct nvmf_auth_dhchap_protocol_descriptor *desc;
+	struct nvmf_auth_dhchap_challenge_data *chal =
+		(struct nvmf_auth_dhchap_challenge_data *)s->msg;
+	const __u8 *dhlist;
+	size_t dhvlen = 0;
+	int i;
+
+	if (len >= sizeof(*neg))
+		s->t_id = le16toh(neg->t_id);
+	if (!auth_msg_check(s, msg, len, NVME_AUTH_COMMON_MESSAGES,
+			    NVME_AUTH_DHCHAP_MESSAGE_NEGOTIATE,
+			    sizeof(*neg) + sizeof(union nvmf_auth_protocol)) ||
+	    !neg->napd)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_MESSAGE);
+	if (neg->sc_c)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_CONCAT_MISMATCH);
+	desc = &neg->auth_protocol[0].dhchap;
+	if (desc->authid != NVME_AUTH_DHCHAP_AUTH_ID ||
+	    desc->halen > AUTH_IDLIST_DHGROUPS ||
+	    desc->dhlen > sizeof(desc->idlist) - AUTH_IDLIST_DHGROUPS)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_PAYLOAD);
+
+	if (auth_offered(desc->idlist, desc->halen, s->ctx->hashid))
+		s->hashid = s->ctx->hashid;
+	for (i = 0; i < desc->halen && !s->hashid; i++) {
+		if (sha2_len(desc->idlist[i]))
+			s->hashid = desc->idlist[i];
+	}
+	if (!s->hashid)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_HASH_UNUSABLE);
+	dhlist = desc->idlist + AUTH_IDLIST_DHGROUPS;
+	s->dhgid = NVME_AUTH_DHGROUP_INVALID;
+	if (auth_offered(dhlist, desc->dhlen, s->ctx->dhgid))
+		s->dhgid = s->ctx->dhgid;
+	for (i = 0; i < desc->dhlen && s->dhgid == NVME_AUTH_DHGROUP_INVALID;
+	     i++) {
+		if (dhlist[i] == NVME_AUTH_DHGROUP_NULL || dh_len(dhlist[i]))
+			s->dhgid = dhlist[i];
+	}
+	if (s->dhgid == NVME_AUTH_DHGROUP_INVALID)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_DHGROUP_UNUSABLE);
+	s->hl = sha2_len(s->hashid);
+	if (s->dhgid != NVME_AUTH_DHGROUP_NULL) {
+		s->key = dh_pool_get(&s->ctx->pool, s->dhgid);
+		if (!s->key)
+			return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_FAILED);
+		dhvlen = dh_len(s->dhgid);
+	}
+
+	s->s1 = auth_seqnum();
+	auth_random(s->c1, s->hl);
+	memset(chal, 0, sizeof(*chal));
+	chal->auth_type = NVME_AUTH_DHCHAP_MESSAGES;
+	chal->auth_id = NVME_AUTH_DHCHAP_MESSAGE_CHALLENGE;
+	chal->t_id = htole16(s->t_id);
+	chal->hl = s->hl;
+	chal->hashid = s->hashid;
+	chal->dhgid = s->dhgid;
+	chal->dhvlen = htole16(dhvlen);
+	chal->seqnum = htole32(s->s1);
+	memcpy(chal->cval, s->c1, s->hl);
+	if (s->key)
+		memcpy(chal->cval + s->hl, s->key->pub, dhvlen);
+	s->msg_len = sizeof(*chal) + s->hl + dhvlen;
+	s->step = AUTH_CHALLENGE;
+	return 0;
+}
+
+/* Check the host response in @reply, and prepare Success1 */
+static int auth_ctrl_reply(struct auth_session *s, const void *msg,
+			   size_t len)
+{
+	const struct nvmf_auth_dhchap_reply_data *reply = msg;
+	struct nvmf_auth_dhchap_success1_data *succ =
+		(struct nvmf_auth_dhchap_success1_data *)s->msg;
+	__u8 resp[SHA2_MAX_DIGEST];
+	size_t hl = s->hl, dhvlen = s->key ? dh_len(s->dhgid) : 0;
+
+	if (!auth_msg_check(s, msg, len, NVME_AUTH_DHCHAP_MESSAGES,
+			    NVME_AUTH_DHCHAP_MESSAGE_REPLY,
+			    sizeof(*reply) + 2 * hl + dhvlen) ||
+	    reply->hl != hl || le16toh(reply->dhvlen) != dhvlen)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_PAYLOAD);
+	if (s->key && auth_shared(s, reply->rval + 2 * hl, dhvlen) < 0)
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_PAYLOAD);
+	auth_response(s, 1, s->c1, s->s1, resp);
+	if (!auth_response_equal(resp, reply->rval, hl))
+		return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_FAILED);
+
+	memset(succ, 0, sizeof(*succ) + hl);
+	succ->auth_type = NVME_AUTH_DHCHAP_MESSAGES;
+	succ->auth_id = NVME_AUTH_DHCHAP_MESSAGE_SUCCESS1;
+	succ->t_id = htole16(s->t_id);
+	succ->hl = hl;
+	if (reply->cvalid & NVME_AUTH_DHCHAP_RESPONSE_VALID) {
+		/* The host asks to authenticate the controller */
+		if (!s->ctx->ctrl_secret.len)
+			return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_NOT_USABLE);
+		s->s2 = le32toh(reply->seqnum);
+		memcpy(s->c2, reply->rval + hl, hl);
+		auth_response(s, 0, s->c2, s->s2, succ->rval);
+		succ->rvalid = 1;
+	}
+	s->msg_len = sizeof(*succ) + hl;
+	s->step = AUTH_SUCCESS1;
+	return 0;
+}
+
+/*
+ * Process the host message @msg of @len bytes sent by Authentication
+ * Send. Returns 0, also if the authentication failed, or -EPROTO if
+ * the session does not expect a message from the host.
+ */
+int auth_ctrl_send(struct auth_session *s, const void *msg, size_t len)
+{
+	const struct nvmf_auth_dhchap_failure_data *fail = msg;
+
+	if (s->step == AUTH_DONE || s->step == AUTH_FAILED)
+		return -EPROTO;
+	if (len >= sizeof(*fail) &&
+	    fail->auth_type == NVME_AUTH_COMMON_MESSAGES &&
+	    fail->auth_id == NVME_AUTH_DHCHAP_MESSAGE_FAILURE2) {
+		s->step = AUTH_FAILED;
+		__atomic_add_fetch(&s->ctx->num_failed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	switch (s->step) {
+	case AUTH_NEGOTIATE:
+		return auth_ctrl_negotiate(s, msg, len);
+	case AUTH_REPLY:
+		return auth_ctrl_reply(s, msg, len);
+	case AUTH_SUCCESS2:
+		if (!auth_msg_check(s, msg, len, NVME_AUTH_DHCHAP_MESSAGES,
+				    NVME_AUTH_DHCHAP_MESSAGE_SUCCESS2,
+				    sizeof(struct nvmf_auth_dhchap_success2_data)))
+			return auth_ctrl_fail(s, NVME_AUTH_DHCHAP_FAILURE_INCORRECT_MESSAGE);
+		s->step = AUTH_DONE;
+		__atomic_add_fetch(&s->ctx->num_ok, 1, __ATOMIC_RELAXED);
+		return 0;
+	default:
+		return -EPROTO;
+	}
+}
+
+/*
+ * Message for Authentication Receive, of *@len bytes, or NULL if the
+ * session has none to return.
+ */
+const void *auth_ctrl_receive(struct auth_session *s, size_t *len)
+{
+	switch (s->step) {
+	case AUTH_CHALLENGE:
+		s->step = AUTH_REPLY;
+		break;
+	case AUTH_SUCCESS1:
+		if (s->s2) {
+			s->step = AUTH_SUCCESS2;
+			break;
+		}
+		s->step = AUTH_DONE;
+		__atomic_add_fetch(&s->ctx->num_ok, 1, __ATOMIC_RELAXED);
+		break;
+	case AUTH_FAILURE1:
+		s->step = AUTH_FAILED;
+		__atomic_add_fetch(&s->ctx->num_failed, 1, __ATOMIC_RELAXED);
+		break;
+	default:
+		return NULL;
+	}
+	*len = s->msg_len;
+	return s->msg;
+}
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * auth.h - NVMe in-band authentication with DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _AUTH_H
+#define _AUTH_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "nvme.h"
+#include "sha2.h"
+#include "dh.h"
+
+/*
+ * Largest DH-HMAC-CHAP message: a Reply with a response, a challenge
+ * and an ffdhe8192 public value
+ */
+#define AUTH_MSG_MAX		(sizeof(struct nvmf_auth_dhchap_reply_data) + \
+				 2 * SHA2_MAX_DIGEST + DH_MAX_BYTES)
+
+/* Message buffers are accessed through the message structures */
+#define AUTH_MSG_ALIGN		__alignof__(struct nvmf_auth_dhchap_reply_data)
+
+/* Sessions a DH key pair is used for at most, and for how long */
+#define AUTH_KEY_MAX_USES	64
+#define AUTH_KEY_MAX_AGE_MS	60000
+
+/* Handshakes per configuration of the authentication benchmark */
+#define AUTH_BENCH_HANDSHAKES	200
+
+/**
+ * struct auth_secret - DH-HMAC-CHAP secret
+ *
+ * @key:           secret key
+ * @len:           length of @key, 0 if no secret is set
+ * @hashid:        hash transforming @key with the NQN, 0 to use @key
+ *                 as is
+ */
+struct auth_secret {
+	__u8 key[SHA2_MAX_DIGEST];
+	size_t len;
+	int hashid;
+};
+
+/**
+ * struct auth_ctx - DH-HMAC-CHAP configuration of a host or CDC
+ *
+ * @host_secret:   secret authenticating the host
+ * @ctrl_secret:   secret authenticating the controller, unset for
+ *                 unidirectional authentication
+ * @hashid:        hash the controller selects if the host offers it
+ * @dhgid:         DH group the controller selects if the host offers
+ *                 it
+ * @pool:          DH key pairs
+ * @num_ok:        number of successful authentications
+ * @num_failed:    number of failed authentications
+ *
+ * Shared by all sessions and threads of a host or CDC; the counters
+ * are updated atomically.
+ */
+struct auth_ctx {
+	struct auth_secret host_secret;
+	struct auth_secret ctrl_secret;
+	__u8 hashid;
+	__u8 dhgid;
+	struct dh_pool pool;
+	unsigned long num_ok;
+	unsigned long num_failed;
+};
+
+/* Message a session expects next, or its outcome */
+enum auth_step {
+	AUTH_NEGOTIATE,
+	AUTH_CHALLENGE,
+	AUTH_REPLY,
+	AUTH_SUCCESS1,
+	AUTH_SUCCESS2,
+	AUTH_FAILURE1,
+	AUTH_DONE,
+	AUTH_FAILED,
+};
+
+/**
+ * struct auth_session - DH-HMAC-CHAP transaction of one queue
+ *
+ * @ctx:           configuration
+ * @hostnqn:       NQN of the host
+ * @subsysnqn:     NQN of the subsystem connected to
+ * @step:          message expected next
+ * @t_id:          transaction id
+ * @hashid:        selected hash
+ * @dhgid:         selected DH group
+ * @hl:            length of the hashes, challenges and responses
+ * @s1:            sequence number of the controller challenge
+ * @s2:            sequence number of the host challenge, 0 for
+ *                 unidirectional authentication
+ * @c1:            controller challenge
+ * @c2:            host challenge
+ * @hskey:         hash of the DH shared secret, keying the augmented
+ *                 challenges
+ * @key:           DH key pair, NULL for the NULL group
+ * @rescode_exp:   failure reason, NVME_AUTH_DHCHAP_FAILURE_*
+ * @msg:           controller message for the next Auth Receive
+ * @msg_len:       length of @msg
+ *
+ * All hashes are computed on the session, so an authentication
+ * allocates no memory besides the DH key pairs, which come from the
+ * pool of @ctx.
+ */
+struct auth_session {
+	struct auth_ctx *ctx;
+	char hostnqn[NVMF_NQN_FIELD_LEN + 1];
+	char subsysnqn[NVMF_NQN_FIELD_LEN + 1];
+	enum auth_step step;
+	__u16 t_id;
+	__u8 hashid;
+	__u8 dhgid;
+	size_t hl;
+	__u32 s1;
+	__u32 s2;
+	__u8 c1[SHA2_MAX_DIGEST];
+	__u8 c2[SHA2_MAX_DIGEST];
+	__u8 hskey[SHA2_MAX_DIGEST];
+	struct dh_key *key;
+	__u8 rescode_exp;
+	__u8 msg[AUTH_MSG_MAX] __attribute__((aligned(AUTH_MSG_ALIGN)));
+	size_t msg_len;
+};
+
+int auth_secret_parse(struct auth_secret *secret, const char *str);
+int auth_ctx_init(struct auth_ctx *ctx, const char *host_secret,
+		  const char *ctrl_secret, int depth, unsigned int max_uses);
+void auth_ctx_free(struct auth_ctx *ctx);
+
+void auth_session_init(struct auth_session *s, struct auth_ctx *ctx,
+		       const char *hostnqn, const char *subsysnqn,
+		       __u16 t_id);
+void auth_session_free(struct auth_session *s);
+
+size_t auth_host_negotiate(struct auth_session *s, void *buf);
+size_t auth_host_reply(struct auth_session *s, const void *msg, size_t len,
+		       void *buf);
+size_t auth_host_success(struct auth_session *s, const void *msg,
+			 size_t len, void *buf);
+
+int auth_ctrl_send(struct auth_session *s, const void *msg, size_t len);
+const void *auth_ctrl_receive(struct auth_session *s, size_t *len);
+
+#endif /* _AUTH_H */
@@ -0,0 +1,2059 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * cdc.c - centralized discovery controller protocol engine
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Handles the PDUs of a DDC connection: ICReq is answered with an
+ * ICResp, and each KDReq PDU updates the registry and is answered
+ * with a KDResp. A KDReq without records is a keep-alive. Responses
+ * are queued on the connection and sent by the I/O backend.
+ *
+ * Connections whose ICReq does not set KDCONN are discovery hosts,
+ * served by a minimal discovery controller admin queue: Connect,
+ * Property Get/Set, Identify Controller, Keep Alive, and Get Log
+ * Page for the discovery log, which is sent from the serialized
+ * log page of the current registry generation, and Asynchronous
+ * Event Requests, completed with discovery log change notices.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "acdc.h"
+#include "cdc.h"
+#include "crc32c.h"
+
+/* Source of the zero padding of log page data beyond its end */
+static const char ddc_zero_page[4096];
+
+/* Retain Asynchronous Event bit of Get Log Page (CDW10 bit 15) */
+#define DDC_LOG_RAE		(1 << 7)
+
+/*
+ * Schedule a change notice once the registry has been quiet for the
+ * notice window, deferring it at most CDC_AEN_MAX_DEFER windows.
+ */
+static void cdc_aen_changed(struct cdc_server *srv)
+{
+	struct timespec now, last;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!srv->aen_pending) {
+		srv->aen_pending = 1;
+		srv->aen_first = now;
+	} else {
+		srv->num_aen_coalesced++;
+	}
+	srv->aen_due = now;
+	timespec_add_ms(&srv->aen_due, srv->aen_window);
+	last = srv->aen_first;
+	timespec_add_ms(&last, (long)srv->aen_window * CDC_AEN_MAX_DEFER);
+	if (timespec_diff_ms(&srv->aen_due, &last) < 0)
+		srv->aen_due = last;
+}
+
+/*
+ * Time in ms until the pending change notice is to be raised, or -1
+ * if there is none; called by the registry owner.
+ */
+long cdc_aen_timeout(struct cdc_server *srv)
+{
+	struct timespec now;
+	long ms;
+
+	if (!srv->aen_pending)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = timespec_diff_ms(&now, &srv->aen_due);
+	return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Raise the pending change notice if it is due; called by the
+ * registry owner. Returns 1 if the I/O loops have to notify their
+ * hosts.
+ */
+int cdc_aen_raise(struct cdc_server *srv)
+{
+	if (cdc_aen_timeout(srv))
+		return 0;
+	srv->aen_pending = 0;
+	srv->num_aen_notices++;
+	__atomic_add_fetch(&srv->aen_seq, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Replace the log page by one built from the registry; called by the
+ * registry owner with the log lock held. The previous log page stays
+ * if out of memory.
+ */
+static void cdc_log_build(struct cdc_server *srv)
+{
+	struct disc_log *log;
+
+	log = disc_log_build(&srv->reg, NVME_DISC_SUBSYS_NAME);
+	if (!log)
+		return;
+	disc_log_put(srv->log);
+	srv->log = log;
+	srv->log_stale = 0;
+	srv->num_log_builds++;
+}
+
+/*
+ * Keep the discovery log page in sync with the registry; called by
+ * the registry owner, which is the only one building log pages.
+ */
+static void cdc_reg_changed(void *priv, struct registry *reg, int idx)
+{
+	struct cdc_server *srv = priv;
+
+	pthread_mutex_lock(&srv->log_lock);
+	if (!srv->log || srv->log_stale)
+		cdc_log_build(srv);
+	else if (disc_log_update(&srv->log, reg, idx) < 0)
+		/* Hosts get the last page until cdc_log_retry() */
+		srv->log_stale = 1;
+	else
+		srv->num_log_patches++;
+	pthread_mutex_unlock(&srv->log_lock);
+	cdc_aen_changed(srv);
+}
+
+/*
+ * Rebuild the log page if it is missing or lags behind the registry;
+ * called by the registry owner.
+ */
+void cdc_log_retry(struct cdc_server *srv)
+{
+	if (srv->log && !srv->log_stale)
+		return;
+	pthread_mutex_lock(&srv->log_lock);
+	cdc_log_build(srv);
+	pthread_mutex_unlock(&srv->log_lock);
+}
+
+/*
+ * Time in ms until cdc_log_retry() is to be called again, or -1 if
+ * the log page is up to date; called by the registry owner.
+ */
+long cdc_log_timeout(struct cdc_server *srv)
+{
+	return srv->log && !srv->log_stale ? -1 : CDC_LOG_RETRY_MS;
+}
+
+void cdc_server_init(struct cdc_server *srv, const char *nqn)
+{
+	memset(srv, 0, sizeof(*srv));
+	strncpy(srv->nqn, nqn, NVMF_NQN_SIZE);
+	srv->maxdata = CDC_MAXDATA;
+	srv->reg_efd = -1;
+	srv->aen_window = CDC_AEN_WINDOW;
+	registry_init(&srv->reg);
+	wal_init(&srv->wal);
+	srv->reg.notify = cdc_reg_changed;
+	srv->reg.notify_priv = srv;
+	pthread_mutex_init(&srv->log_lock, NULL);
+	/* From now on registry changes are patched into the log page */
+	srv->log = disc_log_build(&srv->reg, NVME_DISC_SUBSYS_NAME);
+	if (srv->log)
+		srv->num_log_builds++;
+}
+
+void cdc_server_free(struct cdc_server *srv)
+{
+	disc_log_put(srv->log);
+	srv->log = NULL;
+	disc_log_put(srv->snap_log);
+	srv->snap_log = NULL;
+	pthread_mutex_destroy(&srv->log_lock);
+	registry_free(&srv->reg);
+	snap_unmap(&srv->snap);
+	wal_close(&srv->wal);
+	if (srv->gossip) {
+		gossip_free(srv->gossip);
+		free(srv->gossip);
+		srv->gossip = NULL;
+	}
+	free(srv->repl_path);
+	srv->repl_path = NULL;
+}
+
+/*
+ * Restore the registry and the discovery log page from the snapshot
+ * at @path, where cdc_snap_save() saves them from now on. A missing
+ * snapshot starts an empty registry. Returns 0 or a negative errno
+ * value.
+ */
+int cdc_snap_load(struct cdc_server *srv, const char *path)
+{
+	struct disc_log *log = NULL;
+	int ret;
+
+	srv->snap_path = path;
+	ret = snap_load(&srv->snap, path, &srv->reg, &log,
+			NVME_DISC_SUBSYS_NAME);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret < 0)
+		return ret;
+	disc_log_put(srv->log);
+	srv->log = log;
+	srv->snap_genctr = srv->reg.genctr;
+	/* Verified by the registry owner once serving */
+	srv->snap_log = log ? disc_log_get(log) : NULL;
+	clock_gettime(CLOCK_MONOTONIC, &srv->snap_verify);
+	timespec_add_ms(&srv->snap_verify, CDC_SNAP_VERIFY_MS);
+	return 0;
+}
+
+/*
+ * Time in ms until cdc_snap_verify() is to be called, or -1 if the
+ * snapshot was verified; called by the registry owner.
+ */
+long cdc_snap_timeout(struct cdc_server *srv)
+{
+	struct timespec now;
+	long ms;
+
+	if (srv->snap_corrupt)
+		return CDC_SNAP_VERIFY_MS;
+	if (!srv->snap.file)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = timespec_diff_ms(&now, &srv->snap_verify);
+	return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Replace the registry restored from a corrupt snapshot by a copy
+ * rebuilt from its entries, which drops any broken index and
+ * duplicates, and rebuild the log page. Returns 0 or -ENOMEM.
+ */
+static int cdc_reg_rebuild(struct cdc_server *srv)
+{
+	struct registry reg;
+	struct port_rec rec;
+	int i, ret;
+
+	registry_init(&reg);
+	for (i = 0; i < srv->reg.num_recs; i++) {
+		struct reg_entry *e = &srv->reg.entries[i];
+
+		rec = e->rec;
+		rec.traddr[sizeof(rec.traddr) - 1] = '\0';
+		rec.trsvcid[sizeof(rec.trsvcid) - 1] = '\0';
+		ret = registry_add(&reg, &rec, &e->ddc);
+		if (ret < 0) {
+			registry_free(&reg);
+			return ret;
+		}
+	}
+	reg.genctr = srv->reg.genctr + 1;
+	reg.notify = srv->reg.notify;
+	reg.notify_priv = srv->reg.notify_priv;
+	registry_free(&srv->reg);
+	srv->reg = reg;
+	pthread_mutex_lock(&srv->log_lock);
+	srv->log_stale = 1;
+	cdc_log_build(srv);
+	pthread_mutex_unlock(&srv->log_lock);
+	cdc_aen_changed(srv);
+	return 0;
+}
+
+/*
+ * Verify the snapshot the registry was restored from once
+ * CDC_SNAP_VERIFY_MS have passed, off the path of the first log
+ * pages served. A corrupt snapshot is replaced by a registry rebuilt
+ * from it, and unmapped as soon as no response refers to its log
+ * page any longer. Only to be called by the registry owner.
+ */
+void cdc_snap_verify(struct cdc_server *srv)
+{
+	int ret;
+
+	if (srv->snap_corrupt) {
+		if (srv->snap_log && srv->log != srv->snap_log &&
+		    __atomic_load_n(&srv->snap_log->refs,
+				    __ATOMIC_ACQUIRE) == 1) {
+			disc_log_put(srv->snap_log);
+			srv->snap_log = NULL;
+		}
+		if (!srv->snap_log) {
+			snap_unmap(&srv->snap);
+			srv->snap_corrupt = 0;
+		}
+		return;
+	}
+	if (cdc_snap_timeout(srv))
+		return;
+	if (!snap_verify(&srv->snap)) {
+		disc_log_put(srv->snap_log);
+		srv->snap_log = NULL;
+		return;
+	}
+	fprintf(stderr, "snapshot %s is corrupt, rebuilding the registry\n",
+		srv->snap_path);
+	ret = cdc_reg_rebuild(srv);
+	if (ret < 0) {
+		/* Rather serve the damaged registry than none */
+		fprintf(stderr, "cannot rebuild the registry: %s\n",
+			strerror(-ret));
+		return;
+	}
+	srv->snap_corrupt = 1;
+	/* Replace the damaged snapshot */
+	srv->snap_genctr = 0;
+}
+
+/*
+ * Forget old deregistrations, and save the replicated state if it
+ * changed. Only to be called by the registry owner.
+ */
+static void cdc_gossip_save(struct cdc_server *srv)
+{
+	int ret;
+
+	gossip_purge(srv->gossip);
+	if (!srv->repl_path)
+		return;
+	ret = gossip_save(srv->gossip, srv->repl_path);
+	if (ret < 0)
+		fprintf(stderr, "cannot save replication state %s: %s\n",
+			srv->repl_path, strerror(-ret));
+}
+
+/*
+ * Save the registry if it changed since the last snapshot, and the
+ * replicated state. Only to be called by the registry owner.
+ * Returns 0 or a negative errno value.
+ */
+int cdc_snap_save(struct cdc_server *srv)
+{
+	int ret;
+
+	if (srv->gossip)
+		cdc_gossip_save(srv);
+	if (!srv->snap_path || srv->reg.genctr == srv->snap_genctr ||
+	    !srv->log || srv->log_stale)
+		return 0;
+	/* The log must not end up behind the snapshot */
+	ret = cdc_wal_commit(srv);
+	if (ret < 0)
+		return ret;
+	ret = snap_save(srv->snap_path, &srv->reg, srv->log);
+	if (ret < 0) {
+		fprintf(stderr, "cannot save snapshot %s: %s\n",
+			srv->snap_path, strerror(-ret));
+		return ret;
+	}
+	srv->snap_genctr = srv->reg.genctr;
+	/* Everything logged so far is in the snapshot now */
+	if (srv->wal.fd >= 0) {
+		ret = wal_reset(&srv->wal);
+		if (ret < 0)
+			fprintf(stderr, "cannot reset write-ahead log: %s\n",
+				strerror(-ret));
+	}
+	return 0;
+}
+
+/*
+ * Replay the write-ahead log at @path on top of the registry, which
+ * is restored from the snapshot first if there is one, and log the
+ * registry changes to it from now on. Returns the number of changes
+ * replayed or a negative errno value.
+ */
+int cdc_wal_open(struct cdc_server *srv, const char *path)
+{
+	int ret;
+
+	srv->wal_path = path;
+	/* Build the log page once instead of patching every change */
+	srv->reg.notify = NULL;
+	ret = wal_open(&srv->wal, path, &srv->reg);
+	srv->reg.notify = cdc_reg_changed;
+	if (ret <= 0)
+		return ret;
+	disc_log_put(srv->log);
+	srv->log = disc_log_build(&srv->reg, NVME_DISC_SUBSYS_NAME);
+	if (srv->log)
+		srv->num_log_builds++;
+	return ret;
+}
+
+/*
+ * Time in ms until a failed write-ahead log commit is to be tried
+ * again, or -1 if none failed; called by the registry owner.
+ */
+long cdc_wal_timeout(struct cdc_server *srv)
+{
+	struct timespec now;
+	long ms;
+
+	if (!srv->wal_failed)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = timespec_diff_ms(&now, &srv->wal_retry);
+	return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Make the registry changes logged since the last call durable, with
+ * a single fdatasync() for all of them. After a failure the changes
+ * stay buffered, and are only written again once CDC_WAL_RETRY_MS
+ * have passed. Only to be called by the registry owner.
+ * Returns 0, -EAGAIN while waiting to try again, or a negative errno
+ * value.
+ */
+int cdc_wal_commit(struct cdc_server *srv)
+{
+	int ret;
+
+	if (srv->wal.fd < 0 || !srv->wal.num_pending)
+		return 0;
+	if (cdc_wal_timeout(srv) > 0)
+		return -EAGAIN;
+	ret = wal_commit(&srv->wal);
+	if (ret < 0) {
+		/* Only report the first of the failed attempts */
+		if (!srv->wal_failed)
+			fprintf(stderr, "cannot commit write-ahead log: %s\n",
+				strerror(-ret));
+		srv->wal_failed = 1;
+		clock_gettime(CLOCK_MONOTONIC, &srv->wal_retry);
+		timespec_add_ms(&srv->wal_retry, CDC_WAL_RETRY_MS);
+		return ret;
+	}
+	if (srv->wal_failed)
+		fprintf(stderr, "write-ahead log committed again\n");
+	srv->wal_failed = 0;
+	return 0;
+}
+
+/*
+ * Take a reference to the current discovery log page, pinning it if
+ * @pin is set, and return its length in @len. Returns NULL if it
+ * could not be built.
+ */
+static struct disc_log *cdc_log_get(struct cdc_server *srv, int pin,
+				    size_t *len)
+{
+	struct disc_log *log;
+
+	pthread_mutex_lock(&srv->log_lock);
+	/* Only the registry owner may read the registry */
+	if ((!srv->log || srv->log_stale) && !srv->reg_queue)
+		cdc_log_build(srv);
+	log = srv->log;
+	if (log) {
+		disc_log_get(log);
+		if (pin)
+			disc_log_pin(log);
+		*len = log->len;
+	}
+	pthread_mutex_unlock(&srv->log_lock);
+	return log;
+}
+
+/*
+ * Add @rec registered by @ddc to the registry, or remove it if @dereg
+ * is set, logging the change first. Changes made by a DDC connected
+ * to this CDC, as opposed to a replication peer, are recorded for
+ * replication if @local is set. Only to be called by the registry
+ * owner. Returns 0 or a negative errno value.
+ */
+static int cdc_reg_apply(struct cdc_server *srv, int dereg,
+			 struct port_rec *rec, const struct in6_addr *ddc,
+			 int local)
+{
+	int ret;
+
+	if (srv->wal.fd >= 0) {
+		ret = wal_append(&srv->wal, dereg ? WAL_REC_DEL : WAL_REC_ADD,
+				 rec, ddc);
+		if (ret < 0)
+			return ret;
+	}
+	if (dereg)
+		ret = registry_del(&srv->reg, rec);
+	else
+		ret = registry_add(&srv->reg, rec, ddc);
+	if (ret >= 0 && local && srv->gossip)
+		ret = gossip_local(srv->gossip, rec, ddc, dereg);
+	return ret < 0 ? ret : 0;
+}
+
+/* Apply the changes of a replication peer which are newer */
+static void cdc_reg_merge(struct cdc_server *srv, struct cdc_reg_op *op)
+{
+	struct gossip_change *c;
+	int i, ret;
+
+	for (i = 0; i < op->num_recs; i++) {
+		c = &op->repl[i];
+		ret = gossip_merge(srv->gossip, c);
+		if (ret > 0)
+			ret = cdc_reg_apply(srv, c->deleted, &c->rec, &c->ddc,
+					    0);
+		if (ret < 0)
+			fprintf(stderr, "registry: %s\n", strerror(-ret));
+	}
+	free(op->repl);
+}
+
+/*
+ * Apply the registry changes queued by the workers and by the
+ * replication peers. Returns the number of changes applied.
+ */
+int cdc_reg_drain(struct cdc_server *srv)
+{
+	struct mpsc_node *n;
+	int num = 0, i, ret;
+
+	__atomic_store_n(&srv->reg_pending, 0, __ATOMIC_SEQ_CST);
+	while ((n = mpsc_pop(srv->reg_queue))) {
+		struct cdc_reg_op *op = (struct cdc_reg_op *)n;
+
+		if (op->repl)
+			cdc_reg_merge(srv, op);
+		for (i = 0; i < op->num_recs && !op->repl; i++) {
+			ret = cdc_reg_apply(srv, op->dereg, &op->recs[i],
+					    &op->ddc, 1);
+			if (ret < 0)
+				fprintf(stderr, "registry: %s\n",
+					strerror(-ret));
+		}
+		/* Durable with the next commit */
+		if (op->ws)
+			op->ws->applied = op->seq;
+		free(op);
+		num++;
+	}
+	srv->num_reg_ops += num;
+	return num;
+}
+
+/* Queue @op for the registry owner, waking it up if it may be waiting */
+static void cdc_reg_queue(struct cdc_server *srv, struct cdc_reg_op *op)
+{
+	uint64_t one = 1;
+
+	mpsc_push(srv->reg_queue, &op->node);
+	if (!__atomic_fetch_add(&srv->reg_pending, 1, __ATOMIC_SEQ_CST) &&
+	    write(srv->reg_efd, &one, sizeof(one)) < 0)
+		perror("registry queue eventfd");
+}
+
+/* Queue @num changes received from a replication peer */
+static void cdc_gossip_apply(void *priv, struct gossip_change *changes,
+			     int num)
+{
+	struct cdc_server *srv = priv;
+	struct cdc_reg_op *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op) {
+		/* Sent again by the next round */
+		free(changes);
+		return;
+	}
+	op->num_recs = num;
+	op->repl = changes;
+	cdc_reg_queue(srv, op);
+}
+
+/*
+ * Replicate the registry with peer CDCs, answering their rounds on
+ * @addr:@port unless @port is NULL. The replicated state is restored
+ * from, and saved to, the snapshot or else the write-ahead log path
+ * with CDC_REPL_SUFFIX appended; records which changed since it was
+ * saved become changes of this node. Without a saved state, records
+ * restored so far get the oldest version, so changes peers made
+ * meanwhile win. Peers are added with gossip_add_peer(), and
+ * cdc_serve() runs the replication on worker threads. Returns 0 or a
+ * negative errno value.
+ */
+int cdc_gossip_init(struct cdc_server *srv, const char *addr,
+		    const char *port)
+{
+	const char *base = srv->snap_path ? srv->snap_path : srv->wal_path;
+	struct reg_entry *re;
+	struct gossip_change c;
+	struct port_rec rec;
+	struct gossip *g;
+	int i, restored = 0, ret;
+
+	g = malloc(sizeof(*g));
+	if (!g)
+		return -ENOMEM;
+	ret = gossip_init(g, cdc_gossip_apply, srv);
+	if (ret < 0) {
+		free(g);
+		return ret;
+	}
+	srv->gossip = g;
+	if (port) {
+		ret = gossip_listen(g, addr, port);
+		if (ret < 0)
+			return ret;
+	}
+	if (base) {
+		srv->repl_path = malloc(strlen(base) + sizeof(CDC_REPL_SUFFIX));
+		if (!srv->repl_path)
+			return -ENOMEM;
+		sprintf(srv->repl_path, "%s" CDC_REPL_SUFFIX, base);
+		ret = gossip_load(g, srv->repl_path);
+		if (ret < 0 && ret != -ENOENT) {
+			fprintf(stderr, "cannot restore replication state "
+				"%s: %s\n", srv->repl_path, strerror(-ret));
+			return ret;
+		}
+		restored = ret >= 0;
+	}
+	for (i = 0; i < srv->reg.num_recs; i++) {
+		re = &srv->reg.entries[i];
+		if (restored) {
+			/* Unchanged records keep their version */
+			ret = gossip_local(g, &re->rec, &re->ddc, 0);
+		} else {
+			memset(&c, 0, sizeof(c));
+			c.rec = re->rec;
+			c.ddc = re->ddc;
+			ret = gossip_merge(g, &c);
+		}
+		if (ret < 0)
+			return -ENOMEM;
+	}
+	/* Deregistered after the state was saved */
+	for (i = 0; restored && i < g->num_entries; i++) {
+		rec = g->entries[i].change.rec;
+		if (!g->entries[i].change.deleted &&
+		    !registry_lookup(&srv->reg, &rec) &&
+		    gossip_local(g, &rec, NULL, 1) < 0)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void ddc_timer_set(struct ddc_conn *dc, unsigned long ms)
+{
+	if (dc->wheel)
+		wheel_add(dc->wheel, &dc->timer, ms);
+}
+
+static void ddc_timer_del(struct ddc_conn *dc)
+{
+	if (dc->wheel)
+		wheel_del(dc->wheel, &dc->timer);
+}
+
+void ddc_init(struct ddc_conn *dc, struct cdc_server *srv,
+	      struct cdc_stats *stats, struct ddc_conn **aen_hosts,
+	      struct cdc_wal_sync *wal_sync, struct wheel *wheel, int fd,
+	      const struct in6_addr *addr)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->fd = fd;
+	dc->addr = *addr;
+	dc->srv = srv;
+	dc->stats = stats;
+	dc->aen_hosts = aen_hosts;
+	dc->wal_sync = wal_sync;
+	/* Only changes from now on are notified */
+	dc->aen_seq = __atomic_load_n(&srv->aen_seq, __ATOMIC_ACQUIRE);
+	dc->state = DDC_ICREQ;
+	/* Room for the largest KDReq including both digests */
+	pdu_buf_init(&dc->pb, srv->maxdata + sizeof(struct nvme_tcp_kdreq_pdu) +
+		     2 * NVME_TCP_DIGEST_LENGTH);
+	dc->wheel = wheel;
+	ddc_timer_set(dc, CDC_CONNECT_TMO_MS);
+}
+
+/* Drop the transmit queue, including any unsent segments */
+static void ddc_tx_release(struct ddc_conn *dc)
+{
+	int i;
+
+	for (i = dc->iov_head; i < dc->iov_cnt; i++) {
+		if (dc->iov[i].pinned)
+			disc_log_unpin(dc->iov[i].log);
+		disc_log_put(dc->iov[i].log);
+	}
+	free(dc->iov);
+	dc->iov = NULL;
+	dc->iov_head = dc->iov_cnt = dc->iov_size = 0;
+	dc->iov_off = dc->tx_pending = 0;
+	free(dc->tx);
+	dc->tx = NULL;
+	dc->tx_len = dc->tx_off = dc->tx_size = 0;
+}
+
+static void ddc_aen_link(struct ddc_conn *dc)
+{
+	struct ddc_conn **head = dc->aen_hosts;
+
+	if (!head || dc->aen_pprev)
+		return;
+	dc->aen_next = *head;
+	if (*head)
+		(*head)->aen_pprev = &dc->aen_next;
+	*head = dc;
+	dc->aen_pprev = head;
+}
+
+static void ddc_aen_unlink(struct ddc_conn *dc)
+{
+	if (!dc->aen_pprev)
+		return;
+	*dc->aen_pprev = dc->aen_next;
+	if (dc->aen_next)
+		dc->aen_next->aen_pprev = dc->aen_pprev;
+	dc->aen_next = NULL;
+	dc->aen_pprev = NULL;
+}
+
+static void ddc_wal_unlink(struct ddc_conn *dc)
+{
+	if (!dc->wal_pprev)
+		return;
+	*dc->wal_pprev = dc->wal_next;
+	if (dc->wal_next)
+		dc->wal_next->wal_pprev = dc->wal_pprev;
+	dc->wal_next = NULL;
+	dc->wal_pprev = NULL;
+}
+
+/* End the authentication transaction of @dc, if any */
+static void ddc_auth_free(struct ddc_conn *dc)
+{
+	if (!dc->auth)
+		return;
+	auth_session_free(dc->auth);
+	free(dc->auth);
+	dc->auth = NULL;
+}
+
+void ddc_free(struct ddc_conn *dc)
+{
+	ddc_auth_free(dc);
+	ddc_timer_del(dc);
+	ddc_aen_unlink(dc);
+	ddc_wal_unlink(dc);
+	pdu_buf_free(&dc->pb);
+	ddc_tx_release(dc);
+}
+
+static int ddc_push_iov(struct ddc_conn *dc, const char *base, size_t len,
+			struct disc_log *log, int pin)
+{
+	struct ddc_iov *iov;
+
+	if (dc->iov_cnt == dc->iov_size && dc->iov_head) {
+		memmove(dc->iov, dc->iov + dc->iov_head,
+			(dc->iov_cnt - dc->iov_head) * sizeof(*iov));
+		dc->iov_cnt -= dc->iov_head;
+		dc->iov_head = 0;
+	}
+	if (dc->iov_cnt == dc->iov_size) {
+		int size = dc->iov_size ? dc->iov_size * 2 : 8;
+
+		iov = realloc(dc->iov, size * sizeof(*iov));
+		if (!iov)
+			return -ENOMEM;
+		dc->iov = iov;
+		dc->iov_size = size;
+	}
+	iov = &dc->iov[dc->iov_cnt++];
+	iov->base = base;
+	iov->len = len;
+	iov->log = log ? disc_log_get(log) : NULL;
+	iov->pinned = log && pin;
+	if (iov->pinned)
+		disc_log_pin(log);
+	dc->tx_pending += len;
+	return 0;
+}
+
+/*
+ * Queue @len bytes at @base by reference; @log, if set, is kept
+ * until they have been sent, and not changed in the meantime if
+ * @pin is set.
+ */
+static int ddc_queue_ref(struct ddc_conn *dc, const void *base, size_t len,
+			 struct disc_log *log, int pin)
+{
+	if (!len)
+		return 0;
+	return ddc_push_iov(dc, base, len, log, pin);
+}
+
+/*
+ * Append a PDU to the transmit queue.
+ */
+static int ddc_queue(struct ddc_conn *dc, const void *buf, size_t len)
+{
+	struct ddc_iov *last = dc->iov_cnt > dc->iov_head ?
+		&dc->iov[dc->iov_cnt - 1] : NULL;
+
+	if (dc->tx_off) {
+		memmove(dc->tx, dc->tx + dc->tx_off, dc->tx_len - dc->tx_off);
+		dc->tx_len -= dc->tx_off;
+		dc->tx_off = 0;
+	}
+	if (dc->tx_len + len > dc->tx_size) {
+		size_t size = dc->tx_size ? dc->tx_size : 512;
+		char *tx;
+
+		while (size < dc->tx_len + len)
+			size <<= 1;
+		tx = realloc(dc->tx, size);
+		if (!tx)
+			return -ENOMEM;
+		dc->tx = tx;
+		dc->tx_size = size;
+	}
+	memcpy(dc->tx + dc->tx_len, buf, len);
+	dc->tx_len += len;
+	/* Consecutive inline PDUs share a segment */
+	if (last && !last->base) {
+		last->len += len;
+		dc->tx_pending += len;
+		return 0;
+	}
+	if (ddc_push_iov(dc, NULL, len, NULL, 0) < 0) {
+		dc->tx_len -= len;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Fill in up to @max entries of @vec with the queued data, in order.
+ * Returns the number of entries used.
+ */
+int ddc_tx_iov(struct ddc_conn *dc, struct iovec *vec, int max)
+{
+	const char *inl = dc->tx + dc->tx_off;
+	size_t off = dc->iov_off;
+	int i, n = 0;
+
+	for (i = dc->iov_head; i < dc->iov_cnt && n < max; i++, n++) {
+		struct ddc_iov *iov = &dc->iov[i];
+
+		/* @tx_off already accounts for the sent inline bytes */
+		if (iov->base) {
+			vec[n].iov_base = (char *)iov->base + off;
+		} else {
+			vec[n].iov_base = (char *)inl;
+			inl += iov->len - off;
+		}
+		vec[n].iov_len = iov->len - off;
+		off = 0;
+	}
+	return n;
+}
+
+/*
+ * Consume @len sent bytes from the transmit queue. The buffers are
+ * released once everything has been sent.
+ */
+void ddc_tx_advance(struct ddc_conn *dc, size_t len)
+{
+	dc->tx_pending -= len;
+	while (len) {
+		struct ddc_iov *iov = &dc->iov[dc->iov_head];
+		size_t rem = iov->len - dc->iov_off;
+
+		if (len < rem) {
+			dc->iov_off += len;
+			if (!iov->base)
+				dc->tx_off += len;
+			return;
+		}
+		len -= rem;
+		if (!iov->base)
+			dc->tx_off += rem;
+		if (iov->pinned)
+			disc_log_unpin(iov->log);
+		disc_log_put(iov->log);
+		iov->log = NULL;
+		dc->iov_head++;
+		dc->iov_off = 0;
+	}
+	if (dc->iov_head == dc->iov_cnt)
+		ddc_tx_release(dc);
+}
+
+static int ddc_icreq_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			     void *data, size_t data_len)
+{
+	struct ddc_conn *dc = ctx;
+	struct nvme_tcp_icresp_pdu icresp;
+
+	if (dc->state != DDC_ICREQ) {
+		dc->fes = NVME_TCP_FES_PDU_SEQ_ERR;
+		return -EPROTO;
+	}
+	if (le32toh(pdu->icreq.hdr.plen) != sizeof(pdu->icreq)) {
+		dc->fes = NVME_TCP_FES_INVALID_PDU_HDR;
+		return -EPROTO;
+	}
+	if (le16toh(pdu->icreq.pfv) != NVME_TCP_PFV_1_0 ||
+	    pdu->icreq.digest & ~(NVME_TCP_HDR_DIGEST_ENABLE |
+				  NVME_TCP_DATA_DIGEST_ENABLE)) {
+		dc->fes = NVME_TCP_FES_UNSUPPORTED_PARAM;
+		return -EPROTO;
+	}
+
+	memset(&icresp, 0, sizeof(icresp));
+	icresp.hdr.type = nvme_tcp_icresp;
+	icresp.hdr.hlen = sizeof(icresp);
+	icresp.hdr.plen = htole32(sizeof(icresp));
+	icresp.pfv = htole16(NVME_TCP_PFV_1_0);
+	icresp.digest = pdu->icreq.digest;
+	icresp.maxdata = htole32(dc->srv->maxdata);
+	dc->pb.digest = pdu->icreq.digest;
+	if (pdu->icreq.hdr.flags & NVME_TCP_F_KDCONN) {
+		dc->state = DDC_KDREQ;
+		ddc_timer_del(dc);
+	} else {
+		dc->state = DDC_CONNECT;
+	}
+	return ddc_queue(dc, &icresp, sizeof(icresp));
+}
+
+/*
+ * Decode the kickstart record @krec into @rec.
+ * Returns 0 or the KDResp failure reason.
+ */
+static __u8 kdreq_decode_rec(struct port_rec *rec,
+			     struct nvme_tcp_kickstart_rec *krec)
+{
+	unsigned char addr[sizeof(struct in6_addr)];
+	size_t len;
+	char *end;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->portid = -1;
+	switch (krec->trtype) {
+	case NVMF_TRTYPE_RDMA:
+	case NVMF_TRTYPE_FC:
+	case NVMF_TRTYPE_TCP:
+	case NVMF_TRTYPE_LOOP:
+		rec->trtype = krec->trtype;
+		break;
+	default:
+		return NVME_TCP_KDRESP_INVALID_TRTYPE;
+	}
+	switch (krec->adrfam) {
+	case NVMF_ADDR_FAMILY_PCI:
+	case NVMF_ADDR_FAMILY_IP4:
+	case NVMF_ADDR_FAMILY_IP6:
+	case NVMF_ADDR_FAMILY_IB:
+	case NVMF_ADDR_FAMILY_FC:
+	case NVMF_ADDR_FAMILY_LOOP:
+		rec->adrfam = krec->adrfam;
+		break;
+	default:
+		return NVME_TCP_KDRESP_INVALID_ADRFAM;
+	}
+
+	/* The fields are space or zero padded, and need not be terminated */
+	len = strnlen((char *)krec->traddr, sizeof(krec->traddr));
+	while (len && krec->traddr[len - 1] == ' ')
+		len--;
+	if (!len || len == sizeof(rec->traddr))
+		return NVME_TCP_KDRESP_ADRFAM_MISMATCH;
+	memcpy(rec->traddr, krec->traddr, len);
+	len = strnlen((char *)krec->trsvcid, sizeof(krec->trsvcid));
+	while (len && krec->trsvcid[len - 1] == ' ')
+		len--;
+	if (len == sizeof(rec->trsvcid))
+		return NVME_TCP_KDRESP_TRSCVID_MISMATCH;
+	memcpy(rec->trsvcid, krec->trsvcid, len);
+
+	if ((rec->adrfam == NVMF_ADDR_FAMILY_IP4 &&
+	     inet_pton(AF_INET, rec->traddr, addr) != 1) ||
+	    (rec->adrfam == NVMF_ADDR_FAMILY_IP6 &&
+	     inet_pton(AF_INET6, rec->traddr, addr) != 1))
+		return NVME_TCP_KDRESP_ADRFAM_MISMATCH;
+	if (rec->trtype == NVMF_TRTYPE_TCP &&
+	    (!len || strtoul(rec->trsvcid, &end, 10) > 65535 || *end))
+		return NVME_TCP_KDRESP_TRSCVID_MISMATCH;
+	return 0;
+}
+
+static int ddc_kdresp(struct ddc_conn *dc, __u8 failrsn)
+{
+	char buf[sizeof(struct nvme_tcp_kdresp_pdu) + NVMF_NQN_FIELD_LEN +
+		 8 + 2 * NVME_TCP_DIGEST_LENGTH]
+		__attribute__((aligned(__alignof__(struct nvme_tcp_kdresp_pdu))));
+	struct nvme_tcp_kdresp_pdu *kdresp = (struct nvme_tcp_kdresp_pdu *)buf;
+	size_t plen;
+
+	memset(buf, 0, sizeof(buf));
+	/* The CDC NQN is followed by 8 reserved bytes */
+	plen = pdu_init_hdr(&kdresp->hdr, nvme_tcp_kdresp,
+			    offsetof(struct nvme_tcp_kdresp_pdu, failrsn) + 1,
+			    NVMF_NQN_FIELD_LEN + 8, dc->pb.digest);
+	kdresp->ksstat = failrsn ? 1 : 0;
+	kdresp->failrsn = failrsn;
+	memcpy(pdu_data(&kdresp->hdr), dc->srv->nqn, NVMF_NQN_FIELD_LEN);
+	pdu_set_digests(&kdresp->hdr);
+	return ddc_queue(dc, buf, plen);
+}
+
+/*
+ * Hold back the KDResp with @failrsn until registry change @seq of
+ * the I/O loop is durable, pausing the connection until then.
+ */
+static int ddc_wal_hold(struct ddc_conn *dc, unsigned long seq,
+			__u8 failrsn)
+{
+	struct cdc_wal_sync *ws = dc->wal_sync;
+
+	dc->wal_seq = seq;
+	dc->wal_failrsn = failrsn;
+	dc->wal_next = ws->waiters;
+	if (ws->waiters)
+		ws->waiters->wal_pprev = &dc->wal_next;
+	ws->waiters = dc;
+	dc->wal_pprev = &ws->waiters;
+	return PDU_PAUSE;
+}
+
+/*
+ * Queue the KDResp held back by ddc_wal_hold() now that the registry
+ * changes are durable, resuming PDU dispatching; PDUs received in
+ * the meantime are left to the caller. Returns 0 or -ENOMEM.
+ */
+int ddc_wal_release(struct ddc_conn *dc)
+{
+	ddc_wal_unlink(dc);
+	dc->wal_seq = 0;
+	dc->pb.paused = 0;
+	return ddc_kdresp(dc, dc->wal_failrsn);
+}
+
+static int ddc_kdreq_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			     void *data, size_t data_len)
+{
+	struct ddc_conn *dc = ctx;
+	struct cdc_server *srv = dc->srv;
+	struct nvme_tcp_kickstart_rec *krec = data;
+	unsigned int i, numkr = le16toh(pdu->kdreq.numkr);
+	int dereg = pdu->kdreq.hdr.flags & NVME_TCP_F_KDDEREG;
+	struct cdc_wal_sync *ws = srv->wal.fd >= 0 ? dc->wal_sync : NULL;
+	struct cdc_reg_op *op;
+	struct port_rec rec;
+	unsigned long seq = 0;
+	__u8 failrsn = 0;
+
+	if (dc->state != DDC_KDREQ) {
+		dc->fes = NVME_TCP_FES_PDU_SEQ_ERR;
+		return -EPROTO;
+	}
+	if (data_len != numkr * sizeof(*krec)) {
+		dc->fes = NVME_TCP_FES_INVALID_PDU_HDR;
+		return -EPROTO;
+	}
+
+	if (srv->reg_queue && numkr) {
+		/* Validated here, applied by the registry owner */
+		op = malloc(sizeof(*op) + numkr * sizeof(op->recs[0]));
+		if (!op) {
+			failrsn = NVME_TCP_KDRESP_NO_RESOURCES;
+			goto out;
+		}
+		for (i = 0; i < numkr; i++)
+			failrsn |= kdreq_decode_rec(&op->recs[i], &krec[i]);
+		if (failrsn) {
+			free(op);
+			goto out;
+		}
+		op->ws = ws;
+		op->seq = ws ? ++ws->queued : 0;
+		op->dereg = dereg;
+		op->ddc = dc->addr;
+		op->num_recs = numkr;
+		op->repl = NULL;
+		seq = op->seq;
+		cdc_reg_queue(srv, op);
+		goto out;
+	}
+
+	/* Apply all records of the PDU or none */
+	for (i = 0; i < numkr; i++)
+		failrsn |= kdreq_decode_rec(&rec, &krec[i]);
+	for (i = 0; i < numkr && !failrsn; i++) {
+		kdreq_decode_rec(&rec, &krec[i]);
+		/* Committed by the I/O loop */
+		if (ws && !seq)
+			seq = ws->applied = ++ws->queued;
+		if (cdc_reg_apply(srv, dereg, &rec, &dc->addr, 1) < 0)
+			failrsn = NVME_TCP_KDRESP_NO_RESOURCES;
+	}
+out:
+	dc->stats->num_kdreq++;
+	if (failrsn)
+		dc->stats->num_rejected++;
+	/* Only confirm registry changes once they are durable */
+	if (seq)
+		return ddc_wal_hold(dc, seq, failrsn);
+	return ddc_kdresp(dc, failrsn);
+}
+
+/* Queue the response capsule completing command @command_id */
+static int ddc_complete_id(struct ddc_conn *dc, __u16 command_id,
+			   __u16 status, __u64 result)
+{
+	char buf[sizeof(struct nvme_tcp_rsp_pdu) + NVME_TCP_DIGEST_LENGTH]
+		__attribute__((aligned(__alignof__(struct nvme_tcp_rsp_pdu))));
+	struct nvme_tcp_rsp_pdu *rsp = (struct nvme_tcp_rsp_pdu *)buf;
+	size_t plen;
+
+	memset(buf, 0, sizeof(buf));
+	plen = pdu_init_hdr(&rsp->hdr, nvme_tcp_rsp, sizeof(*rsp), 0,
+			    dc->pb.digest);
+	dc->sqhd = (dc->sqhd + 1) % (dc->sqsize + 1);
+	rsp->cqe.result.u64 = htole64(result);
+	rsp->cqe.sq_head = htole16(dc->sqhd);
+	rsp->cqe.command_id = command_id;
+	rsp->cqe.status = htole16(status << 1);
+	pdu_set_digests(&rsp->hdr);
+	return ddc_queue(dc, buf, plen);
+}
+
+static int ddc_complete(struct ddc_conn *dc, struct nvme_command *cmd,
+			__u16 status, __u64 result)
+{
+	return ddc_complete_id(dc, cmd->common.command_id, status, result);
+}
+
+/*
+ * Queue the header of a C2HData PDU carrying all @len bytes of data
+ * for @cmd; the data and its digest are queued separately. Without SQ
+ * flow control the PDU completes the command, see ddc_c2h_complete().
+ */
+static int ddc_c2h_hdr(struct ddc_conn *dc, struct nvme_command *cmd,
+		       size_t len)
+{
+	char buf[sizeof(struct nvme_tcp_data_pdu) + NVME_TCP_DIGEST_LENGTH]
+		__attribute__((aligned(__alignof__(struct nvme_tcp_data_pdu))));
+	struct nvme_tcp_data_pdu *data = (struct nvme_tcp_data_pdu *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	data->hdr.flags = NVME_TCP_F_DATA_LAST;
+	if (dc->sqflow_off)
+		data->hdr.flags |= NVME_TCP_F_DATA_SUCCESS;
+	pdu_init_hdr(&data->hdr, nvme_tcp_c2h_data, sizeof(*data), len,
+		     dc->pb.digest);
+	data->command_id = cmd->common.command_id;
+	data->data_length = htole32(len);
+	pdu_set_hdr_digest(&data->hdr);
+	return ddc_queue(dc, buf, data->hdr.pdo);
+}
+
+/* Queue the data digest @crc of a C2HData PDU, if enabled */
+static int ddc_c2h_ddgst(struct ddc_conn *dc, __u32 crc)
+{
+	__le32 ddgst = htole32(crc);
+
+	if (!(dc->pb.digest & NVME_TCP_DATA_DIGEST_ENABLE))
+		return 0;
+	return ddc_queue(dc, &ddgst, sizeof(ddgst));
+}
+
+/* Complete @cmd after its C2HData, unless that completed it already */
+static int ddc_c2h_complete(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	if (dc->sqflow_off)
+		return 0;
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, 0);
+}
+
+/* The host may send admin commands, under its keep alive timeout */
+static void ddc_admin_start(struct ddc_conn *dc)
+{
+	dc->state = DDC_ADMIN;
+	if (dc->kato)
+		ddc_timer_set(dc, dc->kato);
+	else
+		ddc_timer_del(dc);
+}
+
+/*
+ * Admit the host once its authentication succeeded. After a failed
+ * one all commands are rejected until the connect timeout closes the
+ * connection.
+ */
+static void ddc_auth_check(struct ddc_conn *dc)
+{
+	switch (dc->auth->step) {
+	case AUTH_DONE:
+		dc->stats->num_auth++;
+		ddc_auth_free(dc);
+		ddc_admin_start(dc);
+		break;
+	case AUTH_FAILED:
+		dc->stats->num_auth_failed++;
+		auth_session_free(dc->auth);
+		break;
+	default:
+		break;
+	}
+}
+
+static int ddc_connect(struct ddc_conn *dc, struct nvme_command *cmd,
+		       void *data, size_t data_len)
+{
+	struct cdc_server *srv = dc->srv;
+	struct nvmf_connect_data *cd = data;
+
+	if (data_len != sizeof(*cd))
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	if (le16toh(cmd->connect.qid) != 0 || !le16toh(cmd->connect.sqsize) ||
+	    (strncmp(cd->subsysnqn, NVME_DISC_SUBSYS_NAME,
+		     sizeof(cd->subsysnqn)) &&
+	     strncmp(cd->subsysnqn, srv->nqn, sizeof(cd->subsysnqn))))
+		return ddc_complete(dc, cmd, NVME_SC_CONNECT_INVALID_PARAM |
+				    NVME_SC_DNR, 0);
+
+	/* Shared by all workers */
+	dc->cntlid = __atomic_fetch_add(&srv->next_cntlid, 1, __ATOMIC_RELAXED) %
+		NVME_CNTLID_MAX + NVME_CNTLID_MIN;
+	dc->sqsize = le16toh(cmd->connect.sqsize);
+	dc->kato = le32toh(cmd->connect.kato);
+	dc->sqflow_off = !!(cmd->connect.cattr & NVME_CONNECT_DISABLE_SQFLOW);
+	if (srv->auth) {
+		/* Still under the connect timeout until authenticated */
+		dc->auth = malloc(sizeof(*dc->auth));
+		if (!dc->auth)
+			return -ENOMEM;
+		auth_session_init(dc->auth, srv->auth, cd->hostnqn,
+				  cd->subsysnqn, 0);
+		dc->state = DDC_AUTH;
+		return ddc_complete(dc, cmd, NVME_SC_SUCCESS, dc->cntlid |
+				    NVME_CONNECT_AUTHREQ_ATR << 16);
+	}
+	ddc_admin_start(dc);
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, dc->cntlid);
+}
+
+/*
+ * Authentication Send: pass the DH-HMAC-CHAP message of the host to
+ * the transaction of the connection.
+ */
+static int ddc_auth_send(struct ddc_conn *dc, struct nvme_command *cmd,
+			 void *data, size_t data_len)
+{
+	struct nvmf_auth_send_command *as = &cmd->auth_send;
+
+	if (as->secp != NVME_AUTH_DHCHAP_PROTOCOL_IDENTIFIER ||
+	    as->spsp0 != 0x01 || as->spsp1 != 0x01 || !data_len ||
+	    le32toh(as->tl) != data_len)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	if (auth_ctrl_send(dc->auth, data, data_len) < 0)
+		return ddc_complete(dc, cmd, NVME_SC_CMD_SEQ_ERROR |
+				    NVME_SC_DNR, 0);
+	ddc_auth_check(dc);
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, 0);
+}
+
+/*
+ * Authentication Receive: return the next DH-HMAC-CHAP message of
+ * the transaction, zero padded to the allocation length.
+ */
+static int ddc_auth_recv(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	struct nvmf_auth_receive_command *ar = &cmd->auth_receive;
+	size_t al = le32toh(ar->al), len, pad, chunk;
+	const void *msg;
+	__u32 crc;
+	int ret;
+
+	if (ar->secp != NVME_AUTH_DHCHAP_PROTOCOL_IDENTIFIER ||
+	    ar->spsp0 != 0x01 || ar->spsp1 != 0x01 ||
+	    al < dc->auth->msg_len || al > DDC_AUTH_AL_MAX)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	msg = auth_ctrl_receive(dc->auth, &len);
+	if (!msg)
+		return ddc_complete(dc, cmd, NVME_SC_CMD_SEQ_ERROR |
+				    NVME_SC_DNR, 0);
+	ret = ddc_c2h_hdr(dc, cmd, al);
+	if (!ret)
+		ret = ddc_queue(dc, msg, len);
+	crc = crc32c_update(~0U, msg, len);
+	for (pad = al - len; !ret && pad; pad -= chunk) {
+		chunk = pad < sizeof(ddc_zero_page) ?
+			pad : sizeof(ddc_zero_page);
+		ret = ddc_queue_ref(dc, ddc_zero_page, chunk, NULL, 0);
+		crc = crc32c_update(crc, ddc_zero_page, chunk);
+	}
+	if (!ret)
+		ret = ddc_c2h_ddgst(dc, ~crc);
+	if (ret)
+		return ret;
+	/* The message was copied into the transmit queue */
+	ddc_auth_check(dc);
+	return ddc_c2h_complete(dc, cmd);
+}
+
+static int ddc_prop_get(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	__u64 value;
+
+	switch (le32toh(cmd->prop_get.offset)) {
+	case NVME_REG_CAP:
+		/* MQES, CQR, TO of 7.5s, NVM command set */
+		value = (NVME_AQ_DEPTH - 1) | (1ULL << 16) | (15ULL << 24) |
+			((__u64)NVME_CAP_CSS_NVM << 37);
+		break;
+	case NVME_REG_VS:
+		value = NVME_VS(1, 3, 0);
+		break;
+	case NVME_REG_CC:
+		value = dc->cc;
+		break;
+	case NVME_REG_CSTS:
+		value = 0;
+		if (dc->cc & NVME_CC_ENABLE)
+			value |= NVME_CSTS_RDY;
+		if (dc->cc & NVME_CC_SHN_MASK)
+			value |= NVME_CSTS_SHST_CMPLT;
+		break;
+	default:
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	}
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, value);
+}
+
+static int ddc_prop_set(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	if (le32toh(cmd->prop_set.offset) != NVME_REG_CC)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	dc->cc = le64toh(cmd->prop_set.value);
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, 0);
+}
+
+static void ddc_id_string(char *field, size_t size, const char *str)
+{
+	size_t len = strlen(str);
+
+	memset(field, ' ', size);
+	memcpy(field, str, len < size ? len : size);
+}
+
+static int ddc_identify(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	struct nvme_id_ctrl id;
+	int ret;
+
+	if (cmd->identify.cns != NVME_ID_CNS_CTRL)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+
+	memset(&id, 0, sizeof(id));
+	ddc_id_string(id.sn, sizeof(id.sn), "acdc");
+	ddc_id_string(id.mn, sizeof(id.mn), "acdc discovery controller");
+	ddc_id_string(id.fr, sizeof(id.fr), "1.0");
+	id.cntlid = htole16(dc->cntlid);
+	id.ver = htole32(NVME_VS(1, 3, 0));
+	id.cntrltype = NVME_CTRL_DISC;
+	/* Extended data for Get Log Page */
+	id.lpa = 1 << 2;
+	id.kas = htole16(CDC_KAS);
+	id.ctratt = htole32(NVME_CTRL_ATTR_TBKAS);
+	id.maxcmd = htole16(NVME_AQ_DEPTH);
+	id.mdts = CDC_MDTS;
+	/* SGLs and SGL offsets for in-capsule data */
+	id.sgls = htole32((1 << 0) | (1 << 20));
+	id.ioccsz = htole32(sizeof(struct nvme_command) / 16);
+	id.iorcsz = htole32(sizeof(struct nvme_completion) / 16);
+	id.msdbd = 1;
+	memcpy(id.subnqn, dc->srv->nqn, sizeof(id.subnqn));
+	id.oaes = htole32(NVME_AEN_CFG_DISC_CHANGE);
+	id.aerl = DDC_MAX_AER - 1;
+
+	ret = ddc_c2h_hdr(dc, cmd, sizeof(id));
+	if (!ret)
+		ret = ddc_queue(dc, &id, sizeof(id));
+	if (!ret)
+		ret = ddc_c2h_ddgst(dc, crc32c(&id, sizeof(id)));
+	if (ret)
+		return ret;
+	return ddc_c2h_complete(dc, cmd);
+}
+
+/*
+ * Send the requested range of the discovery log page by reference;
+ * only the headers of the response are generated per command.
+ */
+static int ddc_get_log_page(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	struct nvme_get_log_page_command *glp = &cmd->get_log_page;
+	__u64 off = le64toh(glp->lpo);
+	int pin = dc->pb.digest & NVME_TCP_DATA_DIGEST_ENABLE;
+	size_t len, log_len, avail, pad, left, chunk;
+	struct disc_log *log;
+	__u32 crc = 0;
+	int ret;
+
+	len = (((size_t)le16toh(glp->numdu) << 16 | le16toh(glp->numdl)) + 1) * 4;
+	if (glp->lid != NVME_LOG_DISC)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_LOG_PAGE |
+				    NVME_SC_DNR, 0);
+	/* Hosts have to split larger transfers as announced by MDTS */
+	if (len > CDC_MAX_XFER)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	log = cdc_log_get(dc->srv, pin, &log_len);
+	if (!log)
+		return ddc_complete(dc, cmd, NVME_SC_INTERNAL, 0);
+	if (off & 3 || off > log_len) {
+		ret = ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				   NVME_SC_DNR, 0);
+		goto out_put;
+	}
+	dc->stats->num_get_log++;
+	/* Reading the log page acknowledges the last change notice */
+	if (!(glp->lsp & DDC_LOG_RAE))
+		dc->aen_masked = 0;
+
+	/* Data beyond the end of the log page reads as zeroes */
+	avail = log_len - off;
+	if (avail > len)
+		avail = len;
+	pad = len - avail;
+	ret = ddc_c2h_hdr(dc, cmd, len);
+	if (!ret)
+		ret = ddc_queue_ref(dc, log->data + off, avail, log, pin);
+	for (left = pad; !ret && left; left -= chunk) {
+		chunk = left < sizeof(ddc_zero_page) ?
+			left : sizeof(ddc_zero_page);
+		ret = ddc_queue_ref(dc, ddc_zero_page, chunk, NULL, 0);
+	}
+	if (ret)
+		goto out_put;
+
+	if (pin) {
+		/* Hosts mostly read the whole log page after its header */
+		if (!off && avail == log_len && !pad) {
+			/* Pinned log pages do not change, racing is benign */
+			if (!__atomic_load_n(&log->has_ddgst, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&log->ddgst,
+						 crc32c(log->data, log_len),
+						 __ATOMIC_RELAXED);
+				__atomic_store_n(&log->has_ddgst, 1,
+						 __ATOMIC_RELEASE);
+			}
+			crc = __atomic_load_n(&log->ddgst, __ATOMIC_RELAXED);
+		} else {
+			crc = crc32c_update(~0U, log->data + off, avail);
+			for (left = pad; left; left -= chunk) {
+				chunk = left < sizeof(ddc_zero_page) ?
+					left : sizeof(ddc_zero_page);
+				crc = crc32c_update(crc, ddc_zero_page, chunk);
+			}
+			crc = ~crc;
+		}
+	}
+	ret = ddc_c2h_ddgst(dc, crc);
+	if (!ret)
+		ret = ddc_c2h_complete(dc, cmd);
+out_put:
+	/* The queued segments hold their own references */
+	if (pin)
+		disc_log_unpin(log);
+	disc_log_put(log);
+	return ret;
+}
+
+/* Only the Asynchronous Event Configuration feature is supported */
+static int ddc_features(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	if ((le32toh(cmd->features.fid) & 0xff) != NVME_FEAT_ASYNC_EVENT)
+		return ddc_complete(dc, cmd, NVME_SC_INVALID_FIELD |
+				    NVME_SC_DNR, 0);
+	if (cmd->common.opcode == nvme_admin_set_features)
+		dc->aen_cfg = le32toh(cmd->features.dword11) &
+			NVME_AEN_CFG_DISC_CHANGE;
+	return ddc_complete(dc, cmd, NVME_SC_SUCCESS, dc->aen_cfg);
+}
+
+/*
+ * Complete an outstanding Asynchronous Event Request if the server
+ * raised a change notice this host has not seen yet. Notices raised
+ * while the host has no AER outstanding are kept until it sends one;
+ * notices raised before the host read the log page after the last
+ * one are dropped, as the log page it reads covers them.
+ * Returns 1 if a completion was queued, 0 if not, or a negative
+ * errno value.
+ */
+int ddc_aen_poll(struct ddc_conn *dc)
+{
+	__u32 seq = __atomic_load_n(&dc->srv->aen_seq, __ATOMIC_ACQUIRE);
+	__u16 cid;
+	int ret;
+
+	if (dc->aen_seq == seq)
+		return 0;
+	if (!(dc->aen_cfg & NVME_AEN_CFG_DISC_CHANGE)) {
+		dc->aen_seq = seq;
+		return 0;
+	}
+	if (dc->aen_masked) {
+		dc->aen_seq = seq;
+		dc->stats->num_aen_masked++;
+		return 0;
+	}
+	if (!dc->num_aer)
+		return 0;
+	cid = dc->aer_cids[--dc->num_aer];
+	if (!dc->num_aer)
+		ddc_aen_unlink(dc);
+	dc->aen_seq = seq;
+	dc->aen_masked = 1;
+	dc->stats->num_aen++;
+	ret = ddc_complete_id(dc, cid, NVME_SC_SUCCESS,
+			      NVME_AER_NOTICE |
+			      NVME_AER_NOTICE_DISC_CHANGED << 8 |
+			      NVME_LOG_DISC << 16);
+	return ret < 0 ? ret : 1;
+}
+
+/* Hold the request until there is a change to notify */
+static int ddc_async_event(struct ddc_conn *dc, struct nvme_command *cmd)
+{
+	int ret;
+
+	if (dc->num_aer == DDC_MAX_AER)
+		return ddc_complete(dc, cmd, NVME_SC_ASYNC_LIMIT |
+				    NVME_SC_DNR, 0);
+	dc->aer_cids[dc->num_aer++] = cmd->common.command_id;
+	ddc_aen_link(dc);
+	ret = ddc_aen_poll(dc);
+	return ret < 0 ? ret : 0;
+}
+
+static int ddc_cmd_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			   void *data, size_t data_len)
+{
+	struct ddc_conn *dc = ctx;
+	struct nvme_command *cmd = &pdu->cmd.cmd;
+	int fabrics = cmd->common.opcode == nvme_fabrics_command;
+
+	if (dc->state != DDC_CONNECT && dc->state != DDC_AUTH &&
+	    dc->state != DDC_ADMIN) {
+		dc->fes = NVME_TCP_FES_PDU_SEQ_ERR;
+		return -EPROTO;
+	}
+	dc->kato_traffic = 1;
+	if (fabrics && cmd->fabrics.fctype == nvme_fabrics_type_connect) {
+		if (dc->state != DDC_CONNECT)
+			return ddc_complete(dc, cmd, NVME_SC_CMD_SEQ_ERROR |
+					    NVME_SC_DNR, 0);
+		return ddc_connect(dc, cmd, data, data_len);
+	}
+	if (dc->state == DDC_AUTH) {
+		if (fabrics &&
+		    cmd->fabrics.fctype == nvme_fabrics_type_auth_send)
+			return ddc_auth_send(dc, cmd, data, data_len);
+		if (fabrics &&
+		    cmd->fabrics.fctype == nvme_fabrics_type_auth_receive)
+			return ddc_auth_recv(dc, cmd);
+		return ddc_complete(dc, cmd, NVME_SC_AUTH_REQUIRED |
+				    NVME_SC_DNR, 0);
+	}
+	if (dc->state != DDC_ADMIN)
+		return ddc_complete(dc, cmd, NVME_SC_CMD_SEQ_ERROR |
+				    NVME_SC_DNR, 0);
+
+	if (fabrics) {
+		switch (cmd->fabrics.fctype) {
+		case nvme_fabrics_type_property_get:
+			return ddc_prop_get(dc, cmd);
+		case nvme_fabrics_type_property_set:
+			return ddc_prop_set(dc, cmd);
+		}
+	} else {
+		switch (cmd->common.opcode) {
+		case nvme_admin_identify:
+			return ddc_identify(dc, cmd);
+		case nvme_admin_get_log_page:
+			return ddc_get_log_page(dc, cmd);
+		case nvme_admin_keep_alive:
+			return ddc_complete(dc, cmd, NVME_SC_SUCCESS, 0);
+		case nvme_admin_set_features:
+		case nvme_admin_get_features:
+			return ddc_features(dc, cmd);
+		case nvme_admin_async_event:
+			return ddc_async_event(dc, cmd);
+		}
+	}
+	return ddc_complete(dc, cmd, NVME_SC_INVALID_OPCODE | NVME_SC_DNR, 0);
+}
+
+static int ddc_term_handler(void *ctx, union nvme_tcp_pdu *pdu,
+			    void *data, size_t data_len)
+{
+	return -ECONNRESET;
+}
+
+const struct pdu_ops ddc_pdu_ops = {
+	.handler = {
+		[nvme_tcp_icreq] = ddc_icreq_handler,
+		[nvme_tcp_h2c_term] = ddc_term_handler,
+		[nvme_tcp_cmd] = ddc_cmd_handler,
+		[nvme_tcp_kdreq] = ddc_kdreq_handler,
+	},
+};
+
+/*
+ * Handle a failure returned by PDU processing: queue a termination
+ * PDU for protocol errors, and stop processing the connection.
+ */
+void ddc_fatal(struct ddc_conn *dc, int err)
+{
+	struct nvme_tcp_term_pdu term;
+
+	dc->state = DDC_CLOSING;
+	if (err == -ECONNRESET)
+		return;
+	dc->stats->num_errors++;
+	if (err != -EPROTO && err != -EBADMSG)
+		return;
+	if (!dc->fes)
+		dc->fes = err == -EBADMSG ? NVME_TCP_FES_HDR_DIGEST_ERR :
+			NVME_TCP_FES_INVALID_PDU_HDR;
+	memset(&term, 0, sizeof(term));
+	term.hdr.type = nvme_tcp_c2h_term;
+	term.hdr.hlen = sizeof(term);
+	term.hdr.plen = htole32(sizeof(term));
+	term.fes = htole16(dc->fes);
+	ddc_queue(dc, &term, sizeof(term));
+}
+
+/*
+ * Handle the expiry of the connection timer: close the connection if
+ * it did not connect in time, or if no command was received for a
+ * keep alive timeout. Commands only flag the connection, and the
+ * timer is started again here, so keeping hosts alive costs no timer
+ * operations per command; an idle host is closed after one to two
+ * keep alive timeouts.
+ * Returns 1 if the connection is to be closed.
+ */
+int ddc_timeout(struct ddc_conn *dc)
+{
+	if (dc->state == DDC_ADMIN && dc->kato_traffic) {
+		dc->kato_traffic = 0;
+		ddc_timer_set(dc, dc->kato);
+		return 0;
+	}
+	if (dc->state != DDC_CLOSING)
+		dc->stats->num_timeouts++;
+	dc->state = DDC_CLOSING;
+	return 1;
+}
+
+/* Connect @dc to the discovery controller as a host would */
+static int disc_log_bench_connect(struct ddc_conn *dc)
+{
+	union nvme_tcp_pdu icreq, cmd;
+	struct nvmf_connect_data cd;
+
+	memset(&icreq, 0, sizeof(icreq));
+	icreq_init(&icreq.icreq, 0);
+	icreq.icreq.hdr.flags = 0;
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&cd, 0, sizeof(cd));
+	cmd.cmd.cmd.connect.opcode = nvme_fabrics_command;
+	cmd.cmd.cmd.connect.fctype = nvme_fabrics_type_connect;
+	cmd.cmd.cmd.connect.sqsize = htole16(NVME_AQ_DEPTH - 1);
+	strcpy(cd.subsysnqn, NVME_DISC_SUBSYS_NAME);
+	if (ddc_pdu_ops.handler[nvme_tcp_icreq](dc, &icreq, NULL, 0) < 0 ||
+	    ddc_pdu_ops.handler[nvme_tcp_cmd](dc, &cmd, &cd, sizeof(cd)) < 0 ||
+	    dc->state != DDC_ADMIN) {
+		fprintf(stderr, "discovery connect failed\n");
+		return -1;
+	}
+	ddc_tx_advance(dc, dc->tx_pending);
+	return 0;
+}
+
+/*
+ * Time Get Log Page commands for the complete discovery log of
+ * @num_recs records against serializing the log page per command,
+ * and patching registry changes into the log page against
+ * serializing it per change. The responses are consumed from the
+ * transmit queue as if sent.
+ */
+int disc_log_bench(int num_recs, int num_reqs)
+{
+	struct cdc_server srv;
+	struct cdc_stats stats = { 0 };
+	struct ddc_conn dc;
+	struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+	union nvme_tcp_pdu cmd;
+	struct timespec start, end;
+	struct disc_log *log;
+	struct port_rec rec;
+	double served_us, built_us, patched_us;
+	size_t len;
+	int i, ret = 1;
+
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	for (i = 0; i < num_recs; i++) {
+		port_rec_bench(&rec, i);
+		if (registry_add(&srv.reg, &rec, &addr) < 0) {
+			fprintf(stderr, "registry_add failed\n");
+			goto out_srv;
+		}
+	}
+	len = sizeof(struct nvmf_disc_rsp_page_hdr) +
+		num_recs * sizeof(struct nvmf_disc_rsp_page_entry);
+
+	ddc_init(&dc, &srv, &stats, NULL, NULL, NULL, -1, &addr);
+	if (disc_log_bench_connect(&dc) < 0)
+		goto out_dc;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd.cmd.get_log_page.opcode = nvme_admin_get_log_page;
+	cmd.cmd.cmd.get_log_page.lid = NVME_LOG_DISC;
+	cmd.cmd.cmd.get_log_page.numdl = htole16((len / 4 - 1) & 0xffff);
+	cmd.cmd.cmd.get_log_page.numdu = htole16((len / 4 - 1) >> 16);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_reqs; i++) {
+		cmd.cmd.cmd.get_log_page.command_id = i;
+		if (ddc_pdu_ops.handler[nvme_tcp_cmd](&dc, &cmd, NULL, 0) < 0) {
+			fprintf(stderr, "Get Log Page failed\n");
+			goto out_dc;
+		}
+		ddc_tx_advance(&dc, dc.tx_pending);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	served_us = timespec_diff_ns(&start, &end) / 1e3 / num_reqs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_reqs; i++) {
+		log = disc_log_build(&srv.reg, NVME_DISC_SUBSYS_NAME);
+		if (!log) {
+			fprintf(stderr, "disc_log_build failed\n");
+			goto out_dc;
+		}
+		disc_log_put(log);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	built_us = timespec_diff_ns(&start, &end) / 1e3 / num_reqs;
+
+	/* Remove and re-register records, swapping entries around */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_reqs; i++) {
+		port_rec_bench(&rec, (i * 7919UL) % num_recs);
+		if (registry_del(&srv.reg, &rec) != 1 ||
+		    registry_add(&srv.reg, &rec, &addr) != 1) {
+			fprintf(stderr, "registry change failed\n");
+			goto out_dc;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	patched_us = timespec_diff_ns(&start, &end) / 1e3 / (2 * num_reqs);
+
+	printf("disc log: %d records, %zu bytes, %lu builds for %lu "
+	       "Get Log Page commands, %lu patches\n", num_recs, len,
+	       srv.num_log_builds, stats.num_get_log, srv.num_log_patches);
+	printf("disc log: %.2f us/command from the serialized log page, "
+	       "%.2f us/command serializing per command\n",
+	       served_us, built_us);
+	printf("disc log: %.2f us/change patching in place (including the "
+	       "registry update), %.2f us/change serializing per change\n",
+	       patched_us, built_us);
+
+	/* The patched log page has to match a fresh one */
+	log = disc_log_build(&srv.reg, NVME_DISC_SUBSYS_NAME);
+	if (!log || !srv.log || log->len != srv.log->len ||
+	    memcmp(log->data, srv.log->data, log->len)) {
+		fprintf(stderr, "patched log page differs\n");
+		disc_log_put(log);
+		goto out_dc;
+	}
+	disc_log_put(log);
+	if (srv.num_log_builds == 1 &&
+	    stats.num_get_log == (unsigned long)num_reqs)
+		ret = 0;
+out_dc:
+	ddc_free(&dc);
+out_srv:
+	cdc_server_free(&srv);
+	return ret;
+}
+
+/* Have @dc send an Asynchronous Event Request with command id @cid */
+static int cdc_aen_bench_aer(struct ddc_conn *dc, __u16 cid)
+{
+	union nvme_tcp_pdu cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd.cmd.common.opcode = nvme_admin_async_event;
+	cmd.cmd.cmd.common.command_id = cid;
+	return ddc_pdu_ops.handler[nvme_tcp_cmd](dc, &cmd, NULL, 0);
+}
+
+/*
+ * Register @num_recs records in a burst while @num_hosts hosts wait
+ * for discovery log change notices, then register another burst
+ * without the hosts reading the log page in between. The first burst
+ * is expected to result in a single AEN per host, the second in
+ * none, where notifying every change would send @num_recs AENs per
+ * host and burst.
+ */
+int cdc_aen_bench(int num_hosts, int num_recs)
+{
+	struct cdc_server srv;
+	struct cdc_stats stats = { 0 };
+	struct ddc_conn *hosts, *aen_hosts = NULL, *dc, *next;
+	struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+	union nvme_tcp_pdu cmd;
+	struct port_rec rec;
+	struct timespec start, end, ts;
+	unsigned long raised;
+	int i, n, burst, ret = 1;
+	long ms;
+
+	hosts = calloc(num_hosts, sizeof(*hosts));
+	if (!hosts) {
+		perror("calloc");
+		return 1;
+	}
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd.cmd.features.opcode = nvme_admin_set_features;
+	cmd.cmd.cmd.features.fid = htole32(NVME_FEAT_ASYNC_EVENT);
+	cmd.cmd.cmd.features.dword11 = htole32(NVME_AEN_CFG_DISC_CHANGE);
+	for (n = 0; n < num_hosts; n++) {
+		dc = &hosts[n];
+		ddc_init(dc, &srv, &stats, &aen_hosts, NULL, NULL, -1, &addr);
+		if (disc_log_bench_connect(dc) < 0 ||
+		    ddc_pdu_ops.handler[nvme_tcp_cmd](dc, &cmd, NULL, 0) < 0 ||
+		    cdc_aen_bench_aer(dc, 0) < 0) {
+			fprintf(stderr, "host setup failed\n");
+			n++;
+			goto out_hosts;
+		}
+		ddc_tx_advance(dc, dc->tx_pending);
+	}
+
+	for (burst = 0; burst < 2; burst++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < num_recs; i++) {
+			port_rec_bench(&rec, burst * num_recs + i);
+			if (registry_add(&srv.reg, &rec, &addr) < 0) {
+				fprintf(stderr, "registry_add failed\n");
+				goto out_hosts;
+			}
+		}
+		while ((ms = cdc_aen_timeout(&srv)) > 0) {
+			ts.tv_sec = ms / 1000;
+			ts.tv_nsec = (ms % 1000) * 1000000;
+			nanosleep(&ts, NULL);
+		}
+		if (!cdc_aen_raise(&srv)) {
+			fprintf(stderr, "no change notice raised\n");
+			goto out_hosts;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		raised = stats.num_aen;
+		for (dc = aen_hosts; dc; dc = next) {
+			next = dc->aen_next;
+			if (ddc_aen_poll(dc) < 0) {
+				fprintf(stderr, "ddc_aen_poll failed\n");
+				goto out_hosts;
+			}
+			ddc_tx_advance(dc, dc->tx_pending);
+		}
+		printf("aen: burst %d: %d registrations notified after "
+		       "%.1f ms, %lu AENs to %d hosts\n", burst, num_recs,
+		       timespec_diff_ns(&start, &end) / 1e6,
+		       stats.num_aen - raised, num_hosts);
+		/* Hosts send a new AER, but do not read the log page */
+		for (i = 0; i < num_hosts; i++) {
+			if (cdc_aen_bench_aer(&hosts[i], burst + 1) < 0) {
+				fprintf(stderr, "AER failed\n");
+				goto out_hosts;
+			}
+		}
+	}
+
+	printf("aen: %lu notices raised for %d changes, %lu changes "
+	       "coalesced, %lu AENs sent, %lu suppressed until the log "
+	       "page is read, %lu AENs without coalescing\n",
+	       srv.num_aen_notices, 2 * num_recs, srv.num_aen_coalesced,
+	       stats.num_aen, stats.num_aen_masked,
+	       2UL * num_recs * num_hosts);
+	if (srv.num_aen_notices == 2 &&
+	    stats.num_aen == (unsigned long)num_hosts &&
+	    stats.num_aen_masked == (unsigned long)num_hosts)
+		ret = 0;
+out_hosts:
+	for (i = 0; i < n; i++)
+		ddc_free(&hosts[i]);
+	cdc_server_free(&srv);
+	free(hosts);
+	return ret;
+}
+
+/* Have a host connect to @srv and read the log page header */
+static int cdc_snap_bench_serve(struct cdc_server *srv,
+				struct cdc_stats *stats)
+{
+	struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+	struct ddc_conn dc;
+	union nvme_tcp_pdu cmd;
+	int ret = -1;
+
+	ddc_init(&dc, srv, stats, NULL, NULL, NULL, -1, &addr);
+	if (disc_log_bench_connect(&dc) < 0)
+		goto out;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd.cmd.get_log_page.opcode = nvme_admin_get_log_page;
+	cmd.cmd.cmd.get_log_page.lid = NVME_LOG_DISC;
+	cmd.cmd.cmd.get_log_page.numdl = htole16(DISC_LOG_SLOT / 4 - 1);
+	if (ddc_pdu_ops.handler[nvme_tcp_cmd](&dc, &cmd, NULL, 0) < 0 ||
+	    stats->num_get_log != 1) {
+		fprintf(stderr, "Get Log Page failed\n");
+		goto out;
+	}
+	ddc_tx_advance(&dc, dc.tx_pending);
+	ret = 0;
+out:
+	ddc_free(&dc);
+	return ret;
+}
+
+static int cdc_snap_bench_run(const char *path, int num_recs)
+{
+	struct cdc_server srv;
+	struct cdc_stats stats = { 0 };
+	struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+	struct timespec start, end;
+	struct disc_log *log;
+	struct port_rec rec;
+	double save_ms, load_ms, reg_ms, read_ms, verify_ms;
+	size_t file_len;
+	int i, ret = 1;
+
+	/* Time registering all records again, as after a restart */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	for (i = 0; i < num_recs; i++) {
+		port_rec_bench(&rec, i);
+		if (registry_add(&srv.reg, &rec, &addr) < 0) {
+			fprintf(stderr, "registry_add failed\n");
+			goto out_srv;
+		}
+	}
+	if (cdc_snap_bench_serve(&srv, &stats) < 0)
+		goto out_srv;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	reg_ms = timespec_diff_ns(&start, &end) / 1e6;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	srv.snap_path = path;
+	if (cdc_snap_save(&srv) < 0)
+		goto out_srv;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	save_ms = timespec_diff_ns(&start, &end) / 1e6;
+	cdc_server_free(&srv);
+
+	/* Time restoring the snapshot instead */
+	memset(&stats, 0, sizeof(stats));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	if (cdc_snap_load(&srv, path) < 0 || srv.reg.num_recs != num_recs ||
+	    !srv.log || !srv.log->mapped) {
+		fprintf(stderr, "cannot restore snapshot %s\n", path);
+		goto out_srv;
+	}
+	if (cdc_snap_bench_serve(&srv, &stats) < 0)
+		goto out_srv;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	load_ms = timespec_diff_ns(&start, &end) / 1e6;
+	file_len = srv.snap.len;
+
+	/* Reading the complete log page faults in all of it */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	crc32c(srv.log->data, srv.log->len);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	read_ms = timespec_diff_ns(&start, &end) / 1e6;
+
+	/* The contents are verified off the startup path */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	srv.snap_verify = start;
+	cdc_snap_verify(&srv);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	verify_ms = timespec_diff_ns(&start, &end) / 1e6;
+	if (srv.snap.file || srv.snap_corrupt) {
+		fprintf(stderr, "snapshot %s not verified\n", path);
+		goto out_srv;
+	}
+
+	/* Changes are copied on write and patched as before */
+	port_rec_bench(&rec, num_recs);
+	if (!registry_lookup(&srv.reg, &rec) &&
+	    registry_add(&srv.reg, &rec, &addr) == 1 &&
+	    registry_del(&srv.reg, &rec) == 1) {
+		rec = srv.reg.entries[0].rec;
+		if (registry_del(&srv.reg, &rec) != 1)
+			goto out_srv;
+		log = disc_log_build(&srv.reg, NVME_DISC_SUBSYS_NAME);
+		if (log && srv.log && log->len == srv.log->len &&
+		    !memcmp(log->data, srv.log->data, log->len))
+			ret = 0;
+		disc_log_put(log);
+	}
+	if (ret) {
+		fprintf(stderr, "restored registry inconsistent\n");
+		goto out_srv;
+	}
+	printf("snapshot: %7d records, %9zu bytes, saved in %7.2f ms, "
+	       "log page served %6.2f ms after startup (%8.2f ms "
+	       "registering again), read in %7.2f ms, verified in %7.2f ms\n",
+	       num_recs, file_len, save_ms, load_ms, reg_ms, read_ms,
+	       verify_ms);
+out_srv:
+	cdc_server_free(&srv);
+	return ret;
+}
+
+/*
+ * Compare the time from startup to the first Get Log Page served
+ * when restoring a snapshot in @dir against registering all records
+ * again, for registries of 1000 up to @max_recs records.
+ */
+int cdc_snap_bench(const char *dir, int max_recs)
+{
+	char path[PATH_MAX];
+	int num_recs, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/acdc-bench.snap", dir);
+	for (num_recs = 1000; !ret && num_recs <= max_recs; num_recs *= 10)
+		ret = cdc_snap_bench_run(path, num_recs);
+	unlink(path);
+	return ret;
+}
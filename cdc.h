@@ -0,0 +1,462 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * cdc.h - centralized discovery controller
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _CDC_H
+#define _CDC_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+
+#include "nvme-tcp.h"
+#include "pdu.h"
+#include "registry.h"
+#include "disclog.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "gossip.h"
+#include "mpsc.h"
+#include "wheel.h"
+#include "auth.h"
+
+/* Largest KDReq PDU accepted, announced as maxdata in the ICResp */
+#define CDC_MAXDATA		(64 * 1024)
+
+/*
+ * Largest Get Log Page transfer, announced as MDTS in units of the
+ * 4 KiB minimum memory page size
+ */
+#define CDC_MDTS		8
+#define CDC_MAX_XFER		(4096UL << CDC_MDTS)
+
+/* Appended to the snapshot or WAL path to name the replicated state */
+#define CDC_REPL_SUFFIX		".repl"
+
+/* Delay in ms before a failed write-ahead log commit is tried again */
+#define CDC_WAL_RETRY_MS	1000
+
+/* Delay in ms before a log page which failed to build is tried again */
+#define CDC_LOG_RETRY_MS	100
+
+/* Delay in ms after a snapshot was restored until it is verified */
+#define CDC_SNAP_VERIFY_MS	1000
+
+/* Interval of the statistics summary in seconds */
+#define CDC_STATS_INTERVAL	10
+
+/* Keep alive timeout announced to hosts, in 100 ms units (kas) */
+#define CDC_KAS			100
+
+/*
+ * Time in ms a connection has to complete the ICReq exchange and, for
+ * hosts, the Connect command and the authentication
+ */
+#define CDC_CONNECT_TMO_MS	10000
+
+/* Number of concurrent DDC connections of the server benchmark */
+#define CDC_BENCH_CONNS		10000
+
+/* Largest number of worker threads */
+#define CDC_MAX_WORKERS		64
+
+/* Registrations per worker count in the scaling benchmark */
+#define CDC_SCALE_CONNS		20000
+
+/*
+ * Default time in ms the registry has to be quiet before a discovery
+ * log change notice is raised, and the longest a notice is deferred
+ * while changes keep coming in, in windows
+ */
+#define CDC_AEN_WINDOW		500
+#define CDC_AEN_MAX_DEFER	10
+
+/* Asynchronous Event Requests a host may have outstanding */
+#define DDC_MAX_AER		4
+
+/* Largest allocation length of an Authentication Receive command */
+#define DDC_AUTH_AL_MAX		8192
+
+/* Hosts and registrations of the notice coalescing benchmark */
+#define CDC_AEN_BENCH_HOSTS	100
+#define CDC_AEN_BENCH_RECS	5000
+
+/**
+ * struct cdc_stats - counters of one I/O loop
+ *
+ * @num_conns:     number of open connections
+ * @num_accepted:  number of connections accepted
+ * @num_kdreq:     number of KDReq PDUs processed
+ * @num_rejected:  number of KDReq PDUs rejected
+ * @num_errors:    number of connections closed on protocol errors
+ * @num_get_log:   number of Get Log Page commands for the
+ *                 discovery log
+ * @num_aen:       number of discovery log change notices sent
+ * @num_aen_masked: number of notices not sent as the host had not
+ *                 read the log page since the previous one
+ * @num_timeouts:  number of connections closed as they did not
+ *                 connect in time or their keep alive timer expired
+ * @num_auth:      number of hosts authenticated
+ * @num_auth_failed: number of failed host authentications
+ *
+ * Only written by the thread running the loop; other threads read
+ * them for statistics only.
+ */
+struct cdc_stats {
+	int num_conns;
+	unsigned long num_accepted;
+	unsigned long num_kdreq;
+	unsigned long num_rejected;
+	unsigned long num_errors;
+	unsigned long num_get_log;
+	unsigned long num_aen;
+	unsigned long num_aen_masked;
+	unsigned long num_timeouts;
+	unsigned long num_auth;
+	unsigned long num_auth_failed;
+};
+
+struct ddc_conn;
+
+/**
+ * struct cdc_wal_sync - durability of the registry changes of a loop
+ *
+ * @waiters:       connections of the loop holding back a KDResp
+ *                 until their registry changes are durable
+ * @queued:        number of registry changes made or queued by the
+ *                 loop
+ * @applied:       number of them appended to the WAL, only used by
+ *                 the registry owner
+ * @synced:        number of them committed to the WAL, written by
+ *                 the registry owner
+ */
+struct cdc_wal_sync {
+	struct ddc_conn *waiters;
+	unsigned long queued;
+	unsigned long applied;
+	unsigned long synced;
+};
+
+/**
+ * struct cdc_reg_op - registry change queued by a worker or received
+ *                     from a replication peer
+ *
+ * @node:          link in the registry queue
+ * @ws:            durability of the changes of the queueing loop,
+ *                 NULL if there is no WAL
+ * @seq:           number of the change in @ws->queued
+ * @dereg:         remove the records instead of adding them
+ * @ddc:           address of the DDC which sent the records
+ * @num_recs:      number of records in @recs, or of changes in @repl
+ * @repl:          changes received from a replication peer, merged
+ *                 instead of applying @recs if set
+ * @recs:          records of one KDReq PDU
+ */
+struct cdc_reg_op {
+	struct mpsc_node node;
+	struct cdc_wal_sync *ws;
+	unsigned long seq;
+	int dereg;
+	struct in6_addr ddc;
+	int num_recs;
+	struct gossip_change *repl;
+	struct port_rec recs[];
+};
+
+/**
+ * struct cdc_server - CDC state shared by all DDC connections
+ *
+ * @nqn:           CDC NQN returned in each KDResp
+ * @maxdata:       maxdata announced in the ICResp
+ * @reg:           registered records, only changed by the registry
+ *                 owner
+ * @log:           discovery log page of the current registry
+ *                 generation, NULL if it could not be built
+ * @log_stale:     @log could not be patched and lags behind the
+ *                 registry until the registry owner rebuilds it
+ * @log_lock:      protects @log against replacement and changes
+ *                 while references are taken
+ * @next_cntlid:   source of the controller id of the next host
+ * @reg_queue:     registry changes from the workers, NULL if the
+ *                 single I/O loop owns the registry
+ * @reg_efd:       eventfd signalled when @reg_queue becomes
+ *                 non-empty
+ * @reg_pending:   number of pushes since the owner last looked at
+ *                 @reg_queue
+ * @num_reg_ops:   number of queued registry changes applied
+ * @num_log_builds: number of times the discovery log was serialized
+ * @num_log_patches: number of registry changes patched into @log
+ * @aen_window:    quiet time in ms before a change notice is raised
+ * @aen_pending:   registry changes have not been notified yet
+ * @aen_first:     time of the first change not notified yet
+ * @aen_due:       time the pending notice is to be raised
+ * @aen_seq:       number of change notices raised, read by all I/O
+ *                 loops to find out whether to notify their hosts
+ * @num_aen_notices: number of change notices raised
+ * @num_aen_coalesced: number of changes folded into a pending notice
+ * @snap_path:     registry snapshot file, NULL if not persisted
+ * @snap:          snapshot the registry was restored from
+ * @snap_verify:   time the contents of @snap are to be verified
+ * @snap_log:      log page in @snap, referenced until @snap is
+ *                 verified or unmapped
+ * @snap_corrupt:  @snap failed to verify and is unmapped once
+ *                 @snap_log is no longer referenced
+ * @snap_genctr:   registry generation of the last snapshot saved
+ * @wal_path:      write-ahead log file, NULL if none
+ * @wal:           write-ahead log of the registry changes since the
+ *                 last snapshot, not open if @wal.fd is -1
+ * @wal_failed:    the last commit of @wal failed
+ * @wal_retry:     time the failed commit is to be tried again
+ * @gossip:        replication of the registry with peer CDCs, NULL
+ *                 if not replicated
+ * @repl_path:     file the replicated state is saved to, NULL if
+ *                 not persisted
+ * @auth:          DH-HMAC-CHAP secrets hosts have to authenticate
+ *                 with, NULL if hosts are not authenticated
+ *
+ * With worker threads, KDReq records are validated and answered by
+ * the worker owning the connection and then queued for the registry
+ * owner, which applies them in order per connection.
+ *
+ * With a WAL, KDResps are only sent once the registry owner has
+ * committed the changes of the KDReq. All changes of an owner loop
+ * iteration are committed together (see cdc_wal_commit()); if that
+ * fails, the changes stay buffered and their KDResps held back until
+ * a later commit succeeds.
+ *
+ * With replication, the registry owner records each change in
+ * @gossip, and merges and applies the changes peers sent, which
+ * are queued like those of the workers. The replicated state is
+ * saved along with the snapshot.
+ *
+ * Change notices are raised by the registry owner once the registry
+ * has been quiet for @aen_window, so a burst of registrations results
+ * in a single notice; each I/O loop then completes an outstanding
+ * Asynchronous Event Request of its hosts (see ddc_aen_poll()).
+ */
+struct cdc_server {
+	char nqn[NVMF_NQN_FIELD_LEN];
+	unsigned int maxdata;
+	struct registry reg;
+	struct disc_log *log;
+	int log_stale;
+	pthread_mutex_t log_lock;
+	__u32 next_cntlid;
+	struct mpsc *reg_queue;
+	int reg_efd;
+	__u32 reg_pending;
+	unsigned long num_reg_ops;
+	unsigned long num_log_builds;
+	unsigned long num_log_patches;
+	unsigned int aen_window;
+	int aen_pending;
+	struct timespec aen_first;
+	struct timespec aen_due;
+	__u32 aen_seq;
+	unsigned long num_aen_notices;
+	unsigned long num_aen_coalesced;
+	const char *snap_path;
+	struct snapshot snap;
+	struct timespec snap_verify;
+	struct disc_log *snap_log;
+	int snap_corrupt;
+	unsigned long snap_genctr;
+	const char *wal_path;
+	struct wal wal;
+	int wal_failed;
+	struct timespec wal_retry;
+	struct gossip *gossip;
+	char *repl_path;
+	struct auth_ctx *auth;
+};
+
+/* I/O backend of the CDC listener */
+enum cdc_io_mode {
+	CDC_IO_EPOLL,
+	CDC_IO_URING,
+};
+
+enum ddc_state {
+	DDC_ICREQ,
+	DDC_KDREQ,
+	DDC_CONNECT,
+	DDC_AUTH,
+	DDC_ADMIN,
+	DDC_CLOSING,
+};
+
+/**
+ * struct ddc_iov - segment of the transmit queue
+ *
+ * @base:          data to send, or NULL for the next @len bytes of
+ *                 the inline buffer
+ * @len:           length of the segment
+ * @log:           log page @base points into, referenced until the
+ *                 segment has been sent
+ * @pinned:        @log is pinned, as the data digest has been
+ *                 computed already
+ */
+struct ddc_iov {
+	const char *base;
+	size_t len;
+	struct disc_log *log;
+	int pinned;
+};
+
+/**
+ * struct ddc_conn - connection from a DDC or a discovery host
+ *
+ * @fd:            socket, owned by the I/O backend
+ * @srv:           CDC the connection belongs to
+ * @stats:         counters of the I/O loop serving the connection
+ * @addr:          DDC address, IPv4 addresses mapped into IPv6
+ * @state:         protocol state
+ * @pb:            PDU receive buffer
+ * @tx:            inline buffer for PDU headers and small PDUs
+ * @tx_len:        number of bytes in @tx
+ * @tx_off:        bytes of @tx already sent
+ * @tx_size:       allocated size of @tx
+ * @iov:           transmit queue, in order
+ * @iov_head:      first segment of @iov not completely sent
+ * @iov_cnt:       number of segments in @iov
+ * @iov_size:      allocated number of segments of @iov
+ * @iov_off:       bytes of @iov[@iov_head] already sent
+ * @tx_pending:    bytes queued and not sent yet
+ * @fes:           fatal error status if a PDU was invalid
+ * @cntlid:        controller id assigned by the Connect command
+ * @sqsize:        admin submission queue size from the Connect
+ *                 command, 0's based
+ * @sqhd:          submission queue head reported in completions
+ * @sqflow_off:    the host disabled SQ flow control in the Connect
+ *                 command, so successful commands returning data are
+ *                 completed by the last C2HData PDU alone
+ * @kato:          keep alive timeout from the Connect command in ms
+ * @kato_traffic:  a command was received since the keep alive timer
+ *                 was started
+ * @cc:            controller configuration property
+ * @aen_cfg:       asynchronous events enabled by Set Features
+ * @aen_seq:       last change notice of the server seen
+ * @aen_masked:    a notice was sent and the host has not read the
+ *                 log page since, so further notices are suppressed
+ * @aer_cids:      command ids of outstanding Asynchronous Event
+ *                 Requests
+ * @num_aer:       number of entries in @aer_cids
+ * @aen_hosts:     list of the I/O loop holding the connections with
+ *                 outstanding AERs, NULL if none
+ * @aen_next:      next connection in *@aen_hosts
+ * @aen_pprev:     link pointing to this connection in *@aen_hosts,
+ *                 NULL if not linked
+ * @wal_sync:      durability of the registry changes of the I/O loop
+ * @wal_seq:       change of @wal_sync the held KDResp waits for, 0
+ *                 if none is held; PDU dispatching is paused until
+ *                 it is sent
+ * @wal_failrsn:   failure reason of the held KDResp
+ * @wal_next:      next connection in @wal_sync->waiters
+ * @wal_pprev:     link pointing to this connection in
+ *                 @wal_sync->waiters, NULL if not linked
+ * @wheel:         timers of the I/O loop, NULL if the connection is
+ *                 not timed
+ * @timer:         connect timeout, then keep alive timer
+ * @auth:          DH-HMAC-CHAP transaction after the Connect command,
+ *                 NULL once the host authenticated
+ *
+ * The protocol engine (ddc_pdu_ops) only consumes PDUs from @pb and
+ * appends the responses to the transmit queue; moving data between
+ * the socket and the buffers is left to the I/O backend, which
+ * sends the segments returned by ddc_tx_iov() and reports progress
+ * with ddc_tx_advance(). Log page data is queued by reference, so
+ * Get Log Page responses never copy the log.
+ *
+ * Connections have CDC_CONNECT_TMO_MS to complete the ICReq exchange
+ * and, for hosts, the Connect command and the authentication; hosts
+ * are then kept alive by any command (traffic based keep alive).
+ * Kickstart sessions have no keep alive timeout and are not timed.
+ */
+struct ddc_conn {
+	int fd;
+	struct cdc_server *srv;
+	struct cdc_stats *stats;
+	struct in6_addr addr;
+	enum ddc_state state;
+	struct pdu_buf pb;
+	char *tx;
+	size_t tx_len;
+	size_t tx_off;
+	size_t tx_size;
+	struct ddc_iov *iov;
+	int iov_head;
+	int iov_cnt;
+	int iov_size;
+	size_t iov_off;
+	size_t tx_pending;
+	__u16 fes;
+	__u16 cntlid;
+	__u16 sqsize;
+	__u16 sqhd;
+	int sqflow_off;
+	__u32 kato;
+	int kato_traffic;
+	__u32 cc;
+	__u32 aen_cfg;
+	__u32 aen_seq;
+	int aen_masked;
+	__u16 aer_cids[DDC_MAX_AER];
+	int num_aer;
+	struct ddc_conn **aen_hosts;
+	struct ddc_conn *aen_next;
+	struct ddc_conn **aen_pprev;
+	struct cdc_wal_sync *wal_sync;
+	unsigned long wal_seq;
+	__u8 wal_failrsn;
+	struct ddc_conn *wal_next;
+	struct ddc_conn **wal_pprev;
+	struct wheel *wheel;
+	struct wheel_timer timer;
+	struct auth_session *auth;
+};
+
+extern const struct pdu_ops ddc_pdu_ops;
+
+void cdc_server_init(struct cdc_server *srv, const char *nqn);
+void cdc_server_free(struct cdc_server *srv);
+int cdc_reg_drain(struct cdc_server *srv);
+int cdc_snap_load(struct cdc_server *srv, const char *path);
+int cdc_snap_save(struct cdc_server *srv);
+void cdc_snap_verify(struct cdc_server *srv);
+long cdc_snap_timeout(struct cdc_server *srv);
+int cdc_wal_open(struct cdc_server *srv, const char *path);
+int cdc_gossip_init(struct cdc_server *srv, const char *addr,
+		    const char *port);
+int cdc_wal_commit(struct cdc_server *srv);
+long cdc_wal_timeout(struct cdc_server *srv);
+void cdc_log_retry(struct cdc_server *srv);
+long cdc_log_timeout(struct cdc_server *srv);
+long cdc_aen_timeout(struct cdc_server *srv);
+int cdc_aen_raise(struct cdc_server *srv);
+void ddc_init(struct ddc_conn *dc, struct cdc_server *srv,
+	      struct cdc_stats *stats, struct ddc_conn **aen_hosts,
+	      struct cdc_wal_sync *wal_sync, struct wheel *wheel, int fd,
+	      const struct in6_addr *addr);
+void ddc_free(struct ddc_conn *dc);
+void ddc_fatal(struct ddc_conn *dc, int err);
+int ddc_timeout(struct ddc_conn *dc);
+int ddc_aen_poll(struct ddc_conn *dc);
+int ddc_wal_release(struct ddc_conn *dc);
+int ddc_tx_iov(struct ddc_conn *dc, struct iovec *vec, int max);
+void ddc_tx_advance(struct ddc_conn *dc, size_t len);
+int cdc_serve(struct cdc_server *srv, const char *addr, const char *port,
+	      enum cdc_io_mode mode, int num_workers, int pin);
+int cdc_server_bench(int num_conns);
+int cdc_scale_bench(int max_workers, int num_conns);
+int cdc_host_bench(int num_recs, int num_reads);
+int disc_log_bench(int num_recs, int num_reqs);
+int cdc_aen_bench(int num_hosts, int num_recs);
+int cdc_snap_bench(const char *dir, int max_recs);
+int cdc_auth_bench(int num_handshakes);
+
+#endif /* _CDC_H */
@@ -0,0 +1,413 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * connect.c - parallel connection establishment
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Implements RFC 8305 ('Happy Eyeballs') style connection setup:
+ * the resolved addresses are interleaved by address family, and a
+ * new non-blocking connect is started whenever the previous attempt
+ * failed or did not complete within the stagger delay. The first
+ * attempt to complete wins and all others are cancelled, so an
+ * unreachable address costs at most the stagger delay instead of
+ * the full SYN timeout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "connect.h"
+
+static void ts_add_ms(struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Milliseconds until @ts, rounded up; negative if @ts has passed */
+static long ts_until_ms(struct timespec *ts)
+{
+	struct timespec now;
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (ts->tv_sec - now.tv_sec) * 1000000000L +
+		(ts->tv_nsec - now.tv_nsec);
+	if (ns <= 0)
+		return ns / 1000000 - 1;
+	return (ns + 999999) / 1000000;
+}
+
+/*
+ * Order @ai_list for connecting: alternate between address families,
+ * starting with the family of the first (i.e. preferred) address.
+ * @ai_list is not owned by @hc and has to stay valid until he_free().
+ */
+int he_init(struct he_conn *hc, struct addrinfo *ai_list,
+	    int stagger_ms, int tmo_ms)
+{
+	struct addrinfo *rp, *rq;
+	int i, num = 0;
+
+	memset(hc, 0, sizeof(*hc));
+	hc->fd = -1;
+	hc->winner = -1;
+	hc->err = ENOENT;
+	hc->stagger_ms = stagger_ms;
+	for (rp = ai_list; rp; rp = rp->ai_next)
+		num++;
+	hc->ai = calloc(num ? num : 1, sizeof(*hc->ai));
+	hc->fds = calloc(num ? num : 1, sizeof(*hc->fds));
+	if (!hc->ai || !hc->fds) {
+		free(hc->ai);
+		free(hc->fds);
+		return -ENOMEM;
+	}
+	rp = ai_list;
+	rq = ai_list;
+	for (i = 0; i < num; ) {
+		/* Next address of the preferred family ... */
+		while (rp && rp->ai_family != ai_list->ai_family)
+			rp = rp->ai_next;
+		if (rp) {
+			hc->ai[i++] = rp;
+			rp = rp->ai_next;
+		}
+		/* ... followed by the next one of any other family */
+		while (rq && rq->ai_family == ai_list->ai_family)
+			rq = rq->ai_next;
+		if (rq) {
+			hc->ai[i++] = rq;
+			rq = rq->ai_next;
+		}
+	}
+	hc->num_ai = num;
+	for (i = 0; i < num; i++)
+		hc->fds[i] = -1;
+	clock_gettime(CLOCK_MONOTONIC, &hc->next_ts);
+	hc->deadline = hc->next_ts;
+	ts_add_ms(&hc->deadline, tmo_ms);
+	return 0;
+}
+
+int he_resolve(struct he_conn *hc, const char *addr, const char *port,
+	       int stagger_ms, int tmo_ms)
+{
+	struct addrinfo hints, *result;
+	int err;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(addr, port, &hints, &result);
+	if (err) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+		return -ENOENT;
+	}
+	err = he_init(hc, result, stagger_ms, tmo_ms);
+	if (err < 0) {
+		freeaddrinfo(result);
+		return err;
+	}
+	hc->ai_list = result;
+	return 0;
+}
+
+static void he_close(struct he_conn *hc, int i)
+{
+	close(hc->fds[i]);
+	hc->fds[i] = -1;
+	hc->active--;
+}
+
+/*
+ * Start the next connection attempt if it is due, i.e. if the stagger
+ * delay has expired or if no other attempt is in progress. Attempts
+ * which fail immediately are skipped.
+ */
+void he_start(struct he_conn *hc)
+{
+	while (hc->fd < 0 && hc->next < hc->num_ai &&
+	       (!hc->active || ts_until_ms(&hc->next_ts) <= 0)) {
+		int i = hc->next++;
+		struct addrinfo *rp = hc->ai[i];
+		int fd;
+
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+			    rp->ai_protocol);
+		if (fd < 0) {
+			hc->err = errno;
+			continue;
+		}
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) < 0 &&
+		    errno != EINPROGRESS) {
+			hc->err = errno;
+			close(fd);
+			continue;
+		}
+		if (hc->watch && hc->watch(hc->watch_arg, fd) < 0) {
+			hc->err = errno;
+			close(fd);
+			continue;
+		}
+		hc->fds[i] = fd;
+		hc->active++;
+		clock_gettime(CLOCK_MONOTONIC, &hc->next_ts);
+		ts_add_ms(&hc->next_ts, hc->stagger_ms);
+	}
+}
+
+/*
+ * Check the attempts in progress for completion.
+ * Returns 1 if connected, with the socket in hc->fd, 0 if still in
+ * progress, or -1 if all attempts failed or the deadline passed, with
+ * the reason in hc->err.
+ */
+int he_check(struct he_conn *hc)
+{
+	int i, j;
+
+	if (hc->fd >= 0)
+		return 1;
+	for (i = 0; i < hc->num_ai; i++) {
+		struct pollfd pfd;
+		socklen_t errlen;
+		int err = 0;
+
+		if (hc->fds[i] < 0)
+			continue;
+		pfd.fd = hc->fds[i];
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) <= 0)
+			continue;
+		errlen = sizeof(err);
+		if (getsockopt(hc->fds[i], SOL_SOCKET, SO_ERROR,
+			       &err, &errlen) < 0)
+			err = errno;
+		if (err) {
+			hc->err = err;
+			he_close(hc, i);
+			continue;
+		}
+		/* Connected; cancel all other attempts */
+		hc->fd = hc->fds[i];
+		hc->fds[i] = -1;
+		hc->active--;
+		hc->winner = i;
+		for (j = 0; j < hc->num_ai; j++) {
+			if (hc->fds[j] >= 0)
+				he_close(hc, j);
+		}
+		return 1;
+	}
+	if (ts_until_ms(&hc->deadline) <= 0) {
+		hc->err = ETIMEDOUT;
+		for (j = 0; j < hc->num_ai; j++) {
+			if (hc->fds[j] >= 0)
+				he_close(hc, j);
+		}
+		hc->next = hc->num_ai;
+		return -1;
+	}
+	he_start(hc);
+	if (!hc->active)
+		return -1;
+	return 0;
+}
+
+/*
+ * Milliseconds until he_start() or he_check() need to be called
+ * again even if no socket became ready.
+ */
+int he_wait_ms(struct he_conn *hc)
+{
+	long ms = ts_until_ms(&hc->deadline);
+
+	if (hc->next < hc->num_ai) {
+		long next = ts_until_ms(&hc->next_ts);
+
+		if (next < ms)
+			ms = next;
+	}
+	return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Blocking connect; returns the connected socket or -1.
+ */
+int he_connect(struct he_conn *hc)
+{
+	struct pollfd *pfds;
+	int ret;
+
+	pfds = calloc(hc->num_ai ? hc->num_ai : 1, sizeof(*pfds));
+	if (!pfds) {
+		hc->err = ENOMEM;
+		return -1;
+	}
+	he_start(hc);
+	while ((ret = he_check(hc)) == 0) {
+		int i, n = 0;
+
+		for (i = 0; i < hc->num_ai; i++) {
+			if (hc->fds[i] < 0)
+				continue;
+			pfds[n].fd = hc->fds[i];
+			pfds[n].events = POLLOUT;
+			n++;
+		}
+		if (poll(pfds, n, he_wait_ms(hc)) < 0 && errno != EINTR) {
+			hc->err = errno;
+			break;
+		}
+	}
+	free(pfds);
+	return ret > 0 ? hc->fd : -1;
+}
+
+/*
+ * Release all resources; the connected socket is not closed.
+ */
+void he_free(struct he_conn *hc)
+{
+	int i;
+
+	for (i = 0; i < hc->num_ai; i++) {
+		if (hc->fds[i] >= 0)
+			he_close(hc, i);
+	}
+	free(hc->fds);
+	hc->fds = NULL;
+	free(hc->ai);
+	hc->ai = NULL;
+	hc->num_ai = 0;
+	if (hc->ai_list)
+		freeaddrinfo(hc->ai_list);
+	hc->ai_list = NULL;
+}
+
+static int bench_listen(struct sockaddr_in *sin, int backlog)
+{
+	socklen_t len = sizeof(*sin);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0 ||
+	    listen(fd, backlog) < 0 ||
+	    getsockname(fd, (struct sockaddr *)sin, &len) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Turn the listener at @sin into a blackhole: once its accept queue
+ * is full, further SYNs are dropped and connects hang just like for
+ * an unreachable address. Returns the number of sockets in @fill.
+ */
+static int bench_blackhole(struct sockaddr_in *sin, int *fill, int max)
+{
+	int n;
+
+	for (n = 0; n < max; n++) {
+		struct pollfd pfd;
+
+		fill[n] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fill[n] < 0)
+			break;
+		connect(fill[n], (struct sockaddr *)sin, sizeof(*sin));
+		pfd.fd = fill[n];
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 100) <= 0)
+			return n + 1;
+	}
+	return n;
+}
+
+static long bench_one(const char *name, struct addrinfo *ai,
+		      int stagger_ms, int tmo_ms)
+{
+	struct he_conn hc;
+	struct timespec start, end;
+	long ms;
+	int fd;
+
+	if (he_init(&hc, ai, stagger_ms, tmo_ms) < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = he_connect(&hc);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000;
+	if (fd < 0)
+		printf("connect %-10s: failed after %5ld ms: %s\n",
+		       name, ms, strerror(hc.err));
+	else {
+		printf("connect %-10s: connected after %5ld ms "
+		       "(address %d of %d)\n",
+		       name, ms, hc.winner + 1, hc.num_ai);
+		close(fd);
+	}
+	he_free(&hc);
+	return ms;
+}
+
+/*
+ * Measure the time to connect when the preferred address is
+ * blackholed, with and without parallel connection attempts.
+ */
+int he_bench(int stagger_ms, int tmo_ms)
+{
+	struct sockaddr_in sin_bh, sin_ok;
+	struct addrinfo ai[2];
+	int bh_fd, ok_fd, fill[64], num_fill, i;
+
+	bh_fd = bench_listen(&sin_bh, 0);
+	ok_fd = bench_listen(&sin_ok, 16);
+	if (bh_fd < 0 || ok_fd < 0) {
+		perror("listen");
+		return 1;
+	}
+	num_fill = bench_blackhole(&sin_bh, fill, 64);
+
+	memset(ai, 0, sizeof(ai));
+	ai[0].ai_family = AF_INET;
+	ai[0].ai_socktype = SOCK_STREAM;
+	ai[0].ai_addr = (struct sockaddr *)&sin_bh;
+	ai[0].ai_addrlen = sizeof(sin_bh);
+	ai[0].ai_next = &ai[1];
+	ai[1] = ai[0];
+	ai[1].ai_addr = (struct sockaddr *)&sin_ok;
+	ai[1].ai_next = NULL;
+
+	printf("blackhole 127.0.0.1:%d, listener 127.0.0.1:%d, "
+	       "stagger %d ms, timeout %d ms\n",
+	       ntohs(sin_bh.sin_port), ntohs(sin_ok.sin_port),
+	       stagger_ms, tmo_ms);
+	/* Serial: the next address is only tried once the previous failed */
+	bench_one("serial", ai, tmo_ms, tmo_ms);
+	bench_one("parallel", ai, stagger_ms, tmo_ms);
+
+	for (i = 0; i < num_fill; i++)
+		close(fill[i]);
+	close(bh_fd);
+	close(ok_fd);
+	return 0;
+}
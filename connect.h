@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * connect.h - parallel connection establishment
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _CONNECT_H
+#define _CONNECT_H
+
+#include <time.h>
+#include <netdb.h>
+
+/* RFC 8305 recommended Connection Attempt Delay */
+#define HE_STAGGER_MS		250
+#define HE_CONNECT_TMO_MS	5000
+
+/**
+ * struct he_conn - staggered parallel connect to a list of addresses
+ *
+ * @ai_list:       addresses from getaddrinfo(), owned by this struct
+ * @ai:            addresses in the order in which they are tried
+ * @fds:           socket for each address, -1 if not in progress
+ * @num_ai:        number of addresses
+ * @next:          index of the next address to try
+ * @active:        number of connection attempts in progress
+ * @stagger_ms:    delay before starting the next attempt while the
+ *                 previous ones are still in progress
+ * @next_ts:       earliest time to start the next attempt
+ * @deadline:      time at which the connect fails
+ * @fd:            connected socket, or -1
+ * @winner:        index of the address @fd is connected to
+ * @err:           errno of the last failed attempt
+ * @watch:         called for each new attempt socket, e.g. to add it
+ *                 to an epoll set; may be NULL
+ * @watch_arg:     argument passed to @watch
+ */
+struct he_conn {
+	struct addrinfo *ai_list;
+	struct addrinfo **ai;
+	int *fds;
+	int num_ai;
+	int next;
+	int active;
+	int stagger_ms;
+	struct timespec next_ts;
+	struct timespec deadline;
+	int fd;
+	int winner;
+	int err;
+	int (*watch)(void *arg, int fd);
+	void *watch_arg;
+};
+
+int he_init(struct he_conn *hc, struct addrinfo *ai_list,
+	    int stagger_ms, int tmo_ms);
+int he_resolve(struct he_conn *hc, const char *addr, const char *port,
+	       int stagger_ms, int tmo_ms);
+void he_start(struct he_conn *hc);
+int he_check(struct he_conn *hc);
+int he_wait_ms(struct he_conn *hc);
+int he_connect(struct he_conn *hc);
+void he_free(struct he_conn *hc);
+int he_bench(int stagger_ms, int tmo_ms);
+
+#endif /* _CONNECT_H */
@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * crc32c.c - CRC32C (Castagnoli) for NVMe/TCP digests
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Uses the SSE4.2 'crc32' instruction if the CPU supports it, and a
+ * slicing-by-8 table implementation otherwise. The implementation is
+ * selected at program startup, before any thread can call it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_generic(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		v = le64toh(v) ^ crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t crc64;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	crc64 = crc;
+	while (len >= 32) {
+		uint64_t v[4];
+
+		memcpy(v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v[0]);
+		crc64 = _mm_crc32_u64(crc64, v[1]);
+		crc64 = _mm_crc32_u64(crc64, v[2]);
+		crc64 = _mm_crc32_u64(crc64, v[3]);
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t (*crc32c_update)(uint32_t crc, const void *buf, size_t len) =
+	crc32c_generic;
+
+static const char *crc32c_name = "generic";
+
+/*
+ * Run from a constructor so the table and @crc32c_update are set up
+ * before main(), and never change once threads are running.
+ */
+__attribute__((constructor))
+static void crc32c_select(void)
+{
+	crc32c_init_table();
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_update = crc32c_sse42;
+		crc32c_name = "sse4.2";
+	}
+#endif
+}
+
+const char *crc32c_impl(void)
+{
+	return crc32c_name;
+}
+
+static void crc32c_bench_one(const char *name,
+			     uint32_t (*fn)(uint32_t, const void *, size_t),
+			     const char *buf, size_t len)
+{
+	struct timespec start, end;
+	unsigned long loops = 0, total = 0;
+	uint32_t crc = 0;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		int i;
+
+		for (i = 0; i < 64; i++) {
+			crc = fn(crc, buf, len);
+			total += len;
+		}
+		loops += 64;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+	} while (secs < 0.25);
+	printf("crc32c %-8s %8zu bytes: %8.2f GB/s %12.0f ns/op (crc %08x)\n",
+	       name, len, total / secs / 1e9, secs * 1e9 / loops, crc);
+}
+
+/*
+ * Measure single-core throughput of all available implementations
+ * for PDU header, capsule and discovery log page sizes.
+ */
+int crc32c_bench(void)
+{
+	static const size_t sizes[] = { 24, 72, 1024, 8192, 1024 * 1024 };
+	static const char check[] = "123456789";
+	size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	char *buf;
+	int i;
+
+	printf("crc32c: using %s implementation\n", crc32c_impl());
+	if (crc32c(check, strlen(check)) != 0xe3069283) {
+		fprintf(stderr, "crc32c: self test failed\n");
+		return 1;
+	}
+	buf = malloc(max);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < max; i++)
+		buf[i] = rand();
+	if (crc32c_update(~0U, buf + 1, max - 1) !=
+	    crc32c_generic(~0U, buf + 1, max - 1)) {
+		fprintf(stderr, "crc32c: %s implementation mismatch\n",
+			crc32c_impl());
+		free(buf);
+		return 1;
+	}
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		crc32c_bench_one("generic", crc32c_generic, buf, sizes[i]);
+#if defined(__x86_64__)
+		if (crc32c_update == crc32c_sse42)
+			crc32c_bench_one("sse4.2", crc32c_sse42,
+					 buf, sizes[i]);
+#endif
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * crc32c.h - CRC32C (Castagnoli) for NVMe/TCP digests
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Update @crc with @len bytes from @buf; no pre- or post-inversion
+ * is done, see crc32c() for the digest value.
+ */
+extern uint32_t (*crc32c_update)(uint32_t crc, const void *buf, size_t len);
+
+const char *crc32c_impl(void);
+int crc32c_bench(void);
+
+/* NVMe/TCP header or data digest over @len bytes from @buf */
+static inline uint32_t crc32c(const void *buf, size_t len)
+{
+	return ~crc32c_update(~0U, buf, len);
+}
+
+#endif /* _CRC32C_H */
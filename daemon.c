@@ -0,0 +1,841 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * daemon.c - persistent CDC sessions with a local control socket
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * In daemon mode the NVMe/TCP session to each CDC is kept open after
+ * the kickstart. Idle sessions are kept alive with empty KDReqs, and
+ * failed sessions are reconnected with exponential backoff; after each
+ * (re-)connect the full record set is registered again.
+ *
+ * Registrations are requested on a UNIX stream socket with one request
+ * per line, answered by any number of information lines and a final
+ * line starting with 'ok' or 'error':
+ *
+ *   register <trtype,traddr[,adrfam[,trsvcid]]> ...
+ *   deregister <trtype,traddr[,adrfam[,trsvcid]]> ...
+ *   status
+ *
+ * Requests are processed one at a time; a register or deregister is
+ * answered once all connected CDCs acknowledged the change.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "acdc.h"
+
+#define ACDC_BACKOFF_MIN_MS	1000
+#define ACDC_BACKOFF_MAX_MS	60000
+
+/**
+ * struct acdc_client - control socket connection
+ *
+ * @fd:            connected socket
+ * @buf:           received data not yet processed
+ * @len:           number of bytes in @buf
+ * @next:          next client
+ */
+struct acdc_client {
+	int fd;
+	char buf[ACDC_CTRL_LINE_MAX];
+	size_t len;
+	struct acdc_client *next;
+};
+
+/**
+ * struct acdc_daemon - daemon state
+ *
+ * @efd:           epoll instance
+ * @lfd:           control socket
+ * @sigfd:         signalfd for SIGINT and SIGTERM
+ * @ctrl_path:     path of the control socket
+ * @running:       cleared on SIGINT or SIGTERM
+ * @cdcs:          CDC sessions
+ * @num_cdcs:      number of CDC sessions
+ * @opts:          session parameters
+ * @icreq:         ICReq PDU sent on each new session
+ * @recs:          records registered with the CDCs
+ * @num_recs:      number of records in @recs
+ * @max_recs:      allocated size of @recs
+ * @clients:       control socket connections
+ * @active:        client whose request is in progress, NULL if none
+ *                 or if the client went away
+ * @busy:          a register or deregister request is in progress
+ * @pd:            changes of the request in progress
+ * @num_targets:   number of CDCs the changes are sent to
+ * @num_pending:   number of CDCs which did not complete the changes
+ * @num_ok:        number of CDCs which acknowledged the changes
+ * @wheel:         session timers
+ */
+struct acdc_daemon {
+	int efd;
+	int lfd;
+	int sigfd;
+	const char *ctrl_path;
+	int running;
+	struct cdc_ctx *cdcs;
+	int num_cdcs;
+	struct kickstart_opts *opts;
+	struct nvme_tcp_icreq_pdu icreq;
+	struct port_rec *recs;
+	int num_recs;
+	int max_recs;
+	struct acdc_client *clients;
+	struct acdc_client *active;
+	int busy;
+	struct port_delta pd;
+	int num_targets;
+	int num_pending;
+	int num_ok;
+	struct wheel wheel;
+};
+
+static void daemon_reply(struct acdc_client *client, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void daemon_reply(struct acdc_client *client, const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	int len;
+
+	if (!client)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (send(client->fd, buf, len, MSG_NOSIGNAL) < 0)
+		perror("send reply");
+}
+
+static void daemon_next_request(struct acdc_daemon *d);
+
+static void daemon_request_done(struct acdc_daemon *d, int ok)
+{
+	d->num_ok += ok;
+	if (--d->num_pending)
+		return;
+	if (d->num_ok == d->num_targets)
+		daemon_reply(d->active, "ok %d records changed, "
+			     "%d CDCs updated\n",
+			     d->pd.num_add + d->pd.num_del, d->num_ok);
+	else
+		daemon_reply(d->active, "error %d of %d CDCs updated, "
+			     "the others are resynchronized on reconnect\n",
+			     d->num_ok, d->num_targets);
+	port_delta_free(&d->pd);
+	d->active = NULL;
+	d->busy = 0;
+	daemon_next_request(d);
+}
+
+static void daemon_send(struct acdc_daemon *d, struct cdc_ctx *cdc,
+			struct port_delta *pd, enum cdc_req req)
+{
+	unsigned int maxdata = cdc->maxdata;
+	size_t len;
+
+	if (!maxdata || maxdata > NVME_TCP_KDREQ_MAX_PDU_LEN)
+		maxdata = NVME_TCP_KDREQ_MAX_PDU_LEN;
+	free(cdc->kdreq_buf);
+	cdc->kdreq_buf = kdreq_alloc(pd, maxdata, cdc->digest,
+				     &len, &cdc->num_pdus);
+	if (!cdc->kdreq_buf) {
+		cdc_fail(d->efd, cdc, ENOMEM, "kdreq");
+		return;
+	}
+	cdc->num_resp = 0;
+	cdc->num_failed = 0;
+	cdc->req = req;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_deadline);
+	timespec_add_ms(&cdc->t_deadline, d->opts->tmo * 1000L);
+	cdc_send_pdu(d->efd, cdc, CDC_KDREQ, cdc->kdreq_buf, len);
+}
+
+static void daemon_connect(struct acdc_daemon *d, struct cdc_ctx *cdc)
+{
+	free(cdc->nqn);
+	cdc->req = CDC_REQ_NONE;
+	cdc->delta_pending = 0;
+	cdc_start(d->efd, cdc, d->opts);
+	/* Covers both the connect and the ICReq exchange */
+	cdc->t_deadline = cdc->t_start;
+	timespec_add_ms(&cdc->t_deadline, d->opts->connect_tmo_ms +
+			d->opts->tmo * 1000L);
+}
+
+/*
+ * Schedule a reconnect of a failed session.
+ */
+static void daemon_cdc_failed(struct acdc_daemon *d, struct cdc_ctx *cdc)
+{
+	if (d->busy && (cdc->req == CDC_REQ_DELTA || cdc->delta_pending))
+		daemon_request_done(d, 0);
+	cdc->req = CDC_REQ_NONE;
+	cdc->delta_pending = 0;
+	printf("CDC %s:%s: %s: %s, reconnecting in %d ms\n",
+	       cdc->addr, cdc->port, cdc->errstr, strerror(cdc->err),
+	       cdc->backoff_ms);
+	he_free(&cdc->hc);
+	pdu_buf_free(&cdc->pb);
+	free(cdc->kdreq_buf);
+	cdc->kdreq_buf = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_next);
+	timespec_add_ms(&cdc->t_next, cdc->backoff_ms);
+	cdc->backoff_ms *= 2;
+	if (cdc->backoff_ms > ACDC_BACKOFF_MAX_MS)
+		cdc->backoff_ms = ACDC_BACKOFF_MAX_MS;
+	cdc->state = CDC_BACKOFF;
+}
+
+/*
+ * Advance the session after its state changed.
+ */
+static void daemon_cdc_progress(struct acdc_daemon *d, struct cdc_ctx *cdc)
+{
+	struct port_delta pd = { 0 };
+	enum cdc_req req;
+
+	if (cdc->state == CDC_FAILED) {
+		daemon_cdc_failed(d, cdc);
+		return;
+	}
+	if (cdc->state != CDC_KDREQ)
+		return;
+	if (cdc->req == CDC_REQ_NONE) {
+		/* ICResp received; register the full set */
+		printf("CDC %s:%s: connected\n", cdc->addr, cdc->port);
+		cdc->backoff_ms = ACDC_BACKOFF_MIN_MS;
+		pd.add = d->recs;
+		pd.num_add = d->num_recs;
+		daemon_send(d, cdc, &pd, CDC_REQ_SYNC);
+		if (cdc->state == CDC_FAILED)
+			daemon_cdc_failed(d, cdc);
+		return;
+	}
+	if (cdc->num_resp < cdc->num_pdus)
+		return;
+	if (cdc->num_failed) {
+		cdc_fail(d->efd, cdc, EPROTO, "kickstart rejected");
+		daemon_cdc_failed(d, cdc);
+		return;
+	}
+	req = cdc->req;
+	cdc->req = CDC_REQ_NONE;
+	cdc->state = CDC_READY;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_next);
+	timespec_add_ms(&cdc->t_next, d->opts->kato * 1000L);
+	if (req == CDC_REQ_SYNC)
+		printf("CDC %s:%s: registered %d records with %s\n",
+		       cdc->addr, cdc->port, d->num_recs, cdc->nqn);
+	else if (req == CDC_REQ_DELTA)
+		daemon_request_done(d, 1);
+	if (cdc->delta_pending && d->busy) {
+		cdc->delta_pending = 0;
+		daemon_send(d, cdc, &d->pd, CDC_REQ_DELTA);
+		if (cdc->state == CDC_FAILED)
+			daemon_cdc_failed(d, cdc);
+	}
+}
+
+static void daemon_cdc_input(struct acdc_daemon *d, struct cdc_ctx *cdc)
+{
+	int ret;
+
+	while (cdc->state == CDC_ICREQ || cdc->state == CDC_KDREQ ||
+	       cdc->state == CDC_READY) {
+		ret = pdu_recv(cdc->sfd, &cdc->pb, &cdc_pdu_ops, cdc);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return;
+		if (ret < 0)
+			cdc_fail(d->efd, cdc, -ret,
+				 cdc_state_str(cdc->state));
+		daemon_cdc_progress(d, cdc);
+	}
+}
+
+/*
+ * Arm the session timer for the next event of the current state.
+ */
+static void daemon_cdc_arm(struct acdc_daemon *d, struct cdc_ctx *cdc)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	switch (cdc->state) {
+	case CDC_CONNECTING:
+		ms = he_wait_ms(&cdc->hc);
+		break;
+	case CDC_BACKOFF:
+	case CDC_READY:
+		ms = timespec_diff_ms(&now, &cdc->t_next);
+		break;
+	case CDC_ICREQ:
+	case CDC_KDREQ:
+		ms = timespec_diff_ms(&now, &cdc->t_deadline);
+		break;
+	default:
+		wheel_del(&d->wheel, &cdc->timer);
+		return;
+	}
+	wheel_add(&d->wheel, &cdc->timer, ms < 0 ? 0 : ms);
+}
+
+/*
+ * Start a reconnect or keep-alive which is due, or expire the request
+ * in flight.
+ */
+static void daemon_timeout(void *priv, struct wheel_timer *t)
+{
+	struct acdc_daemon *d = priv;
+	struct cdc_ctx *cdc = wheel_entry(t, struct cdc_ctx, timer);
+	struct port_delta pd = { 0 };
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	switch (cdc->state) {
+	case CDC_CONNECTING:
+		cdc_handle_connect(d->efd, cdc, (const char *)&d->icreq);
+		break;
+	case CDC_BACKOFF:
+		if (timespec_diff_ms(&now, &cdc->t_next) <= 0)
+			daemon_connect(d, cdc);
+		break;
+	case CDC_READY:
+		if (timespec_diff_ms(&now, &cdc->t_next) <= 0)
+			daemon_send(d, cdc, &pd, CDC_REQ_KEEPALIVE);
+		break;
+	case CDC_ICREQ:
+	case CDC_KDREQ:
+		if (timespec_diff_ms(&now, &cdc->t_deadline) <= 0)
+			cdc_fail(d->efd, cdc, ETIMEDOUT,
+				 cdc_state_str(cdc->state));
+		break;
+	default:
+		break;
+	}
+	daemon_cdc_progress(d, cdc);
+	daemon_cdc_arm(d, cdc);
+}
+
+static int daemon_add_recs(struct acdc_daemon *d, struct port_rec *recs,
+			   int num)
+{
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < d->num_recs; j++) {
+			if (port_rec_equal(&d->recs[j], &recs[i]))
+				break;
+		}
+		if (j < d->num_recs)
+			continue;
+		if (d->num_recs == d->max_recs) {
+			int max_recs = d->max_recs ? d->max_recs * 2 : 64;
+			struct port_rec *tmp;
+
+			tmp = realloc(d->recs, sizeof(*tmp) * max_recs);
+			if (!tmp)
+				return -ENOMEM;
+			d->recs = tmp;
+			d->max_recs = max_recs;
+		}
+		d->recs[d->num_recs++] = recs[i];
+		d->pd.add[d->pd.num_add++] = recs[i];
+	}
+	return 0;
+}
+
+static void daemon_del_recs(struct acdc_daemon *d, struct port_rec *recs,
+			    int num)
+{
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < d->num_recs; j++) {
+			if (port_rec_equal(&d->recs[j], &recs[i]))
+				break;
+		}
+		if (j == d->num_recs)
+			continue;
+		d->pd.del[d->pd.num_del++] = d->recs[j];
+		d->recs[j] = d->recs[--d->num_recs];
+	}
+}
+
+/*
+ * Send the changes in @d->pd to all established sessions.
+ */
+static void daemon_start_delta(struct acdc_daemon *d)
+{
+	int i;
+
+	d->busy = 1;
+	d->num_ok = 0;
+	d->num_targets = 0;
+	for (i = 0; i < d->num_cdcs; i++) {
+		struct cdc_ctx *cdc = &d->cdcs[i];
+
+		if (cdc->state == CDC_READY ||
+		    (cdc->state == CDC_KDREQ && cdc->req != CDC_REQ_NONE)) {
+			cdc->delta_pending = 1;
+			d->num_targets++;
+		}
+	}
+	d->num_pending = d->num_targets;
+	if (!d->num_targets) {
+		daemon_reply(d->active, "ok %d records changed, "
+			     "no CDC connected\n",
+			     d->pd.num_add + d->pd.num_del);
+		port_delta_free(&d->pd);
+		d->active = NULL;
+		d->busy = 0;
+		return;
+	}
+	/* Busy sessions send the changes once their KDReq completes */
+	for (i = 0; i < d->num_cdcs && d->busy; i++) {
+		struct cdc_ctx *cdc = &d->cdcs[i];
+
+		if (cdc->state != CDC_READY || !cdc->delta_pending)
+			continue;
+		cdc->delta_pending = 0;
+		daemon_send(d, cdc, &d->pd, CDC_REQ_DELTA);
+		if (cdc->state == CDC_FAILED)
+			daemon_cdc_failed(d, cdc);
+		daemon_cdc_arm(d, cdc);
+	}
+}
+
+static void daemon_status(struct acdc_daemon *d, struct acdc_client *client)
+{
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < d->num_cdcs; i++) {
+		struct cdc_ctx *cdc = &d->cdcs[i];
+
+		if (cdc->state == CDC_BACKOFF)
+			daemon_reply(client, "cdc %s:%s %s %s: %s, "
+				     "retry in %ld ms\n", cdc->addr, cdc->port,
+				     cdc_state_str(cdc->state), cdc->errstr,
+				     strerror(cdc->err),
+				     timespec_diff_ms(&now, &cdc->t_next));
+		else
+			daemon_reply(client, "cdc %s:%s %s %s\n",
+				     cdc->addr, cdc->port,
+				     cdc_state_str(cdc->state),
+				     cdc->nqn ? cdc->nqn : "-");
+	}
+	daemon_reply(client, "ok %d records\n", d->num_recs);
+}
+
+/*
+ * Process one request line from @client. Returns 1 if the request is
+ * still in progress.
+ */
+static int daemon_request(struct acdc_daemon *d, struct acdc_client *client,
+			  char *line)
+{
+	struct port_rec *recs;
+	char *verb, *arg, *save;
+	int num = 0, dereg;
+
+	verb = strtok_r(line, " \t\r", &save);
+	if (!verb)
+		return 0;
+	if (!strcmp(verb, "status")) {
+		daemon_status(d, client);
+		return 0;
+	}
+	if (!strcmp(verb, "register"))
+		dereg = 0;
+	else if (!strcmp(verb, "deregister"))
+		dereg = 1;
+	else {
+		daemon_reply(client, "error unknown request '%s'\n", verb);
+		return 0;
+	}
+	/* Each record is at least 'tcp,x' plus a separator */
+	recs = calloc(strlen(save ? save : "") / 6 + 1, sizeof(*recs));
+	if (!recs) {
+		daemon_reply(client, "error %s\n", strerror(ENOMEM));
+		return 0;
+	}
+	while ((arg = strtok_r(NULL, " \t\r", &save))) {
+		if (port_rec_parse(&recs[num], arg) < 0) {
+			daemon_reply(client, "error invalid record '%s'\n",
+				     arg);
+			free(recs);
+			return 0;
+		}
+		num++;
+	}
+	memset(&d->pd, 0, sizeof(d->pd));
+	d->pd.add = calloc(num + 1, sizeof(*recs));
+	d->pd.del = calloc(num + 1, sizeof(*recs));
+	if (!d->pd.add || !d->pd.del ||
+	    (!dereg && daemon_add_recs(d, recs, num) < 0)) {
+		daemon_reply(client, "error %s\n", strerror(ENOMEM));
+		port_delta_free(&d->pd);
+		free(recs);
+		return 0;
+	}
+	if (dereg)
+		daemon_del_recs(d, recs, num);
+	free(recs);
+	if (!d->pd.num_add && !d->pd.num_del) {
+		daemon_reply(client, "ok 0 records changed\n");
+		port_delta_free(&d->pd);
+		return 0;
+	}
+	d->active = client;
+	daemon_start_delta(d);
+	return d->busy;
+}
+
+/*
+ * Process buffered requests until one has to wait for the CDCs.
+ */
+static void daemon_next_request(struct acdc_daemon *d)
+{
+	struct acdc_client *client;
+	char *nl;
+
+	for (client = d->clients; client && !d->busy; client = client->next) {
+		while (!d->busy &&
+		       (nl = memchr(client->buf, '\n', client->len))) {
+			size_t len = nl - client->buf + 1;
+
+			*nl = '\0';
+			daemon_request(d, client, client->buf);
+			memmove(client->buf, client->buf + len,
+				client->len - len);
+			client->len -= len;
+		}
+	}
+}
+
+static void daemon_client_close(struct acdc_daemon *d,
+				struct acdc_client *client)
+{
+	struct acdc_client **pc;
+
+	for (pc = &d->clients; *pc; pc = &(*pc)->next) {
+		if (*pc == client) {
+			*pc = client->next;
+			break;
+		}
+	}
+	/* A request in progress completes without reply */
+	if (d->active == client)
+		d->active = NULL;
+	epoll_ctl(d->efd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client);
+}
+
+static void daemon_client_input(struct acdc_daemon *d,
+				struct acdc_client *client)
+{
+	ssize_t len;
+
+	for (;;) {
+		if (client->len == sizeof(client->buf)) {
+			daemon_reply(client, "error request too long\n");
+			daemon_client_close(d, client);
+			return;
+		}
+		len = recv(client->fd, client->buf + client->len,
+			   sizeof(client->buf) - client->len, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len <= 0) {
+			daemon_client_close(d, client);
+			return;
+		}
+		client->len += len;
+	}
+	daemon_next_request(d);
+}
+
+static void daemon_accept(struct acdc_daemon *d)
+{
+	struct acdc_client *client;
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept4(d->lfd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		if (epoll_ctl(d->efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(fd);
+			free(client);
+			continue;
+		}
+		client->next = d->clients;
+		d->clients = client;
+	}
+}
+
+static int daemon_listen(struct acdc_daemon *d)
+{
+	struct sockaddr_un sun;
+	struct epoll_event ev;
+	mode_t mask;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(d->ctrl_path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", d->ctrl_path);
+		return -1;
+	}
+	strcpy(sun.sun_path, d->ctrl_path);
+	d->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (d->lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(d->ctrl_path);
+	/* Only root may (de-)register */
+	mask = umask(0077);
+	if (bind(d->lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		umask(mask);
+		perror("bind");
+		return -1;
+	}
+	umask(mask);
+	if (listen(d->lfd, 16) < 0) {
+		perror("listen");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &d->lfd;
+	return epoll_ctl(d->efd, EPOLL_CTL_ADD, d->lfd, &ev);
+}
+
+static int daemon_signals(struct acdc_daemon *d)
+{
+	struct epoll_event ev;
+	sigset_t mask;
+
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		perror("sigprocmask");
+		return -1;
+	}
+	d->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (d->sigfd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &d->sigfd;
+	return epoll_ctl(d->efd, EPOLL_CTL_ADD, d->sigfd, &ev);
+}
+
+/*
+ * Keep sessions to all CDCs in @cdcs open, registering @recs and any
+ * records requested on the control socket @ctrl_path.
+ */
+int acdc_daemon(const char *ctrl_path, struct cdc_ctx *cdcs, int num_cdcs,
+		struct port_rec *recs, int num_recs,
+		struct kickstart_opts *opts)
+{
+	struct acdc_daemon d = {
+		.lfd = -1,
+		.sigfd = -1,
+		.ctrl_path = ctrl_path,
+		.running = 1,
+		.cdcs = cdcs,
+		.num_cdcs = num_cdcs,
+		.opts = opts,
+		.recs = recs,
+		.num_recs = num_recs,
+		.max_recs = num_recs,
+	};
+	struct epoll_event ev, events[64];
+	int i, n, ret = 1;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (wheel_init(&d.wheel, daemon_timeout, &d) < 0)
+		return 1;
+	d.efd = epoll_create1(EPOLL_CLOEXEC);
+	if (d.efd < 0) {
+		perror("epoll_create1");
+		wheel_free(&d.wheel);
+		return 1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &d.wheel;
+	if (epoll_ctl(d.efd, EPOLL_CTL_ADD, d.wheel.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		goto out;
+	}
+	if (daemon_signals(&d) < 0 || daemon_listen(&d) < 0)
+		goto out;
+	printf("Listening on %s\n", ctrl_path);
+
+	icreq_init(&d.icreq, opts->digest);
+	for (i = 0; i < num_cdcs; i++) {
+		cdcs[i].digest = opts->digest;
+		cdcs[i].backoff_ms = ACDC_BACKOFF_MIN_MS;
+		cdcs[i].nqn = NULL;
+		cdcs[i].kdreq_buf = NULL;
+		memset(&cdcs[i].timer, 0, sizeof(cdcs[i].timer));
+		daemon_connect(&d, &cdcs[i]);
+		daemon_cdc_progress(&d, &cdcs[i]);
+		daemon_cdc_arm(&d, &cdcs[i]);
+	}
+
+	while (d.running) {
+		n = epoll_wait(d.efd, events, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+			uint32_t ev = events[i].events;
+			struct cdc_ctx *cdc = ptr;
+
+			if (ptr == &d.wheel) {
+				wheel_event(&d.wheel);
+			} else if (ptr == &d.lfd) {
+				daemon_accept(&d);
+			} else if (ptr == &d.sigfd) {
+				d.running = 0;
+			} else if (cdc >= cdcs && cdc < cdcs + num_cdcs) {
+				/* Events for closed sockets may still be queued */
+				if (cdc->state == CDC_BACKOFF)
+					continue;
+				if (cdc->state == CDC_CONNECTING) {
+					cdc_handle_connect(d.efd, cdc,
+						(const char *)&d.icreq);
+				} else {
+					if (ev & EPOLLOUT)
+						cdc_handle_output(d.efd, cdc);
+					if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))
+						daemon_cdc_input(&d, cdc);
+				}
+				daemon_cdc_progress(&d, cdc);
+				daemon_cdc_arm(&d, cdc);
+			} else {
+				daemon_client_input(&d, ptr);
+			}
+		}
+	}
+	printf("Shutting down\n");
+	ret = 0;
+out:
+	while (d.clients)
+		daemon_client_close(&d, d.clients);
+	for (i = 0; i < num_cdcs; i++) {
+		struct cdc_ctx *cdc = &cdcs[i];
+
+		if (cdc->sfd >= 0)
+			close(cdc->sfd);
+		he_free(&cdc->hc);
+		pdu_buf_free(&cdc->pb);
+		free(cdc->kdreq_buf);
+		free(cdc->nqn);
+	}
+	if (d.lfd >= 0) {
+		close(d.lfd);
+		unlink(ctrl_path);
+	}
+	if (d.sigfd >= 0)
+		close(d.sigfd);
+	close(d.efd);
+	wheel_free(&d.wheel);
+	free(d.recs);
+	return ret;
+}
+
+/*
+ * Send @cmd to the daemon listening on @ctrl_path and print the reply.
+ */
+int acdc_ctrl(const char *ctrl_path, const char *cmd)
+{
+	struct sockaddr_un sun;
+	char buf[4096];
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, ctrl_path, sizeof(sun.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "connect to %s: %s\n",
+			ctrl_path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	if (write(fd, cmd, strlen(cmd)) < 0 || write(fd, "\n", 1) < 0) {
+		perror("write");
+		close(fd);
+		return 1;
+	}
+	for (;;) {
+		char *nl;
+
+		while ((nl = memchr(buf, '\n', len))) {
+			*nl = '\0';
+			printf("%s\n", buf);
+			if (!strncmp(buf, "ok", 2) ||
+			    !strncmp(buf, "error", 5)) {
+				close(fd);
+				return strncmp(buf, "ok", 2) ? 1 : 0;
+			}
+			len -= nl - buf + 1;
+			memmove(buf, nl + 1, len);
+		}
+		if (len == sizeof(buf))
+			len = 0;
+		ret = read(fd, buf + len, sizeof(buf) - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	fprintf(stderr, "Connection to %s closed\n", ctrl_path);
+	close(fd);
+	return 1;
+}
@@ -0,0 +1,547 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * dh.c - finite field Diffie-Hellman for DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Key pairs and shared secrets of the RFC 7919 FFDHE groups that
+ * DH-HMAC-CHAP negotiates. Modular exponentiation uses Montgomery
+ * multiplication on 64 bit limbs with a fixed 4 bit window, and
+ * selects the table entry of each window without branching on the
+ * private exponent. The private exponents are twice as long as the
+ * security strength of the group (RFC 7919, section 5.2), rounded
+ * up to whole limbs.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/random.h>
+#include <linux/types.h>
+
+#include "nvme.h"
+#include "dh.h"
+
+static const char ffdhe2048_p[] =
+	"FFFFFFFFFFFFFFFFADF85458A2BB4A9AAFDC5620273D3CF1D8B9C583CE2D3695"
+	"A9E13641146433FBCC939DCE249B3EF97D2FE363630C75D8F681B202AEC4617A"
+	"D3DF1ED5D5FD65612433F51F5F066ED0856365553DED1AF3B557135E7F57C935"
+	"984F0C70E0E68B77E2A689DAF3EFE8721DF158A136ADE73530ACCA4F483A797A"
+	"BC0AB182B324FB61D108A94BB2C8E3FBB96ADAB760D7F4681D4F42A3DE394DF4"
+	"AE56EDE76372BB190B07A7C8EE0A6D709E02FCE1CDF7E2ECC03404CD28342F61"
+	"9172FE9CE98583FF8E4F1232EEF28183C3FE3B1B4C6FAD733BB5FCBC2EC22005"
+	"C58EF1837D1683B2C6F34A26C1B2EFFA886B423861285C97FFFFFFFFFFFFFFFF";
+
+static const char ffdhe3072_p[] =
+	"FFFFFFFFFFFFFFFFADF85458A2BB4A9AAFDC5620273D3CF1D8B9C583CE2D3695"
+	"A9E13641146433FBCC939DCE249B3EF97D2FE363630C75D8F681B202AEC4617A"
+	"D3DF1ED5D5FD65612433F51F5F066ED0856365553DED1AF3B557135E7F57C935"
+	"984F0C70E0E68B77E2A689DAF3EFE8721DF158A136ADE73530ACCA4F483A797A"
+	"BC0AB182B324FB61D108A94BB2C8E3FBB96ADAB760D7F4681D4F42A3DE394DF4"
+	"AE56EDE76372BB190B07A7C8EE0A6D709E02FCE1CDF7E2ECC03404CD28342F61"
+	"9172FE9CE98583FF8E4F1232EEF28183C3FE3B1B4C6FAD733BB5FCBC2EC22005"
+	"C58EF1837D1683B2C6F34A26C1B2EFFA886B4238611FCFDCDE355B3B6519035B"
+	"BC34F4DEF99C023861B46FC9D6E6C9077AD91D2691F7F7EE598CB0FAC186D91C"
+	"AEFE130985139270B4130C93BC437944F4FD4452E2D74DD364F2E21E71F54BFF"
+	"5CAE82AB9C9DF69EE86D2BC522363A0DABC521979B0DEADA1DBF9A42D5C4484E"
+	"0ABCD06BFA53DDEF3C1B20EE3FD59D7C25E41D2B66C62E37FFFFFFFFFFFFFFFF";
+
+static const char ffdhe4096_p[] =
+	"FFFFFFFFFFFFFFFFADF85458A2BB4A9AAFDC5620273D3CF1D8B9C583CE2D3695"
+	"A9E13641146433FBCC939DCE249B3EF97D2FE363630C75D8F681B202AEC4617A"
+	"D3DF1ED5D5FD65612433F51F5F066ED0856365553DED1AF3B557135E7F57C935"
+	"984F0C70E0E68B77E2A689DAF3EFE8721DF158A136ADE73530ACCA4F483A797A"
+	"BC0AB182B324FB61D108A94BB2C8E3FBB96ADAB760D7F4681D4F42A3DE394DF4"
+	"AE56EDE76372BB190B07A7C8EE0A6D709E02FCE1CDF7E2ECC03404CD28342F61"
+	"9172FE9CE98583FF8E4F1232EEF28183C3FE3B1B4C6FAD733BB5FCBC2EC22005"
+	"C58EF1837D1683B2C6F34A26C1B2EFFA886B4238611FCFDCDE355B3B6519035B"
+	"BC34F4DEF99C023861B46FC9D6E6C9077AD91D2691F7F7EE598CB0FAC186D91C"
+	"AEFE130985139270B4130C93BC437944F4FD4452E2D74DD364F2E21E71F54BFF"
+	"5CAE82AB9C9DF69EE86D2BC522363A0DABC521979B0DEADA1DBF9A42D5C4484E"
+	"0ABCD06BFA53DDEF3C1B20EE3FD59D7C25E41D2B669E1EF16E6F52C3164DF4FB"
+	"7930E9E4E58857B6AC7D5F42D69F6D187763CF1D5503400487F55BA57E31CC7A"
+	"7135C886EFB4318AED6A1E012D9E6832A907600A918130C46DC778F971AD0038"
+	"092999A333CB8B7A1A1DB93D7140003C2A4ECEA9F98D0ACC0A8291CDCEC97DCF"
+	"8EC9B55A7F88A46B4DB5A851F44182E1C68A007E5E655F6AFFFFFFFFFFFFFFFF";
+
+static const char ffdhe6144_p[] =
+	"FFFFFFFFFFFFFFFFADF85458A2BB4A9AAFDC5620273D3CF1D8B9C583CE2D3695"
+	"A9E13641146433FBCC939DCE249B3EF97D2FE363630C75D8F681B202AEC4617A"
+	"D3DF1ED5D5FD65612433F51F5F066ED0856365553DED1AF3B557135E7F57C935"
+	"984F0C70E0E68B77E2A689DAF3EFE8721DF158A136ADE73530ACCA4F483A797A"
+	"BC0AB182B324FB61D108A94BB2C8E3FBB96ADAB760D7F4681D4F42A3DE394DF4"
+	"AE56EDE76372BB190B07A7C8EE0A6D709E02FCE1CDF7E2ECC03404CD28342F61"
+	"9172FE9CE98583FF8E4F1232EEF28183C3FE3B1B4C6FAD733BB5FCBC2EC22005"
+	"C58EF1837D1683B2C6F34A26C1B2EFFA886B4238611FCFDCDE355B3B6519035B"
+	"BC34F4DEF99C023861B46FC9D6E6C9077AD91D2691F7F7EE598CB0FAC186D91C"
+	"AEFE130985139270B4130C93BC437944F4FD4452E2D74DD364F2E21E71F54BFF"
+	"5CAE82AB9C9DF69EE86D2BC522363A0DABC521979B0DEADA1DBF9A42D5C4484E"
+	"0ABCD06BFA53DDEF3C1B20EE3FD59D7C25E41D2B669E1EF16E6F52C3164DF4FB"
+	"7930E9E4E58857B6AC7D5F42D69F6D187763CF1D5503400487F55BA57E31CC7A"
+	"7135C886EFB4318AED6A1E012D9E6832A907600A918130C46DC778F971AD0038"
+	"092999A333CB8B7A1A1DB93D7140003C2A4ECEA9F98D0ACC0A8291CDCEC97DCF"
+	"8EC9B55A7F88A46B4DB5A851F44182E1C68A007E5E0DD9020BFD64B645036C7A"
+	"4E677D2C38532A3A23BA4442CAF53EA63BB454329B7624C8917BDD64B1C0FD4C"
+	"B38E8C334C701C3ACDAD0657FCCFEC719B1F5C3E4E46041F388147FB4CFDB477"
+	"A52471F7A9A96910B855322EDB6340D8A00EF092350511E30ABEC1FFF9E3A26E"
+	"7FB29F8C183023C3587E38DA0077D9B4763E4E4B94B2BBC194C6651E77CAF992"
+	"EEAAC0232A281BF6B3A739C1226116820AE8DB5847A67CBEF9C9091B462D538C"
+	"D72B03746AE77F5E62292C311562A846505DC82DB854338AE49F5235C95B9117"
+	"8CCF2DD5CACEF403EC9D1810C6272B045B3B71F9DC6B80D63FDD4A8E9ADB1E69"
+	"62A69526D43161C1A41D570D7938DAD4A40E329CD0E40E65FFFFFFFFFFFFFFFF";
+
+static const char ffdhe8192_p[] =
+	"FFFFFFFFFFFFFFFFADF85458A2BB4A9AAFDC5620273D3CF1D8B9C583CE2D3695"
+	"A9E13641146433FBCC939DCE249B3EF97D2FE363630C75D8F681B202AEC4617A"
+	"D3DF1ED5D5FD65612433F51F5F066ED0856365553DED1AF3B557135E7F57C935"
+	"984F0C70E0E68B77E2A689DAF3EFE8721DF158A136ADE73530ACCA4F483A797A"
+	"BC0AB182B324FB61D108A94BB2C8E3FBB96ADAB760D7F4681D4F42A3DE394DF4"
+	"AE56EDE76372BB190B07A7C8EE0A6D709E02FCE1CDF7E2ECC03404CD28342F61"
+	"9172FE9CE98583FF8E4F1232EEF28183C3FE3B1B4C6FAD733BB5FCBC2EC22005"
+	"C58EF1837D1683B2C6F34A26C1B2EFFA886B4238611FCFDCDE355B3B6519035B"
+	"BC34F4DEF99C023861B46FC9D6E6C9077AD91D2691F7F7EE598CB0FAC186D91C"
+	"AEFE130985139270B4130C93BC437944F4FD4452E2D74DD364F2E21E71F54BFF"
+	"5CAE82AB9C9DF69EE86D2BC522363A0DABC521979B0DEADA1DBF9A42D5C4484E"
+	"0ABCD06BFA53DDEF3C1B20EE3FD59D7C25E41D2B669E1EF16E6F52C3164DF4FB"
+	"7930E9E4E58857B6AC7D5F42D69F6D187763CF1D5503400487F55BA57E31CC7A"
+	"7135C886EFB4318AED6A1E012D9E6832A907600A918130C46DC778F971AD0038"
+	"092999A333CB8B7A1A1DB93D7140003C2A4ECEA9F98D0ACC0A8291CDCEC97DCF"
+	"8EC9B55A7F88A46B4DB5A851F44182E1C68A007E5E0DD9020BFD64B645036C7A"
+	"4E677D2C38532A3A23BA4442CAF53EA63BB454329B7624C8917BDD64B1C0FD4C"
+	"B38E8C334C701C3ACDAD0657FCCFEC719B1F5C3E4E46041F388147FB4CFDB477"
+	"A52471F7A9A96910B855322EDB6340D8A00EF092350511E30ABEC1FFF9E3A26E"
+	"7FB29F8C183023C3587E38DA0077D9B4763E4E4B94B2BBC194C6651E77CAF992"
+	"EEAAC0232A281BF6B3A739C1226116820AE8DB5847A67CBEF9C9091B462D538C"
+	"D72B03746AE77F5E62292C311562A846505DC82DB854338AE49F5235C95B9117"
+	"8CCF2DD5CACEF403EC9D1810C6272B045B3B71F9DC6B80D63FDD4A8E9ADB1E69"
+	"62A69526D43161C1A41D570D7938DAD4A40E329CCFF46AAA36AD004CF600C838"
+	"1E425A31D951AE64FDB23FCEC9509D43687FEB69EDD1CC5E0B8CC3BDF64B10EF"
+	"86B63142A3AB8829555B2F747C932665CB2C0F1CC01BD70229388839D2AF05E4"
+	"54504AC78B7582822846C0BA35C35F5C59160CC046FD8251541FC68C9C86B022"
+	"BB7099876A460E7451A8A93109703FEE1C217E6C3826E52C51AA691E0E423CFC"
+	"99E9E31650C1217B624816CDAD9A95F9D5B8019488D9C0A0A1FE3075A577E231"
+	"83F81D4A3F2FA4571EFC8CE0BA8A4FE8B6855DFE72B0A66EDED2FBABFBE58A30"
+	"FAFABE1C5D71A87E2F741EF8C1FE86FEA6BBFDE530677F0D97D11D49F7A8443D"
+	"0822E506A9F4614E011E2A94838FF88CD68C8BB7C5C6424CFFFFFFFFFFFFFFFF";
+
+/**
+ * struct dh_group - FFDHE group prepared for Montgomery arithmetic
+ *
+ * @hex:           the prime, big endian hex digits
+ * @bits:          size of the prime
+ * @exp_bits:      size of the private exponents
+ * @limbs:         size of the prime in 64 bit limbs
+ * @ready:         the fields below are set up
+ * @p:             the prime
+ * @n0:            -p^-1 mod 2^64
+ * @one:           1 in Montgomery form, R mod p with R = 2^(64 limbs)
+ * @rr:            R^2 mod p, converts to Montgomery form
+ * @g:             the generator 2 in Montgomery form
+ */
+struct dh_group {
+	const char *hex;
+	int bits;
+	int exp_bits;
+	int limbs;
+	int ready;
+	__u64 p[DH_MAX_LIMBS];
+	__u64 n0;
+	__u64 one[DH_MAX_LIMBS];
+	__u64 rr[DH_MAX_LIMBS];
+	__u64 g[DH_MAX_LIMBS];
+};
+
+static struct dh_group dh_groups[DH_NUM_GROUPS] = {
+	[NVME_AUTH_DHGROUP_2048] = { ffdhe2048_p, 2048, 256 },
+	[NVME_AUTH_DHGROUP_3072] = { ffdhe3072_p, 3072, 320 },
+	[NVME_AUTH_DHGROUP_4096] = { ffdhe4096_p, 4096, 320 },
+	[NVME_AUTH_DHGROUP_6144] = { ffdhe6144_p, 6144, 384 },
+	[NVME_AUTH_DHGROUP_8192] = { ffdhe8192_p, 8192, 448 },
+};
+
+static pthread_mutex_t dh_group_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* @r = @a - @b over @n limbs; returns the borrow */
+static __u64 dh_sub(__u64 *r, const __u64 *a, const __u64 *b, int n)
+{
+	__u64 borrow = 0, x, y;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		x = a[i];
+		y = b[i];
+		r[i] = x - y - borrow;
+		borrow = (x < y) | ((x == y) & borrow);
+	}
+	return borrow;
+}
+
+/*
+ * @r = @a * @b / R mod p for @a, @b < p; @r may be @a or @b.
+ */
+static void dh_mont_mul(__u64 *r, const __u64 *a, const __u64 *b,
+			const struct dh_group *grp)
+{
+	__u64 t[DH_MAX_LIMBS + 2], m, c, mask;
+	unsigned __int128 uv;
+	int n = grp->limbs, i, j;
+
+	memset(t, 0, (n + 2) * sizeof(*t));
+	for (i = 0; i < n; i++) {
+		c = 0;
+		for (j = 0; j < n; j++) {
+			uv = (unsigned __int128)a[j] * b[i] + t[j] + c;
+			t[j] = uv;
+			c = uv >> 64;
+		}
+		uv = (unsigned __int128)t[n] + c;
+		t[n] = uv;
+		t[n + 1] = uv >> 64;
+
+		m = t[0] * grp->n0;
+		uv = (unsigned __int128)m * grp->p[0] + t[0];
+		c = uv >> 64;
+		for (j = 1; j < n; j++) {
+			uv = (unsigned __int128)m * grp->p[j] + t[j] + c;
+			t[j - 1] = uv;
+			c = uv >> 64;
+		}
+		uv = (unsigned __int128)t[n] + c;
+		t[n - 1] = uv;
+		t[n] = t[n + 1] + (__u64)(uv >> 64);
+	}
+	/* t < 2p; keep t - p unless it borrowed, without branching */
+	mask = -(__u64)(dh_sub(r, t, grp->p, n) & (t[n] == 0));
+	for (j = 0; j < n; j++)
+		r[j] = (t[j] & mask) | (r[j] & ~mask);
+}
+
+/*
+ * @r = @base ^ @exp, all in Montgomery form but @exp, which has
+ * @bits bits, a multiple of 4.
+ */
+static void dh_mont_exp(__u64 *r, const __u64 *base, const __u64 *exp,
+			int bits, const struct dh_group *grp)
+{
+	__u64 tbl[16][DH_MAX_LIMBS], sel[DH_MAX_LIMBS], mask;
+	size_t size = grp->limbs * sizeof(__u64);
+	int n = grp->limbs, bit, w, i, j;
+
+	memcpy(tbl[0], grp->one, size);
+	memcpy(tbl[1], base, size);
+	for (i = 2; i < 16; i++)
+		dh_mont_mul(tbl[i], tbl[i - 1], base, grp);
+	memcpy(r, grp->one, size);
+	for (bit = bits - 4; bit >= 0; bit -= 4) {
+		for (i = 0; i < 4; i++)
+			dh_mont_mul(r, r, r, grp);
+		w = (exp[bit / 64] >> (bit % 64)) & 0xf;
+		memset(sel, 0, size);
+		for (i = 0; i < 16; i++) {
+			mask = -(__u64)(i == w);
+			for (j = 0; j < n; j++)
+				sel[j] |= tbl[i][j] & mask;
+		}
+		dh_mont_mul(r, r, sel, grp);
+	}
+	memset(tbl, 0, sizeof(tbl));
+}
+
+/* Big endian @len bytes at @buf into @n limbs at @r */
+static void dh_from_bytes(__u64 *r, int n, const __u8 *buf, size_t len)
+{
+	size_t i;
+
+	memset(r, 0, n * sizeof(*r));
+	for (i = 0; i < len; i++)
+		r[i / 8] |= (__u64)buf[len - 1 - i] << (8 * (i % 8));
+}
+
+static void dh_to_bytes(__u8 *buf, size_t len, const __u64 *a)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[len - 1 - i] = a[i / 8] >> (8 * (i % 8));
+}
+
+/* Convert @a out of Montgomery form into @len big endian bytes */
+static void dh_mont_out(__u8 *buf, size_t len, const __u64 *a,
+			const struct dh_group *grp)
+{
+	__u64 one[DH_MAX_LIMBS] = { 1 }, r[DH_MAX_LIMBS];
+
+	dh_mont_mul(r, a, one, grp);
+	dh_to_bytes(buf, len, r);
+}
+
+static void dh_group_setup(struct dh_group *grp)
+{
+	__u64 zero[DH_MAX_LIMBS] = { 0 }, tmp[DH_MAX_LIMBS], carry;
+	const char *s;
+	int n, i, j, v;
+
+	n = grp->limbs = grp->bits / 64;
+	for (i = 0, s = grp->hex + strlen(grp->hex) - 1; s >= grp->hex;
+	     i++, s--) {
+		v = *s <= '9' ? *s - '0' : *s - 'A' + 10;
+		grp->p[i / 16] |= (__u64)v << (4 * (i % 16));
+	}
+	/* Newton iteration doubles the correct low bits of p^-1 */
+	grp->n0 = 1;
+	for (i = 0; i < 6; i++)
+		grp->n0 *= 2 - grp->p[0] * grp->n0;
+	grp->n0 = -grp->n0;
+	/* The top bit of p is set, so R mod p = R - p */
+	dh_sub(grp->one, zero, grp->p, n);
+	/* R^2 mod p by doubling R mod p another 64 * n times */
+	memcpy(grp->rr, grp->one, n * sizeof(__u64));
+	for (i = 0; i < 64 * n; i++) {
+		carry = grp->rr[n - 1] >> 63;
+		for (j = n - 1; j > 0; j--)
+			grp->rr[j] = grp->rr[j] << 1 | grp->rr[j - 1] >> 63;
+		grp->rr[0] <<= 1;
+		if (carry || !dh_sub(tmp, grp->rr, grp->p, n))
+			dh_sub(grp->rr, grp->rr, grp->p, n);
+		if (i == 0)
+			memcpy(grp->g, grp->rr, n * sizeof(__u64));
+	}
+}
+
+static struct dh_group *dh_group(int group)
+{
+	struct dh_group *grp;
+
+	if (group <= NVME_AUTH_DHGROUP_NULL || group >= DH_NUM_GROUPS)
+		return NULL;
+	grp = &dh_groups[group];
+	if (__atomic_load_n(&grp->ready, __ATOMIC_ACQUIRE))
+		return grp;
+	pthread_mutex_lock(&dh_group_lock);
+	if (!grp->ready) {
+		dh_group_setup(grp);
+		__atomic_store_n(&grp->ready, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dh_group_lock);
+	return grp;
+}
+
+/* Size of the public values of @group in bytes, 0 if not supported */
+size_t dh_len(int group)
+{
+	if (group <= NVME_AUTH_DHGROUP_NULL || group >= DH_NUM_GROUPS)
+		return 0;
+	return dh_groups[group].bits / 8;
+}
+
+/* Generate a key pair of @group, with one reference held */
+struct dh_key *dh_key_new(int group)
+{
+	struct dh_group *grp = dh_group(group);
+	__u64 r[DH_MAX_LIMBS];
+	struct dh_key *key;
+	size_t len;
+
+	if (!grp)
+		return NULL;
+	key = calloc(1, sizeof(*key));
+	if (!key)
+		return NULL;
+	len = grp->exp_bits / 8;
+	if (getrandom(key->x, len, 0) != len) {
+		free(key);
+		return NULL;
+	}
+	/* Exponents of full length, so the time taken does not vary */
+	key->x[grp->exp_bits / 64 - 1] |= 1ULL << 63;
+	key->group = group;
+	key->refs = 1;
+	dh_mont_exp(r, grp->g, key->x, grp->exp_bits, grp);
+	dh_mont_out(key->pub, grp->bits / 8, r, grp);
+	return key;
+}
+
+void dh_key_put(struct dh_key *key)
+{
+	if (!key || __atomic_sub_fetch(&key->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	memset(key->x, 0, sizeof(key->x));
+	free(key);
+}
+
+/*
+ * Compute the secret shared with the peer whose public value is the
+ * @len bytes at @peer, storing dh_len() bytes at @out.
+ * Returns 0, or -EINVAL if the public value is not within 1 < y < p - 1.
+ */
+int dh_shared(struct dh_key *key, const __u8 *peer, size_t len, __u8 *out)
+{
+	struct dh_group *grp = dh_group(key->group);
+	__u64 y[DH_MAX_LIMBS], r[DH_MAX_LIMBS], pm1[DH_MAX_LIMBS];
+	__u64 one[DH_MAX_LIMBS] = { 1 };
+	int n = grp->limbs, i;
+	__u64 high = 0;
+
+	if (len > grp->bits / 8)
+		return -EINVAL;
+	dh_from_bytes(y, n, peer, len);
+	for (i = 1; i < n; i++)
+		high |= y[i];
+	dh_sub(pm1, grp->p, one, n);
+	if ((!high && y[0] < 2) || !dh_sub(r, y, pm1, n))
+		return -EINVAL;
+	dh_mont_mul(y, y, grp->rr, grp);
+	dh_mont_exp(r, y, key->x, grp->exp_bits, grp);
+	dh_mont_out(out, grp->bits / 8, r, grp);
+	memset(r, 0, sizeof(r));
+	return 0;
+}
+
+static long dh_ms_since(struct timespec *t, struct timespec *now)
+{
+	return (now->tv_sec - t->tv_sec) * 1000 +
+		(now->tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* Keep @depth keys ready for each group asked for */
+static void *dh_pool_worker(void *arg)
+{
+	struct dh_pool *pool = arg;
+	struct dh_pool_group *g;
+	struct dh_key *key;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running) {
+		g = NULL;
+		for (i = 0; i < DH_NUM_GROUPS && !g; i++) {
+			if (pool->groups[i].active &&
+			    pool->groups[i].num_ready < pool->depth)
+				g = &pool->groups[i];
+		}
+		if (!g) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		key = dh_key_new(g - pool->groups);
+		pthread_mutex_lock(&pool->lock);
+		if (!key) {
+			/* Keys are generated when needed instead */
+			g->active = 0;
+			continue;
+		}
+		key->next = g->ready;
+		g->ready = key;
+		g->num_ready++;
+		pool->num_generated++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Set up @pool to hand out each key to up to @max_uses sessions
+ * within @max_age_ms, keeping @depth keys of each group in use ready.
+ * Returns 0 or a negative errno.
+ */
+int dh_pool_start(struct dh_pool *pool, int depth, unsigned int max_uses,
+		  unsigned int max_age_ms)
+{
+	int ret;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->depth = depth;
+	pool->max_uses = max_uses;
+	pool->max_age_ms = max_age_ms;
+	if (!depth)
+		return 0;
+	pool->running = 1;
+	ret = pthread_create(&pool->thread, NULL, dh_pool_worker, pool);
+	if (ret) {
+		pool->running = 0;
+		return -ret;
+	}
+	return 0;
+}
+
+void dh_pool_stop(struct dh_pool *pool)
+{
+	struct dh_pool_group *g;
+	struct dh_key *key;
+	int i, running;
+
+	pthread_mutex_lock(&pool->lock);
+	running = pool->running;
+	pool->running = 0;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	if (running)
+		pthread_join(pool->thread, NULL);
+	for (i = 0; i < DH_NUM_GROUPS; i++) {
+		g = &pool->groups[i];
+		dh_key_put(g->cur);
+		while ((key = g->ready)) {
+			g->ready = key->next;
+			dh_key_put(key);
+		}
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Key pair of @group for a new session, with a reference held for
+ * the session. Returns NULL if the group is not supported or no key
+ * could be generated.
+ */
+struct dh_key *dh_pool_get(struct dh_pool *pool, int group)
+{
+	struct dh_pool_group *g;
+	struct dh_key *key, *old;
+	struct timespec now;
+
+	if (!dh_len(group))
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&pool->lock);
+	g = &pool->groups[group];
+	pool->num_gets++;
+	key = g->cur;
+	if (key && key->uses < pool->max_uses &&
+	    dh_ms_since(&key->born, &now) < pool->max_age_ms) {
+		pool->num_reused++;
+		goto out;
+	}
+	if (!g->active && pool->running) {
+		g->active = 1;
+		pthread_cond_signal(&pool->cond);
+	}
+	key = g->ready;
+	if (key) {
+		g->ready = key->next;
+		g->num_ready--;
+		pthread_cond_signal(&pool->cond);
+	} else {
+		pool->num_missed++;
+		pthread_mutex_unlock(&pool->lock);
+		key = dh_key_new(group);
+		if (!key)
+			return NULL;
+		pthread_mutex_lock(&pool->lock);
+	}
+	/* The age of a key counts from its first session */
+	key->born = now;
+	old = g->cur;
+	g->cur = key;
+	if (old)
+		dh_key_put(old);
+out:
+	key->uses++;
+	__atomic_add_fetch(&key->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+	return key;
+}
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * dh.h - finite field Diffie-Hellman for DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _DH_H
+#define _DH_H
+
+#include <pthread.h>
+#include <time.h>
+#include <linux/types.h>
+
+/* Largest group, in 64 bit limbs and in bytes of a public value */
+#define DH_MAX_BITS		8192
+#define DH_MAX_LIMBS		(DH_MAX_BITS / 64)
+#define DH_MAX_BYTES		(DH_MAX_BITS / 8)
+
+/* Number of NVME_AUTH_DHGROUP_* values, NULL group included */
+#define DH_NUM_GROUPS		6
+
+/* Key pairs kept ready per group by the pool */
+#define DH_POOL_DEPTH		4
+
+/**
+ * struct dh_key - key pair of an FFDHE group
+ *
+ * @group:         NVME_AUTH_DHGROUP_* of the key
+ * @refs:          references held by the pool and by sessions
+ * @uses:          number of sessions the key was handed out to
+ * @born:          time the key was first handed out
+ * @x:             private exponent, little endian limbs
+ * @pub:           public value g^x mod p, big endian, padded to the
+ *                 group size
+ * @next:          next key ready in the pool
+ */
+struct dh_key {
+	int group;
+	int refs;
+	unsigned int uses;
+	struct timespec born;
+	__u64 x[DH_MAX_LIMBS];
+	__u8 pub[DH_MAX_BYTES];
+	struct dh_key *next;
+};
+
+/**
+ * struct dh_pool_group - key pairs of one group
+ *
+ * @active:        keys of the group were asked for, so the pool keeps
+ *                 some ready
+ * @cur:           key handed out to new sessions, NULL if none
+ * @ready:         keys generated in advance
+ * @num_ready:     number of keys in @ready
+ */
+struct dh_pool_group {
+	int active;
+	struct dh_key *cur;
+	struct dh_key *ready;
+	int num_ready;
+};
+
+/**
+ * struct dh_pool - key pairs shared by the sessions of a host or CDC
+ *
+ * @lock:          protects the groups and the counters
+ * @cond:          signalled when a group runs low on keys or the pool
+ *                 is stopped
+ * @thread:        generates the keys in advance
+ * @running:       @thread was started and not asked to stop
+ * @depth:         keys kept ready per group, 0 to generate them when
+ *                 needed
+ * @max_uses:      sessions a key is handed out to at most
+ * @max_age_ms:    time after which a key is no longer handed out
+ * @groups:        key pairs, indexed by NVME_AUTH_DHGROUP_*
+ * @num_gets:      number of keys handed out
+ * @num_reused:    number of times a key was handed out again
+ * @num_generated: number of keys generated in advance
+ * @num_missed:    number of keys generated when needed, as none was
+ *                 ready
+ *
+ * Generating a key pair takes a modular exponentiation as expensive
+ * as computing the shared secret, so the pool generates them in the
+ * background. A key is handed out to up to @max_uses sessions within
+ * @max_age_ms; reusing a key trades forward secrecy between these
+ * sessions for half of the exponentiations, while each session still
+ * has its own challenge and thus its own response.
+ */
+struct dh_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int depth;
+	unsigned int max_uses;
+	unsigned int max_age_ms;
+	struct dh_pool_group groups[DH_NUM_GROUPS];
+	unsigned long num_gets;
+	unsigned long num_reused;
+	unsigned long num_generated;
+	unsigned long num_missed;
+};
+
+size_t dh_len(int group);
+struct dh_key *dh_key_new(int group);
+void dh_key_put(struct dh_key *key);
+int dh_shared(struct dh_key *key, const __u8 *peer, size_t len, __u8 *out);
+
+int dh_pool_start(struct dh_pool *pool, int depth, unsigned int max_uses,
+		  unsigned int max_age_ms);
+void dh_pool_stop(struct dh_pool *pool);
+struct dh_key *dh_pool_get(struct dh_pool *pool, int group);
+
+#endif /* _DH_H */
@@ -0,0 +1,258 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * disclog.c - serialized discovery log page
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * The discovery log page is serialized once and then shared by all
+ * Get Log Page responses, which only add references to it. Hosts
+ * poll the log page far more often than DDCs change the registry,
+ * and each registry change only rewrites the entry slot it affects
+ * and the header, so the cost of an update does not depend on the
+ * number of records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "disclog.h"
+
+static void disc_log_fill_entry(struct nvmf_disc_rsp_page_entry *e,
+				struct port_rec *rec, const char *subnqn)
+{
+	memset(e, 0, sizeof(*e));
+	e->trtype = rec->trtype;
+	e->adrfam = rec->adrfam;
+	/* DDCs register their discovery controller ports */
+	e->subtype = NVME_NQN_DISC;
+	e->treq = NVMF_TREQ_NOT_SPECIFIED;
+	e->portid = htole16(rec->portid < 0 ? 0 : rec->portid);
+	e->cntlid = htole16(NVME_CNTLID_DYNAMIC);
+	e->asqsz = htole16(NVME_AQ_DEPTH);
+	memcpy(e->trsvcid, rec->trsvcid, sizeof(e->trsvcid));
+	memcpy(e->traddr, rec->traddr, sizeof(e->traddr));
+	strncpy(e->subnqn, subnqn, sizeof(e->subnqn) - 1);
+}
+
+/* Room for the header and @num_recs entries, plus some headroom */
+static size_t disc_log_size(int num_recs)
+{
+	size_t slots = 16;
+
+	while (slots < (size_t)num_recs + 1)
+		slots <<= 1;
+	return slots * DISC_LOG_SLOT;
+}
+
+/*
+ * Publish the generation of @reg in the header. The entries are
+ * written first, and genctr is stored last and atomically, so a
+ * reader seeing the new genctr also sees the new entries.
+ */
+static void disc_log_set_hdr(struct disc_log *log, struct registry *reg)
+{
+	struct nvmf_disc_rsp_page_hdr *hdr =
+		(struct nvmf_disc_rsp_page_hdr *)log->data;
+
+	log->genctr = reg->genctr;
+	log->len = (reg->num_recs + 1) * DISC_LOG_SLOT;
+	log->has_ddgst = 0;
+	hdr->numrec = htole64(reg->num_recs);
+	__atomic_store_n(&hdr->genctr, htole64(reg->genctr), __ATOMIC_RELEASE);
+}
+
+/*
+ * Serialize the records of @reg. The returned log page holds one
+ * reference. Returns NULL if out of memory.
+ */
+struct disc_log *disc_log_build(struct registry *reg, const char *subnqn)
+{
+	struct nvmf_disc_rsp_page_hdr *hdr;
+	struct disc_log *log;
+	size_t size = disc_log_size(reg->num_recs);
+	int i;
+
+	log = calloc(1, sizeof(*log) + size);
+	if (!log)
+		return NULL;
+	log->refs = 1;
+	log->subnqn = subnqn;
+	log->size = size;
+	log->data = (char *)(log + 1);
+	hdr = (struct nvmf_disc_rsp_page_hdr *)log->data;
+	for (i = 0; i < reg->num_recs; i++)
+		disc_log_fill_entry(&hdr->entries[i], &reg->entries[i].rec,
+				    subnqn);
+	disc_log_set_hdr(log, reg);
+	return log;
+}
+
+/*
+ * Wrap the log page of @reg serialized at @data, with room for @size
+ * bytes, as mapped from a registry snapshot. The mapping has to be
+ * private, so patches are copied on write and never reach the file,
+ * and has to outlive the log page. Returns NULL if out of memory.
+ */
+struct disc_log *disc_log_map(char *data, size_t size, struct registry *reg,
+			      const char *subnqn)
+{
+	struct disc_log *log;
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return NULL;
+	log->refs = 1;
+	log->subnqn = subnqn;
+	log->genctr = reg->genctr;
+	log->len = (reg->num_recs + 1) * DISC_LOG_SLOT;
+	log->size = size;
+	log->mapped = 1;
+	log->data = data;
+	return log;
+}
+
+/*
+ * Record slot @slot as changed, extending or joining the adjacent
+ * ranges; once all ranges are in use they are collapsed into one.
+ */
+static void disc_log_mark_dirty(struct disc_log *log, __u32 slot)
+{
+	struct disc_log_range *r, *left = NULL, *right = NULL;
+	int i;
+
+	for (i = 0; i < log->num_dirty; i++) {
+		r = &log->dirty[i];
+		if (slot >= r->start && slot < r->end)
+			return;
+		if (r->end == slot)
+			left = r;
+		else if (r->start == slot + 1)
+			right = r;
+	}
+	if (left && right) {
+		left->end = right->end;
+		*right = log->dirty[--log->num_dirty];
+	} else if (left) {
+		left->end++;
+	} else if (right) {
+		right->start--;
+	} else if (log->num_dirty < DISC_LOG_MAX_DIRTY) {
+		r = &log->dirty[log->num_dirty++];
+		r->start = slot;
+		r->end = slot + 1;
+	} else {
+		r = &log->dirty[0];
+		for (i = 1; i < log->num_dirty; i++) {
+			if (log->dirty[i].start < r->start)
+				r->start = log->dirty[i].start;
+			if (log->dirty[i].end > r->end)
+				r->end = log->dirty[i].end;
+		}
+		if (slot < r->start)
+			r->start = slot;
+		if (slot >= r->end)
+			r->end = slot + 1;
+		log->num_dirty = 1;
+	}
+}
+
+void disc_log_clear_dirty(struct disc_log *log)
+{
+	log->num_dirty = 0;
+}
+
+/*
+ * Make @*logp writable with room for the records of @reg, replacing
+ * it by a copy if it is pinned or has to grow while referenced.
+ */
+static int disc_log_prepare(struct disc_log **logp, struct registry *reg)
+{
+	struct disc_log *log = *logp, *new;
+	size_t len = (reg->num_recs + 1) * DISC_LOG_SLOT, size = log->size;
+
+	int pins = __atomic_load_n(&log->pins, __ATOMIC_ACQUIRE);
+
+	if (!pins && len <= log->size)
+		return 0;
+	while (size < len)
+		size <<= 1;
+	if (!pins && !log->mapped &&
+	    __atomic_load_n(&log->refs, __ATOMIC_ACQUIRE) == 1) {
+		new = realloc(log, sizeof(*log) + size);
+		if (!new)
+			return -ENOMEM;
+		new->size = size;
+		new->data = (char *)(new + 1);
+		*logp = new;
+		return 0;
+	}
+	/* Responses in flight keep the old copy */
+	new = malloc(sizeof(*log) + size);
+	if (!new)
+		return -ENOMEM;
+	memcpy(new, log, sizeof(*log));
+	new->data = (char *)(new + 1);
+	memcpy(new->data, log->data, log->len);
+	new->refs = 1;
+	new->pins = 0;
+	new->mapped = 0;
+	new->size = size;
+	disc_log_put(log);
+	*logp = new;
+	return 0;
+}
+
+/*
+ * Patch the log page after registry entry @idx of @reg changed, or
+ * was removed if @idx is beyond the last entry. Only the entry slot
+ * and the header are rewritten; @*logp may be replaced.
+ * Returns 0 or -ENOMEM.
+ */
+int disc_log_update(struct disc_log **logp, struct registry *reg, int idx)
+{
+	struct nvmf_disc_rsp_page_hdr *hdr;
+	struct disc_log *log;
+	int ret;
+
+	ret = disc_log_prepare(logp, reg);
+	if (ret < 0)
+		return ret;
+	log = *logp;
+	hdr = (struct nvmf_disc_rsp_page_hdr *)log->data;
+	if (idx < reg->num_recs) {
+		disc_log_fill_entry(&hdr->entries[idx], &reg->entries[idx].rec,
+				    log->subnqn);
+		disc_log_mark_dirty(log, idx + 1);
+	}
+	disc_log_set_hdr(log, reg);
+	disc_log_mark_dirty(log, 0);
+	return 0;
+}
+
+/*
+ * References and pins are taken and dropped by the I/O threads, and
+ * checked by the registry owner under the server log lock.
+ */
+struct disc_log *disc_log_get(struct disc_log *log)
+{
+	__atomic_add_fetch(&log->refs, 1, __ATOMIC_RELAXED);
+	return log;
+}
+
+void disc_log_put(struct disc_log *log)
+{
+	if (log && !__atomic_sub_fetch(&log->refs, 1, __ATOMIC_ACQ_REL))
+		free(log);
+}
+
+void disc_log_pin(struct disc_log *log)
+{
+	__atomic_add_fetch(&log->pins, 1, __ATOMIC_ACQUIRE);
+}
+
+void disc_log_unpin(struct disc_log *log)
+{
+	__atomic_sub_fetch(&log->pins, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * disclog.h - serialized discovery log page
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _DISCLOG_H
+#define _DISCLOG_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "nvme.h"
+#include "registry.h"
+
+/* Number of records in the log page benchmark */
+#define DISC_LOG_BENCH_RECS	(4 * MAX_DISC_LOGS)
+
+/* Number of Get Log Page commands in the log page benchmark */
+#define DISC_LOG_BENCH_REQS	10000
+
+/*
+ * The log page header and the entries have the same size, so the
+ * log page is an array of slots: slot 0 is the header, and slot
+ * n + 1 holds registry entry n.
+ */
+#define DISC_LOG_SLOT		sizeof(struct nvmf_disc_rsp_page_entry)
+
+/* Dirty ranges tracked before they are merged into one */
+#define DISC_LOG_MAX_DIRTY	16
+
+/**
+ * struct disc_log_range - range of log page slots
+ *
+ * @start:         first slot
+ * @end:           slot after the last slot
+ */
+struct disc_log_range {
+	__u32 start;
+	__u32 end;
+};
+
+/**
+ * struct disc_log - discovery log page in wire format
+ *
+ * @refs:          references held by the server and by responses
+ *                 still being sent
+ * @pins:          references of responses whose data digest has been
+ *                 computed already; the data must not change until
+ *                 they are sent
+ * @genctr:        registry generation the log page reflects
+ * @subnqn:        subsystem NQN of the entries
+ * @len:           length of @data in use
+ * @size:          allocated length of @data
+ * @ddgst:         data digest of the complete log page, valid if
+ *                 @has_ddgst is set
+ * @has_ddgst:     @ddgst has been computed
+ * @dirty:         slot ranges changed since the last
+ *                 disc_log_clear_dirty(), not overlapping
+ * @num_dirty:     number of ranges in @dirty
+ * @mapped:        @data lies in a private mapping of a registry
+ *                 snapshot instead of following the structure
+ * @data:          nvmf_disc_rsp_page_hdr followed by one
+ *                 nvmf_disc_rsp_page_entry per record
+ *
+ * Registry changes are patched into the log page in place, slot by
+ * slot, in the same order as the registry entries. Responses still
+ * being sent may thus see a newer generation for some entries,
+ * which hosts detect by reading genctr again; only pinned log pages
+ * are copied before being changed.
+ */
+struct disc_log {
+	int refs;
+	int pins;
+	unsigned long genctr;
+	const char *subnqn;
+	size_t len;
+	size_t size;
+	__u32 ddgst;
+	int has_ddgst;
+	struct disc_log_range dirty[DISC_LOG_MAX_DIRTY];
+	int num_dirty;
+	int mapped;
+	char *data;
+};
+
+struct disc_log *disc_log_build(struct registry *reg, const char *subnqn);
+struct disc_log *disc_log_map(char *data, size_t size, struct registry *reg,
+			      const char *subnqn);
+int disc_log_update(struct disc_log **logp, struct registry *reg, int idx);
+void disc_log_clear_dirty(struct disc_log *log);
+struct disc_log *disc_log_get(struct disc_log *log);
+void disc_log_put(struct disc_log *log);
+void disc_log_pin(struct disc_log *log);
+void disc_log_unpin(struct disc_log *log);
+
+#endif /* _DISCLOG_H */
@@ -0,0 +1,1467 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * gossip.c - registry replication between CDCs
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * CDCs replicate their registries by anti-entropy: every interval a
+ * node runs a round with one of its peers in turn. Each record keeps
+ * the Lamport clock and the node of its last change, deregistrations
+ * included, and the newest change of a record wins everywhere. The
+ * records are hashed into shards, and a digest holds the XOR of the
+ * version hashes of each shard, so a round between nodes in sync
+ * only exchanges the digest. Otherwise the responder lists the record
+ * versions of the differing shards, and only records which are newer
+ * on one side are transferred, in batches of one message per
+ * direction.
+ *
+ * The records are kept apart from the registry, which only the
+ * registry owner may touch: changes received from peers are handed
+ * to the owner, which merges them here and applies them to the
+ * registry if they are newer.
+ *
+ * Deregistered records are kept, so the deregistration wins over
+ * older versions still held by peers, until GOSSIP_TOMBSTONE_AGE
+ * newer changes were made. The clock and the records, deregistered
+ * ones included, may be saved and restored across restarts.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "acdc.h"
+#include "gossip.h"
+#include "registry.h"
+#include "connect.h"
+#include "crc32c.h"
+
+/*
+ * The header is 12 bytes long, so it is preceded by padding in a
+ * message being built: the payload starts 8 byte aligned, as do its
+ * __le64 fields.
+ */
+#define GOSSIP_HDR_PAD		(8 - sizeof(struct gossip_msg_hdr) % 8)
+#define GOSSIP_PAYLOAD_OFF	(GOSSIP_HDR_PAD + sizeof(struct gossip_msg_hdr))
+
+/**
+ * struct gossip_buf - message being built
+ *
+ * @data:          padding, message header and the payload
+ * @len:           number of bytes in @data
+ * @size:          allocated size of @data
+ * @err:           an allocation failed
+ */
+struct gossip_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	int err;
+};
+
+static __u64 gossip_mix(__u64 h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static __u64 gossip_hash_bytes(__u64 hash, const void *buf, size_t len)
+{
+	const __u8 *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Key of the canonical record @rec */
+static __u64 gossip_key(const struct port_rec *rec)
+{
+	__u64 hash = 0xcbf29ce484222325ULL;
+
+	hash = gossip_hash_bytes(hash, &rec->trtype, 1);
+	hash = gossip_hash_bytes(hash, &rec->adrfam, 1);
+	hash = gossip_hash_bytes(hash, rec->traddr, strlen(rec->traddr) + 1);
+	hash = gossip_hash_bytes(hash, rec->trsvcid, strlen(rec->trsvcid));
+	return gossip_mix(hash);
+}
+
+static int gossip_shard(__u64 key)
+{
+	return key >> 56;
+}
+
+/* Hash of the version of record @e, the unit of the shard digests */
+static __u64 gossip_vhash(struct gossip_entry *e)
+{
+	return gossip_mix(e->key ^ gossip_mix(e->change.clock) ^
+			  e->change.node);
+}
+
+/* Whether change @a is newer than change @b */
+static int gossip_newer(__u64 a_clock, __u32 a_node, __u64 b_clock,
+			__u32 b_node)
+{
+	return a_clock > b_clock || (a_clock == b_clock && a_node > b_node);
+}
+
+int gossip_init(struct gossip *g, gossip_apply_t apply, void *apply_priv)
+{
+	memset(g, 0, sizeof(*g));
+	g->lfd = -1;
+	g->interval_ms = GOSSIP_INTERVAL_MS;
+	g->apply = apply;
+	g->apply_priv = apply_priv;
+	/* Node 0 marks records restored without a known version */
+	while (!g->node) {
+		if (getrandom(&g->node, sizeof(g->node), 0) !=
+		    sizeof(g->node))
+			g->node = time(NULL) ^ getpid();
+	}
+	g->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (g->stopfd < 0)
+		return -errno;
+	pthread_mutex_init(&g->lock, NULL);
+	return 0;
+}
+
+void gossip_free(struct gossip *g)
+{
+	int i;
+
+	gossip_stop(g);
+	if (g->lfd >= 0)
+		close(g->lfd);
+	close(g->stopfd);
+	for (i = 0; i < g->num_peers; i++) {
+		free(g->peers[i].addr);
+		free(g->peers[i].port);
+	}
+	free(g->peers);
+	free(g->entries);
+	free(g->slots);
+	pthread_mutex_destroy(&g->lock);
+}
+
+/* Slot holding @key, or the empty slot ending its probe sequence */
+static __u32 gossip_find(struct gossip *g, __u64 key)
+{
+	__u32 pos;
+
+	for (pos = key & g->mask; g->slots[pos];
+	     pos = (pos + 1) & g->mask) {
+		if (g->entries[g->slots[pos] - 1].key == key)
+			break;
+	}
+	return pos;
+}
+
+static struct gossip_entry *gossip_lookup(struct gossip *g, __u64 key)
+{
+	__u32 pos;
+
+	if (!g->slots)
+		return NULL;
+	pos = gossip_find(g, key);
+	return g->slots[pos] ? &g->entries[g->slots[pos] - 1] : NULL;
+}
+
+/* Make room for one more record. Returns 0 or -ENOMEM. */
+static int gossip_reserve(struct gossip *g)
+{
+	struct gossip_entry *entries;
+	size_t num_slots;
+	__u32 *slots;
+	int i;
+
+	if (g->num_entries == g->max_entries) {
+		int max = g->max_entries ? g->max_entries * 2 : 64;
+
+		entries = realloc(g->entries, sizeof(*entries) * max);
+		if (!entries)
+			return -ENOMEM;
+		g->entries = entries;
+		g->max_entries = max;
+	}
+	if (g->slots &&
+	    (size_t)(g->num_entries + 1) * REG_LOAD_DIV <= (size_t)g->mask + 1)
+		return 0;
+	num_slots = g->slots ? ((size_t)g->mask + 1) * 2 : 128;
+	slots = calloc(num_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	free(g->slots);
+	g->slots = slots;
+	g->mask = num_slots - 1;
+	for (i = 0; i < g->num_entries; i++)
+		g->slots[gossip_find(g, g->entries[i].key)] = i + 1;
+	return 0;
+}
+
+/* Record that a change of @node with @clock was seen */
+static void gossip_seen(struct gossip *g, __u32 node, __u64 clock)
+{
+	int i;
+
+	if (clock > g->clock)
+		g->clock = clock;
+	for (i = 0; i < g->num_nodes; i++) {
+		if (g->nodes[i].node == node) {
+			if (clock > g->nodes[i].clock)
+				g->nodes[i].clock = clock;
+			return;
+		}
+	}
+	/* The vector may be incomplete */
+	if (g->num_nodes < GOSSIP_MAX_NODES) {
+		g->nodes[g->num_nodes].node = node;
+		g->nodes[g->num_nodes].clock = clock;
+		g->num_nodes++;
+	}
+}
+
+/*
+ * Store change @c of the record with @key unless the stored change
+ * is newer. Called with the lock held. Returns 1 if stored, 0 if
+ * not, or -ENOMEM.
+ */
+static int gossip_update(struct gossip *g, __u64 key, struct gossip_change *c)
+{
+	struct gossip_entry *e;
+	__u32 pos;
+
+	if (gossip_reserve(g) < 0)
+		return -ENOMEM;
+	pos = gossip_find(g, key);
+	if (g->slots[pos]) {
+		e = &g->entries[g->slots[pos] - 1];
+		if (!gossip_newer(c->clock, c->node, e->change.clock,
+				  e->change.node))
+			return 0;
+		g->shards[gossip_shard(key)] ^= gossip_vhash(e);
+	} else {
+		/* Stays forgotten, like on the nodes which purged it */
+		if (c->deleted && c->clock + GOSSIP_TOMBSTONE_AGE < g->clock)
+			return 0;
+		e = &g->entries[g->num_entries];
+		g->slots[pos] = ++g->num_entries;
+	}
+	e->key = key;
+	e->change = *c;
+	g->shards[gossip_shard(key)] ^= gossip_vhash(e);
+	gossip_seen(g, c->node, c->clock);
+	g->gen++;
+	return 1;
+}
+
+/*
+ * Empty slot @pos, moving back following slots of the probe sequence
+ * which would otherwise become unreachable.
+ */
+static void gossip_remove_slot(struct gossip *g, __u32 pos)
+{
+	__u32 i = pos, j = pos, home;
+
+	for (;;) {
+		j = (j + 1) & g->mask;
+		if (!g->slots[j])
+			break;
+		home = g->entries[g->slots[j] - 1].key & g->mask;
+		/* Entries whose home slot lies in (i, j] stay */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		g->slots[i] = g->slots[j];
+		i = j;
+	}
+	g->slots[i] = 0;
+}
+
+/* Remove entry @idx. Called with the lock held. */
+static void gossip_remove(struct gossip *g, int idx)
+{
+	struct gossip_entry *e = &g->entries[idx];
+	int last;
+
+	g->shards[gossip_shard(e->key)] ^= gossip_vhash(e);
+	gossip_remove_slot(g, gossip_find(g, e->key));
+
+	/* Move the last entry into the hole and repoint its slot */
+	last = --g->num_entries;
+	if (idx != last) {
+		*e = g->entries[last];
+		g->slots[gossip_find(g, e->key)] = idx + 1;
+	}
+}
+
+/*
+ * Forget the deregistered records GOSSIP_TOMBSTONE_AGE clock ticks
+ * older than the newest change. Peers forget them as soon as their
+ * clock has caught up. Only to be called by the registry owner.
+ * Returns the number of records forgotten.
+ */
+int gossip_purge(struct gossip *g)
+{
+	struct gossip_change *c;
+	int i, num = 0;
+
+	pthread_mutex_lock(&g->lock);
+	/* Backwards, as the last entry moves into the hole */
+	for (i = g->num_entries - 1; i >= 0; i--) {
+		c = &g->entries[i].change;
+		if (c->deleted && c->clock + GOSSIP_TOMBSTONE_AGE < g->clock) {
+			gossip_remove(g, i);
+			num++;
+		}
+	}
+	g->gen += num;
+	pthread_mutex_unlock(&g->lock);
+	return num;
+}
+
+/*
+ * Record a change of @rec made by a DDC on this node: registered by
+ * @ddc, or deregistered if @deleted is set. Only to be called by the
+ * registry owner. Returns 1 if the replicated state changed, 0 if
+ * not, or -ENOMEM.
+ */
+int gossip_local(struct gossip *g, const struct port_rec *rec,
+		 const struct in6_addr *ddc, int deleted)
+{
+	struct gossip_change c;
+	struct gossip_entry *e;
+	struct reg_key rkey;
+	__u64 key;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	c.rec = *rec;
+	registry_key(&rkey, &c.rec);
+	if (ddc)
+		c.ddc = *ddc;
+	c.deleted = deleted;
+	key = gossip_key(&c.rec);
+
+	pthread_mutex_lock(&g->lock);
+	e = gossip_lookup(g, key);
+	/* Registering again does not need to be replicated */
+	if ((!e && deleted) ||
+	    (e && e->change.deleted == deleted &&
+	     (deleted || (e->change.rec.portid == c.rec.portid &&
+			  !memcmp(&e->change.ddc, &c.ddc, sizeof(c.ddc)))))) {
+		pthread_mutex_unlock(&g->lock);
+		return 0;
+	}
+	c.clock = g->clock + 1;
+	c.node = g->node;
+	ret = gossip_update(g, key, &c);
+	pthread_mutex_unlock(&g->lock);
+	return ret;
+}
+
+/*
+ * Store change @c received from a peer unless the stored change of
+ * the record is newer. Only to be called by the registry owner.
+ * Returns 1 if @c is to be applied to the registry, 0 if not, or
+ * -ENOMEM.
+ */
+int gossip_merge(struct gossip *g, struct gossip_change *c)
+{
+	int ret;
+
+	pthread_mutex_lock(&g->lock);
+	ret = gossip_update(g, gossip_key(&c->rec), c);
+	pthread_mutex_unlock(&g->lock);
+	return ret;
+}
+
+/* XOR of all shard hashes, equal on nodes in sync */
+__u64 gossip_root(struct gossip *g)
+{
+	__u64 root = 0;
+	int i;
+
+	pthread_mutex_lock(&g->lock);
+	for (i = 0; i < GOSSIP_SHARDS; i++)
+		root ^= g->shards[i];
+	pthread_mutex_unlock(&g->lock);
+	return root;
+}
+
+static void *gossip_buf_put(struct gossip_buf *b, size_t len)
+{
+	void *p;
+
+	if (b->err)
+		return NULL;
+	if (b->len + len > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		char *data;
+
+		while (size < b->len + len)
+			size <<= 1;
+		data = realloc(b->data, size);
+		if (!data) {
+			b->err = 1;
+			return NULL;
+		}
+		b->data = data;
+		b->size = size;
+	}
+	p = b->data + b->len;
+	memset(p, 0, len);
+	b->len += len;
+	return p;
+}
+
+/* Start a message, reserving room for the header */
+static void gossip_buf_start(struct gossip_buf *b)
+{
+	b->len = 0;
+	b->err = 0;
+	gossip_buf_put(b, GOSSIP_PAYLOAD_OFF);
+}
+
+/* Append the digest of @g. Called with the lock held. */
+static void gossip_put_digest(struct gossip *g, struct gossip_buf *b)
+{
+	struct gossip_digest *d;
+	__u64 root = 0;
+	int i;
+
+	d = gossip_buf_put(b, sizeof(*d) +
+			   g->num_nodes * sizeof(d->nodes[0]));
+	if (!d)
+		return;
+	d->node = htole32(g->node);
+	d->num_nodes = htole32(g->num_nodes);
+	d->num_recs = htole32(g->num_entries);
+	for (i = 0; i < GOSSIP_SHARDS; i++) {
+		d->shards[i] = htole64(g->shards[i]);
+		root ^= g->shards[i];
+	}
+	d->root = htole64(root);
+	for (i = 0; i < g->num_nodes; i++) {
+		d->nodes[i].node = htole32(g->nodes[i].node);
+		d->nodes[i].clock = htole64(g->nodes[i].clock);
+	}
+}
+
+/* Check the digest at the start of @len bytes at @p, returning its size */
+static size_t gossip_get_digest(void *p, size_t len, struct gossip_digest **dp)
+{
+	struct gossip_digest *d = p;
+	size_t dlen;
+
+	if (len < sizeof(*d) || le32toh(d->num_nodes) > GOSSIP_MAX_NODES)
+		return 0;
+	dlen = sizeof(*d) + le32toh(d->num_nodes) * sizeof(d->nodes[0]);
+	if (len < dlen)
+		return 0;
+	*dp = d;
+	return dlen;
+}
+
+/*
+ * Catch up with the clock of the sender of digest @d, so changes made
+ * here from now on are newer than those it has seen. Called with the
+ * lock held.
+ */
+static void gossip_sync_clock(struct gossip *g, struct gossip_digest *d)
+{
+	__u32 i;
+
+	for (i = 0; i < le32toh(d->num_nodes); i++) {
+		if (le64toh(d->nodes[i].clock) > g->clock)
+			g->clock = le64toh(d->nodes[i].clock);
+	}
+}
+
+static void gossip_put_rec(struct gossip_buf *b, struct gossip_change *c)
+{
+	size_t traddr_len = strnlen(c->rec.traddr, sizeof(c->rec.traddr) - 1);
+	size_t trsvcid_len = strnlen(c->rec.trsvcid,
+				     sizeof(c->rec.trsvcid) - 1);
+	size_t len = (sizeof(struct gossip_rec) + traddr_len + trsvcid_len +
+		      7) & ~7;
+	struct gossip_rec *r;
+
+	r = gossip_buf_put(b, len);
+	if (!r)
+		return;
+	r->clock = htole64(c->clock);
+	r->node = htole32(c->node);
+	r->portid = htole32((__u32)c->rec.portid);
+	r->len = htole16(len);
+	r->deleted = c->deleted;
+	r->trtype = c->rec.trtype;
+	r->adrfam = c->rec.adrfam;
+	r->traddr_len = traddr_len;
+	r->trsvcid_len = trsvcid_len;
+	memcpy(r->ddc, &c->ddc, sizeof(r->ddc));
+	memcpy(r->data, c->rec.traddr, traddr_len);
+	memcpy(r->data + traddr_len, c->rec.trsvcid, trsvcid_len);
+}
+
+/*
+ * Decode the @num_recs records of @len bytes at @p into a new array
+ * returned in @changesp. Returns 0, -EPROTO or -ENOMEM.
+ */
+static int gossip_get_recs(char *p, size_t len, int num_recs,
+			   struct gossip_change **changesp)
+{
+	struct gossip_change *changes, *c;
+	struct reg_key rkey;
+	size_t off = 0, rlen;
+	int i;
+
+	changes = calloc(num_recs ? num_recs : 1, sizeof(*changes));
+	if (!changes)
+		return -ENOMEM;
+	for (i = 0; i < num_recs; i++) {
+		struct gossip_rec *r = (struct gossip_rec *)(p + off);
+
+		if (len - off < sizeof(*r))
+			goto out_proto;
+		rlen = le16toh(r->len);
+		/* Any __u8 traddr_len fits NVMF_TRADDR_SIZE with the NUL */
+		if (rlen < sizeof(*r) || rlen & 7 || rlen > len - off ||
+		    !r->traddr_len ||
+		    r->trsvcid_len >= sizeof(changes->rec.trsvcid) ||
+		    sizeof(*r) + r->traddr_len + r->trsvcid_len > rlen)
+			goto out_proto;
+		c = &changes[i];
+		c->clock = le64toh(r->clock);
+		c->node = le32toh(r->node);
+		c->deleted = !!r->deleted;
+		c->rec.portid = (int)le32toh(r->portid);
+		c->rec.trtype = r->trtype;
+		c->rec.adrfam = r->adrfam;
+		memcpy(c->rec.traddr, r->data, r->traddr_len);
+		memcpy(c->rec.trsvcid, r->data + r->traddr_len,
+		       r->trsvcid_len);
+		memcpy(&c->ddc, r->ddc, sizeof(c->ddc));
+		/* Keyed the same way on every node */
+		registry_key(&rkey, &c->rec);
+		off += rlen;
+	}
+	*changesp = changes;
+	return 0;
+
+out_proto:
+	free(changes);
+	return -EPROTO;
+}
+
+static int gossip_write(struct gossip *g, int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, p, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		__atomic_fetch_add(&g->num_bytes, ret, __ATOMIC_RELAXED);
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int gossip_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = recv(fd, p, len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? -ETIMEDOUT : -errno;
+		}
+		if (!ret)
+			return -ECONNRESET;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Save the clock and the records, deregistered ones included, to
+ * @path unless nothing changed since they were last saved, replacing
+ * the previous state atomically. Returns 0 or a negative errno value.
+ */
+int gossip_save(struct gossip *g, const char *path)
+{
+	struct gossip_state_hdr *hdr;
+	struct gossip_buf b = { 0 };
+	char tmp[PATH_MAX];
+	unsigned long gen;
+	size_t off;
+	ssize_t n;
+	__u64 clock;
+	int num, i, fd, ret;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	pthread_mutex_lock(&g->lock);
+	gen = g->gen;
+	if (gen == g->saved_gen) {
+		pthread_mutex_unlock(&g->lock);
+		return 0;
+	}
+	gossip_buf_put(&b, sizeof(*hdr));
+	for (i = 0; i < g->num_entries; i++)
+		gossip_put_rec(&b, &g->entries[i].change);
+	num = g->num_entries;
+	clock = g->clock;
+	pthread_mutex_unlock(&g->lock);
+	if (b.err)
+		return -ENOMEM;
+	hdr = (struct gossip_state_hdr *)b.data;
+	memcpy(hdr->magic, GOSSIP_STATE_MAGIC, sizeof(hdr->magic));
+	hdr->version = htole32(GOSSIP_STATE_VERSION);
+	hdr->num_recs = htole32(num);
+	hdr->clock = htole64(clock);
+	hdr->crc = htole32(crc32c(b.data + sizeof(*hdr),
+				  b.len - sizeof(*hdr)));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = 0;
+	for (off = 0; !ret && off < b.len; off += n) {
+		n = write(fd, b.data + off, b.len - off);
+		if (n < 0) {
+			n = 0;
+			if (errno != EINTR)
+				ret = -errno;
+		}
+	}
+	if (!ret && fdatasync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret < 0)
+		unlink(tmp);
+	else
+		g->saved_gen = gen;
+out:
+	free(b.data);
+	return ret;
+}
+
+/*
+ * Restore the clock and the records saved to @path by gossip_save().
+ * Returns the number of records restored, -ENOENT if there is no
+ * saved state, or another negative errno value.
+ */
+int gossip_load(struct gossip *g, const char *path)
+{
+	struct gossip_state_hdr *hdr;
+	struct gossip_change *changes;
+	struct stat st;
+	char *p = NULL;
+	size_t len, off;
+	ssize_t n;
+	int fd, num, i, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	len = st.st_size;
+	ret = -EINVAL;
+	if (len < sizeof(*hdr))
+		goto out;
+	p = malloc(len);
+	if (!p) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (off = 0; off < len; off += n) {
+		n = read(fd, p + off, len - off);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {
+			ret = n < 0 ? -errno : -EINVAL;
+			goto out;
+		}
+	}
+	hdr = (struct gossip_state_hdr *)p;
+	num = le32toh(hdr->num_recs);
+	ret = -EINVAL;
+	if (memcmp(hdr->magic, GOSSIP_STATE_MAGIC, sizeof(hdr->magic)) ||
+	    le32toh(hdr->version) != GOSSIP_STATE_VERSION || num < 0 ||
+	    (size_t)num > (len - sizeof(*hdr)) / sizeof(struct gossip_rec) ||
+	    le32toh(hdr->crc) != crc32c(p + sizeof(*hdr), len - sizeof(*hdr)))
+		goto out;
+	ret = gossip_get_recs(p + sizeof(*hdr), len - sizeof(*hdr), num,
+			      &changes);
+	if (ret < 0)
+		goto out;
+	pthread_mutex_lock(&g->lock);
+	if (le64toh(hdr->clock) > g->clock)
+		g->clock = le64toh(hdr->clock);
+	for (i = 0; i < num && ret >= 0; i++)
+		ret = gossip_update(g, gossip_key(&changes[i].rec),
+				    &changes[i]);
+	g->saved_gen = g->gen;
+	pthread_mutex_unlock(&g->lock);
+	free(changes);
+	ret = ret < 0 ? ret : num;
+out:
+	free(p);
+	close(fd);
+	return ret;
+}
+
+/* Send the message built in @b as @type */
+static int gossip_send(struct gossip *g, int fd, struct gossip_buf *b,
+		       enum gossip_msg_type type)
+{
+	struct gossip_msg_hdr *hdr;
+
+	if (b->err)
+		return -ENOMEM;
+	if (b->len - GOSSIP_PAYLOAD_OFF > GOSSIP_MSG_MAX)
+		return -EMSGSIZE;
+	hdr = (struct gossip_msg_hdr *)(b->data + GOSSIP_HDR_PAD);
+	hdr->magic = htole32(GOSSIP_MAGIC);
+	hdr->type = type;
+	hdr->version = GOSSIP_VERSION;
+	hdr->len = htole32(b->len - GOSSIP_PAYLOAD_OFF);
+	return gossip_write(g, fd, hdr, b->len - GOSSIP_HDR_PAD);
+}
+
+/*
+ * Receive a message, returning its type and its malloc()ed payload
+ * in @payload and @len. Returns the type or a negative errno value.
+ */
+static int gossip_recv(int fd, char **payload, size_t *len)
+{
+	struct gossip_msg_hdr hdr;
+	char *p;
+	int ret;
+
+	ret = gossip_read(fd, &hdr, sizeof(hdr));
+	if (ret < 0)
+		return ret;
+	if (le32toh(hdr.magic) != GOSSIP_MAGIC ||
+	    hdr.version != GOSSIP_VERSION ||
+	    le32toh(hdr.len) > GOSSIP_MSG_MAX)
+		return -EPROTO;
+	*len = le32toh(hdr.len);
+	p = malloc(*len ? *len : 1);
+	if (!p)
+		return -ENOMEM;
+	ret = gossip_read(fd, p, *len);
+	if (ret < 0) {
+		free(p);
+		return ret;
+	}
+	*payload = p;
+	return hdr.type;
+}
+
+/* Hand @num changes received from a peer to the registry owner */
+static int gossip_apply(struct gossip *g, char *p, size_t len, int num)
+{
+	struct gossip_change *changes;
+	int ret;
+
+	ret = gossip_get_recs(p, len, num, &changes);
+	if (ret < 0)
+		return ret;
+	if (!num) {
+		free(changes);
+		return 0;
+	}
+	__atomic_fetch_add(&g->num_recs_recv, num, __ATOMIC_RELAXED);
+	g->apply(g->apply_priv, changes, num);
+	return 0;
+}
+
+/* Parse the counts of a PUSH or RECS payload */
+static int gossip_get_counts(char *p, size_t len, __u32 *num_recs,
+			     __u32 *num_wants, __le64 **wants)
+{
+	__le32 *n = (__le32 *)p;
+
+	if (len < 8)
+		return -EPROTO;
+	*num_recs = le32toh(n[0]);
+	*num_wants = le32toh(n[1]);
+	if (*num_wants > (len - 8) / sizeof(__le64) ||
+	    *num_recs > (len - 8) / sizeof(struct gossip_rec))
+		return -EPROTO;
+	*wants = (__le64 *)(p + 8);
+	return 0;
+}
+
+/* Answer a round run by a peer on connection @fd */
+static int gossip_serve(struct gossip *g, int fd)
+{
+	struct gossip_buf b = { 0 };
+	struct gossip_digest *d;
+	struct gossip_version *v;
+	struct gossip_entry *e;
+	__u8 differs[GOSSIP_SHARDS];
+	__u32 num_recs, num_wants, i;
+	__le32 *counts;
+	__le16 *shards;
+	__le64 *wants;
+	size_t len, off;
+	char *p = NULL;
+	int num_shards = 0, num_versions = 0, ret;
+
+	ret = gossip_recv(fd, &p, &len);
+	if (ret < 0)
+		return ret;
+	if (ret != GOSSIP_DIGEST || !gossip_get_digest(p, len, &d)) {
+		ret = -EPROTO;
+		goto out;
+	}
+	__atomic_fetch_add(&g->num_served, 1, __ATOMIC_RELAXED);
+
+	gossip_buf_start(&b);
+	pthread_mutex_lock(&g->lock);
+	gossip_sync_clock(g, d);
+	for (i = 0; i < GOSSIP_SHARDS; i++) {
+		differs[i] = le64toh(d->shards[i]) != g->shards[i];
+		num_shards += differs[i];
+	}
+	if (!num_shards) {
+		pthread_mutex_unlock(&g->lock);
+		ret = gossip_send(g, fd, &b, GOSSIP_SYNCED);
+		goto out;
+	}
+	gossip_put_digest(g, &b);
+	off = b.len;
+	gossip_buf_put(&b, 8 + ((num_shards * sizeof(__le16) + 7) & ~7));
+	for (i = 0; i < (__u32)g->num_entries; i++) {
+		e = &g->entries[i];
+		if (!differs[gossip_shard(e->key)])
+			continue;
+		v = gossip_buf_put(&b, sizeof(*v));
+		if (!v)
+			break;
+		v->key = htole64(e->key);
+		v->clock = htole64(e->change.clock);
+		v->node = htole32(e->change.node);
+		num_versions++;
+	}
+	pthread_mutex_unlock(&g->lock);
+	if (!b.err) {
+		counts = (__le32 *)(b.data + off);
+		counts[0] = htole32(num_shards);
+		counts[1] = htole32(num_versions);
+		shards = (__le16 *)(b.data + off + 8);
+		for (i = 0; i < GOSSIP_SHARDS; i++) {
+			if (differs[i])
+				*shards++ = htole16(i);
+		}
+	}
+	ret = gossip_send(g, fd, &b, GOSSIP_SUMMARY);
+	if (ret < 0)
+		goto out;
+
+	/* Records this node lacks, and keys of the records wanted */
+	free(p);
+	p = NULL;
+	ret = gossip_recv(fd, &p, &len);
+	if (ret < 0)
+		goto out;
+	if (ret != GOSSIP_PUSH ||
+	    gossip_get_counts(p, len, &num_recs, &num_wants, &wants) < 0) {
+		ret = -EPROTO;
+		goto out;
+	}
+	off = 8 + num_wants * sizeof(__le64);
+	ret = gossip_apply(g, p + off, len - off, num_recs);
+	if (ret < 0)
+		goto out;
+
+	gossip_buf_start(&b);
+	counts = gossip_buf_put(&b, 8);
+	num_recs = 0;
+	pthread_mutex_lock(&g->lock);
+	for (i = 0; i < num_wants; i++) {
+		e = gossip_lookup(g, le64toh(wants[i]));
+		if (!e)
+			continue;
+		gossip_put_rec(&b, &e->change);
+		num_recs++;
+	}
+	pthread_mutex_unlock(&g->lock);
+	if (!b.err) {
+		counts = (__le32 *)(b.data + GOSSIP_PAYLOAD_OFF);
+		counts[0] = htole32(num_recs);
+	}
+	__atomic_fetch_add(&g->num_recs_sent, num_recs, __ATOMIC_RELAXED);
+	ret = gossip_send(g, fd, &b, GOSSIP_RECS);
+out:
+	free(p);
+	free(b.data);
+	return ret;
+}
+
+static int gossip_version_cmp(const void *a, const void *b)
+{
+	__u64 ka = le64toh(((const struct gossip_version *)a)->key);
+	__u64 kb = le64toh(((const struct gossip_version *)b)->key);
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+/*
+ * Build the PUSH answering the SUMMARY of @len bytes at @p: the
+ * records of the differing shards the peer lacks or has an older
+ * version of, and the keys of those this node lacks or has an older
+ * version of.
+ */
+static int gossip_push(struct gossip *g, struct gossip_buf *b, char *p,
+		       size_t len)
+{
+	struct gossip_version *versions, *v, key;
+	struct gossip_digest *d;
+	struct gossip_entry *e;
+	__u8 differs[GOSSIP_SHARDS];
+	__u32 num_shards, num_versions, num_recs = 0, num_wants = 0, i;
+	__le32 *counts;
+	__le16 *shards;
+	__le64 *want;
+	size_t off;
+
+	off = gossip_get_digest(p, len, &d);
+	if (!off || len - off < 8)
+		return -EPROTO;
+	counts = (__le32 *)(p + off);
+	num_shards = le32toh(counts[0]);
+	num_versions = le32toh(counts[1]);
+	shards = (__le16 *)(p + off + 8);
+	off += 8 + ((num_shards * sizeof(__le16) + 7) & ~7);
+	if (num_shards > GOSSIP_SHARDS || off > len ||
+	    num_versions != (len - off) / sizeof(*versions) ||
+	    (len - off) % sizeof(*versions))
+		return -EPROTO;
+	versions = (struct gossip_version *)(p + off);
+	memset(differs, 0, sizeof(differs));
+	for (i = 0; i < num_shards; i++) {
+		if (le16toh(shards[i]) >= GOSSIP_SHARDS)
+			return -EPROTO;
+		differs[le16toh(shards[i])] = 1;
+	}
+	qsort(versions, num_versions, sizeof(*versions), gossip_version_cmp);
+
+	gossip_buf_start(b);
+	gossip_buf_put(b, 8);
+	pthread_mutex_lock(&g->lock);
+	gossip_sync_clock(g, d);
+	/* Keys wanted first, the records follow them */
+	for (i = 0; i < num_versions; i++) {
+		v = &versions[i];
+		e = gossip_lookup(g, le64toh(v->key));
+		if (e && !gossip_newer(le64toh(v->clock), le32toh(v->node),
+				       e->change.clock, e->change.node))
+			continue;
+		want = gossip_buf_put(b, sizeof(*want));
+		if (want)
+			*want = v->key;
+		num_wants++;
+	}
+	for (i = 0; i < (__u32)g->num_entries; i++) {
+		e = &g->entries[i];
+		if (!differs[gossip_shard(e->key)])
+			continue;
+		key.key = htole64(e->key);
+		v = bsearch(&key, versions, num_versions, sizeof(*versions),
+			    gossip_version_cmp);
+		if (v && !gossip_newer(e->change.clock, e->change.node,
+				       le64toh(v->clock), le32toh(v->node)))
+			continue;
+		gossip_put_rec(b, &e->change);
+		num_recs++;
+	}
+	pthread_mutex_unlock(&g->lock);
+	if (b->err)
+		return -ENOMEM;
+	counts = (__le32 *)(b->data + GOSSIP_PAYLOAD_OFF);
+	counts[0] = htole32(num_recs);
+	counts[1] = htole32(num_wants);
+	__atomic_fetch_add(&g->num_recs_sent, num_recs, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Block on @fd, with GOSSIP_TIMEOUT_MS for each send and receive */
+static void gossip_sock_setup(int fd)
+{
+	struct timeval tv = {
+		.tv_sec = GOSSIP_TIMEOUT_MS / 1000,
+		.tv_usec = (GOSSIP_TIMEOUT_MS % 1000) * 1000,
+	};
+	int on = 1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/* Run an anti-entropy round with @peer */
+static int gossip_round(struct gossip *g, struct gossip_peer *peer)
+{
+	struct gossip_buf b = { 0 };
+	struct he_conn hc;
+	__u32 num_recs, num_wants;
+	__le64 *wants;
+	size_t len, off;
+	char *p = NULL;
+	int fd, ret;
+
+	ret = he_resolve(&hc, peer->addr, peer->port, HE_STAGGER_MS,
+			 GOSSIP_TIMEOUT_MS);
+	if (ret < 0)
+		return ret;
+	fd = he_connect(&hc);
+	ret = -hc.err;
+	he_free(&hc);
+	if (fd < 0)
+		return ret ? ret : -ECONNREFUSED;
+	gossip_sock_setup(fd);
+
+	gossip_buf_start(&b);
+	pthread_mutex_lock(&g->lock);
+	gossip_put_digest(g, &b);
+	pthread_mutex_unlock(&g->lock);
+	ret = gossip_send(g, fd, &b, GOSSIP_DIGEST);
+	if (ret < 0)
+		goto out;
+	ret = gossip_recv(fd, &p, &len);
+	if (ret < 0)
+		goto out;
+	__atomic_fetch_add(&g->num_rounds, 1, __ATOMIC_RELAXED);
+	if (ret == GOSSIP_SYNCED) {
+		__atomic_fetch_add(&g->num_synced, 1, __ATOMIC_RELAXED);
+		ret = 0;
+		goto out;
+	}
+	if (ret != GOSSIP_SUMMARY) {
+		ret = -EPROTO;
+		goto out;
+	}
+	ret = gossip_push(g, &b, p, len);
+	if (!ret)
+		ret = gossip_send(g, fd, &b, GOSSIP_PUSH);
+	if (ret < 0)
+		goto out;
+
+	free(p);
+	p = NULL;
+	ret = gossip_recv(fd, &p, &len);
+	if (ret < 0)
+		goto out;
+	if (ret != GOSSIP_RECS ||
+	    gossip_get_counts(p, len, &num_recs, &num_wants, &wants) < 0) {
+		ret = -EPROTO;
+		goto out;
+	}
+	off = 8 + num_wants * sizeof(__le64);
+	ret = gossip_apply(g, p + off, len - off, num_recs);
+out:
+	free(p);
+	free(b.data);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Run a round with the peers in turn until one succeeds, so the
+ * clock catches up with theirs before changes are made here: the
+ * clock restored after a restart may be behind. Only to be called
+ * before gossip_start(). Returns 0, or the error of the last round
+ * if no peer answered.
+ */
+int gossip_seed(struct gossip *g)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < g->num_peers; i++) {
+		ret = gossip_round(g, &g->peers[i]);
+		if (!ret)
+			break;
+	}
+	return ret;
+}
+
+static void *gossip_server(void *arg)
+{
+	struct gossip *g = arg;
+	struct pollfd pfd[2];
+	int fd, ret;
+
+	pfd[0].fd = g->stopfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = g->lfd;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (pfd[0].revents)
+			break;
+		fd = accept4(g->lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		gossip_sock_setup(fd);
+		ret = gossip_serve(g, fd);
+		if (ret < 0 && ret != -ECONNRESET)
+			fprintf(stderr, "gossip: serving round: %s\n",
+				strerror(-ret));
+		close(fd);
+	}
+	return NULL;
+}
+
+static void *gossip_client(void *arg)
+{
+	struct gossip *g = arg;
+	struct gossip_peer *peer;
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = g->stopfd;
+	pfd.events = POLLIN;
+	for (;;) {
+		ret = poll(&pfd, 1, g->interval_ms);
+		if (ret < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		if (ret > 0)
+			break;
+		peer = &g->peers[g->next_peer];
+		g->next_peer = (g->next_peer + 1) % g->num_peers;
+		ret = gossip_round(g, peer);
+		/* Only report peers going down and coming back */
+		if (ret < 0 && !peer->down)
+			fprintf(stderr, "gossip: peer %s:%s: %s\n", peer->addr,
+				peer->port, strerror(-ret));
+		else if (!ret && peer->down)
+			fprintf(stderr, "gossip: peer %s:%s is back\n",
+				peer->addr, peer->port);
+		peer->down = ret < 0;
+	}
+	return NULL;
+}
+
+/*
+ * Answer rounds of peers on @addr:@port. Returns 0 or a negative
+ * errno value.
+ */
+int gossip_listen(struct gossip *g, const char *addr, const char *port)
+{
+	struct addrinfo hints, *ai_list, *ai;
+	int fd = -1, on = 1, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	err = getaddrinfo(addr, port, &hints, &ai_list);
+	if (err) {
+		fprintf(stderr, "getaddrinfo %s:%s: %s\n", addr ? addr : "*",
+			port, gai_strerror(err));
+		return -ENOENT;
+	}
+	for (ai = ai_list; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+			    SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+		    !listen(fd, SOMAXCONN))
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+		errno = err;
+	}
+	freeaddrinfo(ai_list);
+	if (fd < 0) {
+		err = -errno;
+		fprintf(stderr, "listen on %s:%s: %s\n", addr ? addr : "*",
+			port, strerror(errno));
+		return err;
+	}
+	g->lfd = fd;
+	return 0;
+}
+
+/* Run anti-entropy rounds with the node at @addr:@port as well */
+int gossip_add_peer(struct gossip *g, const char *addr, const char *port)
+{
+	struct gossip_peer *peers;
+
+	peers = realloc(g->peers, sizeof(*peers) * (g->num_peers + 1));
+	if (!peers)
+		return -ENOMEM;
+	g->peers = peers;
+	peers[g->num_peers].addr = strdup(addr);
+	peers[g->num_peers].port = strdup(port);
+	peers[g->num_peers].down = 0;
+	if (!peers[g->num_peers].addr || !peers[g->num_peers].port) {
+		free(peers[g->num_peers].addr);
+		free(peers[g->num_peers].port);
+		return -ENOMEM;
+	}
+	g->num_peers++;
+	return 0;
+}
+
+/* Start answering and running rounds. Returns 0 or a negative errno. */
+int gossip_start(struct gossip *g)
+{
+	int ret;
+
+	if (g->lfd >= 0) {
+		ret = pthread_create(&g->server, NULL, gossip_server, g);
+		if (ret)
+			return -ret;
+	}
+	if (g->num_peers) {
+		/* Spread the rounds of nodes started together */
+		g->next_peer = g->node % g->num_peers;
+		ret = pthread_create(&g->client, NULL, gossip_client, g);
+		if (ret) {
+			if (g->lfd >= 0) {
+				eventfd_write(g->stopfd, 1);
+				pthread_join(g->server, NULL);
+			}
+			return -ret;
+		}
+	}
+	g->running = 1;
+	return 0;
+}
+
+void gossip_stop(struct gossip *g)
+{
+	if (!g->running)
+		return;
+	if (eventfd_write(g->stopfd, 1) < 0)
+		perror("eventfd_write");
+	if (g->lfd >= 0)
+		pthread_join(g->server, NULL);
+	if (g->num_peers)
+		pthread_join(g->client, NULL);
+	g->running = 0;
+}
+
+/* Without a registry, changes of peers are merged right away */
+static void gossip_bench_apply(void *priv, struct gossip_change *changes,
+			       int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		gossip_merge(priv, &changes[i]);
+	free(changes);
+}
+
+/* Sum of the bytes and records sent by @num_nodes nodes */
+static void gossip_bench_sum(struct gossip *nodes, int num_nodes,
+			     unsigned long *bytes, unsigned long *recs,
+			     unsigned long *rounds)
+{
+	int i;
+
+	*bytes = *recs = *rounds = 0;
+	for (i = 0; i < num_nodes; i++) {
+		*bytes += __atomic_load_n(&nodes[i].num_bytes,
+					  __ATOMIC_RELAXED);
+		*recs += __atomic_load_n(&nodes[i].num_recs_sent,
+					 __ATOMIC_RELAXED);
+		*rounds += __atomic_load_n(&nodes[i].num_rounds,
+					   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Wait until all @num_nodes nodes are in sync, then print how long
+ * it took and what was sent. Returns 0 or -ETIMEDOUT.
+ */
+static int gossip_bench_converge(struct gossip *nodes, int num_nodes,
+				 const char *what, size_t full_bytes)
+{
+	struct timespec start, now;
+	unsigned long bytes0, recs0, rounds0, bytes, recs, rounds;
+	__u64 root;
+	int i;
+
+	gossip_bench_sum(nodes, num_nodes, &bytes0, &recs0, &rounds0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		root = gossip_root(&nodes[0]);
+		for (i = 1; i < num_nodes; i++) {
+			if (gossip_root(&nodes[i]) != root)
+				break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (i == num_nodes)
+			break;
+		if (timespec_diff_ms(&start, &now) > 60000) {
+			fprintf(stderr, "gossip: %s did not converge\n", what);
+			return -ETIMEDOUT;
+		}
+		usleep(1000);
+	}
+	gossip_bench_sum(nodes, num_nodes, &bytes, &recs, &rounds);
+	printf("gossip: %s: converged in %8.1f ms, %4lu rounds, %7lu records, "
+	       "%9lu bytes sent (full state %zu bytes per node)\n", what,
+	       timespec_diff_ns(&start, &now) / 1e6, rounds - rounds0,
+	       recs - recs0, bytes - bytes0, full_bytes);
+	return 0;
+}
+
+/*
+ * Replicate @num_recs records registered with one of @num_nodes nodes
+ * on localhost, then changes made on two others, and measure the
+ * time to converge and the bytes exchanged, and the cost of rounds
+ * between nodes in sync.
+ */
+int gossip_bench(int num_nodes, int num_recs)
+{
+	struct in6_addr ddc = IN6ADDR_LOOPBACK_INIT;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	struct gossip *nodes;
+	struct port_rec rec;
+	char port[NI_MAXSERV];
+	unsigned long bytes0, recs0, rounds0, bytes, recs, rounds;
+	size_t full_bytes = 0;
+	int i, j, num_changes = num_recs / 100 ? num_recs / 100 : 1;
+	int ret = 1;
+
+	nodes = calloc(num_nodes, sizeof(*nodes));
+	if (!nodes) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < num_nodes; i++) {
+		if (gossip_init(&nodes[i], gossip_bench_apply, &nodes[i]) < 0 ||
+		    gossip_listen(&nodes[i], "127.0.0.1", "0") < 0)
+			goto out;
+		nodes[i].interval_ms = 20;
+	}
+	/* Every node runs rounds with all the others in turn */
+	for (i = 0; i < num_nodes; i++) {
+		sslen = sizeof(ss);
+		if (getsockname(nodes[i].lfd, (struct sockaddr *)&ss,
+				&sslen) < 0 ||
+		    getnameinfo((struct sockaddr *)&ss, sslen, NULL, 0,
+				port, sizeof(port), NI_NUMERICSERV)) {
+			perror("getsockname");
+			goto out;
+		}
+		for (j = 0; j < num_nodes; j++) {
+			if (j != i &&
+			    gossip_add_peer(&nodes[j], "127.0.0.1", port) < 0)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < num_recs; i++) {
+		port_rec_bench(&rec, i);
+		gossip_local(&nodes[0], &rec, &ddc, 0);
+		full_bytes += (sizeof(struct gossip_rec) + strlen(rec.traddr) +
+			       strlen(rec.trsvcid) + 7) & ~7;
+	}
+	for (i = 0; i < num_nodes; i++) {
+		if (gossip_start(&nodes[i]) < 0) {
+			fprintf(stderr, "gossip: cannot start node %d\n", i);
+			goto out;
+		}
+	}
+	printf("gossip: %d nodes, %d records, %d ms rounds\n", num_nodes,
+	       num_recs, nodes[0].interval_ms);
+	if (gossip_bench_converge(nodes, num_nodes, "initial sync  ",
+				  full_bytes) < 0)
+		goto out;
+
+	/* Deregistrations on one node, new registrations on another */
+	for (i = 0; i < num_changes; i++) {
+		port_rec_bench(&rec, i * 97 % num_recs);
+		gossip_local(&nodes[1 % num_nodes], &rec, &ddc, 1);
+		port_rec_bench(&rec, num_recs + i);
+		gossip_local(&nodes[2 % num_nodes], &rec, &ddc, 0);
+	}
+	if (gossip_bench_converge(nodes, num_nodes, "1% changed    ",
+				  full_bytes) < 0)
+		goto out;
+
+	port_rec_bench(&rec, num_recs / 2 + 1);
+	gossip_local(&nodes[num_nodes - 1], &rec, &ddc, 1);
+	if (gossip_bench_converge(nodes, num_nodes, "single change ",
+				  full_bytes) < 0)
+		goto out;
+
+	gossip_bench_sum(nodes, num_nodes, &bytes0, &recs0, &rounds0);
+	usleep(500000);
+	gossip_bench_sum(nodes, num_nodes, &bytes, &recs, &rounds);
+	printf("gossip: in sync: %lu rounds, %lu records, %.0f bytes per "
+	       "round\n", rounds - rounds0, recs - recs0,
+	       rounds > rounds0 ? (double)(bytes - bytes0) /
+	       (rounds - rounds0) : 0.0);
+	ret = 0;
+out:
+	/* No rounds with nodes already gone */
+	for (i = 0; i < num_nodes; i++) {
+		if (nodes[i].stopfd > 0)
+			gossip_stop(&nodes[i]);
+	}
+	for (i = 0; i < num_nodes; i++) {
+		if (nodes[i].stopfd > 0)
+			gossip_free(&nodes[i]);
+	}
+	free(nodes);
+	return ret;
+}
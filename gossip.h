@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * gossip.h - registry replication between CDCs
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _GOSSIP_H
+#define _GOSSIP_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+
+#include "nvmet.h"
+
+#define GOSSIP_MAGIC		0x67646361	/* "acdg" */
+#define GOSSIP_VERSION		1
+
+/* Default replication port */
+#define GOSSIP_PORT		"8010"
+
+/* Number of shards the digest hashes the records into */
+#define GOSSIP_SHARDS		256
+
+/* Largest number of nodes in the genctr vector of a digest */
+#define GOSSIP_MAX_NODES	64
+
+/* Time between anti-entropy rounds, and I/O timeout of a round */
+#define GOSSIP_INTERVAL_MS	1000
+#define GOSSIP_TIMEOUT_MS	2000
+
+/* Largest gossip message */
+#define GOSSIP_MSG_MAX		(256 << 20)
+
+/*
+ * Clock ticks after which a deregistered record is forgotten, and
+ * older deregistrations of records not known are ignored
+ */
+#define GOSSIP_TOMBSTONE_AGE	65536
+
+#define GOSSIP_STATE_MAGIC	"acdcrepl"
+#define GOSSIP_STATE_VERSION	1
+
+/* Nodes and records of the gossip benchmark */
+#define GOSSIP_BENCH_NODES	4
+#define GOSSIP_BENCH_RECS	10000
+
+enum gossip_msg_type {
+	GOSSIP_DIGEST = 1,	/* initiator: digest */
+	GOSSIP_SYNCED = 2,	/* responder: nothing differs */
+	GOSSIP_SUMMARY = 3,	/* responder: digest and record versions
+				 * of the differing shards */
+	GOSSIP_PUSH = 4,	/* initiator: records the responder lacks,
+				 * and keys of those it wants */
+	GOSSIP_RECS = 5,	/* responder: records wanted */
+};
+
+/**
+ * struct gossip_msg_hdr - header of a gossip message
+ *
+ * @magic:         GOSSIP_MAGIC
+ * @type:          enum gossip_msg_type
+ * @version:       GOSSIP_VERSION
+ * @rsvd:          reserved
+ * @len:           length of the payload following the header
+ *
+ * All fields of gossip messages are little endian.
+ */
+struct gossip_msg_hdr {
+	__le32 magic;
+	__u8 type;
+	__u8 version;
+	__le16 rsvd;
+	__le32 len;
+};
+
+/**
+ * struct gossip_clock - genctr vector element
+ *
+ * @node:          node id
+ * @rsvd:          reserved
+ * @clock:         highest clock of the changes of @node seen
+ */
+struct gossip_clock {
+	__le32 node;
+	__le32 rsvd;
+	__le64 clock;
+};
+
+/**
+ * struct gossip_digest - summary of the replicated records of a node
+ *
+ * @node:          node id of the sender
+ * @num_nodes:     number of elements in @nodes
+ * @num_recs:      number of records, including deleted ones
+ * @root:          XOR of @shards
+ * @shards:        XOR of the version hashes of the records of each
+ *                 shard
+ * @nodes:         genctr vector of the sender
+ */
+struct gossip_digest {
+	__le32 node;
+	__le32 num_nodes;
+	__le32 num_recs;
+	__le32 rsvd;
+	__le64 root;
+	__le64 shards[GOSSIP_SHARDS];
+	struct gossip_clock nodes[];
+};
+
+/**
+ * struct gossip_version - version of a record in a summary
+ *
+ * @key:           key of the record
+ * @clock:         Lamport clock of the last change
+ * @node:          node which made the last change
+ * @rsvd:          reserved
+ *
+ * A SUMMARY holds the digest of the responder, the number of
+ * differing shards and of versions as two __le32, the differing
+ * shard numbers as __le16 padded to 8 bytes, and the versions of all
+ * records of these shards.
+ */
+struct gossip_version {
+	__le64 key;
+	__le64 clock;
+	__le32 node;
+	__le32 rsvd;
+};
+
+/**
+ * struct gossip_rec - replicated record on the wire
+ *
+ * @clock:         Lamport clock of the last change
+ * @node:          node which made the last change
+ * @portid:        port id, -1 if unset
+ * @len:           length of the record, a multiple of 8
+ * @deleted:       the record was deregistered
+ * @trtype:        transport type
+ * @adrfam:        address family
+ * @traddr_len:    length of the transport address in @data
+ * @trsvcid_len:   length of the transport service id in @data
+ * @rsvd:          reserved
+ * @ddc:           address of the DDC which registered the record
+ * @data:          traddr followed by trsvcid, not NUL terminated,
+ *                 zero padded
+ *
+ * PUSH and RECS hold the number of records and of wanted keys as two
+ * __le32, the wanted keys as __le64, and the records.
+ */
+struct gossip_rec {
+	__le64 clock;
+	__le32 node;
+	__le32 portid;
+	__le16 len;
+	__u8 deleted;
+	__u8 trtype;
+	__u8 adrfam;
+	__u8 traddr_len;
+	__u8 trsvcid_len;
+	__u8 rsvd;
+	__u8 ddc[16];
+	char data[];
+};
+
+/**
+ * struct gossip_state_hdr - header of a saved replicated state
+ *
+ * @magic:         GOSSIP_STATE_MAGIC
+ * @version:       GOSSIP_STATE_VERSION
+ * @num_recs:      number of records following the header, in the
+ *                 format of struct gossip_rec
+ * @clock:         Lamport clock
+ * @crc:           CRC32C of the records
+ * @rsvd:          reserved
+ *
+ * All fields are little endian.
+ */
+struct gossip_state_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 num_recs;
+	__le64 clock;
+	__le32 crc;
+	__le32 rsvd;
+};
+
+/**
+ * struct gossip_change - replicated state of a record
+ *
+ * @rec:           record in canonical form
+ * @ddc:           address of the DDC which registered the record
+ * @clock:         Lamport clock of the last change
+ * @node:          node which made the last change
+ * @deleted:       the record was deregistered
+ *
+ * Changes are ordered by @clock, then by @node.
+ */
+struct gossip_change {
+	struct port_rec rec;
+	struct in6_addr ddc;
+	__u64 clock;
+	__u32 node;
+	int deleted;
+};
+
+/*
+ * Called with @num changes received from a peer, which are to be
+ * passed to gossip_merge() by the registry owner. Takes ownership of
+ * the malloc()ed @changes.
+ */
+typedef void (*gossip_apply_t)(void *priv, struct gossip_change *changes,
+			       int num);
+
+/**
+ * struct gossip_entry - replicated record
+ *
+ * @key:           hash of the canonical record key
+ * @change:        last change of the record
+ */
+struct gossip_entry {
+	__u64 key;
+	struct gossip_change change;
+};
+
+/**
+ * struct gossip_peer - node to run anti-entropy rounds with
+ *
+ * @addr:          address of the peer
+ * @port:          replication port of the peer
+ * @down:          the last round failed
+ */
+struct gossip_peer {
+	char *addr;
+	char *port;
+	int down;
+};
+
+/**
+ * struct gossip - replicated registry state of a node
+ *
+ * @lock:          protects the records, the digest and the clocks
+ * @entries:       records, including deleted ones
+ * @num_entries:   number of records in @entries
+ * @max_entries:   allocated size of @entries
+ * @slots:         open addressing index of @entries, entry index + 1
+ * @mask:          number of slots - 1
+ * @shards:        XOR of the version hashes of each shard
+ * @node:          node id of this node
+ * @clock:         Lamport clock
+ * @nodes:         genctr vector, highest clock seen per node
+ * @num_nodes:     number of elements in @nodes
+ * @gen:           number of records stored or forgotten
+ * @saved_gen:     @gen when the state was last saved or restored
+ * @peers:         nodes to run anti-entropy rounds with
+ * @num_peers:     number of @peers
+ * @next_peer:     peer of the next round
+ * @interval_ms:   time between rounds
+ * @lfd:           replication listener, -1 if none
+ * @stopfd:        eventfd stopping the threads
+ * @apply:         receives changes from peers
+ * @apply_priv:    argument of @apply
+ * @server:        thread answering rounds of peers
+ * @client:        thread running rounds with @peers
+ * @running:       the threads were started
+ * @num_rounds:    rounds run by this node
+ * @num_synced:    rounds which found nothing to exchange
+ * @num_served:    rounds run by peers with this node
+ * @num_bytes:     bytes sent by this node
+ * @num_recs_sent: records sent by this node
+ * @num_recs_recv: records received by this node
+ */
+struct gossip {
+	pthread_mutex_t lock;
+	struct gossip_entry *entries;
+	int num_entries;
+	int max_entries;
+	__u32 *slots;
+	__u32 mask;
+	__u64 shards[GOSSIP_SHARDS];
+	__u32 node;
+	__u64 clock;
+	struct gossip_clock nodes[GOSSIP_MAX_NODES];
+	int num_nodes;
+	unsigned long gen;
+	unsigned long saved_gen;
+	struct gossip_peer *peers;
+	int num_peers;
+	int next_peer;
+	int interval_ms;
+	int lfd;
+	int stopfd;
+	gossip_apply_t apply;
+	void *apply_priv;
+	pthread_t server;
+	pthread_t client;
+	int running;
+	unsigned long num_rounds;
+	unsigned long num_synced;
+	unsigned long num_served;
+	unsigned long num_bytes;
+	unsigned long num_recs_sent;
+	unsigned long num_recs_recv;
+};
+
+int gossip_init(struct gossip *g, gossip_apply_t apply, void *apply_priv);
+void gossip_free(struct gossip *g);
+int gossip_listen(struct gossip *g, const char *addr, const char *port);
+int gossip_add_peer(struct gossip *g, const char *addr, const char *port);
+int gossip_seed(struct gossip *g);
+int gossip_start(struct gossip *g);
+void gossip_stop(struct gossip *g);
+int gossip_local(struct gossip *g, const struct port_rec *rec,
+		 const struct in6_addr *ddc, int deleted);
+int gossip_merge(struct gossip *g, struct gossip_change *c);
+int gossip_purge(struct gossip *g);
+int gossip_save(struct gossip *g, const char *path);
+int gossip_load(struct gossip *g, const char *path);
+__u64 gossip_root(struct gossip *g);
+int gossip_bench(int num_nodes, int num_recs);
+
+#endif /* _GOSSIP_H */
@@ -0,0 +1,975 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * host.c - NVMe/TCP discovery host
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Connects to a discovery controller as a host would, enables it
+ * with the Property Get/Set sequence and reads the discovery log
+ * with several Get Log Page commands in flight, so that a check of
+ * what a CDC knows costs neither a process nor a handshake per log
+ * page chunk. Repeated checks read only the log page header as long
+ * as its generation counter does not change. The session is
+ * authenticated with DH-HMAC-CHAP if the controller asks for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "acdc.h"
+#include "crc32c.h"
+#include "host.h"
+
+static const struct pdu_ops disc_host_pdu_ops;
+
+void disc_host_init(struct disc_host *h, __u8 digest,
+		    struct auth_ctx *auth)
+{
+	int i;
+
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	h->digest = digest;
+	h->auth = auth;
+	/* C2HData PDUs are not limited by the receive buffer */
+	pdu_buf_init(&h->pb, SIZE_MAX);
+	/* Lowest command ids first */
+	for (i = 0; i < NVME_AQ_DEPTH; i++)
+		h->free_cids[i] = NVME_AQ_DEPTH - 1 - i;
+	h->num_free = NVME_AQ_DEPTH;
+}
+
+void disc_host_close(struct disc_host *h)
+{
+	if (h->fd >= 0) {
+		close(h->fd);
+		h->fd = -1;
+	}
+	pdu_buf_free(&h->pb);
+	free(h->log);
+	h->log = NULL;
+}
+
+/* Command in flight with id @cid, or NULL */
+static struct disc_host_req *disc_host_req(struct disc_host *h, __u16 cid)
+{
+	struct disc_host_req *req;
+
+	if (cid >= NVME_AQ_DEPTH)
+		return NULL;
+	req = &h->reqs[cid];
+	if (!req->busy || req->done)
+		return NULL;
+	return req;
+}
+
+static int disc_host_icresp_handler(void *ctx, union nvme_tcp_pdu *pdu,
+				    void *data, size_t data_len)
+{
+	struct disc_host *h = ctx;
+
+	if (h->icresp) {
+		fprintf(stderr, "Unexpected icresp PDU\n");
+		return -EPROTO;
+	}
+	if (icresp_check(&pdu->icresp) < 0)
+		return -EPROTO;
+	if (pdu->icresp.digest != h->digest) {
+		fprintf(stderr, "Digest mismatch, requested %#x got %#x\n",
+			h->digest, pdu->icresp.digest);
+		return -EPROTO;
+	}
+	h->pb.digest = pdu->icresp.digest;
+	h->icresp = 1;
+	return 0;
+}
+
+/* Queue command @cid for disc_host_reap() */
+static void disc_host_req_done(struct disc_host *h, __u16 cid)
+{
+	int idx = (h->done_head + h->num_done) % NVME_AQ_DEPTH;
+
+	h->reqs[cid].done = 1;
+	h->done_cids[idx] = cid;
+	h->num_done++;
+}
+
+static int disc_host_rsp_handler(void *ctx, union nvme_tcp_pdu *pdu,
+				 void *data, size_t data_len)
+{
+	struct disc_host *h = ctx;
+	struct nvme_completion *cqe = &pdu->rsp.cqe;
+	struct disc_host_req *req;
+
+	req = disc_host_req(h, cqe->command_id);
+	if (!req) {
+		fprintf(stderr, "Unexpected completion for command %u\n",
+			cqe->command_id);
+		return -EPROTO;
+	}
+	req->status = le16toh(cqe->status) >> 1;
+	req->result = le64toh(cqe->result.u64);
+	if (!req->status && req->received != req->len) {
+		fprintf(stderr, "Command %u completed with %zu of %zu bytes\n",
+			cqe->command_id, req->received, req->len);
+		return -EPROTO;
+	}
+	disc_host_req_done(h, cqe->command_id);
+	return 0;
+}
+
+/*
+ * Command the C2HData PDU @pdu with @data_len bytes of data belongs
+ * to, if the data fits into its buffer; NULL otherwise.
+ */
+static struct disc_host_req *disc_host_c2h_req(struct disc_host *h,
+					       struct nvme_tcp_data_pdu *pdu,
+					       size_t data_len)
+{
+	struct disc_host_req *req;
+	size_t off = le32toh(pdu->data_offset);
+	size_t len = le32toh(pdu->data_length);
+
+	req = disc_host_req(h, pdu->command_id);
+	if (!req || len != data_len || off > req->len ||
+	    len > req->len - off) {
+		fprintf(stderr, "Invalid c2h_data PDU for command %u, "
+			"offset %zu length %zu\n", pdu->command_id, off, len);
+		return NULL;
+	}
+	return req;
+}
+
+/*
+ * Account @len bytes of C2HData received for command @cid. With
+ * NVME_TCP_F_DATA_SUCCESS the last PDU completes the command, and no
+ * response capsule follows.
+ */
+static int disc_host_c2h_done(struct disc_host *h, __u16 cid, __u8 flags,
+			      size_t len)
+{
+	struct disc_host_req *req = &h->reqs[cid];
+
+	req->received += len;
+	h->num_data += len;
+	if (!(flags & NVME_TCP_F_DATA_SUCCESS))
+		return 0;
+	if (!(flags & NVME_TCP_F_DATA_LAST) || req->received != req->len) {
+		fprintf(stderr, "Invalid c2h_data PDU success flag for "
+			"command %u\n", cid);
+		return -EPROTO;
+	}
+	req->status = NVME_SC_SUCCESS;
+	req->result = 0;
+	disc_host_req_done(h, cid);
+	return 0;
+}
+
+/* C2HData received completely along with the preceding headers */
+static int disc_host_c2h_handler(void *ctx, union nvme_tcp_pdu *pdu,
+				 void *data, size_t data_len)
+{
+	struct disc_host *h = ctx;
+	struct disc_host_req *req;
+
+	req = disc_host_c2h_req(h, &pdu->data, data_len);
+	if (!req)
+		return -EPROTO;
+	memcpy((char *)req->buf + le32toh(pdu->data.data_offset), data,
+	       data_len);
+	h->num_copied += data_len;
+	return disc_host_c2h_done(h, pdu->data.command_id,
+				  pdu->data.hdr.flags, data_len);
+}
+
+static int disc_host_term_handler(void *ctx, union nvme_tcp_pdu *pdu,
+				  void *data, size_t data_len)
+{
+	fprintf(stderr, "Connection terminated by controller, fes %d fei %u\n",
+		le16toh(pdu->term.fes), le32toh(pdu->term.fei));
+	return -ECONNRESET;
+}
+
+static const struct pdu_ops disc_host_pdu_ops = {
+	.handler = {
+		[nvme_tcp_icresp] = disc_host_icresp_handler,
+		[nvme_tcp_c2h_term] = disc_host_term_handler,
+		[nvme_tcp_rsp] = disc_host_rsp_handler,
+		[nvme_tcp_c2h_data] = disc_host_c2h_handler,
+	},
+};
+
+/*
+ * If the PDU at the head of the receive buffer is a C2HData PDU
+ * whose header is complete but whose data is not, switch to
+ * receiving its data into the command buffer. Only the part which
+ * arrived with the header is copied.
+ * Returns 0 or a negative errno.
+ */
+static int disc_host_c2h_start(struct disc_host *h)
+{
+	struct pdu_buf *pb = &h->pb;
+	struct nvme_tcp_data_pdu *pdu;
+	size_t avail = pb->tail - pb->head, hlen = sizeof(*pdu);
+	size_t plen, pdo, ddgst = 0, len, n;
+	int hdgst = pb->digest & NVME_TCP_HDR_DIGEST_ENABLE;
+	__le32 crc;
+
+	if (avail < sizeof(struct nvme_tcp_hdr))
+		return 0;
+	pdu = (struct nvme_tcp_data_pdu *)(pb->buf + pb->head);
+	plen = le32toh(pdu->hdr.plen);
+	if (pdu->hdr.type != nvme_tcp_c2h_data) {
+		if (plen > DISC_HOST_RX_SIZE) {
+			fprintf(stderr, "Invalid %s PDU len %zu\n",
+				pdu_type_name(pdu->hdr.type), plen);
+			return -EPROTO;
+		}
+		return 0;
+	}
+	/* No header padding, as none was requested in the ICReq */
+	pdo = hlen + (hdgst ? NVME_TCP_DIGEST_LENGTH : 0);
+	if (avail < pdo || avail >= plen)
+		return 0;
+	if (pdu->hdr.flags & NVME_TCP_F_DDGST)
+		ddgst = NVME_TCP_DIGEST_LENGTH;
+	if (pdu->hdr.hlen != hlen || pdu->hdr.pdo != pdo ||
+	    !!(pdu->hdr.flags & NVME_TCP_F_HDGST) != !!hdgst ||
+	    (ddgst && !(pb->digest & NVME_TCP_DATA_DIGEST_ENABLE)) ||
+	    plen < pdo + ddgst) {
+		fprintf(stderr, "Invalid c2h_data PDU header\n");
+		return -EPROTO;
+	}
+	if (hdgst) {
+		memcpy(&crc, (char *)pdu + hlen, sizeof(crc));
+		if (le32toh(crc) != crc32c(pdu, hlen)) {
+			fprintf(stderr, "c2h_data PDU header digest error\n");
+			return -EBADMSG;
+		}
+	}
+	len = plen - pdo - ddgst;
+	h->rx_req = disc_host_c2h_req(h, pdu, len);
+	if (!h->rx_req)
+		return -EPROTO;
+	h->rx_cid = pdu->command_id;
+	h->rx_flags = pdu->hdr.flags;
+	h->rx_start = le32toh(pdu->data_offset);
+	h->rx_len = len;
+	h->rx_left = len;
+	h->rx_ddgst_left = ddgst;
+	pb->head += pdo;
+
+	/* Everything else in the buffer belongs to this PDU */
+	n = pb->tail - pb->head < len ? pb->tail - pb->head : len;
+	memcpy((char *)h->rx_req->buf + h->rx_start, pb->buf + pb->head, n);
+	h->num_copied += n;
+	h->rx_left -= n;
+	pb->head += n;
+	n = pb->tail - pb->head;
+	memcpy((char *)&h->rx_ddgst + ddgst - h->rx_ddgst_left,
+	       pb->buf + pb->head, n);
+	h->rx_ddgst_left -= n;
+	pb->head = pb->tail = 0;
+	return 0;
+}
+
+/* Check the C2HData received into the command buffer */
+static int disc_host_c2h_end(struct disc_host *h)
+{
+	struct disc_host_req *req = h->rx_req;
+
+	h->rx_req = NULL;
+	if ((h->rx_flags & NVME_TCP_F_DDGST) &&
+	    le32toh(h->rx_ddgst) != crc32c((char *)req->buf + h->rx_start,
+					   h->rx_len)) {
+		fprintf(stderr, "c2h_data PDU data digest error\n");
+		return -EBADMSG;
+	}
+	return disc_host_c2h_done(h, h->rx_cid, h->rx_flags, h->rx_len);
+}
+
+/*
+ * Receive and process PDUs; the socket blocks up to the I/O timeout.
+ * PDU headers are read into the receive buffer, at most
+ * DISC_HOST_RX_WINDOW bytes at a time, and C2HData into the command
+ * buffer, see disc_host_c2h_start().
+ * Returns 0 or a negative errno.
+ */
+static int disc_host_recv(struct disc_host *h)
+{
+	struct pdu_buf *pb = &h->pb;
+	struct iovec iov[3];
+	size_t window, n;
+	ssize_t len;
+	int cnt = 0, ret;
+
+	if (!pb->buf) {
+		pb->buf = malloc(DISC_HOST_RX_SIZE);
+		if (!pb->buf)
+			return -ENOMEM;
+		pb->size = DISC_HOST_RX_SIZE;
+	}
+	if (pb->size - pb->tail < DISC_HOST_RX_WINDOW) {
+		memmove(pb->buf, pb->buf + pb->head, pb->tail - pb->head);
+		pb->tail -= pb->head;
+		pb->head = 0;
+	}
+	window = pb->size - pb->tail;
+	if (window > DISC_HOST_RX_WINDOW)
+		window = DISC_HOST_RX_WINDOW;
+	if (h->rx_req && h->rx_left) {
+		iov[cnt].iov_base = (char *)h->rx_req->buf + h->rx_start +
+			h->rx_len - h->rx_left;
+		iov[cnt++].iov_len = h->rx_left;
+	}
+	if (h->rx_req && h->rx_ddgst_left) {
+		iov[cnt].iov_base = (char *)&h->rx_ddgst +
+			NVME_TCP_DIGEST_LENGTH - h->rx_ddgst_left;
+		iov[cnt++].iov_len = h->rx_ddgst_left;
+	}
+	iov[cnt].iov_base = pb->buf + pb->tail;
+	iov[cnt++].iov_len = window;
+	do {
+		len = readv(h->fd, iov, cnt);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ?
+			-ETIMEDOUT : -errno;
+	if (!len)
+		return -ECONNRESET;
+
+	if (h->rx_req) {
+		n = (size_t)len < h->rx_left ? (size_t)len : h->rx_left;
+		h->rx_left -= n;
+		len -= n;
+		n = (size_t)len < h->rx_ddgst_left ?
+			(size_t)len : h->rx_ddgst_left;
+		h->rx_ddgst_left -= n;
+		len -= n;
+		if (h->rx_left || h->rx_ddgst_left)
+			return 0;
+		ret = disc_host_c2h_end(h);
+		if (ret < 0)
+			return ret;
+	}
+	pb->tail += len;
+	ret = pdu_dispatch(pb, &disc_host_pdu_ops, h);
+	if (ret < 0)
+		return ret;
+	return disc_host_c2h_start(h);
+}
+
+/*
+ * Queue the command capsule for @cmd with @data_len bytes of
+ * in-capsule data, receiving up to @len bytes of data into @buf.
+ * The command is sent by the next disc_host_flush().
+ * Returns the command id, -EBUSY if NVME_AQ_DEPTH commands are in
+ * flight already, or a negative errno.
+ */
+int disc_host_submit(struct disc_host *h, struct nvme_command *cmd,
+		     const void *data, size_t data_len,
+		     void *buf, size_t len)
+{
+	char pbuf[DISC_HOST_CMD_MAX]
+		__attribute__((aligned(__alignof__(struct nvme_tcp_cmd_pdu))));
+	struct nvme_tcp_cmd_pdu *pdu = (struct nvme_tcp_cmd_pdu *)pbuf;
+	struct disc_host_req *req;
+	size_t plen;
+	__u16 cid;
+
+	if (!h->num_free)
+		return -EBUSY;
+	if (data_len > AUTH_MSG_MAX)
+		return -EINVAL;
+	memset(pdu, 0, sizeof(*pdu));
+	plen = pdu_init_hdr(&pdu->hdr, nvme_tcp_cmd, sizeof(*pdu), data_len,
+			    h->pb.digest);
+	if (h->txlen + plen > sizeof(h->txbuf))
+		return -ENOBUFS;
+
+	cid = h->free_cids[--h->num_free];
+	req = &h->reqs[cid];
+	memset(req, 0, sizeof(*req));
+	req->buf = buf;
+	req->len = buf ? len : 0;
+	req->busy = 1;
+
+	pdu->cmd = *cmd;
+	pdu->cmd.common.command_id = cid;
+	pdu->cmd.common.flags |= NVME_CMD_SGL_METABUF;
+	if (data_len) {
+		pdu->cmd.common.dptr.sgl.type = NVME_SGL_FMT_DATA_DESC << 4 |
+			NVME_SGL_FMT_OFFSET;
+		pdu->cmd.common.dptr.sgl.length = htole32(data_len);
+		memcpy(pdu_data(&pdu->hdr), data, data_len);
+	} else if (req->len) {
+		pdu->cmd.common.dptr.sgl.type =
+			NVME_TRANSPORT_SGL_DATA_DESC << 4;
+		pdu->cmd.common.dptr.sgl.length = htole32(req->len);
+	}
+	pdu_set_digests(&pdu->hdr);
+	memcpy(h->txbuf + h->txlen, pbuf, plen);
+	h->txlen += plen;
+	return cid;
+}
+
+/* Send all queued command capsules. Returns 0 or a negative errno. */
+int disc_host_flush(struct disc_host *h)
+{
+	size_t off = 0;
+	ssize_t len;
+
+	while (off < h->txlen) {
+		len = send(h->fd, h->txbuf + off, h->txlen - off,
+			   MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return -ETIMEDOUT;
+			return -errno;
+		}
+		off += len;
+	}
+	h->txlen = 0;
+	return 0;
+}
+
+/*
+ * Wait for the next completion, sending the queued commands first.
+ * Completions are returned in the order they were received.
+ * Returns the id of the completed command, which may be reused from
+ * now on, or a negative errno.
+ */
+int disc_host_reap(struct disc_host *h, __u16 *status, __u64 *result)
+{
+	struct disc_host_req *req;
+	__u16 cid;
+	int ret;
+
+	ret = disc_host_flush(h);
+	if (ret < 0)
+		return ret;
+	while (!h->num_done) {
+		if (h->num_free == NVME_AQ_DEPTH)
+			return -ENOENT;
+		ret = disc_host_recv(h);
+		if (ret < 0)
+			return ret;
+	}
+	cid = h->done_cids[h->done_head];
+	h->done_head = (h->done_head + 1) % NVME_AQ_DEPTH;
+	h->num_done--;
+	req = &h->reqs[cid];
+	*status = req->status;
+	if (result)
+		*result = req->result;
+	req->busy = 0;
+	req->done = 0;
+	h->free_cids[h->num_free++] = cid;
+	h->num_cmds++;
+	return cid;
+}
+
+/*
+ * Run a single command with no other commands in flight.
+ * Returns the completion status, or a negative errno.
+ */
+int disc_host_exec(struct disc_host *h, struct nvme_command *cmd,
+		   const void *data, size_t data_len,
+		   void *buf, size_t len, __u64 *result)
+{
+	__u16 status;
+	int ret;
+
+	ret = disc_host_submit(h, cmd, data, data_len, buf, len);
+	if (ret < 0)
+		return ret;
+	ret = disc_host_reap(h, &status, result);
+	return ret < 0 ? ret : status;
+}
+
+static int disc_host_prop_get(struct disc_host *h, __u32 offset,
+			      __u64 *value)
+{
+	struct nvme_command cmd;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.prop_get.opcode = nvme_fabrics_command;
+	cmd.prop_get.fctype = nvme_fabrics_type_property_get;
+	/* All properties are read as 8 bytes */
+	cmd.prop_get.attrib = 1;
+	cmd.prop_get.offset = htole32(offset);
+	ret = disc_host_exec(h, &cmd, NULL, 0, NULL, 0, value);
+	if (ret > 0) {
+		fprintf(stderr, "Property Get %#x failed, status %#x\n",
+			offset, ret);
+		return -EIO;
+	}
+	return ret;
+}
+
+static int disc_host_prop_set(struct disc_host *h, __u32 offset, __u64 value)
+{
+	struct nvme_command cmd;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.prop_set.opcode = nvme_fabrics_command;
+	cmd.prop_set.fctype = nvme_fabrics_type_property_set;
+	cmd.prop_set.offset = htole32(offset);
+	cmd.prop_set.value = htole64(value);
+	ret = disc_host_exec(h, &cmd, NULL, 0, NULL, 0, NULL);
+	if (ret > 0) {
+		fprintf(stderr, "Property Set %#x failed, status %#x\n",
+			offset, ret);
+		return -EIO;
+	}
+	return ret;
+}
+
+/* Host NQN from DISC_HOST_NQN_PATH, if present */
+static void disc_host_nqn(char *nqn, size_t size)
+{
+	FILE *f;
+
+	snprintf(nqn, size, "%s", DISC_HOST_NQN);
+	f = fopen(DISC_HOST_NQN_PATH, "r");
+	if (!f)
+		return;
+	if (fgets(nqn, size, f))
+		nqn[strcspn(nqn, " \t\n")] = '\0';
+	if (!*nqn)
+		snprintf(nqn, size, "%s", DISC_HOST_NQN);
+	fclose(f);
+}
+
+/*
+ * Connect the admin queue. Returns the authentication requirements
+ * of the controller, NVME_CONNECT_AUTHREQ_*, or a negative errno.
+ */
+static int disc_host_admin_connect(struct disc_host *h, int kato_ms)
+{
+	struct nvmf_connect_data cd;
+	struct nvme_command cmd;
+	__u64 result;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.connect.opcode = nvme_fabrics_command;
+	cmd.connect.fctype = nvme_fabrics_type_connect;
+	cmd.connect.qid = 0;
+	cmd.connect.sqsize = htole16(NVME_AQ_DEPTH - 1);
+	/* Lets the controller complete commands with their C2HData */
+	cmd.connect.cattr = NVME_CONNECT_DISABLE_SQFLOW;
+	cmd.connect.kato = htole32(kato_ms);
+	memset(&cd, 0, sizeof(cd));
+	cd.cntlid = htole16(NVME_CNTLID_DYNAMIC);
+	strcpy(cd.subsysnqn, NVME_DISC_SUBSYS_NAME);
+	disc_host_nqn(h->hostnqn, sizeof(h->hostnqn));
+	memcpy(cd.hostnqn, h->hostnqn, sizeof(cd.hostnqn));
+	ret = disc_host_exec(h, &cmd, &cd, sizeof(cd), NULL, 0, &result);
+	if (ret > 0) {
+		fprintf(stderr, "Connect failed, status %#x\n", ret);
+		return -ECONNREFUSED;
+	}
+	if (ret < 0)
+		return ret;
+	h->cntlid = result & 0xffff;
+	/* Authentication requirements in the upper half of DW0 */
+	return (result >> 16) & 0xffff;
+}
+
+/*
+ * Send the DH-HMAC-CHAP message @msg of @len bytes with an
+ * Authentication Send command. Returns 0 or a negative errno.
+ */
+static int disc_host_auth_send(struct disc_host *h, const void *msg,
+			       size_t len)
+{
+	struct nvme_command cmd;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.auth_send.opcode = nvme_fabrics_command;
+	cmd.auth_send.fctype = nvme_fabrics_type_auth_send;
+	cmd.auth_send.secp = NVME_AUTH_DHCHAP_PROTOCOL_IDENTIFIER;
+	cmd.auth_send.spsp0 = 0x01;
+	cmd.auth_send.spsp1 = 0x01;
+	cmd.auth_send.tl = htole32(len);
+	ret = disc_host_exec(h, &cmd, msg, len, NULL, 0, NULL);
+	if (ret > 0) {
+		fprintf(stderr, "Authentication Send failed, status %#x\n",
+			ret);
+		return -EACCES;
+	}
+	return ret;
+}
+
+/*
+ * Receive the next DH-HMAC-CHAP message into @buf of AUTH_MSG_MAX
+ * bytes with an Authentication Receive command.
+ * Returns 0 or a negative errno.
+ */
+static int disc_host_auth_recv(struct disc_host *h, void *buf)
+{
+	struct nvme_command cmd;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.auth_receive.opcode = nvme_fabrics_command;
+	cmd.auth_receive.fctype = nvme_fabrics_type_auth_receive;
+	cmd.auth_receive.secp = NVME_AUTH_DHCHAP_PROTOCOL_IDENTIFIER;
+	cmd.auth_receive.spsp0 = 0x01;
+	cmd.auth_receive.spsp1 = 0x01;
+	cmd.auth_receive.al = htole32(AUTH_MSG_MAX);
+	ret = disc_host_exec(h, &cmd, NULL, 0, buf, AUTH_MSG_MAX, NULL);
+	if (ret > 0) {
+		fprintf(stderr, "Authentication Receive failed, status %#x\n",
+			ret);
+		return -EACCES;
+	}
+	return ret;
+}
+
+/*
+ * Authenticate the session with DH-HMAC-CHAP, as the controller
+ * required with @authreq or the host asks to authenticate the
+ * controller. Returns 0, -EACCES if the authentication failed, or a
+ * negative errno.
+ */
+static int disc_host_auth(struct disc_host *h, int authreq)
+{
+	struct auth_session s;
+	__u8 msg[AUTH_MSG_MAX] __attribute__((aligned(AUTH_MSG_ALIGN)));
+	__u8 buf[AUTH_MSG_MAX] __attribute__((aligned(AUTH_MSG_ALIGN)));
+	size_t len;
+	int ret;
+
+	if (authreq & NVME_CONNECT_AUTHREQ_ASCR) {
+		fprintf(stderr, "Secure channel concatenation not supported\n");
+		return -EOPNOTSUPP;
+	}
+	if (!h->auth) {
+		if (!(authreq & NVME_CONNECT_AUTHREQ_ATR))
+			return 0;
+		fprintf(stderr, "Controller requires authentication, "
+			"but no secret is set\n");
+		return -EACCES;
+	}
+	if (!(authreq & NVME_CONNECT_AUTHREQ_ATR) &&
+	    !h->auth->ctrl_secret.len)
+		return 0;
+
+	/* The controller id tells concurrent transactions apart */
+	auth_session_init(&s, h->auth, h->hostnqn, NVME_DISC_SUBSYS_NAME,
+			  h->cntlid);
+	len = auth_host_negotiate(&s, buf);
+	ret = disc_host_auth_send(h, buf, len);
+	if (!ret)
+		ret = disc_host_auth_recv(h, msg);
+	if (!ret) {
+		len = auth_host_reply(&s, msg, AUTH_MSG_MAX, buf);
+		if (len)
+			ret = disc_host_auth_send(h, buf, len);
+	}
+	if (!ret && s.step == AUTH_SUCCESS1) {
+		ret = disc_host_auth_recv(h, msg);
+		if (!ret) {
+			len = auth_host_success(&s, msg, AUTH_MSG_MAX, buf);
+			if (len)
+				ret = disc_host_auth_send(h, buf, len);
+		}
+	}
+	if (!ret && s.step != AUTH_DONE) {
+		fprintf(stderr, "Authentication failed, reason %u\n",
+			s.rescode_exp);
+		ret = -EACCES;
+	}
+	auth_session_free(&s);
+	return ret;
+}
+
+/* Enable the controller and wait until it is ready */
+static int disc_host_enable(struct disc_host *h)
+{
+	struct timespec now, deadline;
+	__u64 csts;
+	int ret;
+
+	ret = disc_host_prop_get(h, NVME_REG_CAP, &h->cap);
+	if (ret < 0)
+		return ret;
+	ret = disc_host_prop_set(h, NVME_REG_CC, NVME_CC_CSS_NVM |
+				 NVME_CC_IOSQES | NVME_CC_IOCQES |
+				 NVME_CC_ENABLE);
+	if (ret < 0)
+		return ret;
+	/* CAP.TO is in units of 500 ms */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_ms(&deadline, (NVME_CAP_TIMEOUT(h->cap) + 1) * 500);
+	for (;;) {
+		ret = disc_host_prop_get(h, NVME_REG_CSTS, &csts);
+		if (ret < 0)
+			return ret;
+		if (csts & NVME_CSTS_CFS) {
+			fprintf(stderr, "Controller fatal status\n");
+			return -EIO;
+		}
+		if (csts & NVME_CSTS_RDY)
+			return 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_ms(&now, &deadline) <= 0)
+			return -ETIMEDOUT;
+		usleep(1000);
+	}
+}
+
+/*
+ * Connect to the discovery controller at @addr:@port with a keep
+ * alive timeout of @kato_ms, and bring it up as a host would:
+ * ICReq, Connect, authentication if needed, Property Get CAP,
+ * Property Set CC.EN and Property Get CSTS until it is ready.
+ * Returns 0 or a negative errno; disc_host_close() has to be called
+ * in either case.
+ */
+int disc_host_connect(struct disc_host *h, const char *addr,
+		      const char *port, int kato_ms)
+{
+	struct timeval tv = {
+		.tv_sec = DISC_HOST_TMO_MS / 1000,
+		.tv_usec = (DISC_HOST_TMO_MS % 1000) * 1000,
+	};
+	struct nvme_tcp_icreq_pdu icreq;
+	struct he_conn hc;
+	int on = 1, ret;
+
+	ret = he_resolve(&hc, addr, port, HE_STAGGER_MS, DISC_HOST_TMO_MS);
+	if (ret < 0)
+		return ret;
+	h->fd = he_connect(&hc);
+	ret = -hc.err;
+	he_free(&hc);
+	if (h->fd < 0)
+		return ret ? ret : -ECONNREFUSED;
+	fcntl(h->fd, F_SETFL, fcntl(h->fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(h->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(h->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(h->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	/* A host connection, not a kickstart */
+	icreq_init(&icreq, h->digest);
+	icreq.hdr.flags = 0;
+	memcpy(h->txbuf, &icreq, sizeof(icreq));
+	h->txlen = sizeof(icreq);
+	ret = disc_host_flush(h);
+	while (!ret && !h->icresp)
+		ret = disc_host_recv(h);
+	if (!ret)
+		ret = disc_host_admin_connect(h, kato_ms);
+	if (ret >= 0)
+		ret = disc_host_auth(h, ret);
+	if (!ret)
+		ret = disc_host_enable(h);
+	return ret;
+}
+
+static void disc_host_glp(struct nvme_command *cmd, __u64 off, size_t len)
+{
+	__u32 numd = len / 4 - 1;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->get_log_page.opcode = nvme_admin_get_log_page;
+	cmd->get_log_page.lid = NVME_LOG_DISC;
+	cmd->get_log_page.numdl = htole16(numd & 0xffff);
+	cmd->get_log_page.numdu = htole16(numd >> 16);
+	cmd->get_log_page.lpo = htole64(off);
+}
+
+/* Read the discovery log page header into @hdr */
+static int disc_host_get_hdr(struct disc_host *h,
+			     struct nvmf_disc_rsp_page_hdr *hdr)
+{
+	struct nvme_command cmd;
+	int ret;
+
+	disc_host_glp(&cmd, 0, sizeof(*hdr));
+	ret = disc_host_exec(h, &cmd, NULL, 0, hdr, sizeof(*hdr), NULL);
+	if (ret > 0) {
+		fprintf(stderr, "Get Log Page failed, status %#x\n", ret);
+		return -EIO;
+	}
+	return ret;
+}
+
+/*
+ * Read the entries of the discovery log @log of @len bytes in
+ * DISC_HOST_CHUNK sized pieces with up to @depth Get Log Page
+ * commands in flight.
+ * Returns 1 if the log page ended before @len, which it does when it
+ * shrank after its header was read.
+ */
+static int disc_host_get_entries(struct disc_host *h, int depth,
+				 struct nvmf_disc_rsp_page_hdr *log,
+				 size_t len)
+{
+	struct nvme_command cmd;
+	size_t off = sizeof(*log), chunk;
+	__u16 status;
+	int inflight = 0, shrunk = 0, ret;
+
+	while (off < len || inflight) {
+		while (off < len && inflight < depth) {
+			chunk = len - off < DISC_HOST_CHUNK ?
+				len - off : DISC_HOST_CHUNK;
+			disc_host_glp(&cmd, off, chunk);
+			ret = disc_host_submit(h, &cmd, NULL, 0,
+					       (char *)log + off, chunk);
+			if (ret < 0)
+				return ret;
+			off += chunk;
+			inflight++;
+		}
+		ret = disc_host_reap(h, &status, NULL);
+		if (ret < 0)
+			return ret;
+		inflight--;
+		/* An offset beyond the end of the log page is invalid */
+		if ((status & ~NVME_SC_DNR) == NVME_SC_INVALID_FIELD) {
+			shrunk = 1;
+			off = len;
+		} else if (status) {
+			fprintf(stderr, "Get Log Page failed, status %#x\n",
+				status);
+			return -EIO;
+		}
+	}
+	return shrunk;
+}
+
+/*
+ * Bring the discovery log in @h->log up to date. Only the header is
+ * read if its genctr matches that of @h->log, as it does for nearly
+ * all polls. Otherwise the entries are read with up to @depth
+ * Get Log Page commands in flight, and the header is read again: a
+ * log changing while its entries were read, which may also have made
+ * it shorter than the entries asked for, is read once more, up to
+ * DISC_HOST_LOG_RETRIES times.
+ * Returns 1 if @h->log was replaced, 0 if it was up to date, -EAGAIN
+ * if the log kept changing, or another negative errno after which the
+ * connection has to be closed.
+ */
+int disc_host_get_log(struct disc_host *h, int depth)
+{
+	struct nvmf_disc_rsp_page_hdr hdr, *log = NULL, *tmp;
+	size_t len;
+	__u64 numrec;
+	int tries, shrunk, ret;
+
+	if (depth < 1)
+		depth = 1;
+	if (depth > NVME_AQ_DEPTH)
+		depth = NVME_AQ_DEPTH;
+	ret = disc_host_get_hdr(h, &hdr);
+	if (ret < 0)
+		return ret;
+	h->num_polls++;
+	if (h->log && h->log->genctr == hdr.genctr) {
+		h->num_unchanged++;
+		return 0;
+	}
+
+	for (tries = 0; ; tries++) {
+		numrec = le64toh(hdr.numrec);
+		if (numrec > (SIZE_MAX - sizeof(hdr)) /
+		    sizeof(hdr.entries[0])) {
+			ret = -EPROTO;
+			goto out_free;
+		}
+		len = sizeof(hdr) + numrec * sizeof(hdr.entries[0]);
+		tmp = realloc(log, len);
+		if (!tmp) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		log = tmp;
+		memcpy(log, &hdr, sizeof(hdr));
+		/* A header alone is read by a single command */
+		if (len == sizeof(hdr))
+			break;
+		ret = disc_host_get_entries(h, depth, log, len);
+		if (ret < 0)
+			goto out_free;
+		shrunk = ret;
+		ret = disc_host_get_hdr(h, &hdr);
+		if (ret < 0)
+			goto out_free;
+		if (hdr.genctr == log->genctr) {
+			if (!shrunk)
+				break;
+			fprintf(stderr, "discovery log shorter than its "
+				"header\n");
+			ret = -EPROTO;
+			goto out_free;
+		}
+		h->num_torn++;
+		if (tries == DISC_HOST_LOG_RETRIES) {
+			fprintf(stderr, "discovery log changed while "
+				"being read %d times\n", tries + 1);
+			ret = -EAGAIN;
+			goto out_free;
+		}
+	}
+	free(h->log);
+	h->log = log;
+	h->log_len = len;
+	return 1;
+out_free:
+	free(log);
+	return ret;
+}
+
+static const char *disc_host_subtype_name(__u8 subtype)
+{
+	switch (subtype) {
+	case NVME_NQN_DISC:
+		return "referral";
+	case NVME_NQN_NVME:
+		return "nvme";
+	case NVME_NQN_CURR:
+		return "current";
+	}
+	return "unknown";
+}
+
+void disc_host_print_log(struct nvmf_disc_rsp_page_hdr *log)
+{
+	__u64 i, numrec = le64toh(log->numrec);
+
+	printf("Discovery log: genctr %llu, %llu records\n",
+	       (unsigned long long)le64toh(log->genctr),
+	       (unsigned long long)numrec);
+	for (i = 0; i < numrec; i++) {
+		struct nvmf_disc_rsp_page_entry *e = &log->entries[i];
+
+		printf("%4llu: %s %s %.*s:%.*s portid %u %s %.*s\n",
+		       (unsigned long long)i, nvmf_trtype_name(e->trtype),
+		       nvmf_adrfam_name(e->adrfam),
+		       (int)strnlen(e->traddr, sizeof(e->traddr)), e->traddr,
+		       (int)strnlen(e->trsvcid, sizeof(e->trsvcid)), e->trsvcid,
+		       le16toh(e->portid), disc_host_subtype_name(e->subtype),
+		       (int)strnlen(e->subnqn, sizeof(e->subnqn)), e->subnqn);
+	}
+}
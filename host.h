@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * host.h - NVMe/TCP discovery host
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "nvme.h"
+#include "nvme-tcp.h"
+#include "pdu.h"
+#include "auth.h"
+
+/* Host NQN file, and the host NQN used if it does not exist */
+#define DISC_HOST_NQN_PATH	"/etc/nvme/hostnqn"
+#define DISC_HOST_NQN		"nqn.2014-08.org.nvmexpress:acdc"
+
+/* Discovery log data read by each Get Log Page command */
+#define DISC_HOST_CHUNK		(256 * 1024)
+
+/*
+ * Receive buffer for PDU headers, and the most read into it at once;
+ * C2HData read along with headers is copied, all other C2HData is
+ * received into the command buffer directly
+ */
+#define DISC_HOST_RX_SIZE	4096
+#define DISC_HOST_RX_WINDOW	512
+
+/* Discovery log reads repeated when the log changes while being read */
+#define DISC_HOST_LOG_RETRIES	3
+
+/* I/O timeout, and default keep alive timeout in ms */
+#define DISC_HOST_TMO_MS	5000
+#define DISC_HOST_KATO_MS	30000
+
+/* Records of the host benchmark, and discovery log reads per depth */
+#define DISC_HOST_BENCH_RECS	10000
+#define DISC_HOST_BENCH_READS	50
+
+/*
+ * Largest command capsule: an Authentication Send with a DH-HMAC-CHAP
+ * Reply, which is larger than the data of a Connect
+ */
+#define DISC_HOST_CMD_MAX	(sizeof(struct nvme_tcp_cmd_pdu) + \
+				 AUTH_MSG_MAX + 2 * NVME_TCP_DIGEST_LENGTH)
+
+/**
+ * struct disc_host_req - admin command in flight
+ *
+ * @buf:           destination of the command data, NULL if none
+ * @len:           length of @buf
+ * @received:      bytes of data received so far
+ * @status:        completion status without the phase bit, valid
+ *                 once @done is set
+ * @result:        completion result
+ * @busy:          the command was submitted
+ * @done:          the completion was received
+ */
+struct disc_host_req {
+	void *buf;
+	size_t len;
+	size_t received;
+	__u16 status;
+	__u64 result;
+	int busy;
+	int done;
+};
+
+/**
+ * struct disc_host - connection to a discovery controller
+ *
+ * @fd:            connected socket, -1 if none
+ * @pb:            PDU receive buffer
+ * @digest:        requested and negotiated digests
+ * @icresp:        the ICResp was received
+ * @auth:          DH-HMAC-CHAP secrets, NULL to not authenticate
+ * @hostnqn:       host NQN sent in the Connect command
+ * @cntlid:        controller id assigned by the Connect command
+ * @cap:           controller capabilities
+ * @reqs:          commands in flight, indexed by command id
+ * @free_cids:     stack of unused command ids
+ * @num_free:      number of entries in @free_cids
+ * @done_cids:     completed command ids in completion order
+ * @done_head:     first entry of @done_cids
+ * @num_done:      number of entries in @done_cids
+ * @txbuf:         command capsules not sent yet
+ * @txlen:         number of bytes in @txbuf
+ * @rx_req:        command whose C2HData is being received into its
+ *                 buffer, NULL while receiving PDU headers
+ * @rx_cid:        command id of @rx_req
+ * @rx_flags:      header flags of the C2HData PDU
+ * @rx_start:      offset of the PDU data in the buffer of @rx_req
+ * @rx_len:        length of the PDU data
+ * @rx_left:       PDU data bytes still to be received
+ * @rx_ddgst:      data digest of the PDU
+ * @rx_ddgst_left: data digest bytes still to be received
+ * @log:           last discovery log read, NULL if none
+ * @log_len:       length of @log
+ * @num_cmds:      number of commands completed
+ * @num_data:      C2HData bytes received
+ * @num_copied:    C2HData bytes copied from the receive buffer
+ * @num_polls:     discovery log reads
+ * @num_unchanged: discovery log reads which found @log up to date
+ * @num_torn:      discovery log reads repeated as the log changed
+ *
+ * The command id of a command is its index in @reqs, so that the
+ * completions of commands in flight concurrently are matched to
+ * them without searching. Commands are batched in @txbuf until
+ * disc_host_flush() sends them with a single write.
+ *
+ * Once the header of a C2HData PDU has been received, its data and
+ * digest are read with a single readv() into the command buffer at
+ * the PDU offset, along with the headers of the following PDUs.
+ *
+ * With @auth, the host authenticates after the Connect command if the
+ * controller requires it, or if @auth has a controller secret to
+ * authenticate the controller with.
+ */
+struct disc_host {
+	int fd;
+	struct pdu_buf pb;
+	__u8 digest;
+	int icresp;
+	struct auth_ctx *auth;
+	char hostnqn[NVMF_NQN_FIELD_LEN + 1];
+	__u16 cntlid;
+	__u64 cap;
+	struct disc_host_req reqs[NVME_AQ_DEPTH];
+	__u16 free_cids[NVME_AQ_DEPTH];
+	int num_free;
+	__u16 done_cids[NVME_AQ_DEPTH];
+	int done_head;
+	int num_done;
+	char txbuf[NVME_AQ_DEPTH * DISC_HOST_CMD_MAX];
+	size_t txlen;
+	struct disc_host_req *rx_req;
+	__u16 rx_cid;
+	__u8 rx_flags;
+	size_t rx_start;
+	size_t rx_len;
+	size_t rx_left;
+	__le32 rx_ddgst;
+	size_t rx_ddgst_left;
+	struct nvmf_disc_rsp_page_hdr *log;
+	size_t log_len;
+	unsigned long num_cmds;
+	unsigned long num_data;
+	unsigned long num_copied;
+	unsigned long num_polls;
+	unsigned long num_unchanged;
+	unsigned long num_torn;
+};
+
+void disc_host_init(struct disc_host *h, __u8 digest,
+		    struct auth_ctx *auth);
+int disc_host_connect(struct disc_host *h, const char *addr,
+		      const char *port, int kato_ms);
+void disc_host_close(struct disc_host *h);
+int disc_host_submit(struct disc_host *h, struct nvme_command *cmd,
+		     const void *data, size_t data_len,
+		     void *buf, size_t len);
+int disc_host_flush(struct disc_host *h);
+int disc_host_reap(struct disc_host *h, __u16 *status, __u64 *result);
+int disc_host_exec(struct disc_host *h, struct nvme_command *cmd,
+		   const void *data, size_t data_len,
+		   void *buf, size_t len, __u64 *result);
+int disc_host_get_log(struct disc_host *h, int depth);
+void disc_host_print_log(struct nvmf_disc_rsp_page_hdr *log);
+
+#endif /* _HOST_H */
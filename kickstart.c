@@ -0,0 +1,395 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * kickstart.c - concurrent kickstart registration with several CDCs
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Drives the connect/ICReq/KDReq exchange for all CDCs from a single
+ * epoll loop with non-blocking sockets, so the total registration time
+ * is governed by the slowest CDC and not by the sum of all of them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+
+#include "acdc.h"
+
+/*
+ * struct kickstart_batch - KDReq PDUs shared between all CDCs
+ */
+struct kickstart_batch {
+	struct port_delta *pd;
+	__u8 digest;
+	char *kdreq_buf;
+	size_t kdreq_len;
+	int num_pdus;
+};
+
+static const char *cdc_state_name[] = {
+	[CDC_CONNECTING] = "connect",
+	[CDC_ICREQ] = "icreq",
+	[CDC_KDREQ] = "kdreq",
+	[CDC_READY] = "ready",
+	[CDC_DONE] = "done",
+	[CDC_FAILED] = "failed",
+	[CDC_BACKOFF] = "backoff",
+};
+
+const char *cdc_state_str(enum cdc_state state)
+{
+	return cdc_state_name[state];
+}
+
+void cdc_fail(int efd, struct cdc_ctx *cdc, int err, const char *msg)
+{
+	if (cdc->sfd >= 0) {
+		epoll_ctl(efd, EPOLL_CTL_DEL, cdc->sfd, NULL);
+		close(cdc->sfd);
+		cdc->sfd = -1;
+	}
+	cdc->err = err;
+	cdc->errstr = msg;
+	cdc->state = CDC_FAILED;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_end);
+}
+
+static void cdc_done(int efd, struct cdc_ctx *cdc)
+{
+	epoll_ctl(efd, EPOLL_CTL_DEL, cdc->sfd, NULL);
+	close(cdc->sfd);
+	cdc->sfd = -1;
+	cdc->state = CDC_DONE;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_end);
+}
+
+static int cdc_watch(int efd, struct cdc_ctx *cdc, int op, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = cdc;
+	return epoll_ctl(efd, op, cdc->sfd, &ev);
+}
+
+static int cdc_watch_attempt(void *arg, int fd)
+{
+	struct cdc_ctx *cdc = arg;
+	struct epoll_event ev;
+
+	/* Completion of the connect is signalled by EPOLLOUT */
+	ev.events = EPOLLOUT;
+	ev.data.ptr = cdc;
+	return epoll_ctl(cdc->efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void cdc_send_pdu(int efd, struct cdc_ctx *cdc,
+		  enum cdc_state state, const char *buf, size_t len)
+{
+	cdc->state = state;
+	cdc->txbuf = buf;
+	cdc->txlen = len;
+	cdc->txoff = 0;
+	if (cdc_watch(efd, cdc, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT) < 0)
+		cdc_fail(efd, cdc, errno, "epoll_ctl");
+}
+
+void cdc_handle_connect(int efd, struct cdc_ctx *cdc, const char *icreq_buf)
+{
+	int ret;
+
+	ret = he_check(&cdc->hc);
+	if (ret < 0) {
+		cdc_fail(efd, cdc, cdc->hc.err, "connect");
+		return;
+	}
+	if (!ret)
+		return;
+	/* The other attempts are closed and thus removed from epoll */
+	cdc->sfd = cdc->hc.fd;
+	cdc_send_pdu(efd, cdc, CDC_ICREQ, icreq_buf,
+		     sizeof(struct nvme_tcp_icreq_pdu));
+}
+
+void cdc_handle_output(int efd, struct cdc_ctx *cdc)
+{
+	ssize_t len;
+
+	while (cdc->txoff < cdc->txlen) {
+		len = send(cdc->sfd, cdc->txbuf + cdc->txoff,
+			   cdc->txlen - cdc->txoff, MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			cdc_fail(efd, cdc, errno, "send");
+			return;
+		}
+		cdc->txoff += len;
+	}
+	/* Request sent, only wait for the response */
+	if (cdc_watch(efd, cdc, EPOLL_CTL_MOD, EPOLLIN) < 0)
+		cdc_fail(efd, cdc, errno, "epoll_ctl");
+}
+
+/*
+ * Send the KDReq PDUs, reformatting them if the CDC announced a
+ * lower PDU size limit than the one used for the shared batch.
+ */
+static void cdc_send_kdreq(int efd, struct cdc_ctx *cdc,
+			   struct kickstart_batch *kb)
+{
+	unsigned int maxdata = cdc->maxdata;
+	size_t len;
+
+	if (maxdata && maxdata < NVME_TCP_KDREQ_MAX_PDU_LEN) {
+		cdc->kdreq_buf = kdreq_alloc(kb->pd, maxdata, kb->digest,
+					     &len, &cdc->num_pdus);
+		if (!cdc->kdreq_buf) {
+			cdc_fail(efd, cdc, ENOMEM, "kdreq");
+			return;
+		}
+		cdc_send_pdu(efd, cdc, CDC_KDREQ, cdc->kdreq_buf, len);
+		return;
+	}
+	cdc->num_pdus = kb->num_pdus;
+	cdc_send_pdu(efd, cdc, CDC_KDREQ, kb->kdreq_buf, kb->kdreq_len);
+}
+
+static void cdc_handle_input(int efd, struct cdc_ctx *cdc,
+			     struct kickstart_batch *kb)
+{
+	int ret;
+
+	for (;;) {
+		ret = pdu_recv(cdc->sfd, &cdc->pb, &cdc_pdu_ops, cdc);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+			return;
+		if (ret < 0) {
+			cdc_fail(efd, cdc, -ret, cdc_state_name[cdc->state]);
+			return;
+		}
+		/* ICResp received, KDReq not yet sent */
+		if (cdc->state == CDC_KDREQ && !cdc->num_pdus) {
+			cdc_send_kdreq(efd, cdc, kb);
+			if (cdc->state == CDC_FAILED)
+				return;
+		}
+		if (cdc->state == CDC_KDREQ && cdc->num_pdus &&
+		    cdc->num_resp == cdc->num_pdus)
+			break;
+	}
+	if (cdc->num_failed) {
+		free(cdc->nqn);
+		cdc->nqn = NULL;
+		cdc_fail(efd, cdc, EPROTO, "kickstart rejected");
+		return;
+	}
+	cdc_done(efd, cdc);
+}
+
+void cdc_start(int efd, struct cdc_ctx *cdc, struct kickstart_opts *opts)
+{
+	int err;
+
+	cdc->sfd = -1;
+	cdc->efd = efd;
+	pdu_buf_init(&cdc->pb, 0);
+	cdc->maxdata = 0;
+	cdc->nqn = NULL;
+	cdc->kdreq_buf = NULL;
+	cdc->num_pdus = 0;
+	cdc->num_resp = 0;
+	cdc->num_failed = 0;
+	cdc->err = 0;
+	cdc->errstr = NULL;
+	cdc->state = CDC_CONNECTING;
+	clock_gettime(CLOCK_MONOTONIC, &cdc->t_start);
+
+	err = he_resolve(&cdc->hc, cdc->addr, cdc->port,
+			 opts->stagger_ms, opts->connect_tmo_ms);
+	if (err < 0) {
+		cdc_fail(efd, cdc, -err, "resolve");
+		return;
+	}
+	cdc->hc.watch = cdc_watch_attempt;
+	cdc->hc.watch_arg = cdc;
+	he_start(&cdc->hc);
+	if (!cdc->hc.active && cdc->hc.fd < 0)
+		cdc_fail(efd, cdc, cdc->hc.err, "connect");
+}
+
+/*
+ * Send the changes in @pd to all CDCs in @cdcs concurrently, waiting at
+ * most @tmo seconds. Returns the number of successful registrations.
+ */
+int kickstart_cdcs(struct cdc_ctx *cdcs, int num_cdcs,
+		   struct port_delta *pd, struct kickstart_opts *opts)
+{
+	__u8 digest = opts->digest;
+	int tmo = opts->tmo;
+	struct nvme_tcp_icreq_pdu icreq;
+	struct kickstart_batch kb;
+	struct epoll_event *events;
+	struct timespec t_start, t_now;
+	int efd, i, pending = 0, num_ok = 0;
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (efd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	events = calloc(num_cdcs, sizeof(*events));
+	if (!events) {
+		perror("calloc");
+		close(efd);
+		return -1;
+	}
+
+	/* The PDUs are identical for most CDCs, so format them only once */
+	icreq_init(&icreq, digest);
+	kb.pd = pd;
+	kb.digest = digest;
+	kb.kdreq_buf = kdreq_alloc(pd, NVME_TCP_KDREQ_MAX_PDU_LEN, digest,
+				   &kb.kdreq_len, &kb.num_pdus);
+	if (!kb.kdreq_buf) {
+		free(events);
+		close(efd);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (i = 0; i < num_cdcs; i++) {
+		cdcs[i].digest = digest;
+		cdc_start(efd, &cdcs[i], opts);
+		if (cdcs[i].state != CDC_FAILED)
+			pending++;
+	}
+
+	while (pending) {
+		long elapsed, wait;
+		int n;
+
+		/* Start staggered attempts and expire connect timeouts */
+		for (i = 0; i < num_cdcs; i++) {
+			struct cdc_ctx *cdc = &cdcs[i];
+
+			if (cdc->state != CDC_CONNECTING)
+				continue;
+			cdc_handle_connect(efd, cdc, (const char *)&icreq);
+			if (cdc->state == CDC_FAILED)
+				pending--;
+		}
+		if (!pending)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &t_now);
+		elapsed = timespec_diff_ms(&t_start, &t_now);
+		if (elapsed >= tmo * 1000L)
+			break;
+		wait = tmo * 1000L - elapsed;
+		for (i = 0; i < num_cdcs; i++) {
+			struct cdc_ctx *cdc = &cdcs[i];
+
+			if (cdc->state == CDC_CONNECTING &&
+			    he_wait_ms(&cdc->hc) < wait)
+				wait = he_wait_ms(&cdc->hc);
+		}
+		n = epoll_wait(efd, events, num_cdcs, wait);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct cdc_ctx *cdc = events[i].data.ptr;
+			uint32_t ev = events[i].events;
+
+			/* Stale event for another attempt of this CDC */
+			if (cdc->state == CDC_DONE || cdc->state == CDC_FAILED)
+				continue;
+			if (cdc->state == CDC_CONNECTING) {
+				cdc_handle_connect(efd, cdc,
+						   (const char *)&icreq);
+			} else {
+				if (ev & EPOLLOUT)
+					cdc_handle_output(efd, cdc);
+				if ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+				    cdc->state != CDC_FAILED)
+					cdc_handle_input(efd, cdc, &kb);
+			}
+			if (cdc->state == CDC_DONE ||
+			    cdc->state == CDC_FAILED)
+				pending--;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_now);
+	for (i = 0; i < num_cdcs; i++) {
+		struct cdc_ctx *cdc = &cdcs[i];
+
+		if (cdc->state != CDC_DONE && cdc->state != CDC_FAILED) {
+			const char *state = cdc_state_name[cdc->state];
+
+			cdc_fail(efd, cdc, ETIMEDOUT, state);
+		}
+		he_free(&cdc->hc);
+		free(cdc->kdreq_buf);
+		cdc->kdreq_buf = NULL;
+		pdu_buf_free(&cdc->pb);
+		if (cdc->state == CDC_DONE) {
+			printf("CDC %s:%s: registered with %s (%ld ms)\n",
+			       cdc->addr, cdc->port, cdc->nqn,
+			       timespec_diff_ms(&cdc->t_start, &cdc->t_end));
+			num_ok++;
+		} else {
+			printf("CDC %s:%s: %s: %s (%ld ms)\n",
+			       cdc->addr, cdc->port, cdc->errstr,
+			       strerror(cdc->err),
+			       timespec_diff_ms(&cdc->t_start, &cdc->t_end));
+		}
+	}
+	printf("Registered with %d of %d CDCs in %ld ms\n",
+	       num_ok, num_cdcs, timespec_diff_ms(&t_start, &t_now));
+
+	free(kb.kdreq_buf);
+	free(events);
+	close(efd);
+	return num_ok;
+}
+
+/*
+ * Point the referrals of the nvmet ports in @recs to CDC @i of the
+ * CDCs the ports are registered with.
+ */
+void kickstart_referral(const char *root, struct cdc_ctx *cdc, int i,
+			struct port_rec *recs, int num_recs)
+{
+	char ref[32] = "parent";
+
+	if (i > 0)
+		sprintf(ref, "parent%d", i);
+	register_parent(root, recs, num_recs, ref, cdc->addr, cdc->port);
+}
+
+/*
+ * Point the referrals of the nvmet ports in @recs to all CDCs which
+ * completed the kickstart.
+ */
+void kickstart_referrals(const char *root, struct cdc_ctx *cdcs, int num_cdcs,
+			 struct port_rec *recs, int num_recs)
+{
+	int i;
+
+	for (i = 0; i < num_cdcs; i++) {
+		if (cdcs[i].state == CDC_DONE)
+			kickstart_referral(root, &cdcs[i], i, recs, num_recs);
+	}
+}
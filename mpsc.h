@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * mpsc.h - lock-free multi-producer single-consumer queue
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Intrusive linked list after Dmitry Vyukov: producers append with a
+ * single atomic exchange and never wait for each other, the consumer
+ * pops without atomic read-modify-write operations. Nodes of a
+ * single producer are consumed in the order they were pushed.
+ */
+
+#ifndef _MPSC_H
+#define _MPSC_H
+
+#include <stddef.h>
+
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+/**
+ * struct mpsc - multi-producer single-consumer queue
+ *
+ * @head:          last node pushed, written by the producers
+ * @tail:          next node to pop, only used by the consumer
+ * @stub:          placeholder keeping the list non-empty
+ */
+struct mpsc {
+	struct mpsc_node *head;
+	struct mpsc_node *tail;
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc *q, struct mpsc_node *n)
+{
+	struct mpsc_node *prev;
+
+	n->next = NULL;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pop the oldest node. Returns NULL if the queue is empty, or if a
+ * producer is still linking in the next node; it will be seen by a
+ * later call.
+ */
+static inline struct mpsc_node *mpsc_pop(struct mpsc *q)
+{
+	struct mpsc_node *tail = q->tail, *next, *head;
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail != head)
+		return NULL;
+	/* Re-insert the stub so the last node can be handed out */
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+#endif /* _MPSC_H */
@@ -52,6 +52,7 @@ enum nvme_tcp_pdu_flags {
 	NVME_TCP_F_DDGST		= (1 << 1),
 	NVME_TCP_F_DATA_LAST		= (1 << 2),
 	NVME_TCP_F_DATA_SUCCESS		= (1 << 3),
+	NVME_TCP_F_KDDEREG		= (1 << 4),	/* acdc: KDReq removes records */
 	NVME_TCP_F_KDCONN		= (1 << 7),
 };
 
@@ -235,6 +236,7 @@ enum nvme_tcp_kdresp_failure_reason {
 union nvme_tcp_pdu {
 	struct nvme_tcp_icreq_pdu	icreq;
 	struct nvme_tcp_icresp_pdu	icresp;
+	struct nvme_tcp_term_pdu	term;
 	struct nvme_tcp_cmd_pdu		cmd;
 	struct nvme_tcp_rsp_pdu		rsp;
 	struct nvme_tcp_r2t_pdu		r2t;
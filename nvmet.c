@@ -0,0 +1,1092 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * nvmet.c - nvmet configfs port records
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nvmet.h"
+#include "uring.h"
+
+struct nvmf_name {
+	__u8 val;
+	const char *name;
+};
+
+static const struct nvmf_name trtype_names[] = {
+	{ NVMF_TRTYPE_RDMA, "rdma" },
+	{ NVMF_TRTYPE_FC, "fc" },
+	{ NVMF_TRTYPE_TCP, "tcp" },
+	{ NVMF_TRTYPE_LOOP, "loop" },
+};
+
+static const struct nvmf_name adrfam_names[] = {
+	{ NVMF_ADDR_FAMILY_PCI, "pci" },
+	{ NVMF_ADDR_FAMILY_IP4, "ipv4" },
+	{ NVMF_ADDR_FAMILY_IP6, "ipv6" },
+	{ NVMF_ADDR_FAMILY_IB, "ib" },
+	{ NVMF_ADDR_FAMILY_FC, "fc" },
+	{ NVMF_ADDR_FAMILY_LOOP, "loop" },
+};
+
+#define NUM_NAMES(n) (sizeof(n) / sizeof((n)[0]))
+
+static int nvmf_lookup(const struct nvmf_name *names, int num,
+		       const char *name)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (!strcmp(names[i].name, name))
+			return names[i].val;
+	}
+	return -1;
+}
+
+static const char *nvmf_name(const struct nvmf_name *names, int num,
+			     __u8 val)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (names[i].val == val)
+			return names[i].name;
+	}
+	return "<unknown>";
+}
+
+const char *nvmf_trtype_name(__u8 trtype)
+{
+	return nvmf_name(trtype_names, NUM_NAMES(trtype_names), trtype);
+}
+
+const char *nvmf_adrfam_name(__u8 adrfam)
+{
+	return nvmf_name(adrfam_names, NUM_NAMES(adrfam_names), adrfam);
+}
+
+/*
+ * Set trtype, adrfam and the trsvcid default of @rec; @traddr has to
+ * be filled in already.
+ */
+static int port_rec_set_type(struct port_rec *rec, const char *trtype,
+			     const char *adrfam)
+{
+	int val;
+
+	val = nvmf_lookup(trtype_names, NUM_NAMES(trtype_names), trtype);
+	if (val < 0)
+		return -EINVAL;
+	rec->trtype = val;
+	if (strlen(adrfam)) {
+		val = nvmf_lookup(adrfam_names, NUM_NAMES(adrfam_names),
+				  adrfam);
+		if (val < 0)
+			return -EINVAL;
+		rec->adrfam = val;
+	} else if (rec->trtype == NVMF_TRTYPE_FC) {
+		rec->adrfam = NVMF_ADDR_FAMILY_FC;
+	} else if (rec->trtype == NVMF_TRTYPE_LOOP) {
+		rec->adrfam = NVMF_ADDR_FAMILY_LOOP;
+	} else if (strchr(rec->traddr, ':')) {
+		rec->adrfam = NVMF_ADDR_FAMILY_IP6;
+	} else {
+		rec->adrfam = NVMF_ADDR_FAMILY_IP4;
+	}
+	if (!strlen(rec->trsvcid))
+		strcpy(rec->trsvcid, PORT_REC_TRSVCID);
+	return 0;
+}
+
+/*
+ * Copy the next ',' separated field from @str into @buf and advance
+ * @str past it; @str is set to NULL after the last field.
+ */
+static int port_rec_field(const char **str, char *buf, size_t size)
+{
+	const char *s = *str;
+	size_t len;
+
+	if (!s) {
+		buf[0] = '\0';
+		return 0;
+	}
+	len = strcspn(s, ",");
+	if (len >= size)
+		return -EINVAL;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	*str = s[len] ? s + len + 1 : NULL;
+	return len;
+}
+
+/*
+ * Parse a record given as 'trtype,traddr[,adrfam[,trsvcid]]'.
+ */
+int port_rec_parse(struct port_rec *rec, const char *str)
+{
+	char trtype[16], adrfam[16];
+	const char *p = str;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->portid = -1;
+	if (port_rec_field(&p, trtype, sizeof(trtype)) <= 0 ||
+	    port_rec_field(&p, rec->traddr, sizeof(rec->traddr)) <= 0 ||
+	    port_rec_field(&p, adrfam, sizeof(adrfam)) < 0 ||
+	    port_rec_field(&p, rec->trsvcid, sizeof(rec->trsvcid)) < 0 ||
+	    p != NULL)
+		return -EINVAL;
+	return port_rec_set_type(rec, trtype, adrfam);
+}
+
+static int port_rec_cmp(const void *a, const void *b)
+{
+	const struct port_rec *ra = a, *rb = b;
+
+	return ra->portid - rb->portid;
+}
+
+void port_rec_sort(struct port_rec *recs, int num_recs)
+{
+	qsort(recs, num_recs, sizeof(*recs), port_rec_cmp);
+}
+
+int port_rec_equal(struct port_rec *a, struct port_rec *b)
+{
+	return a->trtype == b->trtype && a->adrfam == b->adrfam &&
+		!strcmp(a->traddr, b->traddr) &&
+		!strcmp(a->trsvcid, b->trsvcid);
+}
+
+/*
+ * Fill in record @i of the benchmarks: TCP ports on distinct IPv4
+ * addresses, and on distinct service ids beyond 2^24 records.
+ */
+void port_rec_bench(struct port_rec *rec, int i)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->portid = -1;
+	rec->trtype = NVMF_TRTYPE_TCP;
+	rec->adrfam = NVMF_ADDR_FAMILY_IP4;
+	snprintf(rec->traddr, sizeof(rec->traddr), "10.%d.%d.%d",
+		 (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+	snprintf(rec->trsvcid, sizeof(rec->trsvcid), "%d", 4420 + (i >> 24));
+}
+
+/*
+ * Compute the changes from @old to @new, both sorted by port id.
+ * The records are copied, so both arrays may be freed afterwards.
+ */
+int port_delta_diff(struct port_delta *pd, struct port_rec *old, int num_old,
+		    struct port_rec *new, int num_new)
+{
+	int i = 0, j = 0;
+
+	memset(pd, 0, sizeof(*pd));
+	pd->add = calloc(num_new ? num_new : 1, sizeof(*pd->add));
+	pd->del = calloc(num_old ? num_old : 1, sizeof(*pd->del));
+	if (!pd->add || !pd->del) {
+		port_delta_free(pd);
+		return -ENOMEM;
+	}
+	while (i < num_old || j < num_new) {
+		if (j == num_new ||
+		    (i < num_old && old[i].portid < new[j].portid)) {
+			pd->del[pd->num_del++] = old[i++];
+		} else if (i == num_old || new[j].portid < old[i].portid) {
+			pd->add[pd->num_add++] = new[j++];
+		} else {
+			if (!port_rec_equal(&old[i], &new[j])) {
+				pd->del[pd->num_del++] = old[i];
+				pd->add[pd->num_add++] = new[j];
+			}
+			i++;
+			j++;
+		}
+	}
+	return 0;
+}
+
+void port_delta_free(struct port_delta *pd)
+{
+	free(pd->add);
+	free(pd->del);
+	memset(pd, 0, sizeof(*pd));
+}
+
+enum {
+	NVMET_ATTR_TRTYPE,
+	NVMET_ATTR_ADRFAM,
+	NVMET_ATTR_TRADDR,
+	NVMET_ATTR_TRSVCID,
+	NVMET_PORT_ATTRS,
+};
+
+static const char *nvmet_port_attrs[NVMET_PORT_ATTRS] = {
+	[NVMET_ATTR_TRTYPE] = "addr_trtype",
+	[NVMET_ATTR_ADRFAM] = "addr_adrfam",
+	[NVMET_ATTR_TRADDR] = "addr_traddr",
+	[NVMET_ATTR_TRSVCID] = "addr_trsvcid",
+};
+
+/**
+ * struct nvmet_scan_port - port directory being scanned
+ *
+ * @dfd:           O_PATH descriptor of the port directory
+ * @trtype:        contents of addr_trtype
+ * @adrfam:        contents of addr_adrfam
+ * @len:           result of reading each attribute, or a negative
+ *                 errno value
+ *
+ * addr_traddr and addr_trsvcid are read directly into the record.
+ */
+struct nvmet_scan_port {
+	int dfd;
+	char trtype[16];
+	char adrfam[16];
+	int len[NVMET_PORT_ATTRS];
+};
+
+/**
+ * struct nvmet_scan - configfs port scanner
+ *
+ * @mode:          NVMET_SCAN_SYNC or NVMET_SCAN_URING
+ * @ring:          io_uring instance for NVMET_SCAN_URING
+ * @root:          configfs ports directory, for messages
+ * @recs:          records scanned so far
+ * @num_recs:      number of valid records in @recs
+ * @max_recs:      allocated size of @recs
+ * @ports:         ports of the current batch; the record of @ports[i]
+ *                 is @recs[@num_recs + i]
+ * @num_ports:     number of ports in the current batch
+ * @err:           negative errno value if the scan is incomplete
+ */
+struct nvmet_scan {
+	enum nvmet_scan_mode mode;
+	struct uring ring;
+	const char *root;
+	struct port_rec *recs;
+	int num_recs;
+	int max_recs;
+	struct nvmet_scan_port ports[NVMET_SCAN_BATCH];
+	int num_ports;
+	int err;
+};
+
+static void nvmet_scan_attr_buf(struct nvmet_scan *s, int i, int attr,
+				char **buf, size_t *size)
+{
+	struct nvmet_scan_port *sp = &s->ports[i];
+	struct port_rec *rec = &s->recs[s->num_recs + i];
+
+	switch (attr) {
+	case NVMET_ATTR_TRTYPE:
+		*buf = sp->trtype;
+		*size = sizeof(sp->trtype);
+		break;
+	case NVMET_ATTR_ADRFAM:
+		*buf = sp->adrfam;
+		*size = sizeof(sp->adrfam);
+		break;
+	case NVMET_ATTR_TRADDR:
+		*buf = rec->traddr;
+		*size = sizeof(rec->traddr);
+		break;
+	default:
+		*buf = rec->trsvcid;
+		*size = sizeof(rec->trsvcid);
+		break;
+	}
+}
+
+/*
+ * Read all attributes of the current batch with openat() relative
+ * to the port directories.
+ */
+static void nvmet_scan_sync(struct nvmet_scan *s)
+{
+	int i, attr, fd;
+
+	for (i = 0; i < s->num_ports; i++) {
+		struct nvmet_scan_port *sp = &s->ports[i];
+
+		for (attr = 0; attr < NVMET_PORT_ATTRS; attr++) {
+			char *buf;
+			size_t size;
+
+			nvmet_scan_attr_buf(s, i, attr, &buf, &size);
+			fd = openat(sp->dfd, nvmet_port_attrs[attr], O_RDONLY);
+			if (fd < 0) {
+				sp->len[attr] = -errno;
+				continue;
+			}
+			sp->len[attr] = read(fd, buf, size - 1);
+			if (sp->len[attr] < 0)
+				sp->len[attr] = -errno;
+			close(fd);
+		}
+	}
+}
+
+/*
+ * Queue one io_uring operation on attribute slot @slot of the current
+ * batch. Returns NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *nvmet_scan_sqe(struct nvmet_scan *s,
+					   unsigned int slot, __u8 opcode)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+
+	if (!sqe)
+		return NULL;
+	sqe->opcode = opcode;
+	sqe->user_data = slot;
+	return sqe;
+}
+
+/*
+ * Submit all @num queued operations and wait for their completions,
+ * storing the results in the attribute lengths. Whatever was
+ * submitted is reaped even if the batch fails, so the attribute
+ * buffers can be reused for synchronous reads; if the completions
+ * cannot be waited for, the ring is torn down instead.
+ */
+static int nvmet_scan_reap(struct nvmet_scan *s, int num)
+{
+	struct io_uring_cqe *cqe;
+	int i, ret, submitted;
+
+	submitted = uring_submit(&s->ring, num);
+	if (submitted < 0)
+		return submitted;
+	for (i = 0; i < submitted; i++) {
+		unsigned int slot;
+
+		cqe = uring_wait_cqe(&s->ring);
+		if (!cqe) {
+			ret = -errno;
+			uring_exit(&s->ring);
+			return ret;
+		}
+		slot = cqe->user_data;
+		s->ports[slot / NVMET_PORT_ATTRS].len[slot % NVMET_PORT_ATTRS] =
+			cqe->res;
+		uring_cqe_seen(&s->ring);
+	}
+	return submitted < num ? -EAGAIN : 0;
+}
+
+/*
+ * Read all attributes of the current batch via io_uring: one submission
+ * opening all attributes into fixed file slots and one reading them.
+ * The slots are not closed explicitly; the next batch replaces them,
+ * and the remaining ones are released with the ring.
+ */
+static int nvmet_scan_uring(struct nvmet_scan *s)
+{
+	struct io_uring_sqe *sqe;
+	int i, attr, ret, num = 0;
+
+	for (i = 0; i < s->num_ports; i++) {
+		for (attr = 0; attr < NVMET_PORT_ATTRS; attr++) {
+			unsigned int slot = i * NVMET_PORT_ATTRS + attr;
+
+			sqe = nvmet_scan_sqe(s, slot, IORING_OP_OPENAT);
+			if (!sqe)
+				return -EBUSY;
+			sqe->fd = s->ports[i].dfd;
+			sqe->addr = (unsigned long)nvmet_port_attrs[attr];
+			sqe->open_flags = O_RDONLY;
+			sqe->file_index = slot + 1;
+			num++;
+		}
+	}
+	ret = nvmet_scan_reap(s, num);
+	if (ret < 0)
+		return ret;
+	num = 0;
+	for (i = 0; i < s->num_ports; i++) {
+		for (attr = 0; attr < NVMET_PORT_ATTRS; attr++) {
+			unsigned int slot = i * NVMET_PORT_ATTRS + attr;
+			char *buf;
+			size_t size;
+
+			if (s->ports[i].len[attr] < 0)
+				continue;
+			nvmet_scan_attr_buf(s, i, attr, &buf, &size);
+			sqe = nvmet_scan_sqe(s, slot, IORING_OP_READ);
+			if (!sqe)
+				return -EBUSY;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = slot;
+			sqe->addr = (unsigned long)buf;
+			sqe->len = size - 1;
+			num++;
+		}
+	}
+	return nvmet_scan_reap(s, num);
+}
+
+/*
+ * Read the attributes of all ports in the current batch and turn
+ * them into records.
+ */
+static void nvmet_scan_batch(struct nvmet_scan *s)
+{
+	int i, attr, nr = s->num_recs;
+
+	/* Nothing is in flight into the attribute buffers after a failure */
+	if (s->mode == NVMET_SCAN_URING && nvmet_scan_uring(s) < 0) {
+		fprintf(stderr, "io_uring scan failed, "
+			"falling back to synchronous reads\n");
+		s->mode = NVMET_SCAN_SYNC;
+	}
+	if (s->mode == NVMET_SCAN_SYNC)
+		nvmet_scan_sync(s);
+
+	for (i = 0; i < s->num_ports; i++) {
+		struct nvmet_scan_port *sp = &s->ports[i];
+		struct port_rec *rec = &s->recs[s->num_recs + i];
+
+		close(sp->dfd);
+		for (attr = 0; attr < NVMET_PORT_ATTRS; attr++) {
+			char *buf;
+			size_t size;
+			int len = sp->len[attr];
+
+			nvmet_scan_attr_buf(s, i, attr, &buf, &size);
+			/* Only a port removed during the scan may be skipped */
+			if (len < 0 && len != -ENOENT && !s->err) {
+				fprintf(stderr, "Cannot read %s/%d/%s: %s\n",
+					s->root, rec->portid,
+					nvmet_port_attrs[attr], strerror(-len));
+				s->err = len;
+			}
+			if (len < 0)
+				len = 0;
+			buf[len] = '\0';
+			if (len > 0 && buf[len - 1] == '\n')
+				buf[len - 1] = '\0';
+		}
+		if (s->err)
+			continue;
+		if (sp->len[NVMET_ATTR_TRTYPE] < 0) {
+			printf("Cannot read %s/%d/addr_trtype\n",
+			       s->root, rec->portid);
+			continue;
+		}
+		/* Unconfigured and local ports */
+		if (!strlen(sp->trtype) || !strcmp(sp->trtype, "loop") ||
+		    !strcmp(sp->trtype, "pci"))
+			continue;
+		if (port_rec_set_type(rec, sp->trtype, sp->adrfam) < 0) {
+			fprintf(stderr, "port %d: unhandled trtype %s\n",
+				rec->portid, sp->trtype);
+			continue;
+		}
+		if (rec != &s->recs[nr])
+			memcpy(&s->recs[nr], rec, sizeof(*rec));
+		nr++;
+	}
+	s->num_recs = nr;
+	s->num_ports = 0;
+}
+
+static int nvmet_scan_init(struct nvmet_scan *s, enum nvmet_scan_mode mode)
+{
+	struct io_uring_rsrc_register rr;
+	int ret;
+
+	s->mode = NVMET_SCAN_SYNC;
+	s->ring.fd = -1;
+	if (mode == NVMET_SCAN_SYNC)
+		return 0;
+	ret = uring_init(&s->ring, NVMET_SCAN_BATCH * NVMET_PORT_ATTRS, 0);
+	if (ret < 0)
+		return ret;
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = NVMET_SCAN_BATCH * NVMET_PORT_ATTRS;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	ret = uring_register(&s->ring, IORING_REGISTER_FILES2,
+			     &rr, sizeof(rr));
+	if (ret < 0) {
+		uring_exit(&s->ring);
+		return ret;
+	}
+	s->mode = NVMET_SCAN_URING;
+	return 0;
+}
+
+/*
+ * Read all nvmet ports below @root which can be reached from the
+ * outside into the array returned in @recsp. Each port directory is
+ * opened once and its attributes are read relative to it, either
+ * synchronously or batched via io_uring as selected by @mode; @mode
+ * is updated with the method actually used. Returns the number of
+ * records, or a negative errno value if not all ports could be read;
+ * a partial list is never returned.
+ */
+int nvmet_scan_ports(const char *root, struct port_rec **recsp,
+		     enum nvmet_scan_mode *mode)
+{
+	struct nvmet_scan *s;
+	struct port_rec *recs;
+	struct dirent *nvmet_dirent;
+	DIR *nvmet_dir;
+	int ret;
+
+	*recsp = NULL;
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		perror("calloc");
+		return -ENOMEM;
+	}
+	s->root = root;
+	ret = nvmet_scan_init(s, *mode);
+	if (ret < 0 && *mode == NVMET_SCAN_URING)
+		fprintf(stderr, "io_uring not available: %s\n",
+			strerror(-ret));
+	*mode = s->mode;
+
+	nvmet_dir = opendir(root);
+	if (!nvmet_dir) {
+		s->err = -errno;
+		perror("opendir");
+		goto out_free;
+	}
+	while (!s->err) {
+		struct port_rec *rec;
+		char *eptr;
+		long portid;
+		int dfd;
+
+		errno = 0;
+		nvmet_dirent = readdir(nvmet_dir);
+		if (!nvmet_dirent) {
+			if (errno) {
+				s->err = -errno;
+				perror("readdir");
+			}
+			break;
+		}
+		if (nvmet_dirent->d_name[0] == '.')
+			continue;
+		portid = strtol(nvmet_dirent->d_name, &eptr, 10);
+		if (*eptr != '\0' || portid < 0 || portid > 0xffff)
+			continue;
+		if (!s->num_ports &&
+		    s->num_recs + NVMET_SCAN_BATCH > s->max_recs) {
+			int max_recs = s->max_recs ?
+				s->max_recs * 2 : NVMET_SCAN_BATCH;
+
+			recs = realloc(s->recs, sizeof(*recs) * max_recs);
+			if (!recs) {
+				s->err = -ENOMEM;
+				perror("realloc");
+				break;
+			}
+			s->recs = recs;
+			s->max_recs = max_recs;
+		}
+		dfd = openat(dirfd(nvmet_dir), nvmet_dirent->d_name,
+			     O_PATH | O_DIRECTORY);
+		if (dfd < 0) {
+			if (errno == ENOENT)
+				continue;
+			s->err = -errno;
+			perror("openat");
+			break;
+		}
+		rec = &s->recs[s->num_recs + s->num_ports];
+		memset(rec, 0, sizeof(*rec));
+		rec->portid = portid;
+		s->ports[s->num_ports++].dfd = dfd;
+		if (s->num_ports == NVMET_SCAN_BATCH)
+			nvmet_scan_batch(s);
+	}
+	if (s->err) {
+		while (s->num_ports)
+			close(s->ports[--s->num_ports].dfd);
+	} else if (s->num_ports) {
+		nvmet_scan_batch(s);
+	}
+	closedir(nvmet_dir);
+	*mode = s->mode;
+out_free:
+	if (s->ring.fd >= 0)
+		uring_exit(&s->ring);
+	ret = s->err;
+	if (ret < 0) {
+		free(s->recs);
+	} else {
+		*recsp = s->recs;
+		ret = s->num_recs;
+	}
+	free(s);
+	return ret;
+}
+
+/*
+ * Read all nvmet ports below @root which can be reached from the
+ * outside, using @mode to read the attributes. Returns an array of
+ * @num_recs records, or NULL with @num_recs set to 0 if the ports
+ * could not be read.
+ */
+struct port_rec *lookup_nvmet(const char *root, enum nvmet_scan_mode mode,
+			      int *num_recs)
+{
+	struct port_rec *recs;
+	int i, ret;
+
+	*num_recs = 0;
+	ret = nvmet_scan_ports(root, &recs, &mode);
+	if (ret < 0)
+		return NULL;
+	*num_recs = ret;
+	for (i = 0; i < *num_recs; i++)
+		printf("Registering port %d: %s %s %s %s\n", recs[i].portid,
+		       nvmf_trtype_name(recs[i].trtype),
+		       nvmf_adrfam_name(recs[i].adrfam),
+		       recs[i].traddr, recs[i].trsvcid);
+	return recs;
+}
+
+enum {
+	NVMET_REF_TRTYPE,
+	NVMET_REF_ADRFAM,
+	NVMET_REF_TRADDR,
+	NVMET_REF_TRSVCID,
+	NVMET_REF_SUBTYPE,
+	NVMET_REF_ATTRS,
+};
+
+static const char *nvmet_ref_attrs[NVMET_REF_ATTRS] = {
+	[NVMET_REF_TRTYPE] = "addr_trtype",
+	[NVMET_REF_ADRFAM] = "addr_adrfam",
+	[NVMET_REF_TRADDR] = "addr_traddr",
+	[NVMET_REF_TRSVCID] = "addr_trsvcid",
+	[NVMET_REF_SUBTYPE] = "addr_subtype",
+};
+
+/**
+ * struct nvmet_ref_port - referral update of one port
+ *
+ * @rec:           port the referral belongs to
+ * @created:       referral directory was created
+ * @written:       number of attributes written
+ * @err:           negative errno value if the update failed
+ * @errstr:        failed operation
+ * @t_start:       start of the update
+ * @t_end:         end of the update
+ */
+struct nvmet_ref_port {
+	struct port_rec *rec;
+	int created;
+	int written;
+	int err;
+	const char *errstr;
+	struct timespec t_start;
+	struct timespec t_end;
+};
+
+/**
+ * struct nvmet_ref - referral update of all ports
+ *
+ * @root:          nvmet ports directory
+ * @ref:           name of the referral
+ * @values:        attribute values of the referral
+ * @ports:         per-port updates
+ * @num_ports:     number of ports in @ports
+ * @next:          next port to be picked up by a worker
+ */
+struct nvmet_ref {
+	const char *root;
+	const char *ref;
+	const char *values[NVMET_REF_ATTRS];
+	struct nvmet_ref_port *ports;
+	int num_ports;
+	int next;
+};
+
+/*
+ * Read attribute @attr of the directory @dfd without the trailing
+ * newline. Returns the length or a negative errno value.
+ */
+static int nvmet_read_attr(int dfd, const char *attr, char *buf, size_t size)
+{
+	int fd, len;
+
+	fd = openat(dfd, attr, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, size - 1);
+	if (len < 0)
+		len = -errno;
+	close(fd);
+	if (len < 0)
+		return len;
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	buf[len] = '\0';
+	return len;
+}
+
+static int nvmet_write_attr(int dfd, const char *attr, const char *value)
+{
+	int fd, len, err = 0;
+
+	fd = openat(dfd, attr, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	len = write(fd, value, strlen(value));
+	if (len < 0)
+		err = -errno;
+	else if (len < strlen(value))
+		err = -EBUSY;
+	close(fd);
+	return err;
+}
+
+/*
+ * Bring the referral of one port in line with @r->values, writing
+ * only the attributes which differ. The address of an enabled
+ * referral cannot be changed, so it is disabled around the update.
+ */
+static void nvmet_ref_update(struct nvmet_ref *r, struct nvmet_ref_port *rp)
+{
+	char refname[PATH_MAX], buf[NVMF_TRADDR_SIZE];
+	int differ[NVMET_REF_ATTRS], num_differ = 0;
+	int attr, dfd, enabled, err;
+
+	clock_gettime(CLOCK_MONOTONIC, &rp->t_start);
+	if (snprintf(refname, sizeof(refname), "%s/%d/referrals/%s", r->root,
+		     rp->rec->portid, r->ref) >= sizeof(refname)) {
+		rp->err = -ENAMETOOLONG;
+		rp->errstr = "referral";
+		goto out;
+	}
+	dfd = open(refname, O_PATH | O_DIRECTORY);
+	if (dfd < 0 && errno == ENOENT) {
+		if (mkdir(refname, S_IRWXU | S_IRGRP | S_IXGRP |
+			  S_IROTH | S_IXOTH) && errno != EEXIST) {
+			rp->err = -errno;
+			rp->errstr = "mkdir";
+			goto out;
+		}
+		rp->created = 1;
+		dfd = open(refname, O_PATH | O_DIRECTORY);
+	}
+	if (dfd < 0) {
+		rp->err = -errno;
+		rp->errstr = "open";
+		goto out;
+	}
+
+	for (attr = 0; attr < NVMET_REF_ATTRS; attr++) {
+		differ[attr] = nvmet_read_attr(dfd, nvmet_ref_attrs[attr],
+					       buf, sizeof(buf)) < 0 ||
+			strcmp(buf, r->values[attr]);
+		num_differ += differ[attr];
+	}
+	err = nvmet_read_attr(dfd, "enable", buf, sizeof(buf));
+	/* Kernels without referral 'enable' attribute */
+	if (err == -ENOENT) {
+		enabled = -1;
+		if (!num_differ)
+			goto out_close;
+	} else {
+		enabled = err > 0 && !strcmp(buf, "1");
+		if (!num_differ && enabled)
+			goto out_close;
+	}
+
+	if (num_differ && enabled > 0) {
+		err = nvmet_write_attr(dfd, "enable", "0");
+		if (err < 0) {
+			rp->err = err;
+			rp->errstr = "enable";
+			goto out_close;
+		}
+		rp->written++;
+	}
+	for (attr = 0; attr < NVMET_REF_ATTRS; attr++) {
+		if (!differ[attr])
+			continue;
+		err = nvmet_write_attr(dfd, nvmet_ref_attrs[attr],
+				       r->values[attr]);
+		if (err < 0) {
+			rp->err = err;
+			rp->errstr = nvmet_ref_attrs[attr];
+			break;
+		}
+		rp->written++;
+	}
+	if (enabled >= 0 && !rp->err) {
+		err = nvmet_write_attr(dfd, "enable", "1");
+		if (err < 0) {
+			rp->err = err;
+			rp->errstr = "enable";
+		} else
+			rp->written++;
+	}
+out_close:
+	close(dfd);
+out:
+	clock_gettime(CLOCK_MONOTONIC, &rp->t_end);
+}
+
+static void *nvmet_ref_worker(void *arg)
+{
+	struct nvmet_ref *r = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) <
+	       r->num_ports)
+		nvmet_ref_update(r, &r->ports[i]);
+	return NULL;
+}
+
+static double nvmet_ms(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 +
+		(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Point referral @ref of all nvmet ports in @recs to the CDC. The
+ * ports are updated concurrently by up to NVMET_REF_WORKERS threads.
+ * Returns 0 if all referrals are up to date, or the negative errno
+ * value of the first failure.
+ */
+int register_parent(const char *root, struct port_rec *recs, int num_recs,
+		    const char *ref, char *cdc_addr, char *cdc_port)
+{
+	struct nvmet_ref r = {
+		.root = root,
+		.ref = ref,
+	};
+	pthread_t workers[NVMET_REF_WORKERS];
+	struct timespec start, end;
+	int i, num_workers, num_updated = 0, ret = 0;
+
+	r.values[NVMET_REF_TRTYPE] = "tcp";
+	r.values[NVMET_REF_ADRFAM] = strchr(cdc_addr, ':') ? "ipv6" : "ipv4";
+	r.values[NVMET_REF_TRADDR] = cdc_addr;
+	r.values[NVMET_REF_TRSVCID] = cdc_port;
+	r.values[NVMET_REF_SUBTYPE] = "parent";
+
+	r.ports = calloc(num_recs + 1, sizeof(*r.ports));
+	if (!r.ports)
+		return -ENOMEM;
+	for (i = 0; i < num_recs; i++) {
+		if (recs[i].portid < 0)
+			continue;
+		r.ports[r.num_ports++].rec = &recs[i];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	num_workers = r.num_ports - 1;
+	if (num_workers > NVMET_REF_WORKERS)
+		num_workers = NVMET_REF_WORKERS;
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&workers[i], NULL, nvmet_ref_worker, &r))
+			break;
+	}
+	num_workers = i;
+	/* The calling thread works along, or alone if threads failed */
+	nvmet_ref_worker(&r);
+	for (i = 0; i < num_workers; i++)
+		pthread_join(workers[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < r.num_ports; i++) {
+		struct nvmet_ref_port *rp = &r.ports[i];
+		double ms = nvmet_ms(&rp->t_start, &rp->t_end);
+
+		if (rp->err) {
+			fprintf(stderr, "Port %d: referral %s: %s: %s\n",
+				rp->rec->portid, ref, rp->errstr,
+				strerror(-rp->err));
+			if (!ret)
+				ret = rp->err;
+			continue;
+		}
+		if (rp->written)
+			num_updated++;
+		printf("Port %d: referral %s %s, %d attributes written "
+		       "in %.3f ms\n", rp->rec->portid, ref,
+		       rp->created ? "created" :
+		       rp->written ? "updated" : "unchanged",
+		       rp->written, ms);
+	}
+	printf("Referral %s to %s:%s: %d of %d ports updated in %.3f ms "
+	       "with %d threads\n", ref, cdc_addr, cdc_port, num_updated,
+	       r.num_ports, nvmet_ms(&start, &end), num_workers + 1);
+	free(r.ports);
+	return ret;
+}
+
+static int nvmet_bench_write(const char *dir, const char *attr,
+			     const char *value)
+{
+	char attrname[PATH_MAX];
+	int fd, len;
+
+	snprintf(attrname, sizeof(attrname), "%s/%s", dir, attr);
+	fd = open(attrname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	len = write(fd, value, strlen(value));
+	close(fd);
+	return len < 0 ? -1 : 0;
+}
+
+static int nvmet_bench_unlink(const char *path, const struct stat *st,
+			      int type, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/*
+ * Reference for the benchmark: full path lookup for every attribute.
+ */
+static int nvmet_bench_scan_path(const char *root)
+{
+	DIR *nvmet_dir;
+	struct dirent *nvmet_dirent;
+	int nr = 0;
+
+	nvmet_dir = opendir(root);
+	if (!nvmet_dir)
+		return -1;
+	while ((nvmet_dirent = readdir(nvmet_dir))) {
+		char attrname[PATH_MAX], buf[NVMF_TRADDR_SIZE];
+		int attr, fd;
+
+		if (nvmet_dirent->d_name[0] == '.')
+			continue;
+		for (attr = 0; attr < NVMET_PORT_ATTRS; attr++) {
+			if (snprintf(attrname, sizeof(attrname), "%s/%s/%s",
+				     root, nvmet_dirent->d_name,
+				     nvmet_port_attrs[attr]) >= sizeof(attrname))
+				continue;
+			fd = open(attrname, O_RDONLY);
+			if (fd < 0)
+				continue;
+			if (read(fd, buf, sizeof(buf)) < 0)
+				perror("read");
+			close(fd);
+		}
+		nr++;
+	}
+	closedir(nvmet_dir);
+	return nr;
+}
+
+/*
+ * Compare the port scanner variants on a synthetic tree of
+ * @num_ports ports created in a temporary directory below @dir,
+ * which should be on tmpfs.
+ */
+int nvmet_scan_bench(const char *dir, int num_ports)
+{
+	static const char *names[] = { "path", "openat", "io_uring" };
+	static const int loops = 5;
+	char root[PATH_MAX], port[PATH_MAX], traddr[32];
+	struct port_rec *ref = NULL;
+	int i, m, ret = 1, num_ref = 0;
+
+	snprintf(root, sizeof(root), "%s/acdc-bench.XXXXXX", dir);
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < num_ports; i++) {
+		if (snprintf(port, sizeof(port), "%s/%d",
+			     root, i + 1) >= sizeof(port)) {
+			errno = ENAMETOOLONG;
+			perror(root);
+			goto out_remove;
+		}
+		snprintf(traddr, sizeof(traddr), "10.%d.%d.%d",
+			 (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		if (mkdir(port, 0755) < 0 ||
+		    nvmet_bench_write(port, "addr_trtype", "tcp\n") < 0 ||
+		    nvmet_bench_write(port, "addr_adrfam", "ipv4\n") < 0 ||
+		    nvmet_bench_write(port, "addr_traddr", traddr) < 0 ||
+		    nvmet_bench_write(port, "addr_trsvcid", "4420\n") < 0) {
+			perror(port);
+			goto out_remove;
+		}
+	}
+	printf("configfs scan: %d ports in %s\n", num_ports, root);
+
+	for (m = 0; m < 3; m++) {
+		double ms, min_ms = 0, total_ms = 0;
+		int l, nr = 0;
+
+		for (l = 0; l < loops; l++) {
+			enum nvmet_scan_mode mode = m == 1 ?
+				NVMET_SCAN_SYNC : NVMET_SCAN_URING;
+			struct port_rec *recs = NULL;
+			struct timespec start, end;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (m == 0)
+				nr = nvmet_bench_scan_path(root);
+			else
+				nr = nvmet_scan_ports(root, &recs, &mode);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (m == 2 && mode != NVMET_SCAN_URING) {
+				free(recs);
+				break;
+			}
+			if (nr != num_ports) {
+				fprintf(stderr, "%s: scanned %d of %d ports\n",
+					names[m], nr, num_ports);
+				free(recs);
+				goto out_remove;
+			}
+			if (!ref) {
+				ref = recs;
+				num_ref = nr;
+			} else if (recs) {
+				if (memcmp(ref, recs, sizeof(*recs) * num_ref)) {
+					fprintf(stderr, "%s: records differ\n",
+						names[m]);
+					free(recs);
+					goto out_remove;
+				}
+				free(recs);
+			}
+			ms = nvmet_ms(&start, &end);
+			total_ms += ms;
+			if (!l || ms < min_ms)
+				min_ms = ms;
+		}
+		if (l < loops)
+			continue;
+		printf("configfs scan %-8s: %8.2f ms min %8.2f ms avg "
+		       "%6.2f us/port\n", names[m], min_ms, total_ms / loops,
+		       min_ms * 1000 / num_ports);
+	}
+	ret = 0;
+out_remove:
+	free(ref);
+	nftw(root, nvmet_bench_unlink, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * nvmet.h - nvmet configfs port records
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _NVMET_H
+#define _NVMET_H
+
+#include <linux/types.h>
+
+#include "nvme.h"
+
+#define NVMET_CONFIGFS_PORTS	"/sys/kernel/config/nvmet/ports"
+
+/* Ports whose attributes are read in one batch */
+#define NVMET_SCAN_BATCH	256
+
+/* Number of ports in the synthetic tree for the scanner benchmark */
+#define NVMET_BENCH_PORTS	10000
+
+/* Threads writing the referrals of different ports concurrently */
+#define NVMET_REF_WORKERS	8
+
+/* Default transport service id for records without one */
+#define PORT_REC_TRSVCID	"8009"
+
+/**
+ * struct port_rec - port to be registered with a CDC
+ *
+ * @portid:        nvmet port id, or -1 if not backed by an nvmet port
+ * @trtype:        transport type (NVMF_TRTYPE_*)
+ * @adrfam:        address family (NVMF_ADDR_FAMILY_*)
+ * @trsvcid:       transport service identifier, zero padded
+ * @traddr:        transport address, zero padded
+ *
+ * The string fields are always NUL-terminated and have the size of
+ * the corresponding kickstart record fields, so a record can be
+ * copied into a KDReq as is.
+ */
+struct port_rec {
+	int portid;
+	__u8 trtype;
+	__u8 adrfam;
+	char trsvcid[NVMF_TRSVCID_SIZE];
+	char traddr[NVMF_TRADDR_SIZE];
+};
+
+/**
+ * struct port_delta - changes to a set of registered ports
+ *
+ * @add:           records to register
+ * @num_add:       number of records in @add
+ * @del:           records to deregister
+ * @num_del:       number of records in @del
+ *
+ * A port whose address changed is in both @del (old address) and
+ * @add (new address).
+ */
+struct port_delta {
+	struct port_rec *add;
+	int num_add;
+	struct port_rec *del;
+	int num_del;
+};
+
+enum nvmet_scan_mode {
+	NVMET_SCAN_SYNC,
+	NVMET_SCAN_URING,
+};
+
+const char *nvmf_trtype_name(__u8 trtype);
+const char *nvmf_adrfam_name(__u8 adrfam);
+int port_rec_parse(struct port_rec *rec, const char *str);
+int port_rec_equal(struct port_rec *a, struct port_rec *b);
+void port_rec_sort(struct port_rec *recs, int num_recs);
+void port_rec_bench(struct port_rec *rec, int i);
+int port_delta_diff(struct port_delta *pd, struct port_rec *old, int num_old,
+		    struct port_rec *new, int num_new);
+void port_delta_free(struct port_delta *pd);
+int nvmet_scan_ports(const char *root, struct port_rec **recsp,
+		     enum nvmet_scan_mode *mode);
+struct port_rec *lookup_nvmet(const char *root, enum nvmet_scan_mode mode,
+			      int *num_recs);
+int register_parent(const char *root, struct port_rec *recs, int num_recs,
+		    const char *ref, char *cdc_addr, char *cdc_port);
+int nvmet_scan_bench(const char *dir, int num_ports);
+
+#endif /* _NVMET_H */
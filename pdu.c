@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * pdu.c - NVMe/TCP PDU framing
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Reassembles PDUs from the byte stream based on the 'plen' field
+ * of the common header, so that short reads or several PDUs arriving
+ * in a single read are handled transparently, and dispatches them
+ * according to the PDU type.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <endian.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "pdu.h"
+#include "crc32c.h"
+
+/**
+ * struct pdu_type - PDU type description
+ *
+ * @name:          PDU name for diagnostics
+ * @hlen:          expected PDU header length
+ * @no_digest:     PDU never carries digests (connection setup and
+ *                 termination)
+ */
+struct pdu_type {
+	const char *name;
+	__u8 hlen;
+	bool no_digest;
+};
+
+static const struct pdu_type pdu_types[NVME_TCP_PDU_TYPE_MAX] = {
+	[nvme_tcp_icreq] = {
+		.name = "icreq",
+		.no_digest = true,
+		.hlen = sizeof(struct nvme_tcp_icreq_pdu),
+	},
+	[nvme_tcp_icresp] = {
+		.name = "icresp",
+		.no_digest = true,
+		.hlen = sizeof(struct nvme_tcp_icresp_pdu),
+	},
+	[nvme_tcp_h2c_term] = {
+		.name = "h2c_term",
+		.no_digest = true,
+		.hlen = sizeof(struct nvme_tcp_term_pdu),
+	},
+	[nvme_tcp_c2h_term] = {
+		.name = "c2h_term",
+		.no_digest = true,
+		.hlen = sizeof(struct nvme_tcp_term_pdu),
+	},
+	[nvme_tcp_cmd] = {
+		.name = "cmd",
+		.hlen = sizeof(struct nvme_tcp_cmd_pdu),
+	},
+	[nvme_tcp_rsp] = {
+		.name = "rsp",
+		.hlen = sizeof(struct nvme_tcp_rsp_pdu),
+	},
+	[nvme_tcp_h2c_data] = {
+		.name = "h2c_data",
+		.hlen = sizeof(struct nvme_tcp_data_pdu),
+	},
+	[nvme_tcp_c2h_data] = {
+		.name = "c2h_data",
+		.hlen = sizeof(struct nvme_tcp_data_pdu),
+	},
+	[nvme_tcp_r2t] = {
+		.name = "r2t",
+		.hlen = sizeof(struct nvme_tcp_r2t_pdu),
+	},
+	[nvme_tcp_kdreq] = {
+		.name = "kdreq",
+		.hlen = sizeof(struct nvme_tcp_kdreq_pdu),
+	},
+	[nvme_tcp_kdresp] = {
+		/* Excludes the struct tail padding; the CDC NQN follows */
+		.name = "kdresp",
+		.hlen = offsetof(struct nvme_tcp_kdresp_pdu, failrsn) + 1,
+	},
+};
+
+const char *pdu_type_name(__u8 type)
+{
+	if (type >= NVME_TCP_PDU_TYPE_MAX || !pdu_types[type].name)
+		return "unknown";
+	return pdu_types[type].name;
+}
+
+/*
+ * Lay out a PDU header for @data_len bytes of data following it,
+ * with room for the digests enabled in @digest.
+ * Returns the total PDU length.
+ */
+size_t pdu_init_hdr(struct nvme_tcp_hdr *hdr, __u8 type, __u8 hlen,
+		    size_t data_len, __u8 digest)
+{
+	size_t plen = hlen;
+
+	hdr->type = type;
+	hdr->hlen = hlen;
+	hdr->flags &= ~(NVME_TCP_F_HDGST | NVME_TCP_F_DDGST);
+	hdr->pdo = 0;
+	if (digest & NVME_TCP_HDR_DIGEST_ENABLE) {
+		hdr->flags |= NVME_TCP_F_HDGST;
+		plen += NVME_TCP_DIGEST_LENGTH;
+	}
+	if (data_len) {
+		hdr->pdo = plen;
+		plen += data_len;
+		if (digest & NVME_TCP_DATA_DIGEST_ENABLE) {
+			hdr->flags |= NVME_TCP_F_DDGST;
+			plen += NVME_TCP_DIGEST_LENGTH;
+		}
+	}
+	hdr->plen = htole32(plen);
+	return plen;
+}
+
+/* Start of the PDU data, after the header and header digest */
+void *pdu_data(struct nvme_tcp_hdr *hdr)
+{
+	size_t off = hdr->pdo;
+
+	if (!off) {
+		off = hdr->hlen;
+		if (hdr->flags & NVME_TCP_F_HDGST)
+			off += NVME_TCP_DIGEST_LENGTH;
+	}
+	return (char *)hdr + off;
+}
+
+static void pdu_put_digest(char *p, uint32_t digest)
+{
+	digest = htole32(digest);
+	memcpy(p, &digest, NVME_TCP_DIGEST_LENGTH);
+}
+
+static uint32_t pdu_get_digest(const char *p)
+{
+	uint32_t digest;
+
+	memcpy(&digest, p, NVME_TCP_DIGEST_LENGTH);
+	return le32toh(digest);
+}
+
+/*
+ * Fill in the header digest if announced in the header flags, for
+ * PDUs whose data is not stored behind the header.
+ */
+void pdu_set_hdr_digest(struct nvme_tcp_hdr *hdr)
+{
+	char *pdu = (char *)hdr;
+
+	if (hdr->flags & NVME_TCP_F_HDGST)
+		pdu_put_digest(pdu + hdr->hlen, crc32c(pdu, hdr->hlen));
+}
+
+/*
+ * Fill in the digests announced in the header flags; the header and
+ * data have to be complete at this point.
+ */
+void pdu_set_digests(struct nvme_tcp_hdr *hdr)
+{
+	char *pdu = (char *)hdr, *data;
+	size_t plen = le32toh(hdr->plen);
+
+	pdu_set_hdr_digest(hdr);
+	if (hdr->flags & NVME_TCP_F_DDGST) {
+		data = pdu_data(hdr);
+		plen -= NVME_TCP_DIGEST_LENGTH;
+		pdu_put_digest(pdu + plen,
+			       crc32c(data, pdu + plen - data));
+	}
+}
+
+/*
+ * Check the digests of a complete PDU and return the data range.
+ */
+static int pdu_check_digests(struct pdu_buf *pb, struct nvme_tcp_hdr *hdr,
+			     size_t plen, char **data, size_t *data_len)
+{
+	const struct pdu_type *pt = &pdu_types[hdr->type];
+	char *pdu = (char *)hdr, *end = pdu + plen;
+	bool hdgst = false, ddgst = false;
+
+	if (!pt->no_digest) {
+		hdgst = hdr->flags & NVME_TCP_F_HDGST;
+		ddgst = hdr->flags & NVME_TCP_F_DDGST;
+		if (hdgst != !!(pb->digest & NVME_TCP_HDR_DIGEST_ENABLE) ||
+		    (ddgst && !(pb->digest & NVME_TCP_DATA_DIGEST_ENABLE))) {
+			fprintf(stderr, "%s PDU digest flags %#x mismatch\n",
+				pt->name, hdr->flags);
+			return -EPROTO;
+		}
+	}
+	if (hdgst) {
+		if (plen < hdr->hlen + NVME_TCP_DIGEST_LENGTH ||
+		    pdu_get_digest(pdu + hdr->hlen) !=
+		    crc32c(pdu, hdr->hlen)) {
+			fprintf(stderr, "%s PDU header digest error\n",
+				pt->name);
+			return -EBADMSG;
+		}
+	}
+	*data = pt->no_digest ? pdu + hdr->hlen : pdu_data(hdr);
+	if (ddgst)
+		end -= NVME_TCP_DIGEST_LENGTH;
+	if (*data > end || *data < pdu + hdr->hlen) {
+		fprintf(stderr, "Invalid %s PDU data offset %d\n",
+			pt->name, hdr->pdo);
+		return -EPROTO;
+	}
+	if (ddgst && pdu_get_digest(end) != crc32c(*data, end - *data)) {
+		fprintf(stderr, "%s PDU data digest error\n", pt->name);
+		return -EBADMSG;
+	}
+	*data_len = end - *data;
+	return 0;
+}
+
+void pdu_buf_init(struct pdu_buf *pb, size_t max_pdu)
+{
+	memset(pb, 0, sizeof(*pb));
+	pb->max_pdu = max_pdu ? max_pdu : PDU_BUF_MAX;
+}
+
+void pdu_buf_free(struct pdu_buf *pb)
+{
+	free(pb->buf);
+	pb->buf = NULL;
+	pb->size = 0;
+	pb->head = pb->tail = 0;
+}
+
+/*
+ * Make room for at least the remainder of the PDU at @head, moving
+ * it to the start of the buffer or growing the buffer if required.
+ */
+static int pdu_buf_reserve(struct pdu_buf *pb)
+{
+	size_t avail = pb->tail - pb->head, want = sizeof(struct nvme_tcp_hdr);
+
+	if (avail >= want) {
+		struct nvme_tcp_hdr *hdr;
+
+		hdr = (struct nvme_tcp_hdr *)(pb->buf + pb->head);
+		want = le32toh(hdr->plen);
+	}
+	if (pb->head && (pb->head + want > pb->size ||
+			 pb->size - pb->tail < PDU_BUF_MIN / 4)) {
+		memmove(pb->buf, pb->buf + pb->head, avail);
+		pb->head = 0;
+		pb->tail = avail;
+	}
+	if (want > pb->size || !pb->buf) {
+		size_t size = pb->size ? pb->size : PDU_BUF_MIN;
+		char *buf;
+
+		while (size < want)
+			size <<= 1;
+		buf = realloc(pb->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		pb->buf = buf;
+		pb->size = size;
+	}
+	return 0;
+}
+
+/*
+ * Dispatch all complete PDUs in @pb, up to the first one whose
+ * handler pauses the buffer.
+ * Returns the number of PDUs processed, or a negative errno.
+ */
+int pdu_dispatch(struct pdu_buf *pb, const struct pdu_ops *ops, void *ctx)
+{
+	int num = 0, ret;
+
+	while (!pb->paused &&
+	       pb->tail - pb->head >= sizeof(struct nvme_tcp_hdr)) {
+		struct nvme_tcp_hdr *hdr;
+		size_t plen, data_len;
+		char *data;
+
+		hdr = (struct nvme_tcp_hdr *)(pb->buf + pb->head);
+		plen = le32toh(hdr->plen);
+		if (hdr->type >= NVME_TCP_PDU_TYPE_MAX ||
+		    !pdu_types[hdr->type].name) {
+			fprintf(stderr, "Invalid PDU type %d\n", hdr->type);
+			return -EPROTO;
+		}
+		if (hdr->hlen != pdu_types[hdr->type].hlen) {
+			fprintf(stderr, "Invalid %s PDU hdr len %d\n",
+				pdu_types[hdr->type].name, hdr->hlen);
+			return -EPROTO;
+		}
+		if (plen < hdr->hlen || plen > pb->max_pdu) {
+			fprintf(stderr, "Invalid %s PDU len %zu\n",
+				pdu_types[hdr->type].name, plen);
+			return -EPROTO;
+		}
+		if (pb->tail - pb->head < plen)
+			break;
+		if (!ops->handler[hdr->type]) {
+			fprintf(stderr, "Unexpected %s PDU\n",
+				pdu_types[hdr->type].name);
+			return -EPROTO;
+		}
+		ret = pdu_check_digests(pb, hdr, plen, &data, &data_len);
+		if (!ret)
+			ret = ops->handler[hdr->type](ctx,
+						      (union nvme_tcp_pdu *)hdr,
+						      data, data_len);
+		pb->head += plen;
+		if (ret < 0)
+			return ret;
+		if (ret == PDU_PAUSE)
+			pb->paused = 1;
+		num++;
+	}
+	if (pb->head == pb->tail)
+		pb->head = pb->tail = 0;
+	return num;
+}
+
+/*
+ * Receive from @fd and dispatch all PDUs which are complete.
+ * Returns the number of PDUs processed, -EAGAIN if no data was
+ * available on a non-blocking socket, or a negative errno.
+ */
+int pdu_recv(int fd, struct pdu_buf *pb, const struct pdu_ops *ops,
+	     void *ctx)
+{
+	ssize_t len;
+	int ret;
+
+	ret = pdu_buf_reserve(pb);
+	if (ret < 0)
+		return ret;
+	do {
+		len = recv(fd, pb->buf + pb->tail, pb->size - pb->tail, 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return -errno;
+	if (!len)
+		return -ECONNRESET;
+	pb->tail += len;
+	return pdu_dispatch(pb, ops, ctx);
+}
+
+/*
+ * Append @len received bytes to @pb without dispatching them, for
+ * connections which cannot take more PDUs right now.
+ * Returns 0 or a negative errno.
+ */
+int pdu_buf_append(struct pdu_buf *pb, const void *data, size_t len)
+{
+	size_t avail = pb->tail - pb->head;
+
+	if (avail + len > PDU_BUF_MAX)
+		return -ENOBUFS;
+	if (pb->head && pb->tail + len > pb->size) {
+		memmove(pb->buf, pb->buf + pb->head, avail);
+		pb->head = 0;
+		pb->tail = avail;
+	}
+	if (pb->tail + len > pb->size) {
+		size_t size = pb->size ? pb->size : PDU_BUF_MIN;
+		char *buf;
+
+		while (size < pb->tail + len)
+			size <<= 1;
+		buf = realloc(pb->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		pb->buf = buf;
+		pb->size = size;
+	}
+	memcpy(pb->buf + pb->tail, data, len);
+	pb->tail += len;
+	return 0;
+}
+
+/*
+ * Dispatch the PDUs in @len bytes received into a buffer not owned
+ * by @pb, such as a buffer provided to io_uring. If @pb holds no
+ * partial PDU, complete PDUs are processed in place and only the
+ * remainder is copied, so @pb is only allocated for PDUs split
+ * across receives.
+ * Returns the number of PDUs processed, or a negative errno.
+ */
+int pdu_feed(struct pdu_buf *pb, void *data, size_t len,
+	     const struct pdu_ops *ops, void *ctx)
+{
+	char *buf = pb->buf;
+	size_t size = pb->size;
+	int num = 0, ret;
+
+	if (pb->head == pb->tail) {
+		pb->buf = data;
+		pb->size = len;
+		pb->head = 0;
+		pb->tail = len;
+		num = pdu_dispatch(pb, ops, ctx);
+		data = pb->buf + pb->head;
+		len = pb->tail - pb->head;
+		pb->buf = buf;
+		pb->size = size;
+		pb->head = pb->tail = 0;
+		if (num < 0 || !len)
+			return num;
+	}
+	ret = pdu_buf_append(pb, data, len);
+	if (ret < 0)
+		return ret;
+	ret = pdu_dispatch(pb, ops, ctx);
+	if (ret < 0)
+		return ret;
+	return num + ret;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * pdu.h - NVMe/TCP PDU framing
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _PDU_H
+#define _PDU_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "nvme-tcp.h"
+
+#define NVME_TCP_PDU_TYPE_MAX	(nvme_tcp_kdresp + 1)
+
+/* Initial receive buffer size, and upper limit for a single PDU */
+#define PDU_BUF_MIN		4096
+#define PDU_BUF_MAX		(1024 * 1024)
+
+/* Handler return value holding back the following PDUs */
+#define PDU_PAUSE		1
+
+/**
+ * struct pdu_buf - per-connection PDU receive buffer
+ *
+ * @buf:           buffer memory, allocated on first use
+ * @size:          size of @buf
+ * @head:          offset of the first unprocessed byte
+ * @tail:          offset past the last received byte
+ * @max_pdu:       largest PDU accepted on this connection
+ * @digest:        negotiated NVME_TCP_{HDR,DATA}_DIGEST_ENABLE flags
+ * @paused:        a handler returned PDU_PAUSE; received data is
+ *                 only buffered until this is cleared
+ *
+ * Received data is appended at @tail and complete PDUs are consumed
+ * from @head. Once everything has been consumed both offsets wrap
+ * back to the start; a partial PDU is only moved to the front if it
+ * would not fit into the remaining space, so the buffer is reused
+ * for the lifetime of the connection.
+ */
+struct pdu_buf {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	size_t max_pdu;
+	__u8 digest;
+	int paused;
+};
+
+/*
+ * Called with a complete PDU and its @data_len bytes of data, with
+ * the digests already verified and stripped; both are only valid
+ * until the handler returns. A negative return value aborts
+ * processing and is passed back to the caller of pdu_recv();
+ * PDU_PAUSE stops processing after this PDU until the @paused flag
+ * of the buffer is cleared.
+ */
+typedef int (*pdu_handler_t)(void *ctx, union nvme_tcp_pdu *pdu,
+			     void *data, size_t data_len);
+
+/**
+ * struct pdu_ops - PDU dispatch table
+ *
+ * @handler:       handler for each PDU type; PDUs without a handler
+ *                 are rejected with -EPROTO
+ */
+struct pdu_ops {
+	pdu_handler_t handler[NVME_TCP_PDU_TYPE_MAX];
+};
+
+const char *pdu_type_name(__u8 type);
+size_t pdu_init_hdr(struct nvme_tcp_hdr *hdr, __u8 type, __u8 hlen,
+		    size_t data_len, __u8 digest);
+void *pdu_data(struct nvme_tcp_hdr *hdr);
+void pdu_set_hdr_digest(struct nvme_tcp_hdr *hdr);
+void pdu_set_digests(struct nvme_tcp_hdr *hdr);
+void pdu_buf_init(struct pdu_buf *pb, size_t max_pdu);
+void pdu_buf_free(struct pdu_buf *pb);
+int pdu_dispatch(struct pdu_buf *pb, const struct pdu_ops *ops, void *ctx);
+int pdu_recv(int fd, struct pdu_buf *pb, const struct pdu_ops *ops,
+	     void *ctx);
+int pdu_buf_append(struct pdu_buf *pb, const void *data, size_t len);
+int pdu_feed(struct pdu_buf *pb, void *data, size_t len,
+	     const struct pdu_ops *ops, void *ctx);
+
+#endif /* _PDU_H */
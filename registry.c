@@ -0,0 +1,437 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * registry.c - discovery records registered with the CDC
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Records are kept densely packed in an array and indexed by an open
+ * addressing hash table of 8-byte slots with linear probing. Removal
+ * moves the last record into the hole and shifts back the following
+ * slots of the probe sequence, so neither array nor index accumulate
+ * deleted entries, and memory use only depends on the number of
+ * records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "acdc.h"
+#include "registry.h"
+
+void registry_init(struct registry *reg)
+{
+	memset(reg, 0, sizeof(*reg));
+}
+
+void registry_free(struct registry *reg)
+{
+	if (!reg->mapped) {
+		free(reg->entries);
+		free(reg->slots);
+	}
+	registry_init(reg);
+}
+
+/*
+ * Replace the records of @reg by the @num_recs entries at @entries,
+ * with room for @max_recs, indexed by the @num_slots slots at @slots,
+ * as mapped from a registry snapshot. The mapping has to be private
+ * and to outlive @reg; the change callback is kept.
+ */
+void registry_attach(struct registry *reg, struct reg_entry *entries,
+		     int num_recs, int max_recs, struct reg_slot *slots,
+		     __u32 num_slots, unsigned long genctr)
+{
+	reg_notify_t notify = reg->notify;
+	void *notify_priv = reg->notify_priv;
+
+	registry_free(reg);
+	reg->notify = notify;
+	reg->notify_priv = notify_priv;
+	reg->entries = entries;
+	reg->num_recs = num_recs;
+	reg->max_recs = max_recs;
+	reg->slots = slots;
+	reg->mask = num_slots - 1;
+	reg->genctr = genctr;
+	reg->mapped = 1;
+}
+
+static __u32 reg_hash_bytes(__u32 hash, const void *buf, size_t len)
+{
+	const __u8 *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * Fill in the normalized key of @rec. Returns the hash of the key.
+ */
+static __u32 reg_key_init(struct reg_key *key, struct port_rec *rec)
+{
+	unsigned long svc;
+	__u32 hash = 2166136261;
+	char *end;
+	int af = 0;
+
+	memset(key, 0, sizeof(*key));
+	key->trtype = rec->trtype;
+	key->adrfam = rec->adrfam;
+	if (rec->adrfam == NVMF_ADDR_FAMILY_IP4)
+		af = AF_INET;
+	else if (rec->adrfam == NVMF_ADDR_FAMILY_IP6)
+		af = AF_INET6;
+	if (af && inet_pton(af, rec->traddr, key->addr) == 1)
+		key->flags |= REG_KEY_ADDR;
+	svc = strtoul(rec->trsvcid, &end, 10);
+	if (rec->trsvcid[0] >= '0' && rec->trsvcid[0] <= '9' && !*end &&
+	    svc <= 0xffff) {
+		key->flags |= REG_KEY_SVC;
+		key->svc = svc;
+	}
+
+	hash = reg_hash_bytes(hash, key, sizeof(*key));
+	if (!(key->flags & REG_KEY_ADDR))
+		hash = reg_hash_bytes(hash, rec->traddr, strlen(rec->traddr));
+	if (!(key->flags & REG_KEY_SVC))
+		hash = reg_hash_bytes(hash, rec->trsvcid, strlen(rec->trsvcid));
+	/* Mix the high bits into the low bits used for the slot index */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	return hash;
+}
+
+/* Rewrite the converted fields of @rec in canonical form */
+static void reg_rec_canon(struct port_rec *rec, struct reg_key *key)
+{
+	if (key->flags & REG_KEY_ADDR)
+		inet_ntop(key->adrfam == NVMF_ADDR_FAMILY_IP4 ?
+			  AF_INET : AF_INET6, key->addr,
+			  rec->traddr, sizeof(rec->traddr));
+	if (key->flags & REG_KEY_SVC)
+		snprintf(rec->trsvcid, sizeof(rec->trsvcid), "%u", key->svc);
+}
+
+/*
+ * Fill in the normalized key of @rec and rewrite @rec in the canonical
+ * form it is registered in. Returns the hash of the key.
+ */
+__u32 registry_key(struct reg_key *key, struct port_rec *rec)
+{
+	__u32 hash = reg_key_init(key, rec);
+
+	reg_rec_canon(rec, key);
+	return hash;
+}
+
+static int reg_entry_match(struct reg_entry *e, struct reg_key *key,
+			   struct port_rec *rec)
+{
+	if (memcmp(&e->key, key, sizeof(*key)))
+		return 0;
+	if (!(key->flags & REG_KEY_ADDR) && strcmp(e->rec.traddr, rec->traddr))
+		return 0;
+	if (!(key->flags & REG_KEY_SVC) && strcmp(e->rec.trsvcid, rec->trsvcid))
+		return 0;
+	return 1;
+}
+
+/*
+ * Return the slot holding @key, or the empty slot ending its probe
+ * sequence if not present.
+ */
+static __u32 reg_find_slot(struct registry *reg, struct reg_key *key,
+			   __u32 hash, struct port_rec *rec)
+{
+	__u32 pos;
+
+	for (pos = hash & reg->mask; reg->slots[pos].idx;
+	     pos = (pos + 1) & reg->mask) {
+		struct reg_slot *s = &reg->slots[pos];
+
+		/*
+		 * The index of a snapshot is used before its checksum is
+		 * verified; drop slots pointing past the entries.
+		 */
+		if (s->idx > (__u32)reg->num_recs) {
+			s->idx = 0;
+			break;
+		}
+		if (s->hash == hash &&
+		    reg_entry_match(&reg->entries[s->idx - 1], key, rec))
+			break;
+	}
+	return pos;
+}
+
+static void reg_insert_slot(struct registry *reg, __u32 hash, __u32 idx)
+{
+	__u32 pos;
+
+	for (pos = hash & reg->mask; reg->slots[pos].idx;
+	     pos = (pos + 1) & reg->mask)
+		;
+	reg->slots[pos].hash = hash;
+	reg->slots[pos].idx = idx + 1;
+}
+
+/* Copy the entries and the index of @reg out of the snapshot mapping */
+static int reg_unmap(struct registry *reg)
+{
+	struct reg_entry *entries;
+	struct reg_slot *slots;
+
+	entries = malloc(sizeof(*entries) * reg->max_recs);
+	slots = malloc(sizeof(*slots) * (reg->mask + 1));
+	if (!entries || !slots) {
+		free(entries);
+		free(slots);
+		return -ENOMEM;
+	}
+	memcpy(entries, reg->entries, sizeof(*entries) * reg->num_recs);
+	memcpy(slots, reg->slots, sizeof(*slots) * (reg->mask + 1));
+	reg->entries = entries;
+	reg->slots = slots;
+	reg->mapped = 0;
+	return 0;
+}
+
+/*
+ * Make room for @num_recs records without further allocations.
+ * Returns 0 or -ENOMEM.
+ */
+int registry_reserve(struct registry *reg, int num_recs)
+{
+	size_t num_slots = 16;
+	struct reg_entry *entries;
+	struct reg_slot *slots;
+	int i;
+
+	/* Mapped arrays cannot be grown in place */
+	if (reg->mapped && reg_unmap(reg) < 0)
+		return -ENOMEM;
+	if (num_recs > reg->max_recs) {
+		entries = realloc(reg->entries, sizeof(*entries) * num_recs);
+		if (!entries)
+			return -ENOMEM;
+		reg->entries = entries;
+		reg->max_recs = num_recs;
+	}
+	while (num_slots < (size_t)num_recs * REG_LOAD_DIV)
+		num_slots <<= 1;
+	if (reg->slots && num_slots <= reg->mask + 1)
+		return 0;
+	if (num_slots > (size_t)UINT32_MAX + 1)
+		return -ENOMEM;
+
+	slots = calloc(num_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	free(reg->slots);
+	reg->slots = slots;
+	reg->mask = num_slots - 1;
+	for (i = 0; i < reg->num_recs; i++)
+		reg_insert_slot(reg, reg->entries[i].hash, i);
+	return 0;
+}
+
+struct reg_entry *registry_lookup(struct registry *reg, struct port_rec *rec)
+{
+	struct reg_key key;
+	__u32 hash, pos;
+
+	if (!reg->slots)
+		return NULL;
+	hash = reg_key_init(&key, rec);
+	pos = reg_find_slot(reg, &key, hash, rec);
+	if (!reg->slots[pos].idx)
+		return NULL;
+	return &reg->entries[reg->slots[pos].idx - 1];
+}
+
+/*
+ * Add @rec registered by @ddc, or attach an existing record to @ddc.
+ * Returns 1 if added, 0 if already present, or -ENOMEM.
+ */
+int registry_add(struct registry *reg, struct port_rec *rec,
+		 const struct in6_addr *ddc)
+{
+	struct reg_entry *e;
+	struct reg_key key;
+	__u32 hash, pos;
+	int ret;
+
+	if (reg->num_recs == reg->max_recs ||
+	    (size_t)(reg->num_recs + 1) * REG_LOAD_DIV > (size_t)reg->mask + 1 ||
+	    !reg->slots) {
+		ret = registry_reserve(reg, reg->max_recs ?
+				       reg->max_recs * 2 : 64);
+		if (ret < 0)
+			return ret;
+	}
+	hash = reg_key_init(&key, rec);
+	pos = reg_find_slot(reg, &key, hash, rec);
+	if (reg->slots[pos].idx) {
+		e = &reg->entries[reg->slots[pos].idx - 1];
+		if (ddc)
+			e->ddc = *ddc;
+		return 0;
+	}
+	e = &reg->entries[reg->num_recs];
+	e->key = key;
+	e->hash = hash;
+	e->rec = *rec;
+	reg_rec_canon(&e->rec, &key);
+	if (ddc)
+		e->ddc = *ddc;
+	else
+		memset(&e->ddc, 0, sizeof(e->ddc));
+	reg->slots[pos].hash = hash;
+	reg->slots[pos].idx = ++reg->num_recs;
+	reg->genctr++;
+	if (reg->notify)
+		reg->notify(reg->notify_priv, reg, reg->num_recs - 1);
+	return 1;
+}
+
+/*
+ * Empty slot @pos, moving back following slots of the probe sequence
+ * which would otherwise become unreachable.
+ */
+static void reg_remove_slot(struct registry *reg, __u32 pos)
+{
+	__u32 i = pos, j = pos, home;
+
+	for (;;) {
+		j = (j + 1) & reg->mask;
+		if (!reg->slots[j].idx)
+			break;
+		home = reg->slots[j].hash & reg->mask;
+		/* Entries whose home slot lies in (i, j] stay */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		reg->slots[i] = reg->slots[j];
+		i = j;
+	}
+	reg->slots[i].idx = 0;
+}
+
+/*
+ * Remove @rec. Returns 1 if removed, 0 if it was not registered.
+ */
+int registry_del(struct registry *reg, struct port_rec *rec)
+{
+	struct reg_key key;
+	__u32 hash, pos, idx, last;
+
+	if (!reg->slots)
+		return 0;
+	hash = reg_key_init(&key, rec);
+	pos = reg_find_slot(reg, &key, hash, rec);
+	if (!reg->slots[pos].idx)
+		return 0;
+	idx = reg->slots[pos].idx - 1;
+	reg_remove_slot(reg, pos);
+
+	/* Move the last entry into the hole and repoint its slot */
+	last = --reg->num_recs;
+	if (idx != last) {
+		reg->entries[idx] = reg->entries[last];
+		for (pos = reg->entries[idx].hash & reg->mask;
+		     reg->slots[pos].idx && reg->slots[pos].idx != last + 1;
+		     pos = (pos + 1) & reg->mask)
+			;
+		/* Not found if a slot of a corrupt snapshot was dropped */
+		reg->slots[pos].hash = reg->entries[idx].hash;
+		reg->slots[pos].idx = idx + 1;
+	}
+	reg->genctr++;
+	if (reg->notify)
+		reg->notify(reg->notify_priv, reg, idx);
+	return 1;
+}
+
+/*
+ * Time insert, lookup, duplicate insert and removal of @num_recs
+ * records.
+ */
+int registry_bench(int num_recs)
+{
+	static const char *names[] = {
+		"insert", "lookup", "miss", "dedupe", "remove",
+	};
+	struct in6_addr ddc = IN6ADDR_LOOPBACK_INIT;
+	struct port_rec *recs, miss;
+	struct registry reg;
+	struct timespec start, end;
+	int i, op, ret = 1;
+
+	recs = calloc(num_recs, sizeof(*recs));
+	if (!recs) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < num_recs; i++)
+		port_rec_bench(&recs[i], i);
+	miss = recs[0];
+	registry_init(&reg);
+
+	for (op = 0; op < 5; op++) {
+		int num_found = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < num_recs; i++) {
+			switch (op) {
+			case 0:
+				num_found += registry_add(&reg, &recs[i], &ddc);
+				break;
+			case 1:
+				/* In a different order than inserted */
+				num_found += !!registry_lookup(&reg,
+					&recs[(i * 7919UL) % num_recs]);
+				break;
+			case 2:
+				/* 20.x.y.z instead of 10.x.y.z */
+				strcpy(miss.traddr, recs[i].traddr);
+				miss.traddr[0] = '2';
+				num_found += !registry_lookup(&reg, &miss);
+				break;
+			case 3:
+				num_found += !registry_add(&reg, &recs[i], &ddc);
+				break;
+			case 4:
+				num_found += registry_del(&reg, &recs[i]);
+				break;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (num_found != num_recs) {
+			fprintf(stderr, "registry %s: %d of %d records\n",
+				names[op], num_found, num_recs);
+			goto out;
+		}
+		printf("registry %-6s: %d records, %6.1f ns/op\n", names[op],
+		       num_recs,
+		       (double)timespec_diff_ns(&start, &end) / num_recs);
+		if (!op)
+			printf("registry memory: %zu bytes entries, "
+			       "%zu bytes index\n",
+			       reg.max_recs * sizeof(*reg.entries),
+			       (reg.mask + 1) * sizeof(*reg.slots));
+	}
+	if (!reg.num_recs)
+		ret = 0;
+out:
+	registry_free(&reg);
+	free(recs);
+	return ret;
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * registry.h - discovery records registered with the CDC
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <netinet/in.h>
+#include <linux/types.h>
+
+#include "nvmet.h"
+
+/* Number of records in the registry benchmark */
+#define REG_BENCH_RECS		1000000
+
+/* The index is grown once more than 1/REG_LOAD_DIV of it is in use */
+#define REG_LOAD_DIV		2
+
+enum {
+	REG_KEY_ADDR = (1 << 0),	/* @addr holds the binary traddr */
+	REG_KEY_SVC = (1 << 1),		/* @svc holds the numeric trsvcid */
+};
+
+/**
+ * struct reg_key - normalized registry key
+ *
+ * @trtype:        transport type
+ * @adrfam:        address family
+ * @flags:         REG_KEY_* flags
+ * @svc:           transport service id, if numeric
+ * @addr:          IPv4 or IPv6 transport address
+ *
+ * Addresses and service ids which cannot be converted are compared
+ * in their string form instead.
+ */
+struct reg_key {
+	__u8 trtype;
+	__u8 adrfam;
+	__u8 flags;
+	__u8 rsvd;
+	__u16 svc;
+	__u16 rsvd2;
+	__u8 addr[16];
+};
+
+/**
+ * struct reg_entry - registered record
+ *
+ * @key:           normalized key
+ * @hash:          hash of @key
+ * @rec:           record, with traddr and trsvcid in canonical form
+ * @ddc:           address of the DDC which registered the record,
+ *                 IPv4 addresses mapped into IPv6
+ */
+struct reg_entry {
+	struct reg_key key;
+	__u32 hash;
+	struct port_rec rec;
+	struct in6_addr ddc;
+};
+
+/**
+ * struct reg_slot - hash index slot
+ *
+ * @hash:          hash of the entry
+ * @idx:           entry index + 1, 0 if the slot is empty
+ */
+struct reg_slot {
+	__u32 hash;
+	__u32 idx;
+};
+
+struct registry;
+
+/*
+ * Called after entry @idx of @reg was added or replaced by another
+ * entry, or removed if @idx is not below @reg->num_recs.
+ */
+typedef void (*reg_notify_t)(void *priv, struct registry *reg, int idx);
+
+/**
+ * struct registry - records registered by DDCs
+ *
+ * @entries:       registered records, densely packed in no particular
+ *                 order
+ * @num_recs:      number of records in @entries
+ * @max_recs:      allocated size of @entries
+ * @slots:         open addressing hash index of @entries with linear
+ *                 probing
+ * @mask:          number of slots - 1; the number of slots is a power
+ *                 of two
+ * @genctr:        incremented on every change
+ * @mapped:        @entries and @slots lie in a registry snapshot
+ *                 mapping; they are copied before they have to grow
+ * @notify:        change callback, may be NULL
+ * @notify_priv:   argument of @notify
+ */
+struct registry {
+	struct reg_entry *entries;
+	int num_recs;
+	int max_recs;
+	struct reg_slot *slots;
+	__u32 mask;
+	unsigned long genctr;
+	int mapped;
+	reg_notify_t notify;
+	void *notify_priv;
+};
+
+void registry_init(struct registry *reg);
+void registry_free(struct registry *reg);
+int registry_reserve(struct registry *reg, int num_recs);
+void registry_attach(struct registry *reg, struct reg_entry *entries,
+		     int num_recs, int max_recs, struct reg_slot *slots,
+		     __u32 num_slots, unsigned long genctr);
+__u32 registry_key(struct reg_key *key, struct port_rec *rec);
+struct reg_entry *registry_lookup(struct registry *reg, struct port_rec *rec);
+int registry_add(struct registry *reg, struct port_rec *rec,
+		 const struct in6_addr *ddc);
+int registry_del(struct registry *reg, struct port_rec *rec);
+int registry_bench(int num_recs);
+
+#endif /* _REGISTRY_H */
@@ -0,0 +1,2542 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * server.c - CDC listener
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Serves DDC connections from a single edge-triggered epoll loop.
+ * Every socket is registered once for both input and output, so no
+ * epoll_ctl() calls are needed while a connection is in use; input
+ * is read and output written until the socket returns EAGAIN.
+ * Buffers of idle connections are released, so an idle connection
+ * costs little more than its socket.
+ *
+ * With worker threads, each worker runs such a loop with its own
+ * SO_REUSEPORT listener, so the kernel spreads the connections and
+ * a connection is only ever touched by one worker. Registry changes
+ * are passed to the main thread, which owns the registry and the
+ * discovery log page, through a lock-free queue.
+ *
+ * Alternatively each loop runs on io_uring, see cdc_uring_loop().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "acdc.h"
+#include "cdc.h"
+#include "uring.h"
+#include "host.h"
+
+/* Stop reading from a DDC which does not collect its responses */
+#define CDC_TX_MAX		(64 * 1024)
+
+/* Segments passed to a single sendmsg() call */
+#define CDC_TX_IOV		64
+
+/* Connections of the benchmark in ICReq/KDReq exchange at a time */
+#define CDC_BENCH_INFLIGHT	1024
+
+/* Connections of each load generator thread of the scaling benchmark */
+#define CDC_LOAD_INFLIGHT	128
+
+/* Largest number of load generator threads */
+#define CDC_LOAD_THREADS	32
+
+/* Submission queue entries of an io_uring loop */
+#define CDC_URING_ENTRIES	4096
+
+/* Receive buffers shared by all connections of an io_uring loop */
+#define CDC_URING_BUFS		1024
+#define CDC_URING_BUF_SIZE	PDU_BUF_MIN
+
+/* Segments passed to a single IORING_OP_SENDMSG */
+#define CDC_URING_IOV		16
+
+/* Smallest log page segment sent from the registered buffer */
+#define CDC_URING_ZC_MIN	4096
+
+/**
+ * struct cdc_loop - epoll loop of the CDC listener or of a worker
+ *
+ * @srv:           CDC state
+ * @stats:         counters of the connections served by this loop
+ * @efd:           epoll instance
+ * @lfd:           listening socket
+ * @stopfd:        terminates the loop when readable
+ * @spare_fd:      descriptor reserved for shedding connections when
+ *                 running out of descriptors
+ * @quiet:         statistics are printed by the main thread
+ * @cpu:           CPU the worker is bound to, -1 if not bound
+ * @mode:          I/O backend running the loop
+ * @num_syscalls:  number of system calls issued by the loop
+ * @aen_hosts:     connections with outstanding AERs
+ * @wal_sync:      durability of the registry changes of the loop
+ * @owner_efd:     eventfd signalled by the registry owner when a
+ *                 change notice was raised or registry changes of
+ *                 the loop became durable, -1 if the loop owns the
+ *                 registry
+ * @wheel:         connect and keep alive timers of the connections
+ * @thread:        worker thread
+ */
+struct cdc_loop {
+	struct cdc_server *srv;
+	struct cdc_stats stats;
+	int efd;
+	int lfd;
+	int stopfd;
+	int spare_fd;
+	int quiet;
+	int cpu;
+	enum cdc_io_mode mode;
+	unsigned long num_syscalls;
+	struct ddc_conn *aen_hosts;
+	struct cdc_wal_sync wal_sync;
+	int owner_efd;
+	struct wheel wheel;
+	pthread_t thread;
+};
+
+/* Up to one descriptor per connection is needed */
+static void cdc_raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		perror("setrlimit");
+}
+
+/*
+ * Open a listening socket on @addr, or on all addresses if @addr is
+ * NULL, preferring a dual-stack IPv6 socket.
+ */
+static int cdc_listen(const char *addr, const char *port, int reuseport)
+{
+	struct addrinfo hints, *ai_list, *ai;
+	int fd = -1, on = 1, off = 0, pass, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	err = getaddrinfo(addr, port, &hints, &ai_list);
+	if (err) {
+		fprintf(stderr, "getaddrinfo %s:%s: %s\n", addr ? addr : "*",
+			port, gai_strerror(err));
+		return -1;
+	}
+	for (pass = 0; pass < 2 && fd < 0; pass++) {
+		for (ai = ai_list; ai; ai = ai->ai_next) {
+			if ((ai->ai_family == AF_INET6) != !pass)
+				continue;
+			fd = socket(ai->ai_family, ai->ai_socktype |
+				    SOCK_NONBLOCK | SOCK_CLOEXEC,
+				    ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				   &on, sizeof(on));
+			if (reuseport &&
+			    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+				       &on, sizeof(on)) < 0) {
+				close(fd);
+				fd = -1;
+				continue;
+			}
+			if (ai->ai_family == AF_INET6 && !addr)
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+					   &off, sizeof(off));
+			if (!bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+			    !listen(fd, SOMAXCONN))
+				break;
+			err = errno;
+			close(fd);
+			fd = -1;
+			errno = err;
+		}
+	}
+	if (fd < 0)
+		fprintf(stderr, "listen on %s:%s: %s\n", addr ? addr : "*",
+			port, strerror(errno));
+	freeaddrinfo(ai_list);
+	return fd;
+}
+
+static void cdc_close(struct cdc_loop *l, struct ddc_conn *dc)
+{
+	close(dc->fd);
+	l->num_syscalls++;
+	ddc_free(dc);
+	free(dc);
+	l->stats.num_conns--;
+}
+
+/* Source address of a DDC as IPv6 address */
+static void cdc_peer_addr(struct sockaddr_storage *ss, struct in6_addr *addr)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+	memset(addr, 0, sizeof(*addr));
+	if (ss->ss_family == AF_INET6) {
+		*addr = ((struct sockaddr_in6 *)ss)->sin6_addr;
+	} else if (ss->ss_family == AF_INET) {
+		addr->s6_addr[10] = 0xff;
+		addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12], &sin->sin_addr, 4);
+	}
+}
+
+static void cdc_accept(struct cdc_loop *l)
+{
+	struct sockaddr_storage ss;
+	struct in6_addr addr;
+	struct epoll_event ev;
+	struct ddc_conn *dc;
+	socklen_t sslen;
+	int fd, on = 1;
+
+	for (;;) {
+		sslen = sizeof(ss);
+		fd = accept4(l->lfd, (struct sockaddr *)&ss, &sslen,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		l->num_syscalls++;
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if ((errno != EMFILE && errno != ENFILE) ||
+			    l->spare_fd < 0)
+				break;
+			/*
+			 * The listener is edge-triggered, so pending
+			 * connections which cannot be accepted would stall
+			 * it; shed them, the DDCs will retry.
+			 */
+			fprintf(stderr, "accept: %s, dropping connection\n",
+				strerror(errno));
+			close(l->spare_fd);
+			fd = accept(l->lfd, NULL, NULL);
+			if (fd >= 0)
+				close(fd);
+			l->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				break;
+			continue;
+		}
+		/* Small request/response PDUs */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		l->num_syscalls++;
+		dc = malloc(sizeof(*dc));
+		if (!dc) {
+			close(fd);
+			continue;
+		}
+		cdc_peer_addr(&ss, &addr);
+		ddc_init(dc, l->srv, &l->stats, &l->aen_hosts, &l->wal_sync,
+			 &l->wheel, fd, &addr);
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = dc;
+		l->num_syscalls++;
+		if (epoll_ctl(l->efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			close(fd);
+			ddc_free(dc);
+			free(dc);
+			continue;
+		}
+		l->stats.num_conns++;
+		l->stats.num_accepted++;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept");
+}
+
+/*
+ * Send queued PDUs. Returns 1 if everything was sent, 0 if the
+ * socket is full.
+ */
+static int ddc_flush(struct cdc_loop *l, struct ddc_conn *dc)
+{
+	struct iovec vec[CDC_TX_IOV];
+	struct msghdr msg;
+	ssize_t len;
+
+	while (dc->tx_pending) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = ddc_tx_iov(dc, vec, CDC_TX_IOV);
+		len = sendmsg(dc->fd, &msg, MSG_NOSIGNAL);
+		l->num_syscalls++;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			/* Nobody left to send to */
+			dc->state = DDC_CLOSING;
+			len = dc->tx_pending;
+		}
+		ddc_tx_advance(dc, len);
+	}
+	return 1;
+}
+
+static void ddc_event(struct cdc_loop *l, struct ddc_conn *dc)
+{
+	int ret = 0, flushed;
+
+	for (;;) {
+		/* Nothing is read while a KDResp is held back */
+		while (dc->state != DDC_CLOSING && !dc->wal_seq &&
+		       dc->tx_pending < CDC_TX_MAX) {
+			ret = pdu_recv(dc->fd, &dc->pb, &ddc_pdu_ops, dc);
+			l->num_syscalls++;
+			if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+				break;
+			if (ret < 0)
+				ddc_fatal(dc, ret);
+		}
+		flushed = ddc_flush(l, dc);
+		/* Wait for EPOLLIN, or EPOLLOUT to continue */
+		if (dc->state == DDC_CLOSING || ret == -EAGAIN ||
+		    ret == -EWOULDBLOCK || !flushed || dc->wal_seq)
+			break;
+	}
+	if (dc->state == DDC_CLOSING) {
+		if (flushed)
+			cdc_close(l, dc);
+		return;
+	}
+	if (dc->pb.head == dc->pb.tail)
+		pdu_buf_free(&dc->pb);
+}
+
+/* Close a connection whose timer expired, see ddc_timeout() */
+static void cdc_timeout(void *priv, struct wheel_timer *t)
+{
+	struct ddc_conn *dc = wheel_entry(t, struct ddc_conn, timer);
+
+	if (ddc_timeout(dc))
+		ddc_event(priv, dc);
+}
+
+#define cdc_stats_read(l, field) \
+	__atomic_load_n(&(l)->stats.field, __ATOMIC_RELAXED)
+
+/* Sum up the counters of @num_loops loops */
+static void cdc_stats_sum(struct cdc_loop *loops, int num_loops,
+			  struct cdc_stats *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < num_loops; i++) {
+		sum->num_conns += cdc_stats_read(&loops[i], num_conns);
+		sum->num_accepted += cdc_stats_read(&loops[i], num_accepted);
+		sum->num_kdreq += cdc_stats_read(&loops[i], num_kdreq);
+		sum->num_rejected += cdc_stats_read(&loops[i], num_rejected);
+		sum->num_errors += cdc_stats_read(&loops[i], num_errors);
+		sum->num_get_log += cdc_stats_read(&loops[i], num_get_log);
+		sum->num_aen += cdc_stats_read(&loops[i], num_aen);
+		sum->num_aen_masked += cdc_stats_read(&loops[i],
+						      num_aen_masked);
+		sum->num_timeouts += cdc_stats_read(&loops[i], num_timeouts);
+		sum->num_auth += cdc_stats_read(&loops[i], num_auth);
+		sum->num_auth_failed += cdc_stats_read(&loops[i],
+						       num_auth_failed);
+	}
+}
+
+static void cdc_stats(struct cdc_server *srv, struct cdc_stats *st)
+{
+	printf("%d connections, %lu accepted, %lu KDReqs, %lu rejected, "
+	       "%lu errors, %lu timed out, %d records, %lu Get Log Page, "
+	       "%lu log builds, %lu log patches, %lu AENs raised, "
+	       "%lu suppressed\n",
+	       st->num_conns, st->num_accepted,
+	       st->num_kdreq, st->num_rejected, st->num_errors,
+	       st->num_timeouts,
+	       srv->reg.num_recs, st->num_get_log, srv->num_log_builds,
+	       srv->num_log_patches, st->num_aen,
+	       srv->num_aen_coalesced + st->num_aen_masked);
+	if (srv->auth)
+		printf("%lu hosts authenticated, %lu failed, %lu DH keys "
+		       "generated ahead, %lu on demand, %lu reused\n",
+		       st->num_auth, st->num_auth_failed,
+		       srv->auth->pool.num_generated,
+		       srv->auth->pool.num_missed,
+		       srv->auth->pool.num_reused);
+	if (srv->wal.fd >= 0)
+		printf("%lu changes logged in %lu commits\n",
+		       srv->wal.num_recs, srv->wal.num_commits);
+	if (srv->gossip)
+		printf("%lu replication rounds, %lu in sync, %lu served, "
+		       "%lu records sent, %lu received, %lu bytes sent\n",
+		       srv->gossip->num_rounds, srv->gossip->num_synced,
+		       srv->gossip->num_served, srv->gossip->num_recs_sent,
+		       srv->gossip->num_recs_recv, srv->gossip->num_bytes);
+}
+
+/*
+ * Print the statistics of @loops if anything happened since @last,
+ * and update @last.
+ */
+static void cdc_stats_update(struct cdc_server *srv, struct cdc_loop *loops,
+			     int num_loops, struct cdc_stats *last)
+{
+	struct cdc_stats sum;
+
+	cdc_stats_sum(loops, num_loops, &sum);
+	if (sum.num_kdreq != last->num_kdreq ||
+	    sum.num_accepted != last->num_accepted ||
+	    sum.num_get_log != last->num_get_log ||
+	    sum.num_aen != last->num_aen ||
+	    sum.num_timeouts != last->num_timeouts ||
+	    sum.num_auth != last->num_auth ||
+	    sum.num_auth_failed != last->num_auth_failed)
+		cdc_stats(srv, &sum);
+	*last = sum;
+}
+
+/*
+ * Notify the hosts of @l with outstanding AERs of a change notice
+ * raised by the registry owner.
+ */
+static void cdc_aen_deliver(struct cdc_loop *l)
+{
+	struct ddc_conn *dc, *next;
+
+	for (dc = l->aen_hosts; dc; dc = next) {
+		next = dc->aen_next;
+		if (ddc_aen_poll(dc) < 0)
+			ddc_fatal(dc, -ENOMEM);
+		if (ddc_flush(l, dc) && dc->state == DDC_CLOSING)
+			cdc_close(l, dc);
+	}
+}
+
+/* Whether the registry changes @dc holds back its KDResp for are durable */
+static int ddc_wal_synced(struct ddc_conn *dc)
+{
+	unsigned long synced = __atomic_load_n(&dc->wal_sync->synced,
+					       __ATOMIC_ACQUIRE);
+
+	return (long)(synced - dc->wal_seq) >= 0;
+}
+
+/*
+ * Send the KDResps of @l held back for registry changes which are
+ * durable now, and continue with the PDUs received meanwhile.
+ */
+static void cdc_wal_deliver(struct cdc_loop *l)
+{
+	struct ddc_conn *dc, *next;
+	int ret;
+
+	for (dc = l->wal_sync.waiters; dc; dc = next) {
+		next = dc->wal_next;
+		if (!ddc_wal_synced(dc))
+			continue;
+		ret = ddc_wal_release(dc);
+		if (!ret)
+			ret = pdu_dispatch(&dc->pb, &ddc_pdu_ops, dc);
+		if (ret < 0)
+			ddc_fatal(dc, ret);
+		ddc_event(l, dc);
+	}
+}
+
+/*
+ * Commit the registry changes made by the loop owning the registry,
+ * all of them with a single fdatasync(), and send the KDResps held
+ * back for them. Changes made by PDUs dispatched meanwhile are left
+ * to the next iteration of the loop, which does not wait for events
+ * then, so they are committed together with those of other
+ * connections.
+ */
+static void cdc_wal_sync(struct cdc_loop *l)
+{
+	struct cdc_wal_sync *ws = &l->wal_sync;
+
+	if (ws->synced == ws->applied)
+		return;
+	/* KDResps are held back until their changes are durable */
+	if (cdc_wal_commit(l->srv) < 0)
+		return;
+	__atomic_store_n(&ws->synced, ws->applied, __ATOMIC_RELEASE);
+	cdc_wal_deliver(l);
+}
+
+/*
+ * Time in ms until the statistics due at @next, the pending change
+ * notice or a retry of the registry owner are due.
+ */
+static long cdc_owner_timeout(struct cdc_server *srv, struct timespec *now,
+			      struct timespec *next)
+{
+	long ms = timespec_diff_ms(now, next) + 1, aen_ms, wal_ms, log_ms;
+	long snap_ms;
+
+	aen_ms = cdc_aen_timeout(srv);
+	if (aen_ms >= 0 && aen_ms < ms)
+		ms = aen_ms;
+	wal_ms = cdc_wal_timeout(srv);
+	if (wal_ms >= 0 && wal_ms < ms)
+		ms = wal_ms;
+	log_ms = cdc_log_timeout(srv);
+	if (log_ms >= 0 && log_ms < ms)
+		ms = log_ms;
+	snap_ms = cdc_snap_timeout(srv);
+	if (snap_ms >= 0 && snap_ms < ms)
+		ms = snap_ms;
+	return ms;
+}
+
+static int cdc_loop(struct cdc_loop *l)
+{
+	struct epoll_event events[256], ev;
+	struct cdc_stats last = { 0 };
+	struct timespec now, next;
+	uint64_t val;
+	long ms;
+	int i, n, ret = 0;
+
+	if (wheel_init(&l->wheel, cdc_timeout, l) < 0) {
+		perror("timerfd_create");
+		return 1;
+	}
+	l->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->efd < 0) {
+		perror("epoll_create1");
+		wheel_free(&l->wheel);
+		return 1;
+	}
+	l->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	/* NULL tags the listener, the stop descriptor its own address */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(l->efd, EPOLL_CTL_ADD, l->lfd, &ev) < 0) {
+		perror("epoll_ctl");
+		ret = 1;
+		goto out;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &l->stopfd;
+	if (epoll_ctl(l->efd, EPOLL_CTL_ADD, l->stopfd, &ev) < 0) {
+		perror("epoll_ctl");
+		ret = 1;
+		goto out;
+	}
+	ev.data.ptr = &l->owner_efd;
+	if (l->owner_efd >= 0 &&
+	    epoll_ctl(l->efd, EPOLL_CTL_ADD, l->owner_efd, &ev) < 0) {
+		perror("epoll_ctl");
+		ret = 1;
+		goto out;
+	}
+	ev.data.ptr = &l->wheel;
+	if (epoll_ctl(l->efd, EPOLL_CTL_ADD, l->wheel.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		ret = 1;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	timespec_add_ms(&next, CDC_STATS_INTERVAL * 1000);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_ms(&now, &next) <= 0) {
+			if (!l->quiet)
+				cdc_stats_update(l->srv, l, 1, &last);
+			if (l->owner_efd < 0)
+				cdc_snap_save(l->srv);
+			next = now;
+			timespec_add_ms(&next, CDC_STATS_INTERVAL * 1000);
+		}
+		/* Unless a failed commit is to be retried later */
+		if (l->wal_sync.synced != l->wal_sync.applied &&
+		    cdc_wal_timeout(l->srv) <= 0)
+			ms = 0;
+		else if (l->owner_efd < 0)
+			ms = cdc_owner_timeout(l->srv, &now, &next);
+		else
+			ms = timespec_diff_ms(&now, &next) + 1;
+		n = epoll_wait(l->efd, events, 256, ms);
+		l->num_syscalls++;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			ret = 1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (!events[i].data.ptr)
+				cdc_accept(l);
+			else if (events[i].data.ptr == &l->stopfd)
+				goto out;
+			else if (events[i].data.ptr == &l->owner_efd) {
+				if (read(l->owner_efd, &val, sizeof(val)) < 0)
+					perror("read");
+				cdc_wal_deliver(l);
+				cdc_aen_deliver(l);
+			} else if (events[i].data.ptr == &l->wheel) {
+				wheel_event(&l->wheel);
+				l->num_syscalls += 2;
+			} else
+				ddc_event(l, events[i].data.ptr);
+		}
+		if (l->owner_efd < 0) {
+			cdc_wal_sync(l);
+			cdc_log_retry(l->srv);
+			cdc_snap_verify(l->srv);
+		}
+		/* Raise change notices if this loop owns the registry */
+		if (l->owner_efd < 0 && cdc_aen_raise(l->srv))
+			cdc_aen_deliver(l);
+	}
+out:
+	if (l->spare_fd >= 0)
+		close(l->spare_fd);
+	close(l->efd);
+	wheel_free(&l->wheel);
+	return ret;
+}
+
+/*
+ * io_uring backend: the listener is served by a multishot accept and
+ * each connection by a multishot recv selecting buffers from a ring
+ * shared by all connections, so idle connections hold no receive
+ * buffer and no system call is made per connection and event. Log
+ * page data is sent zero-copy from a registered buffer holding the
+ * current log page; everything else with IORING_OP_SENDMSG.
+ *
+ * At most one send is in flight per connection, as the protocol
+ * engine may move the inline transmit buffer when queueing PDUs;
+ * data received meanwhile is kept in the PDU buffer and dispatched
+ * once the send has completed.
+ */
+
+/* Operation tagged in the low bits of the io_uring user_data */
+enum cdc_uring_op {
+	CDC_URING_ACCEPT,
+	CDC_URING_RECV,
+	CDC_URING_SEND,
+	CDC_URING_SEND_ZC,
+	CDC_URING_STOP,
+	CDC_URING_TIMER,
+	CDC_URING_CANCEL,
+	CDC_URING_AEN,
+};
+
+#define CDC_URING_OP_MASK	7
+
+/**
+ * struct cdc_uring - io_uring state of a loop
+ *
+ * @l:             loop served by the ring
+ * @ring:          io_uring instance
+ * @br:            ring of receive buffers provided to the kernel
+ * @br_tail:       next free entry of @br
+ * @bufs:          memory of the receive buffers
+ * @fixed_log:     log page registered as fixed buffer 0, referenced
+ * @zc:            log page data is sent zero-copy
+ * @ts:            statistics interval
+ * @aen_ts:        time until the pending change notice is due
+ * @aen_armed:     waiting for @owner_efd or @aen_ts
+ * @aen_val:       buffer for reading @owner_efd
+ * @wheel_val:     buffer for reading the timerfd of the loop
+ */
+struct cdc_uring {
+	struct cdc_loop *l;
+	struct uring ring;
+	struct io_uring_buf_ring *br;
+	__u16 br_tail;
+	char *bufs;
+	struct disc_log *fixed_log;
+	int zc;
+	struct __kernel_timespec ts;
+	struct __kernel_timespec aen_ts;
+	int aen_armed;
+	uint64_t aen_val;
+	uint64_t wheel_val;
+};
+
+/**
+ * struct cdc_uconn - connection served by io_uring
+ *
+ * @dc:            protocol state
+ * @msg:           message of the send in flight
+ * @vec:           segments of @msg
+ * @recv_armed:    the multishot recv is active
+ * @send_busy:     a send is in flight
+ * @closing:       waiting for the requests in flight to close
+ */
+struct cdc_uconn {
+	struct ddc_conn dc;
+	struct msghdr msg;
+	struct iovec vec[CDC_URING_IOV];
+	int recv_armed;
+	int send_busy;
+	int closing;
+};
+
+/**
+ * struct cdc_uring_zc - zero-copy send of log page data
+ *
+ * @uc:            connection, until the send has completed
+ * @log:           log page referenced until the notification
+ * @pinned:        @log is pinned until the notification
+ */
+struct cdc_uring_zc {
+	struct cdc_uconn *uc;
+	struct disc_log *log;
+	int pinned;
+};
+
+static struct io_uring_sqe *cdc_uring_sqe(struct cdc_uring *u, void *ptr,
+					  enum cdc_uring_op op)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+	if (!sqe) {
+		/* Make room by passing what we have to the kernel */
+		uring_submit(&u->ring, 0);
+		u->l->num_syscalls++;
+		sqe = uring_get_sqe(&u->ring);
+		if (!sqe)
+			return NULL;
+	}
+	sqe->user_data = (unsigned long)ptr | op;
+	return sqe;
+}
+
+static void cdc_uring_put_buf(struct cdc_uring *u, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->br->bufs[u->br_tail & (CDC_URING_BUFS - 1)];
+	buf->addr = (unsigned long)(u->bufs + bid * CDC_URING_BUF_SIZE);
+	buf->len = CDC_URING_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int cdc_uring_accept(struct cdc_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = cdc_uring_sqe(u, NULL, CDC_URING_ACCEPT);
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = u->l->lfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	return 0;
+}
+
+static int cdc_uring_recv(struct cdc_uring *u, struct cdc_uconn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = cdc_uring_sqe(u, uc, CDC_URING_RECV);
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uc->dc.fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	uc->recv_armed = 1;
+	return 0;
+}
+
+static void cdc_uring_timer(struct cdc_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = cdc_uring_sqe(u, NULL, CDC_URING_TIMER);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&u->ts;
+	sqe->len = 1;
+}
+
+/* Wait for the timerfd, tagged as timer with the wheel */
+static void cdc_uring_wheel(struct cdc_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = cdc_uring_sqe(u, &u->l->wheel, CDC_URING_TIMER);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = u->l->wheel.fd;
+	sqe->addr = (unsigned long)&u->wheel_val;
+	sqe->len = sizeof(u->wheel_val);
+}
+
+/*
+ * Register @log as fixed buffer 0 unless it is registered already.
+ * The kernel keeps the previous registration until the sends using
+ * it have completed.
+ */
+static int cdc_uring_fix_log(struct cdc_uring *u, struct disc_log *log)
+{
+	struct io_uring_rsrc_update2 up;
+	struct iovec vec;
+	int ret;
+
+	if (log == u->fixed_log)
+		return 0;
+	vec.iov_base = log->data;
+	vec.iov_len = log->size;
+	memset(&up, 0, sizeof(up));
+	up.data = (unsigned long)&vec;
+	up.nr = 1;
+	ret = uring_register(&u->ring, IORING_REGISTER_BUFFERS_UPDATE,
+			     &up, sizeof(up));
+	u->l->num_syscalls++;
+	if (ret < 0)
+		return ret;
+	/* Also keeps @log from being reallocated in place */
+	disc_log_put(u->fixed_log);
+	u->fixed_log = disc_log_get(log);
+	return 0;
+}
+
+/* Whether segment @i of the transmit queue is sent zero-copy */
+static int cdc_uring_is_zc(struct cdc_uring *u, struct ddc_conn *dc, int i)
+{
+	struct ddc_iov *iov = &dc->iov[i];
+	size_t off = i == dc->iov_head ? dc->iov_off : 0;
+
+	/* File-backed memory cannot be registered */
+	return u->zc && iov->log && !iov->log->mapped &&
+		iov->len - off >= CDC_URING_ZC_MIN;
+}
+
+static void cdc_uring_send(struct cdc_uring *u, struct cdc_uconn *uc)
+{
+	struct ddc_conn *dc = &uc->dc;
+	struct ddc_iov *iov = &dc->iov[dc->iov_head];
+	struct io_uring_sqe *sqe;
+	struct cdc_uring_zc *zc;
+	int i, n;
+
+	if (cdc_uring_is_zc(u, dc, dc->iov_head)) {
+		zc = malloc(sizeof(*zc));
+		if (zc && cdc_uring_fix_log(u, iov->log) < 0) {
+			fprintf(stderr, "cannot register log page buffer, "
+				"disabling zero-copy sends\n");
+			u->zc = 0;
+			free(zc);
+			zc = NULL;
+		}
+		if (zc) {
+			sqe = cdc_uring_sqe(u, zc, CDC_URING_SEND_ZC);
+			if (!sqe) {
+				free(zc);
+				return;
+			}
+			zc->uc = uc;
+			zc->log = disc_log_get(iov->log);
+			zc->pinned = iov->pinned;
+			if (zc->pinned)
+				disc_log_pin(zc->log);
+			sqe->opcode = IORING_OP_SEND_ZC;
+			sqe->fd = dc->fd;
+			sqe->addr = (unsigned long)iov->base + dc->iov_off;
+			sqe->len = iov->len - dc->iov_off;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+			sqe->buf_index = 0;
+			uc->send_busy = 1;
+			return;
+		}
+	}
+	sqe = cdc_uring_sqe(u, uc, CDC_URING_SEND);
+	if (!sqe)
+		return;
+	n = ddc_tx_iov(dc, uc->vec, CDC_URING_IOV);
+	/* Stop at the next segment sent zero-copy */
+	for (i = 1; i < n; i++) {
+		if (cdc_uring_is_zc(u, dc, dc->iov_head + i))
+			break;
+	}
+	memset(&uc->msg, 0, sizeof(uc->msg));
+	uc->msg.msg_iov = uc->vec;
+	uc->msg.msg_iovlen = i;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = dc->fd;
+	sqe->addr = (unsigned long)&uc->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	uc->send_busy = 1;
+}
+
+/* Release @uc once no request refers to it any more */
+static void cdc_uring_close(struct cdc_uring *u, struct cdc_uconn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!uc->closing) {
+		uc->closing = 1;
+		if (uc->recv_armed) {
+			sqe = cdc_uring_sqe(u, NULL, CDC_URING_CANCEL);
+			if (sqe) {
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->addr = (unsigned long)uc | CDC_URING_RECV;
+			}
+		}
+	}
+	if (uc->recv_armed || uc->send_busy)
+		return;
+	close(uc->dc.fd);
+	u->l->num_syscalls++;
+	ddc_free(&uc->dc);
+	free(uc);
+	u->l->stats.num_conns--;
+}
+
+/*
+ * Dispatch buffered PDUs and send the responses, unless a send is
+ * in flight, and close the connection once it is done.
+ */
+static void cdc_uring_progress(struct cdc_uring *u, struct cdc_uconn *uc)
+{
+	struct ddc_conn *dc = &uc->dc;
+	int ret;
+
+	if (uc->closing || uc->send_busy)
+		return;
+	/* Nothing is queued while a send is in flight */
+	if (dc->wal_seq && ddc_wal_synced(dc) && ddc_wal_release(dc) < 0)
+		ddc_fatal(dc, -ENOMEM);
+	if (dc->state != DDC_CLOSING && dc->tx_pending < CDC_TX_MAX &&
+	    dc->pb.head != dc->pb.tail) {
+		ret = pdu_dispatch(&dc->pb, &ddc_pdu_ops, dc);
+		if (ret < 0)
+			ddc_fatal(dc, ret);
+	}
+	if (dc->num_aer && dc->state != DDC_CLOSING && ddc_aen_poll(dc) < 0)
+		ddc_fatal(dc, -ENOMEM);
+	if (dc->pb.head == dc->pb.tail)
+		pdu_buf_free(&dc->pb);
+	/* May free @uc */
+	if (dc->tx_pending)
+		cdc_uring_send(u, uc);
+	else if (dc->state == DDC_CLOSING)
+		cdc_uring_close(u, uc);
+}
+
+static void cdc_uring_new_conn(struct cdc_uring *u, int fd)
+{
+	struct cdc_loop *l = u->l;
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	struct in6_addr addr;
+	struct cdc_uconn *uc;
+	int on = 1;
+
+	l->num_syscalls += 2;
+	if (getpeername(fd, (struct sockaddr *)&ss, &sslen) < 0) {
+		close(fd);
+		return;
+	}
+	/* Small request/response PDUs */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	uc = calloc(1, sizeof(*uc));
+	if (!uc) {
+		close(fd);
+		return;
+	}
+	cdc_peer_addr(&ss, &addr);
+	ddc_init(&uc->dc, l->srv, &l->stats, &l->aen_hosts, &l->wal_sync,
+		 &l->wheel, fd, &addr);
+	if (cdc_uring_recv(u, uc) < 0) {
+		close(fd);
+		ddc_free(&uc->dc);
+		free(uc);
+		return;
+	}
+	l->stats.num_conns++;
+	l->stats.num_accepted++;
+}
+
+/* As cdc_timeout(), connections with a send in flight close after it */
+static void cdc_uring_timeout(void *priv, struct wheel_timer *t)
+{
+	struct cdc_uconn *uc = wheel_entry(t, struct cdc_uconn, dc.timer);
+
+	if (ddc_timeout(&uc->dc))
+		cdc_uring_progress(priv, uc);
+}
+
+static void cdc_uring_accepted(struct cdc_uring *u, struct io_uring_cqe *cqe)
+{
+	struct cdc_loop *l = u->l;
+	int fd;
+
+	if (cqe->res >= 0)
+		cdc_uring_new_conn(u, cqe->res);
+	else if ((cqe->res == -EMFILE || cqe->res == -ENFILE) &&
+		 l->spare_fd >= 0) {
+		/* As in cdc_accept(), shed the connection */
+		fprintf(stderr, "accept: %s, dropping connection\n",
+			strerror(-cqe->res));
+		close(l->spare_fd);
+		fd = accept(l->lfd, NULL, NULL);
+		if (fd >= 0)
+			close(fd);
+		l->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		l->num_syscalls += 4;
+	} else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+		fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		cdc_uring_accept(u);
+}
+
+static void cdc_uring_received(struct cdc_uring *u, struct cdc_uconn *uc,
+			       struct io_uring_cqe *cqe)
+{
+	struct ddc_conn *dc = &uc->dc;
+	unsigned int bid;
+	char *buf;
+	int ret;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uc->recv_armed = 0;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = u->bufs + bid * CDC_URING_BUF_SIZE;
+		if (cqe->res > 0 && !uc->closing && dc->state != DDC_CLOSING) {
+			if (uc->send_busy || dc->tx_pending >= CDC_TX_MAX) {
+				ret = pdu_buf_append(&dc->pb, buf, cqe->res);
+			} else {
+				ret = pdu_feed(&dc->pb, buf, cqe->res,
+					       &ddc_pdu_ops, dc);
+			}
+			if (ret < 0)
+				ddc_fatal(dc, ret);
+		}
+		cdc_uring_put_buf(u, bid);
+	} else if (!cqe->res) {
+		ddc_fatal(dc, -ECONNRESET);
+	} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		ddc_fatal(dc, cqe->res);
+	}
+	if (uc->closing) {
+		cdc_uring_close(u, uc);
+		return;
+	}
+	/* Out of receive buffers, or the kernel ended the recv */
+	if (!uc->recv_armed && dc->state != DDC_CLOSING)
+		cdc_uring_recv(u, uc);
+	cdc_uring_progress(u, uc);
+}
+
+static void cdc_uring_sent(struct cdc_uring *u, struct cdc_uconn *uc,
+			   int res)
+{
+	struct ddc_conn *dc = &uc->dc;
+
+	uc->send_busy = 0;
+	if (res < 0 && res != -EAGAIN && res != -EINTR) {
+		/* Nobody left to send to */
+		dc->state = DDC_CLOSING;
+		ddc_tx_advance(dc, dc->tx_pending);
+	} else if (res > 0) {
+		ddc_tx_advance(dc, res);
+	}
+	if (uc->closing)
+		cdc_uring_close(u, uc);
+	else
+		cdc_uring_progress(u, uc);
+}
+
+static void cdc_uring_sent_zc(struct cdc_uring *u, struct cdc_uring_zc *zc,
+			      struct io_uring_cqe *cqe)
+{
+	if (!(cqe->flags & IORING_CQE_F_NOTIF)) {
+		struct cdc_uconn *uc = zc->uc;
+
+		zc->uc = NULL;
+		if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+			fprintf(stderr, "zero-copy send failed, "
+				"disabling zero-copy sends\n");
+			u->zc = 0;
+			cqe->res = -EAGAIN;
+		}
+		cdc_uring_sent(u, uc, cqe->res);
+		/* The notification follows */
+		if (cqe->flags & IORING_CQE_F_MORE)
+			return;
+	}
+	/* The kernel is done with the data */
+	if (zc->pinned)
+		disc_log_unpin(zc->log);
+	disc_log_put(zc->log);
+	free(zc);
+}
+
+/*
+ * Wait for the next change notice: workers wait for the registry
+ * owner, which also wakes them for durable registry changes, a loop
+ * owning the registry for the notice to become due.
+ */
+static void cdc_uring_aen_arm(struct cdc_uring *u)
+{
+	struct cdc_loop *l = u->l;
+	struct io_uring_sqe *sqe;
+	long ms, wal_ms, snap_ms;
+
+	if (u->aen_armed)
+		return;
+	if (l->owner_efd >= 0) {
+		sqe = cdc_uring_sqe(u, NULL, CDC_URING_AEN);
+		if (!sqe)
+			return;
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = l->owner_efd;
+		sqe->addr = (unsigned long)&u->aen_val;
+		sqe->len = sizeof(u->aen_val);
+	} else {
+		ms = cdc_aen_timeout(l->srv);
+		/* Also wakes the loop to retry a failed commit */
+		wal_ms = cdc_wal_timeout(l->srv);
+		if (wal_ms >= 0 && (ms < 0 || wal_ms < ms))
+			ms = wal_ms;
+		/* And to verify a restored snapshot */
+		snap_ms = cdc_snap_timeout(l->srv);
+		if (snap_ms >= 0 && (ms < 0 || snap_ms < ms))
+			ms = snap_ms;
+		if (ms < 0)
+			return;
+		sqe = cdc_uring_sqe(u, NULL, CDC_URING_AEN);
+		if (!sqe)
+			return;
+		u->aen_ts.tv_sec = ms / 1000;
+		u->aen_ts.tv_nsec = (ms % 1000) * 1000000;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (unsigned long)&u->aen_ts;
+		sqe->len = 1;
+	}
+	u->aen_armed = 1;
+}
+
+/* As cdc_wal_deliver(), connections with a send in flight wait for it */
+static void cdc_uring_wal_deliver(struct cdc_uring *u)
+{
+	struct ddc_conn *dc, *next;
+
+	for (dc = u->l->wal_sync.waiters; dc; dc = next) {
+		next = dc->wal_next;
+		if (ddc_wal_synced(dc))
+			cdc_uring_progress(u, (struct cdc_uconn *)dc);
+	}
+}
+
+/* As cdc_wal_sync() */
+static void cdc_uring_wal_sync(struct cdc_uring *u)
+{
+	struct cdc_wal_sync *ws = &u->l->wal_sync;
+
+	if (ws->synced == ws->applied || cdc_wal_commit(u->l->srv) < 0)
+		return;
+	__atomic_store_n(&ws->synced, ws->applied, __ATOMIC_RELEASE);
+	cdc_uring_wal_deliver(u);
+}
+
+static void cdc_uring_aen(struct cdc_uring *u)
+{
+	struct cdc_loop *l = u->l;
+	struct ddc_conn *dc, *next;
+
+	u->aen_armed = 0;
+	if (l->owner_efd >= 0)
+		cdc_uring_wal_deliver(u);
+	if (l->owner_efd < 0 && !cdc_aen_raise(l->srv))
+		return;
+	/* Connections with a send in flight poll when it completes */
+	for (dc = l->aen_hosts; dc; dc = next) {
+		next = dc->aen_next;
+		cdc_uring_progress(u, (struct cdc_uconn *)dc);
+	}
+}
+
+static int cdc_uring_init(struct cdc_uring *u, struct cdc_loop *l)
+{
+	struct io_uring_rsrc_register rr;
+	struct io_uring_buf_reg reg;
+	size_t br_size = CDC_URING_BUFS * sizeof(struct io_uring_buf);
+	int ret, i;
+
+	memset(u, 0, sizeof(*u));
+	u->l = l;
+	ret = uring_init(&u->ring, CDC_URING_ENTRIES, 0);
+	if (ret < 0)
+		return ret;
+	u->br = mmap(NULL, br_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc(CDC_URING_BUFS * CDC_URING_BUF_SIZE);
+	if (u->br == MAP_FAILED || !u->bufs) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = CDC_URING_BUFS;
+	reg.bgid = 0;
+	ret = uring_register(&u->ring, IORING_REGISTER_PBUF_RING, &reg, 1);
+	if (ret < 0)
+		goto out_free;
+	for (i = 0; i < CDC_URING_BUFS; i++)
+		cdc_uring_put_buf(u, i);
+
+	/* One sparse slot for the log page */
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = 1;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	u->zc = !uring_register(&u->ring, IORING_REGISTER_BUFFERS2,
+				&rr, sizeof(rr));
+	u->ts.tv_sec = CDC_STATS_INTERVAL;
+	return 0;
+
+out_free:
+	if (u->br != MAP_FAILED)
+		munmap(u->br, br_size);
+	free(u->bufs);
+	uring_exit(&u->ring);
+	return ret;
+}
+
+static void cdc_uring_exit(struct cdc_uring *u)
+{
+	/* Requests still referring to connections are cancelled */
+	uring_exit(&u->ring);
+	munmap(u->br, CDC_URING_BUFS * sizeof(struct io_uring_buf));
+	free(u->bufs);
+	disc_log_put(u->fixed_log);
+}
+
+/*
+ * Run the loop @l on io_uring. Returns a negative errno value if
+ * io_uring could not be set up, otherwise like cdc_loop().
+ */
+static int cdc_uring_loop(struct cdc_loop *l)
+{
+	struct cdc_uring u;
+	struct cdc_stats last = { 0 };
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	ret = cdc_uring_init(&u, l);
+	if (ret < 0)
+		return ret;
+	ret = wheel_init(&l->wheel, cdc_uring_timeout, &u);
+	if (ret < 0) {
+		cdc_uring_exit(&u);
+		return ret;
+	}
+	l->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	cdc_uring_accept(&u);
+	cdc_uring_wheel(&u);
+	sqe = cdc_uring_sqe(&u, NULL, CDC_URING_STOP);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = l->stopfd;
+	sqe->poll32_events = POLLIN;
+	if (!l->quiet)
+		cdc_uring_timer(&u);
+
+	for (;;) {
+		/* Registry changes left to commit do not wait */
+		ret = uring_submit(&u.ring,
+				   l->wal_sync.synced == l->wal_sync.applied ||
+				   cdc_wal_timeout(l->srv) > 0);
+		l->num_syscalls++;
+		if (ret < 0 && ret != -EBUSY && ret != -EAGAIN) {
+			fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+			ret = 1;
+			break;
+		}
+		while ((cqe = uring_peek_cqe(&u.ring))) {
+			unsigned long data = cqe->user_data;
+			void *ptr = (void *)(data & ~CDC_URING_OP_MASK);
+
+			switch (data & CDC_URING_OP_MASK) {
+			case CDC_URING_ACCEPT:
+				cdc_uring_accepted(&u, cqe);
+				break;
+			case CDC_URING_RECV:
+				cdc_uring_received(&u, ptr, cqe);
+				break;
+			case CDC_URING_SEND:
+				cdc_uring_sent(&u, ptr, cqe->res);
+				break;
+			case CDC_URING_SEND_ZC:
+				cdc_uring_sent_zc(&u, ptr, cqe);
+				break;
+			case CDC_URING_STOP:
+				uring_cqe_seen(&u.ring);
+				ret = 0;
+				goto out;
+			case CDC_URING_TIMER:
+				if (ptr) {
+					wheel_run(&l->wheel);
+					cdc_uring_wheel(&u);
+					break;
+				}
+				cdc_stats_update(l->srv, l, 1, &last);
+				if (l->owner_efd < 0)
+					cdc_snap_save(l->srv);
+				cdc_uring_timer(&u);
+				break;
+			case CDC_URING_AEN:
+				cdc_uring_aen(&u);
+				break;
+			}
+			uring_cqe_seen(&u.ring);
+		}
+		if (l->owner_efd < 0) {
+			cdc_uring_wal_sync(&u);
+			cdc_snap_verify(l->srv);
+		}
+		cdc_uring_aen_arm(&u);
+	}
+out:
+	if (l->spare_fd >= 0)
+		close(l->spare_fd);
+	cdc_uring_exit(&u);
+	wheel_free(&l->wheel);
+	return ret;
+}
+
+/* Run @l on the I/O backend selected for it */
+static int cdc_run(struct cdc_loop *l)
+{
+	int ret;
+
+	if (l->mode == CDC_IO_URING) {
+		ret = cdc_uring_loop(l);
+		if (ret >= 0)
+			return ret;
+		fprintf(stderr, "io_uring: %s, falling back to epoll\n",
+			strerror(-ret));
+		l->mode = CDC_IO_EPOLL;
+	}
+	return cdc_loop(l);
+}
+
+static void *cdc_worker(void *arg)
+{
+	struct cdc_loop *l = arg;
+	cpu_set_t set;
+
+	if (l->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(l->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "cannot bind worker to CPU %d\n",
+				l->cpu);
+	}
+	cdc_run(l);
+	return NULL;
+}
+
+static void cdc_workers_stop(struct cdc_loop *loops, int num_loops)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < num_loops; i++) {
+		if (write(loops[i].stopfd, &one, sizeof(one)) < 0)
+			perror("write");
+	}
+	for (i = 0; i < num_loops; i++) {
+		pthread_join(loops[i].thread, NULL);
+		close(loops[i].lfd);
+		close(loops[i].stopfd);
+		close(loops[i].owner_efd);
+	}
+}
+
+/*
+ * Start @num_loops workers, each listening on @addr:@port with its
+ * own SO_REUSEPORT socket, optionally bound to the CPUs we may run
+ * on in turn. Registry changes are queued to @queue. If @port is "0",
+ * it is updated to the port picked for the first worker.
+ */
+static int cdc_workers_start(struct cdc_server *srv, struct cdc_loop *loops,
+			     int num_loops, enum cdc_io_mode mode,
+			     const char *addr, char *port, size_t port_len,
+			     int pin, struct mpsc *queue)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	int cpus[CPU_SETSIZE], num_cpus = 0, cpu, i;
+	cpu_set_t set;
+
+	if (pin && !sched_getaffinity(0, sizeof(set), &set)) {
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &set))
+				cpus[num_cpus++] = cpu;
+	}
+	mpsc_init(queue);
+	srv->reg_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (srv->reg_efd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	srv->reg_queue = queue;
+	for (i = 0; i < num_loops; i++) {
+		struct cdc_loop *l = &loops[i];
+
+		memset(l, 0, sizeof(*l));
+		l->srv = srv;
+		l->quiet = 1;
+		l->mode = mode;
+		l->cpu = num_cpus ? cpus[i % num_cpus] : -1;
+		l->lfd = cdc_listen(addr, port, 1);
+		if (l->lfd < 0)
+			goto out_stop;
+		if (!i && !strcmp(port, "0")) {
+			if (getsockname(l->lfd, (struct sockaddr *)&ss,
+					&sslen) < 0) {
+				perror("getsockname");
+				close(l->lfd);
+				goto out_stop;
+			}
+			snprintf(port, port_len, "%u", ntohs(ss.ss_family ==
+				 AF_INET6 ?
+				 ((struct sockaddr_in6 *)&ss)->sin6_port :
+				 ((struct sockaddr_in *)&ss)->sin_port));
+		}
+		l->stopfd = eventfd(0, EFD_CLOEXEC);
+		if (l->stopfd < 0) {
+			perror("eventfd");
+			close(l->lfd);
+			goto out_stop;
+		}
+		l->owner_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (l->owner_efd < 0) {
+			perror("eventfd");
+			close(l->lfd);
+			close(l->stopfd);
+			goto out_stop;
+		}
+		if (pthread_create(&l->thread, NULL, cdc_worker, l)) {
+			fprintf(stderr, "pthread_create failed\n");
+			close(l->lfd);
+			close(l->stopfd);
+			close(l->owner_efd);
+			goto out_stop;
+		}
+	}
+	return 0;
+
+out_stop:
+	cdc_workers_stop(loops, i);
+	close(srv->reg_efd);
+	srv->reg_efd = -1;
+	srv->reg_queue = NULL;
+	return -1;
+}
+
+/*
+ * Apply the registry changes of the workers until @stopfd becomes
+ * readable, printing the statistics of @loops unless @quiet is set.
+ */
+static int cdc_owner_loop(struct cdc_server *srv, struct cdc_loop *loops,
+			  int num_loops, int stopfd, int quiet)
+{
+	struct pollfd pfd[2];
+	struct cdc_stats last = { 0 };
+	struct cdc_wal_sync *ws;
+	struct timespec now, next;
+	uint64_t val, one = 1;
+	int i, raised, durable;
+
+	pfd[0].fd = stopfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = srv->reg_efd;
+	pfd[1].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	timespec_add_ms(&next, CDC_STATS_INTERVAL * 1000);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_diff_ms(&now, &next) <= 0) {
+			if (!quiet)
+				cdc_stats_update(srv, loops, num_loops, &last);
+			cdc_snap_save(srv);
+			next = now;
+			timespec_add_ms(&next, CDC_STATS_INTERVAL * 1000);
+		}
+		if (poll(pfd, 2, cdc_owner_timeout(srv, &now, &next)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		if (pfd[0].revents)
+			break;
+		if (pfd[1].revents && read(srv->reg_efd, &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			perror("read");
+		cdc_reg_drain(srv);
+		cdc_log_retry(srv);
+		cdc_snap_verify(srv);
+		/* All changes drained are made durable together */
+		durable = !cdc_wal_commit(srv);
+		raised = cdc_aen_raise(srv);
+		for (i = 0; i < num_loops; i++) {
+			ws = &loops[i].wal_sync;
+			if ((ws->synced == ws->applied || !durable) && !raised)
+				continue;
+			if (durable)
+				__atomic_store_n(&ws->synced, ws->applied,
+						 __ATOMIC_RELEASE);
+			if (write(loops[i].owner_efd, &one, sizeof(one)) < 0)
+				perror("write");
+		}
+	}
+	return 0;
+}
+
+/*
+ * Serve DDC connections on @addr:@port until SIGINT or SIGTERM with
+ * I/O backend @mode, from @num_workers worker threads, or from the
+ * calling thread only if @num_workers is 0. Workers are bound to
+ * CPUs if @pin is set.
+ */
+int cdc_serve(struct cdc_server *srv, const char *addr, const char *port,
+	      enum cdc_io_mode mode, int num_workers, int pin)
+{
+	struct cdc_loop l = {
+		.srv = srv, .cpu = -1, .mode = mode, .owner_efd = -1,
+	}, *loops;
+	struct cdc_stats sum;
+	struct mpsc queue;
+	char port_buf[NI_MAXSERV];
+	sigset_t mask;
+	int ret;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	cdc_raise_nofile();
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	/* Blocked in the workers as well, which inherit the mask */
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		perror("sigprocmask");
+		return 1;
+	}
+	l.stopfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (l.stopfd < 0) {
+		perror("signalfd");
+		return 1;
+	}
+	/* Changes of replication peers are applied by the registry owner */
+	if (srv->gossip && !num_workers)
+		num_workers = 1;
+	if (!num_workers) {
+		l.lfd = cdc_listen(addr, port, 0);
+		if (l.lfd < 0) {
+			close(l.stopfd);
+			return 1;
+		}
+		printf("CDC %s listening on %s:%s%s\n", srv->nqn,
+		       addr ? addr : "*", port,
+		       mode == CDC_IO_URING ? " using io_uring" : "");
+		ret = cdc_run(&l);
+		cdc_wal_commit(srv);
+		cdc_snap_save(srv);
+		cdc_stats_sum(&l, 1, &sum);
+		cdc_stats(srv, &sum);
+		close(l.lfd);
+		close(l.stopfd);
+		return ret;
+	}
+
+	loops = calloc(num_workers, sizeof(*loops));
+	if (!loops) {
+		perror("calloc");
+		close(l.stopfd);
+		return 1;
+	}
+	snprintf(port_buf, sizeof(port_buf), "%s", port);
+	if (cdc_workers_start(srv, loops, num_workers, mode, addr, port_buf,
+			      sizeof(port_buf), pin, &queue) < 0) {
+		free(loops);
+		close(l.stopfd);
+		return 1;
+	}
+	/* Changes made here are to be newer than those peers have seen */
+	if (srv->gossip && gossip_seed(srv->gossip) < 0)
+		fprintf(stderr, "gossip: no peer answered, clock not caught "
+			"up\n");
+	if (srv->gossip && gossip_start(srv->gossip) < 0) {
+		fprintf(stderr, "cannot start replication\n");
+		cdc_workers_stop(loops, num_workers);
+		cdc_reg_drain(srv);
+		close(srv->reg_efd);
+		srv->reg_efd = -1;
+		srv->reg_queue = NULL;
+		free(loops);
+		close(l.stopfd);
+		return 1;
+	}
+	printf("CDC %s listening on %s:%s with %d %sworkers%s\n", srv->nqn,
+	       addr ? addr : "*", port_buf, num_workers,
+	       mode == CDC_IO_URING ? "io_uring " : "",
+	       pin ? " bound to CPUs" : "");
+	ret = cdc_owner_loop(srv, loops, num_workers, l.stopfd, 0);
+	if (srv->gossip)
+		gossip_stop(srv->gossip);
+	cdc_workers_stop(loops, num_workers);
+	/* Changes queued by the workers and peers before they stopped */
+	cdc_reg_drain(srv);
+	cdc_wal_commit(srv);
+	cdc_snap_save(srv);
+	cdc_stats_sum(loops, num_workers, &sum);
+	cdc_stats(srv, &sum);
+	close(srv->reg_efd);
+	srv->reg_efd = -1;
+	srv->reg_queue = NULL;
+	free(loops);
+	close(l.stopfd);
+	return ret;
+}
+
+/**
+ * struct cdc_bench_server - CDC thread of the server benchmark
+ *
+ * @l:             loop of the CDC
+ * @ru:            resource usage of the thread while serving
+ */
+struct cdc_bench_server {
+	struct cdc_loop l;
+	struct rusage ru;
+};
+
+static void *cdc_bench_server(void *arg)
+{
+	struct cdc_bench_server *bs = arg;
+	struct rusage start;
+
+	getrusage(RUSAGE_THREAD, &start);
+	cdc_run(&bs->l);
+	getrusage(RUSAGE_THREAD, &bs->ru);
+	bs->ru.ru_nvcsw -= start.ru_nvcsw;
+	bs->ru.ru_nivcsw -= start.ru_nivcsw;
+	timersub(&bs->ru.ru_stime, &start.ru_stime, &bs->ru.ru_stime);
+	timersub(&bs->ru.ru_utime, &start.ru_utime, &bs->ru.ru_utime);
+	return NULL;
+}
+
+/**
+ * struct cdc_bench_conn - benchmark DDC connection
+ *
+ * @fd:            socket
+ * @req:           ICReq and KDReq, sent back to back
+ * @req_len:       length of @req
+ * @req_off:       bytes of @req already sent
+ * @resp:          ICResp and KDResp
+ * @resp_off:      bytes of @resp received
+ */
+struct cdc_bench_conn {
+	int fd;
+	char *req;
+	size_t req_len;
+	size_t req_off;
+	char resp[sizeof(struct nvme_tcp_icresp_pdu) +
+		  NVME_TCP_KDRESP_PDU_LEN];
+	size_t resp_off;
+};
+
+static int cdc_bench_start(struct cdc_bench_conn *bc, int efd,
+			   struct sockaddr_in *sin, int i)
+{
+	struct nvme_tcp_icreq_pdu icreq;
+	struct port_delta pd = { 0 };
+	struct port_rec rec;
+	struct epoll_event ev;
+	char traddr[32], *kdreq;
+	size_t len;
+	int num_pdus;
+
+	snprintf(traddr, sizeof(traddr), "tcp,10.%d.%d.%d",
+		 (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+	port_rec_parse(&rec, traddr);
+	pd.add = &rec;
+	pd.num_add = 1;
+	kdreq = kdreq_alloc(&pd, NVME_TCP_KDREQ_MAX_PDU_LEN, 0,
+			    &len, &num_pdus);
+	if (!kdreq)
+		return -ENOMEM;
+	bc->req = malloc(sizeof(icreq) + len);
+	if (!bc->req) {
+		free(kdreq);
+		return -ENOMEM;
+	}
+	icreq_init(&icreq, 0);
+	memcpy(bc->req, &icreq, sizeof(icreq));
+	memcpy(bc->req + sizeof(icreq), kdreq, len);
+	free(kdreq);
+	bc->req_len = sizeof(icreq) + len;
+	bc->req_off = 0;
+	bc->resp_off = 0;
+
+	bc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (bc->fd < 0)
+		return -errno;
+	if (connect(bc->fd, (struct sockaddr *)sin, sizeof(*sin)) < 0 &&
+	    errno != EINPROGRESS)
+		return -errno;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = bc;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, bc->fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Advance a benchmark connection. Returns 1 once the KDResp has been
+ * received, 0 if in progress, or a negative errno value.
+ */
+static int cdc_bench_io(struct cdc_bench_conn *bc)
+{
+	struct nvme_tcp_kdresp_pdu *kdresp;
+	ssize_t len;
+
+	while (bc->req_off < bc->req_len) {
+		len = send(bc->fd, bc->req + bc->req_off,
+			   bc->req_len - bc->req_off, MSG_NOSIGNAL);
+		if (len < 0)
+			return errno == EAGAIN ? 0 : -errno;
+		bc->req_off += len;
+	}
+	while (bc->resp_off < sizeof(bc->resp)) {
+		len = recv(bc->fd, bc->resp + bc->resp_off,
+			   sizeof(bc->resp) - bc->resp_off, 0);
+		if (len < 0)
+			return errno == EAGAIN ? 0 : -errno;
+		if (!len)
+			return -ECONNRESET;
+		bc->resp_off += len;
+	}
+	free(bc->req);
+	bc->req = NULL;
+	kdresp = (struct nvme_tcp_kdresp_pdu *)
+		(bc->resp + sizeof(struct nvme_tcp_icresp_pdu));
+	if (kdresp->hdr.type != nvme_tcp_kdresp || kdresp->ksstat)
+		return -EPROTO;
+	return 1;
+}
+
+/* Wait for the CDC to notice that the DDCs closed their connections */
+static int cdc_bench_drain(struct cdc_loop *l)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (!cdc_stats_read(l, num_conns))
+			return 0;
+		usleep(1000);
+	}
+	fprintf(stderr, "%d connections not closed by the CDC\n",
+		cdc_stats_read(l, num_conns));
+	return -ETIMEDOUT;
+}
+
+/*
+ * Register one record from each of @num_conns DDC connections with
+ * an in-process CDC using I/O backend @mode, keeping all connections
+ * open until all are registered, then close them.
+ */
+static int cdc_server_bench_run(enum cdc_io_mode mode, int num_conns)
+{
+	static const char *mode_str[] = {
+		[CDC_IO_EPOLL] = "epoll",
+		[CDC_IO_URING] = "io_uring",
+	};
+	struct cdc_server srv;
+	struct cdc_bench_server bs = {
+		.l = {
+			.srv = &srv, .cpu = -1, .quiet = 1, .mode = mode,
+			.owner_efd = -1,
+		},
+	};
+	struct cdc_loop *l = &bs.l;
+	struct cdc_bench_conn *conns;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	struct epoll_event events[256];
+	struct timespec start, end;
+	int efd, i, n, next = 0, inflight = 0, done = 0, ret = 1;
+	uint64_t one = 1;
+	pthread_t thread;
+	long ms;
+
+	conns = calloc(num_conns, sizeof(*conns));
+	if (!conns) {
+		perror("calloc");
+		return 1;
+	}
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	l->lfd = cdc_listen("127.0.0.1", "0", 0);
+	l->stopfd = eventfd(0, EFD_CLOEXEC);
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->lfd < 0 || l->stopfd < 0 || efd < 0 ||
+	    getsockname(l->lfd, (struct sockaddr *)&sin, &sinlen) < 0) {
+		perror("cdc bench setup");
+		goto out_free;
+	}
+	if (pthread_create(&thread, NULL, cdc_bench_server, &bs)) {
+		fprintf(stderr, "pthread_create failed\n");
+		goto out_free;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < num_conns) {
+		while (next < num_conns && inflight < CDC_BENCH_INFLIGHT) {
+			int err = cdc_bench_start(&conns[next], efd, &sin, next);
+
+			if (err < 0) {
+				fprintf(stderr, "connection %d: %s\n",
+					next, strerror(-err));
+				goto out_stop;
+			}
+			next++;
+			inflight++;
+		}
+		n = epoll_wait(efd, events, 256, 10000);
+		if (n <= 0) {
+			fprintf(stderr, "%d of %d connections stalled\n",
+				inflight, num_conns);
+			goto out_stop;
+		}
+		for (i = 0; i < n; i++) {
+			struct cdc_bench_conn *bc = events[i].data.ptr;
+			int err;
+
+			if (!bc->req)
+				continue;
+			err = cdc_bench_io(bc);
+			if (err < 0) {
+				fprintf(stderr, "connection %ld: %s\n",
+					(long)(bc - conns), strerror(-err));
+				goto out_stop;
+			}
+			if (err) {
+				inflight--;
+				done++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = timespec_diff_ms(&start, &end);
+	n = cdc_stats_read(l, num_conns);
+	for (i = 0; i < num_conns; i++) {
+		close(conns[i].fd);
+		conns[i].fd = 0;
+	}
+	if (!cdc_bench_drain(l))
+		ret = 0;
+out_stop:
+	if (write(l->stopfd, &one, sizeof(one)) < 0)
+		perror("write");
+	pthread_join(thread, NULL);
+	if (!ret) {
+		printf("cdc server %s: %d connections registered in %ld ms, "
+		       "%.0f registrations/s, %d open, %d records\n",
+		       mode_str[l->mode], num_conns, ms,
+		       ms ? num_conns * 1000.0 / ms : 0.0, n,
+		       srv.reg.num_recs);
+		printf("cdc server %s: %lu system calls (%.1f per connection), "
+		       "%ld context switches (%ld involuntary), "
+		       "%ld ms system, %ld ms user\n",
+		       mode_str[l->mode], l->num_syscalls,
+		       (double)l->num_syscalls / num_conns,
+		       bs.ru.ru_nvcsw + bs.ru.ru_nivcsw, bs.ru.ru_nivcsw,
+		       bs.ru.ru_stime.tv_sec * 1000 +
+		       bs.ru.ru_stime.tv_usec / 1000,
+		       bs.ru.ru_utime.tv_sec * 1000 +
+		       bs.ru.ru_utime.tv_usec / 1000);
+		if (srv.reg.num_recs != num_conns || n != num_conns)
+			ret = 1;
+	}
+out_free:
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i].fd > 0)
+			close(conns[i].fd);
+		free(conns[i].req);
+	}
+	free(conns);
+	if (efd >= 0)
+		close(efd);
+	if (l->lfd >= 0)
+		close(l->lfd);
+	if (l->stopfd >= 0)
+		close(l->stopfd);
+	cdc_server_free(&srv);
+	return ret;
+}
+
+/*
+ * Run the server benchmark with @num_conns connections on each I/O
+ * backend.
+ */
+int cdc_server_bench(int num_conns)
+{
+	struct rlimit rl;
+	int ret;
+
+	cdc_raise_nofile();
+	/* Both ends of each connection live in this process */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) &&
+	    rl.rlim_cur < 2 * num_conns + 64) {
+		num_conns = (rl.rlim_cur - 64) / 2;
+		printf("descriptor limit %lu, using %d connections\n",
+		       (unsigned long)rl.rlim_cur, num_conns);
+	}
+	ret = cdc_server_bench_run(CDC_IO_EPOLL, num_conns);
+	if (cdc_server_bench_run(CDC_IO_URING, num_conns))
+		ret = 1;
+	return ret;
+}
+
+/**
+ * struct cdc_load - load generator thread of the scaling benchmark
+ *
+ * @sin:           address of the CDC
+ * @first:         index of the first registration of this thread
+ * @count:         number of registrations of this thread
+ * @ret:           0 if all registrations succeeded
+ * @thread:        load generator thread
+ *
+ * Each registration uses a new connection, which is reset as soon
+ * as the KDResp has been received, so the benchmark measures the
+ * accept and KDReq path without running out of descriptors or
+ * piling up connections in TIME_WAIT.
+ */
+struct cdc_load {
+	struct sockaddr_in *sin;
+	int first;
+	int count;
+	int ret;
+	pthread_t thread;
+};
+
+/**
+ * struct cdc_owner - registry owner thread of the scaling benchmark
+ *
+ * @srv:           CDC state
+ * @loops:         workers
+ * @num_loops:     number of @loops
+ * @stopfd:        terminates the owner when readable
+ * @thread:        registry owner thread
+ */
+struct cdc_owner {
+	struct cdc_server *srv;
+	struct cdc_loop *loops;
+	int num_loops;
+	int stopfd;
+	pthread_t thread;
+};
+
+static void *cdc_owner_thread(void *arg)
+{
+	struct cdc_owner *o = arg;
+
+	cdc_owner_loop(o->srv, o->loops, o->num_loops, o->stopfd, 1);
+	return NULL;
+}
+
+static void cdc_load_reset(struct cdc_bench_conn *bc)
+{
+	struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+
+	setsockopt(bc->fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	close(bc->fd);
+	bc->fd = -1;
+	free(bc->req);
+	bc->req = NULL;
+}
+
+static void *cdc_load_thread(void *arg)
+{
+	struct cdc_load *ld = arg;
+	struct cdc_bench_conn conns[CDC_LOAD_INFLIGHT];
+	struct epoll_event events[CDC_LOAD_INFLIGHT];
+	int efd, i, n, err, next = 0, inflight = 0, done = 0;
+
+	ld->ret = 1;
+	for (i = 0; i < CDC_LOAD_INFLIGHT; i++) {
+		conns[i].fd = -1;
+		conns[i].req = NULL;
+	}
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (efd < 0) {
+		perror("epoll_create1");
+		return NULL;
+	}
+	while (next < ld->count && next < CDC_LOAD_INFLIGHT) {
+		err = cdc_bench_start(&conns[next], efd, ld->sin,
+				      ld->first + next);
+		if (err < 0)
+			goto out_err;
+		next++;
+		inflight++;
+	}
+	while (done < ld->count) {
+		n = epoll_wait(efd, events, CDC_LOAD_INFLIGHT, 10000);
+		if (n <= 0) {
+			fprintf(stderr, "%d of %d connections stalled\n",
+				inflight, ld->count);
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			struct cdc_bench_conn *bc = events[i].data.ptr;
+
+			if (!bc->req)
+				continue;
+			err = cdc_bench_io(bc);
+			if (err < 0)
+				goto out_err;
+			if (!err)
+				continue;
+			cdc_load_reset(bc);
+			inflight--;
+			done++;
+			if (next == ld->count)
+				continue;
+			/* Reuse the slot for the next registration */
+			err = cdc_bench_start(bc, efd, ld->sin,
+					      ld->first + next);
+			if (err < 0)
+				goto out_err;
+			next++;
+			inflight++;
+		}
+	}
+	ld->ret = 0;
+	goto out;
+out_err:
+	fprintf(stderr, "registration: %s\n", strerror(-err));
+out:
+	for (i = 0; i < CDC_LOAD_INFLIGHT; i++) {
+		if (conns[i].fd >= 0)
+			cdc_load_reset(&conns[i]);
+	}
+	close(efd);
+	return NULL;
+}
+
+/* Register @num_conns records with @num_workers workers */
+static int cdc_scale_run(int num_workers, int num_loads, int num_conns)
+{
+	struct cdc_server srv;
+	struct cdc_loop loops[CDC_MAX_WORKERS];
+	struct cdc_load loads[CDC_LOAD_THREADS];
+	struct cdc_owner owner = {
+		.srv = &srv, .loops = loops, .num_loops = num_workers,
+	};
+	struct cdc_stats sum;
+	struct sockaddr_in sin;
+	struct timespec start, end;
+	struct mpsc queue;
+	char port[NI_MAXSERV] = "0";
+	uint64_t one = 1;
+	int i, ret = 0;
+	long ms;
+
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	if (cdc_workers_start(&srv, loops, num_workers, CDC_IO_EPOLL,
+			      "127.0.0.1", port, sizeof(port), 1, &queue) < 0) {
+		cdc_server_free(&srv);
+		return 1;
+	}
+	owner.stopfd = eventfd(0, EFD_CLOEXEC);
+	if (owner.stopfd < 0 ||
+	    pthread_create(&owner.thread, NULL, cdc_owner_thread, &owner)) {
+		fprintf(stderr, "cannot start registry owner\n");
+		cdc_workers_stop(loops, num_workers);
+		if (owner.stopfd >= 0)
+			close(owner.stopfd);
+		close(srv.reg_efd);
+		cdc_server_free(&srv);
+		return 1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(atoi(port));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_loads; i++) {
+		loads[i].sin = &sin;
+		loads[i].first = (long)num_conns * i / num_loads;
+		loads[i].count = (long)num_conns * (i + 1) / num_loads -
+			loads[i].first;
+		if (pthread_create(&loads[i].thread, NULL, cdc_load_thread,
+				   &loads[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			num_loads = i;
+			ret = 1;
+			break;
+		}
+	}
+	for (i = 0; i < num_loads; i++) {
+		pthread_join(loads[i].thread, NULL);
+		if (loads[i].ret)
+			ret = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = timespec_diff_ms(&start, &end);
+
+	if (write(owner.stopfd, &one, sizeof(one)) < 0)
+		perror("write");
+	pthread_join(owner.thread, NULL);
+	close(owner.stopfd);
+	cdc_workers_stop(loops, num_workers);
+	cdc_reg_drain(&srv);
+	close(srv.reg_efd);
+	srv.reg_efd = -1;
+	srv.reg_queue = NULL;
+	if (!ret) {
+		cdc_stats_sum(loops, num_workers, &sum);
+		printf("cdc scale: %2d workers: %d registrations in %ld ms, "
+		       "%.0f registrations/s, %lu log patches\n",
+		       num_workers, num_conns, ms,
+		       ms ? num_conns * 1000.0 / ms : 0.0,
+		       srv.num_log_patches);
+		if (srv.reg.num_recs != num_conns ||
+		    sum.num_kdreq != (unsigned long)num_conns) {
+			fprintf(stderr, "%d records, %lu KDReqs, expected %d\n",
+				srv.reg.num_recs, sum.num_kdreq, num_conns);
+			ret = 1;
+		}
+	}
+	cdc_server_free(&srv);
+	return ret;
+}
+
+/*
+ * Register @num_conns records over short-lived DDC connections with
+ * 1, 2, 4, ... up to @max_workers workers bound to CPUs, and report
+ * the registration rate for each number of workers.
+ */
+int cdc_scale_bench(int max_workers, int num_conns)
+{
+	int num_loads = sysconf(_SC_NPROCESSORS_ONLN), w, ret = 0;
+
+	if (num_loads < 1)
+		num_loads = 1;
+	if (num_loads > CDC_LOAD_THREADS)
+		num_loads = CDC_LOAD_THREADS;
+	if (max_workers > CDC_MAX_WORKERS)
+		max_workers = CDC_MAX_WORKERS;
+	cdc_raise_nofile();
+	printf("cdc scale: %d load threads, %ld CPUs\n", num_loads,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	for (w = 1; w <= max_workers; w <<= 1) {
+		if (cdc_scale_run(w, num_loads, num_conns))
+			ret = 1;
+	}
+	return ret;
+}
+
+/* Read the discovery log @num_reads times with @depth commands in flight */
+static int cdc_host_bench_read(struct disc_host *h, int depth, int num_reads,
+			       int num_recs)
+{
+	struct timespec start, end;
+	unsigned long num_cmds = h->num_cmds, num_data = h->num_data;
+	unsigned long num_copied = h->num_copied;
+	double ms;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_reads; i++) {
+		/* Forget the last log so that it is read in full */
+		free(h->log);
+		h->log = NULL;
+		ret = disc_host_get_log(h, depth);
+		if (ret < 0) {
+			fprintf(stderr, "discovery log: %s\n", strerror(-ret));
+			return ret;
+		}
+		if (le64toh(h->log->numrec) != (__u64)num_recs) {
+			fprintf(stderr, "discovery log: %llu records, "
+				"expected %d\n",
+				(unsigned long long)le64toh(h->log->numrec),
+				num_recs);
+			return -EPROTO;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6;
+	printf("disc host: depth %2d: %7.2f ms/log, %7.1f MB/s, "
+	       "%lu commands/log, %.2f%% of the data copied\n", depth,
+	       ms / num_reads, h->log_len * num_reads / ms / 1e3,
+	       (h->num_cmds - num_cmds) / num_reads,
+	       100.0 * (h->num_copied - num_copied) /
+	       (h->num_data - num_data));
+	return 0;
+}
+
+/* Poll the unchanged discovery log @num_polls times */
+static int cdc_host_bench_poll(struct disc_host *h, int num_polls)
+{
+	struct timespec start, end;
+	unsigned long num_data = h->num_data;
+	double ms;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_polls; i++) {
+		ret = disc_host_get_log(h, NVME_AQ_DEPTH);
+		if (ret < 0) {
+			fprintf(stderr, "discovery log: %s\n", strerror(-ret));
+			return ret;
+		}
+		if (ret) {
+			fprintf(stderr, "discovery log changed\n");
+			return -EPROTO;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6;
+	printf("disc host: unchanged: %7.3f ms/poll, %lu bytes/poll\n",
+	       ms / num_polls, (h->num_data - num_data) / num_polls);
+	return 0;
+}
+
+/*
+ * Read the discovery log of @num_recs records from a local CDC
+ * @num_reads times over one session with 1, 4 and NVME_AQ_DEPTH Get
+ * Log Page commands in flight, time polling it while it does not
+ * change, and time setting up a session as a check running its own
+ * host would have to.
+ */
+int cdc_host_bench(int num_recs, int num_reads)
+{
+	static const int depths[] = { 1, 4, NVME_AQ_DEPTH };
+	struct cdc_server srv;
+	struct cdc_loop loop;
+	struct in6_addr addr = IN6ADDR_LOOPBACK_INIT;
+	struct disc_host h;
+	struct port_rec rec;
+	struct timespec start, end;
+	struct mpsc queue;
+	char port[NI_MAXSERV] = "0";
+	int i, ret = 1;
+
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	for (i = 0; i < num_recs; i++) {
+		port_rec_bench(&rec, i);
+		if (registry_add(&srv.reg, &rec, &addr) < 0) {
+			fprintf(stderr, "registry_add failed\n");
+			cdc_server_free(&srv);
+			return 1;
+		}
+	}
+	if (cdc_workers_start(&srv, &loop, 1, CDC_IO_EPOLL, "127.0.0.1",
+			      port, sizeof(port), 0, &queue) < 0) {
+		cdc_server_free(&srv);
+		return 1;
+	}
+	printf("disc host: %d records, %zu bytes, %d reads per depth\n",
+	       num_recs, sizeof(struct nvmf_disc_rsp_page_hdr) +
+	       num_recs * sizeof(struct nvmf_disc_rsp_page_entry), num_reads);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_reads; i++) {
+		disc_host_init(&h, 0, NULL);
+		ret = disc_host_connect(&h, "127.0.0.1", port,
+					DISC_HOST_KATO_MS);
+		disc_host_close(&h);
+		if (ret < 0) {
+			fprintf(stderr, "connect: %s\n", strerror(-ret));
+			goto out_stop;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("disc host: %7.2f ms/session setup (ICReq, Connect, "
+	       "enable)\n", ((end.tv_sec - start.tv_sec) * 1e3 +
+			      (end.tv_nsec - start.tv_nsec) / 1e6) / num_reads);
+
+	disc_host_init(&h, 0, NULL);
+	ret = disc_host_connect(&h, "127.0.0.1", port, DISC_HOST_KATO_MS);
+	for (i = 0; !ret && i < sizeof(depths) / sizeof(depths[0]); i++)
+		ret = cdc_host_bench_read(&h, depths[i], num_reads, num_recs);
+	if (!ret)
+		ret = cdc_host_bench_poll(&h, num_reads * 20);
+	if (!ret && h.num_torn)
+		printf("disc host: %lu reads torn\n", h.num_torn);
+	disc_host_close(&h);
+	if (ret < 0)
+		fprintf(stderr, "disc host: %s\n", strerror(-ret));
+out_stop:
+	cdc_workers_stop(&loop, 1);
+	close(srv.reg_efd);
+	srv.reg_efd = -1;
+	srv.reg_queue = NULL;
+	cdc_server_free(&srv);
+	return ret < 0;
+}
+
+/* Secret of the authentication benchmark, in DHHC-1 representation */
+#define CDC_AUTH_BENCH_SECRET \
+	"DHHC-1:01:MDEyMzQ1Njc4OTo7PD0+P0BBQkNERUZHSElKS0xNTk+V+ai1:"
+
+/* Key pairs generated and secrets computed per DH group */
+#define CDC_AUTH_BENCH_DH	8
+
+/* Time key pair generation and shared secret computation per group */
+static int cdc_auth_bench_dh(void)
+{
+	static __u8 secret[DH_MAX_BYTES];
+	struct timespec start, mid, end;
+	struct dh_key *peer, *key;
+	int group, i;
+
+	for (group = NVME_AUTH_DHGROUP_2048; group <= NVME_AUTH_DHGROUP_8192;
+	     group++) {
+		/* Sets up the group outside of the timed loops */
+		peer = dh_key_new(group);
+		if (!peer)
+			return -ENOMEM;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < CDC_AUTH_BENCH_DH; i++) {
+			key = dh_key_new(group);
+			if (!key) {
+				dh_key_put(peer);
+				return -ENOMEM;
+			}
+			dh_key_put(key);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &mid);
+		for (i = 0; i < CDC_AUTH_BENCH_DH; i++)
+			dh_shared(peer, peer->pub, dh_len(group), secret);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("auth: ffdhe%zu: %7.2f ms/key pair, %7.2f ms/shared "
+		       "secret\n", dh_len(group) * 8,
+		       timespec_diff_ns(&start, &mid) / 1e6 / CDC_AUTH_BENCH_DH,
+		       timespec_diff_ns(&mid, &end) / 1e6 / CDC_AUTH_BENCH_DH);
+		dh_key_put(peer);
+	}
+	return 0;
+}
+
+/* Run a transaction between @host and @ctrl without transport */
+static int cdc_auth_bench_xfer(struct auth_session *host,
+			       struct auth_session *ctrl, __u8 *buf)
+{
+	const void *msg;
+	size_t len;
+
+	len = auth_host_negotiate(host, buf);
+	auth_ctrl_send(ctrl, buf, len);
+	msg = auth_ctrl_receive(ctrl, &len);
+	if (!msg)
+		return -EACCES;
+	len = auth_host_reply(host, msg, len, buf);
+	if (len)
+		auth_ctrl_send(ctrl, buf, len);
+	msg = auth_ctrl_receive(ctrl, &len);
+	if (!msg)
+		return -EACCES;
+	len = auth_host_success(host, msg, len, buf);
+	if (len)
+		auth_ctrl_send(ctrl, buf, len);
+	return host->step == AUTH_DONE && ctrl->step == AUTH_DONE ?
+		0 : -EACCES;
+}
+
+/* Time the messages and responses of transactions with the NULL group */
+static int cdc_auth_bench_hmac(struct auth_ctx *ctx, int num)
+{
+	static struct auth_session host, ctrl;
+	static __u8 buf[AUTH_MSG_MAX]
+		__attribute__((aligned(AUTH_MSG_ALIGN)));
+	struct timespec start, end;
+	int i, ret = 0;
+
+	ctx->dhgid = NVME_AUTH_DHGROUP_NULL;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; !ret && i < num; i++) {
+		auth_session_init(&host, ctx, DISC_HOST_NQN,
+				  NVME_DISC_SUBSYS_NAME, i);
+		auth_session_init(&ctrl, ctx, DISC_HOST_NQN,
+				  NVME_DISC_SUBSYS_NAME, 0);
+		ret = cdc_auth_bench_xfer(&host, &ctrl, buf);
+		auth_session_free(&host);
+		auth_session_free(&ctrl);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		fprintf(stderr, "auth: transaction failed\n");
+		return ret;
+	}
+	printf("auth: %7.2f us/transaction without DH, both sides\n",
+	       timespec_diff_ns(&start, &end) / 1e3 / num);
+	return 0;
+}
+
+/*
+ * Set up @num sessions with the CDC of loop @l at @port, which
+ * authenticates hosts with @cctx unless it is NULL, and report the
+ * session rate, and the CPU time per session of the CDC loop and of
+ * the whole process, host included.
+ */
+static int cdc_auth_bench_run(const char *name, struct cdc_loop *l,
+			      const char *port, struct auth_ctx *hctx,
+			      struct auth_ctx *cctx, int num)
+{
+	struct timespec start, end, lstart, lend;
+	struct rusage rstart, rend;
+	struct disc_host h;
+	struct timeval cpu;
+	clockid_t cid;
+	double ms;
+	int i, ret = 0;
+
+	if (pthread_getcpuclockid(l->thread, &cid)) {
+		fprintf(stderr, "pthread_getcpuclockid failed\n");
+		return -EINVAL;
+	}
+	/* Read by the loop on the Connect command of each session */
+	l->srv->auth = cctx;
+	getrusage(RUSAGE_SELF, &rstart);
+	clock_gettime(cid, &lstart);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; !ret && i < num; i++) {
+		disc_host_init(&h, 0, hctx);
+		ret = disc_host_connect(&h, "127.0.0.1", port,
+					DISC_HOST_KATO_MS);
+		disc_host_close(&h);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	clock_gettime(cid, &lend);
+	getrusage(RUSAGE_SELF, &rend);
+	l->srv->auth = NULL;
+	if (ret < 0) {
+		fprintf(stderr, "auth %s: connect: %s\n", name, strerror(-ret));
+		return ret;
+	}
+	ms = timespec_diff_ns(&start, &end) / 1e6;
+	timersub(&rend.ru_utime, &rstart.ru_utime, &rend.ru_utime);
+	timersub(&rend.ru_stime, &rstart.ru_stime, &rend.ru_stime);
+	timeradd(&rend.ru_utime, &rend.ru_stime, &cpu);
+	printf("auth %-9s: %6.0f sessions/s, %6.3f ms CDC loop CPU, "
+	       "%6.3f ms process CPU per session", name, num * 1e3 / ms,
+	       timespec_diff_ns(&lstart, &lend) / 1e6 / num,
+	       (cpu.tv_sec * 1e3 + cpu.tv_usec / 1e3) / num);
+	if (cctx)
+		printf(", DH keys: %lu ahead, %lu on demand, %lu reused",
+		       cctx->pool.num_generated, cctx->pool.num_missed,
+		       cctx->pool.num_reused);
+	printf("\n");
+	return 0;
+}
+
+/*
+ * Time the DH-HMAC-CHAP building blocks, then set up @num sessions
+ * with a local CDC per configuration: without authentication, with
+ * the NULL DH group, and with ffdhe2048 keys generated for each
+ * session, generated ahead by the key pool, and shared by up to
+ * AUTH_KEY_MAX_USES sessions. The host reuses a single key
+ * throughout, so that the CDC side dominates the difference.
+ */
+int cdc_auth_bench(int num)
+{
+	static const struct {
+		const char *name;
+		int dhgid;
+		int depth;
+		unsigned int max_uses;
+	} confs[] = {
+		{ "null DH", NVME_AUTH_DHGROUP_NULL, 0, 1 },
+		{ "fresh", NVME_AUTH_DHGROUP_2048, 0, 1 },
+		{ "ahead", NVME_AUTH_DHGROUP_2048, DH_POOL_DEPTH, 1 },
+		{ "reused", NVME_AUTH_DHGROUP_2048, DH_POOL_DEPTH,
+		  AUTH_KEY_MAX_USES },
+	};
+	struct cdc_server srv;
+	struct cdc_loop loop;
+	struct auth_ctx hctx, cctx;
+	struct mpsc queue;
+	char port[NI_MAXSERV] = "0";
+	int i, ret;
+
+	ret = cdc_auth_bench_dh();
+	if (ret < 0)
+		return 1;
+	if (auth_ctx_init(&hctx, CDC_AUTH_BENCH_SECRET, NULL, 0,
+			  UINT_MAX) < 0)
+		return 1;
+	ret = cdc_auth_bench_hmac(&hctx, num * 50);
+	if (ret < 0)
+		goto out_free;
+
+	cdc_server_init(&srv, NVME_DISC_SUBSYS_NAME);
+	if (cdc_workers_start(&srv, &loop, 1, CDC_IO_EPOLL, "127.0.0.1",
+			      port, sizeof(port), 0, &queue) < 0) {
+		ret = -1;
+		goto out_srv;
+	}
+	printf("auth: %d sessions per configuration, ICReq, Connect, "
+	       "authentication and enable\n", num);
+	ret = cdc_auth_bench_run("none", &loop, port, &hctx, NULL, num);
+	for (i = 0; !ret && i < sizeof(confs) / sizeof(confs[0]); i++) {
+		ret = auth_ctx_init(&cctx, CDC_AUTH_BENCH_SECRET, NULL,
+				    confs[i].depth, confs[i].max_uses);
+		if (ret < 0)
+			break;
+		cctx.dhgid = confs[i].dhgid;
+		ret = cdc_auth_bench_run(confs[i].name, &loop, port, &hctx,
+					 &cctx, num);
+		auth_ctx_free(&cctx);
+	}
+	cdc_workers_stop(&loop, 1);
+	close(srv.reg_efd);
+	srv.reg_efd = -1;
+	srv.reg_queue = NULL;
+out_srv:
+	cdc_server_free(&srv);
+out_free:
+	auth_ctx_free(&hctx);
+	return ret < 0;
+}
@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * sha2.c - SHA-2 hashes and HMAC for DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * SHA-256, SHA-384 and SHA-512 (FIPS 180-4) and HMAC (RFC 2104), the
+ * hash functions DH-HMAC-CHAP negotiates. Hashes are identified by
+ * their NVME_AUTH_HASH_* value. Nothing here allocates memory.
+ */
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <linux/types.h>
+
+#include "nvme.h"
+#include "sha2.h"
+
+static const __u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const __u64 sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const __u32 sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const __u64 sha384_iv[8] = {
+	0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL,
+	0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+	0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL,
+	0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const __u64 sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static inline __u32 ror32(__u32 x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline __u64 ror64(__u64 x, int n)
+{
+	return (x >> n) | (x << (64 - n));
+}
+
+static void sha256_block(__u32 *h, const __u8 *p)
+{
+	__u32 w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		memcpy(&w[i], p + 4 * i, 4);
+		w[i] = be32toh(w[i]);
+	}
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+			 (w[i - 15] >> 3)) +
+			(ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+			 (w[i - 2] >> 10));
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha512_block(__u64 *h, const __u8 *p)
+{
+	__u64 w[80], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		memcpy(&w[i], p + 8 * i, 8);
+		w[i] = be64toh(w[i]);
+	}
+	for (; i < 80; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^
+			 (w[i - 15] >> 7)) +
+			(ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^
+			 (w[i - 2] >> 6));
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 80; i++) {
+		t1 = k + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41)) +
+			((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+		t2 = (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static size_t sha2_block_len(int hashid)
+{
+	return hashid == NVME_AUTH_HASH_SHA256 ? 64 : 128;
+}
+
+/* Digest length of @hashid, 0 if it is not supported */
+size_t sha2_len(int hashid)
+{
+	switch (hashid) {
+	case NVME_AUTH_HASH_SHA256:
+		return 32;
+	case NVME_AUTH_HASH_SHA384:
+		return 48;
+	case NVME_AUTH_HASH_SHA512:
+		return 64;
+	}
+	return 0;
+}
+
+int sha2_init(struct sha2_ctx *ctx, int hashid)
+{
+	ctx->hashid = hashid;
+	ctx->len = 0;
+	ctx->buf_len = 0;
+	switch (hashid) {
+	case NVME_AUTH_HASH_SHA256:
+		memcpy(ctx->h32, sha256_iv, sizeof(sha256_iv));
+		return 0;
+	case NVME_AUTH_HASH_SHA384:
+		memcpy(ctx->h64, sha384_iv, sizeof(sha384_iv));
+		return 0;
+	case NVME_AUTH_HASH_SHA512:
+		memcpy(ctx->h64, sha512_iv, sizeof(sha512_iv));
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static void sha2_block(struct sha2_ctx *ctx, const __u8 *p)
+{
+	if (ctx->hashid == NVME_AUTH_HASH_SHA256)
+		sha256_block(ctx->h32, p);
+	else
+		sha512_block(ctx->h64, p);
+}
+
+void sha2_update(struct sha2_ctx *ctx, const void *data, size_t len)
+{
+	size_t bs = sha2_block_len(ctx->hashid), n;
+	const __u8 *p = data;
+
+	ctx->len += len;
+	if (ctx->buf_len) {
+		n = bs - ctx->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+		if (ctx->buf_len < bs)
+			return;
+		sha2_block(ctx, ctx->buf);
+		ctx->buf_len = 0;
+	}
+	for (; len >= bs; p += bs, len -= bs)
+		sha2_block(ctx, p);
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+/* Pad the message, and store the digest of sha2_len() bytes */
+void sha2_final(struct sha2_ctx *ctx, __u8 *digest)
+{
+	size_t bs = sha2_block_len(ctx->hashid);
+	/* The message length takes 8 bytes, or 16 for SHA-384/512 */
+	size_t lenoff = bs - bs / 8;
+	__u64 bits = htobe64(ctx->len * 8);
+	int i;
+
+	ctx->buf[ctx->buf_len++] = 0x80;
+	if (ctx->buf_len > lenoff) {
+		memset(ctx->buf + ctx->buf_len, 0, bs - ctx->buf_len);
+		sha2_block(ctx, ctx->buf);
+		ctx->buf_len = 0;
+	}
+	memset(ctx->buf + ctx->buf_len, 0, bs - ctx->buf_len);
+	memcpy(ctx->buf + bs - sizeof(bits), &bits, sizeof(bits));
+	sha2_block(ctx, ctx->buf);
+
+	if (ctx->hashid == NVME_AUTH_HASH_SHA256) {
+		for (i = 0; i < 8; i++) {
+			__u32 v = htobe32(ctx->h32[i]);
+
+			memcpy(digest + 4 * i, &v, 4);
+		}
+		return;
+	}
+	for (i = 0; i < sha2_len(ctx->hashid) / 8; i++) {
+		__u64 v = htobe64(ctx->h64[i]);
+
+		memcpy(digest + 8 * i, &v, 8);
+	}
+}
+
+int sha2_digest(int hashid, const void *data, size_t len, __u8 *digest)
+{
+	struct sha2_ctx ctx;
+
+	if (sha2_init(&ctx, hashid) < 0)
+		return -EINVAL;
+	sha2_update(&ctx, data, len);
+	sha2_final(&ctx, digest);
+	return 0;
+}
+
+/*
+ * Prepare @key for HMACs with @hashid keyed by the @len bytes at @k.
+ */
+int hmac_setkey(struct hmac_key *key, int hashid, const __u8 *k, size_t len)
+{
+	__u8 pad[SHA2_MAX_BLOCK];
+	size_t bs = sha2_block_len(hashid), i;
+
+	if (sha2_init(&key->inner, hashid) < 0)
+		return -EINVAL;
+	sha2_init(&key->outer, hashid);
+	memset(pad, 0, sizeof(pad));
+	/* Keys longer than a block are hashed first */
+	if (len > bs)
+		sha2_digest(hashid, k, len, pad);
+	else
+		memcpy(pad, k, len);
+	for (i = 0; i < bs; i++)
+		pad[i] ^= 0x36;
+	sha2_update(&key->inner, pad, bs);
+	for (i = 0; i < bs; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha2_update(&key->outer, pad, bs);
+	memset(pad, 0, sizeof(pad));
+	return 0;
+}
+
+/* Start an HMAC keyed by @key in @ctx; add the data with sha2_update() */
+void hmac_init(struct hmac_key *key, struct sha2_ctx *ctx)
+{
+	*ctx = key->inner;
+}
+
+/* Complete the HMAC in @ctx, storing sha2_len() bytes in @mac */
+void hmac_final(struct hmac_key *key, struct sha2_ctx *ctx, __u8 *mac)
+{
+	__u8 digest[SHA2_MAX_DIGEST];
+	size_t len = sha2_len(ctx->hashid);
+
+	sha2_final(ctx, digest);
+	*ctx = key->outer;
+	sha2_update(ctx, digest, len);
+	sha2_final(ctx, mac);
+}
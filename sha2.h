@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * sha2.h - SHA-2 hashes and HMAC for DH-HMAC-CHAP
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _SHA2_H
+#define _SHA2_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/* Largest digest and block size of the supported hashes */
+#define SHA2_MAX_DIGEST		64
+#define SHA2_MAX_BLOCK		128
+
+/**
+ * struct sha2_ctx - hash computation in progress
+ *
+ * @hashid:        NVME_AUTH_HASH_* of the hash
+ * @h:             intermediate hash value, 32 bit words for SHA-256
+ * @len:           number of bytes hashed so far
+ * @buf:           data not hashed yet, less than a block
+ * @buf_len:       number of bytes in @buf
+ */
+struct sha2_ctx {
+	int hashid;
+	union {
+		__u32 h32[8];
+		__u64 h64[8];
+	};
+	__u64 len;
+	__u8 buf[SHA2_MAX_BLOCK];
+	size_t buf_len;
+};
+
+/**
+ * struct hmac_key - HMAC key prepared for repeated use
+ *
+ * @inner:         hash state after the inner padded key
+ * @outer:         hash state after the outer padded key
+ *
+ * The key is only hashed once by hmac_setkey(); each HMAC then copies
+ * the prepared states, so computing one needs neither the key nor
+ * any allocation.
+ */
+struct hmac_key {
+	struct sha2_ctx inner;
+	struct sha2_ctx outer;
+};
+
+size_t sha2_len(int hashid);
+int sha2_init(struct sha2_ctx *ctx, int hashid);
+void sha2_update(struct sha2_ctx *ctx, const void *data, size_t len);
+void sha2_final(struct sha2_ctx *ctx, __u8 *digest);
+int sha2_digest(int hashid, const void *data, size_t len, __u8 *digest);
+
+int hmac_setkey(struct hmac_key *key, int hashid, const __u8 *k, size_t len);
+void hmac_init(struct hmac_key *key, struct sha2_ctx *ctx);
+void hmac_final(struct hmac_key *key, struct sha2_ctx *ctx, __u8 *mac);
+
+#endif /* _SHA2_H */
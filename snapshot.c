@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * snapshot.c - persistent registry snapshot
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * The snapshot holds the registry and the discovery log page in the
+ * format they are kept in memory, so a restarted CDC only maps the
+ * file and serves the log page right away instead of waiting for
+ * every DDC to register again. Nothing is parsed or re-hashed on
+ * startup; pages are faulted in as they are sent or looked up, and
+ * changes are copied on write. Only the header is checked up front,
+ * the contents are verified by snap_verify() once the CDC serves.
+ * Snapshots are written to a temporary file which replaces the
+ * previous one once synced, so a snapshot is never seen partially
+ * written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "crc32c.h"
+
+static __u64 snap_align(__u64 len)
+{
+	return (len + SNAP_ALIGN - 1) & ~(__u64)(SNAP_ALIGN - 1);
+}
+
+static int snap_write(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * CRC32C of the log page, the entries and the slots in use of a
+ * snapshot with @num_recs records and @num_slots slots
+ */
+static __u32 snap_data_crc(const void *log, const void *entries,
+			   const void *slots, __u32 num_recs, __u32 num_slots)
+{
+	__u32 crc = ~0U;
+
+	crc = crc32c_update(crc, log, (num_recs + 1ULL) * DISC_LOG_SLOT);
+	crc = crc32c_update(crc, entries,
+			    (size_t)num_recs * sizeof(struct reg_entry));
+	crc = crc32c_update(crc, slots,
+			    (size_t)num_slots * sizeof(struct reg_slot));
+	return ~crc;
+}
+
+/* Make the last rename in the directory of @path durable */
+static void snap_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char dir[PATH_MAX];
+	int fd;
+
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == path)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fsync(fd) < 0)
+		perror("fsync");
+	close(fd);
+}
+
+/*
+ * Write @reg and its discovery log page @log to @path, replacing the
+ * previous snapshot atomically. Returns 0 or a negative errno value.
+ */
+int snap_save(const char *path, struct registry *reg, struct disc_log *log)
+{
+	struct snap_hdr hdr;
+	char tmp[PATH_MAX];
+	__u32 num_slots = reg->slots ? reg->mask + 1 : 0;
+	int fd, ret;
+
+	if (log->genctr != reg->genctr ||
+	    log->len != (reg->num_recs + 1) * DISC_LOG_SLOT)
+		return -ESTALE;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAP_VERSION;
+	hdr.entry_size = sizeof(struct reg_entry);
+	hdr.num_recs = reg->num_recs;
+	hdr.max_recs = reg->max_recs;
+	hdr.num_slots = num_slots;
+	hdr.data_crc = snap_data_crc(log->data, reg->entries, reg->slots,
+				     reg->num_recs, num_slots);
+	hdr.genctr = reg->genctr;
+	hdr.log_off = SNAP_ALIGN;
+	hdr.log_size = snap_align(log->size);
+	hdr.entries_off = hdr.log_off + hdr.log_size;
+	hdr.slots_off = hdr.entries_off +
+		snap_align((__u64)hdr.max_recs * hdr.entry_size);
+	hdr.file_size = hdr.slots_off +
+		snap_align((__u64)num_slots * sizeof(struct reg_slot));
+	hdr.crc = crc32c(&hdr, offsetof(struct snap_hdr, crc));
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+	/* Room not written to stays a hole */
+	ret = ftruncate(fd, hdr.file_size) < 0 ? -errno : 0;
+	if (!ret)
+		ret = snap_write(fd, log->data, log->len, hdr.log_off);
+	if (!ret)
+		ret = snap_write(fd, reg->entries,
+				 sizeof(struct reg_entry) * reg->num_recs,
+				 hdr.entries_off);
+	if (!ret)
+		ret = snap_write(fd, reg->slots,
+				 sizeof(struct reg_slot) * num_slots,
+				 hdr.slots_off);
+	if (!ret)
+		ret = snap_write(fd, &hdr, sizeof(hdr), 0);
+	if (!ret && fdatasync(fd) < 0)
+		ret = -errno;
+	close(fd);
+	if (!ret && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret < 0) {
+		unlink(tmp);
+		return ret;
+	}
+	snap_sync_dir(path);
+	return 0;
+}
+
+/* Check the header and the section layout of a snapshot */
+static int snap_check(struct snap_hdr *hdr, size_t len)
+{
+	struct nvmf_disc_rsp_page_hdr *lh;
+
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->crc != crc32c(hdr, offsetof(struct snap_hdr, crc)))
+		return -EINVAL;
+	if (hdr->version != SNAP_VERSION ||
+	    hdr->entry_size != sizeof(struct reg_entry))
+		return -EPROTO;
+	if (hdr->file_size != len || hdr->num_recs > hdr->max_recs ||
+	    hdr->max_recs > INT_MAX ||
+	    (hdr->num_slots & (hdr->num_slots - 1)) ||
+	    (__u64)hdr->num_recs * REG_LOAD_DIV > hdr->num_slots ||
+	    (hdr->num_recs && !hdr->num_slots))
+		return -EINVAL;
+	if ((hdr->log_off | hdr->entries_off | hdr->slots_off) &
+	    (SNAP_ALIGN - 1) || hdr->log_off < sizeof(*hdr) ||
+	    (hdr->num_recs + 1ULL) * DISC_LOG_SLOT > hdr->log_size ||
+	    hdr->log_off + hdr->log_size > hdr->entries_off ||
+	    hdr->entries_off + (__u64)hdr->max_recs * hdr->entry_size >
+	    hdr->slots_off ||
+	    hdr->slots_off + (__u64)hdr->num_slots * sizeof(struct reg_slot) >
+	    hdr->file_size)
+		return -EINVAL;
+	lh = (struct nvmf_disc_rsp_page_hdr *)((char *)hdr + hdr->log_off);
+	if (le64toh(lh->genctr) != hdr->genctr ||
+	    le64toh(lh->numrec) != hdr->num_recs)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Map the snapshot at @path into @snap and attach @reg and the log
+ * page returned in @logp to it. @reg is left alone on failure.
+ * Returns 0 or a negative errno value, -ENOENT if there is no
+ * snapshot.
+ */
+int snap_load(struct snapshot *snap, const char *path, struct registry *reg,
+	      struct disc_log **logp, const char *subnqn)
+{
+	struct snap_hdr *hdr;
+	struct stat st;
+	char *map, *file;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	/* Private, so changes are copied on write and the file stays */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	/* The contents as saved, for snap_verify() */
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		ret = -errno;
+		munmap(map, st.st_size);
+		return ret;
+	}
+	hdr = (struct snap_hdr *)map;
+	ret = snap_check(hdr, st.st_size);
+	if (ret < 0)
+		goto out_unmap;
+	if (hdr->num_slots)
+		registry_attach(reg, (struct reg_entry *)(map + hdr->entries_off),
+				hdr->num_recs, hdr->max_recs,
+				(struct reg_slot *)(map + hdr->slots_off),
+				hdr->num_slots, hdr->genctr);
+	else
+		reg->genctr = hdr->genctr;
+	/* If out of memory, the log page is built on the next change */
+	*logp = disc_log_map(map + hdr->log_off, hdr->log_size, reg, subnqn);
+	snap->map = map;
+	snap->len = st.st_size;
+	snap->file = file;
+	return 0;
+
+out_unmap:
+	munmap(file, st.st_size);
+	munmap(map, st.st_size);
+	return ret;
+}
+
+/*
+ * Verify the checksum of the contents of the snapshot mapped by
+ * snap_load(), which faults in all of the file. The file is not
+ * looked at again afterwards. Returns 0, or -EINVAL if the snapshot
+ * is corrupt and the mapping is not to be used any longer.
+ */
+int snap_verify(struct snapshot *snap)
+{
+	/* The header was checked by snap_load() and is never changed */
+	struct snap_hdr *hdr = snap->map;
+	char *file = snap->file;
+	int ret = 0;
+
+	if (!file)
+		return 0;
+	if (hdr->data_crc != snap_data_crc(file + hdr->log_off,
+					   file + hdr->entries_off,
+					   file + hdr->slots_off,
+					   hdr->num_recs, hdr->num_slots))
+		ret = -EINVAL;
+	munmap(snap->file, snap->len);
+	snap->file = NULL;
+	return ret;
+}
+
+void snap_unmap(struct snapshot *snap)
+{
+	if (snap->file)
+		munmap(snap->file, snap->len);
+	if (snap->map)
+		munmap(snap->map, snap->len);
+	snap->map = NULL;
+	snap->file = NULL;
+	snap->len = 0;
+}
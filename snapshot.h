@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * snapshot.h - persistent registry snapshot
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "registry.h"
+#include "disclog.h"
+
+#define SNAP_MAGIC		"acdcsnap"
+#define SNAP_VERSION		2
+
+/* Alignment of the sections of a snapshot file */
+#define SNAP_ALIGN		4096
+
+/* Largest number of records in the snapshot benchmark */
+#define SNAP_BENCH_RECS		100000
+
+/**
+ * struct snap_hdr - header of a registry snapshot file
+ *
+ * @magic:         SNAP_MAGIC
+ * @version:       SNAP_VERSION
+ * @entry_size:    size of struct reg_entry
+ * @num_recs:      number of registered records
+ * @max_recs:      room for records at @entries_off
+ * @num_slots:     number of hash index slots at @slots_off
+ * @data_crc:      CRC32C of the log page, the entries and the slots
+ *                 in use
+ * @genctr:        registry generation
+ * @log_off:       offset of the discovery log page
+ * @log_size:      room for the log page at @log_off
+ * @entries_off:   offset of the struct reg_entry array
+ * @slots_off:     offset of the struct reg_slot array
+ * @file_size:     size of the complete file
+ * @crc:           CRC32C of the header up to @crc
+ *
+ * The header is followed by the discovery log page in wire format
+ * and by the registry entries and hash index as kept in memory, in
+ * native byte order, each starting on a SNAP_ALIGN boundary. Unused
+ * room is left as a hole.
+ */
+struct snap_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 entry_size;
+	__u32 num_recs;
+	__u32 max_recs;
+	__u32 num_slots;
+	__u32 data_crc;
+	__u64 genctr;
+	__u64 log_off;
+	__u64 log_size;
+	__u64 entries_off;
+	__u64 slots_off;
+	__u64 file_size;
+	__u32 crc;
+};
+
+/**
+ * struct snapshot - mapped registry snapshot
+ *
+ * @map:           private mapping of the snapshot file, NULL if none
+ * @len:           length of @map
+ * @file:          shared read-only mapping of the file while its
+ *                 contents are not verified yet, NULL otherwise
+ */
+struct snapshot {
+	void *map;
+	size_t len;
+	void *file;
+};
+
+int snap_save(const char *path, struct registry *reg, struct disc_log *log);
+int snap_load(struct snapshot *snap, const char *path, struct registry *reg,
+	      struct disc_log **logp, const char *subnqn);
+int snap_verify(struct snapshot *snap);
+void snap_unmap(struct snapshot *snap);
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * uring.c - minimal io_uring interface
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Thin wrapper around the raw io_uring system calls, providing just
+ * enough to queue SQEs and reap CQEs from a single thread.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/*
+ * Set up a ring with @entries submission queue entries.
+ * Returns 0 on success or a negative errno value.
+ */
+int uring_init(struct uring *ring, unsigned int entries, unsigned int flags)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	int fd, err;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+	fd = sys_io_uring_setup(entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->features = p.features;
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+	sq = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto out_close;
+	ring->sq_ring = sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto out_unmap_sq;
+	}
+	ring->cq_ring = cq;
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto out_unmap_cq;
+
+	ring->sq_head = sq + p.sq_off.head;
+	ring->sq_tail = sq + p.sq_off.tail;
+	ring->sq_mask = sq + p.sq_off.ring_mask;
+	ring->sq_array = sq + p.sq_off.array;
+	ring->cq_head = cq + p.cq_off.head;
+	ring->cq_tail = cq + p.cq_off.tail;
+	ring->cq_mask = cq + p.cq_off.ring_mask;
+	ring->cqes = cq + p.cq_off.cqes;
+	return 0;
+
+out_unmap_cq:
+	if (cq != sq)
+		munmap(cq, ring->cq_ring_sz);
+out_unmap_sq:
+	munmap(sq, ring->sq_ring_sz);
+out_close:
+	err = -errno;
+	close(fd);
+	ring->fd = -1;
+	return err;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+int uring_register(struct uring *ring, unsigned int opcode,
+		   void *arg, unsigned int nr_args)
+{
+	if (syscall(__NR_io_uring_register, ring->fd, opcode,
+		    arg, nr_args) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Return a cleared SQE, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Pass all queued SQEs to the kernel and wait for at least @wait_nr
+ * completions. Returns the number of SQEs submitted or a negative
+ * errno value.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int tail = *ring->sq_tail, mask = *ring->sq_mask;
+	unsigned int submitted = ring->sqe_tail - ring->sqe_head;
+	int ret;
+
+	while (ring->sqe_head != ring->sqe_tail) {
+		ring->sq_array[tail & mask] = ring->sqe_head & mask;
+		tail++;
+		ring->sqe_head++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = sys_io_uring_enter(ring->fd, submitted, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/*
+ * Return the next CQE, waiting for it if necessary; NULL on error.
+ */
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring)
+{
+	struct io_uring_cqe *cqe;
+
+	while (!(cqe = uring_peek_cqe(ring))) {
+		if (sys_io_uring_enter(ring->fd, 0, 1,
+				       IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			return NULL;
+	}
+	return cqe;
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * uring.h - minimal io_uring interface
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/**
+ * struct uring - io_uring instance
+ *
+ * @fd:            ring file descriptor
+ * @sq_entries:    number of submission queue entries
+ * @cq_entries:    number of completion queue entries
+ * @sq_head:       kernel submission queue head
+ * @sq_tail:       submission queue tail shared with the kernel
+ * @sq_mask:       submission queue index mask
+ * @sq_array:      submission queue index array
+ * @sqes:          submission queue entries
+ * @sqe_head:      first SQE not yet passed to the kernel
+ * @sqe_tail:      next SQE to be handed out by uring_get_sqe()
+ * @cq_head:       completion queue head
+ * @cq_tail:       completion queue tail
+ * @cq_mask:       completion queue index mask
+ * @cqes:          completion queue entries
+ * @sq_ring:       mapping of the submission queue ring
+ * @sq_ring_sz:    size of @sq_ring
+ * @cq_ring:       mapping of the completion queue ring, may be @sq_ring
+ * @cq_ring_sz:    size of @cq_ring
+ * @features:      IORING_FEAT_* flags reported by the kernel
+ */
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sqe_head;
+	unsigned int sqe_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	unsigned int features;
+};
+
+int uring_init(struct uring *ring, unsigned int entries, unsigned int flags);
+void uring_exit(struct uring *ring);
+int uring_register(struct uring *ring, unsigned int opcode,
+		   void *arg, unsigned int nr_args);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* _URING_H */
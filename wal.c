@@ -0,0 +1,385 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * wal.c - write-ahead log of registry changes
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Registry changes are appended to the log as compact checksummed
+ * records before they are acknowledged. Records are collected in
+ * memory and committed in groups, with one write and one fdatasync()
+ * for all changes of an event loop iteration, so a registration
+ * storm does not pay a disk flush per KDReq. On startup the log is
+ * read sequentially in large chunks and replayed on top of the last
+ * snapshot; a torn record at the end, left by a crash during a
+ * commit, ends the replay and is cut off. The log is reset once a
+ * snapshot holds all of its changes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "acdc.h"
+#include "wal.h"
+#include "crc32c.h"
+
+void wal_init(struct wal *wal)
+{
+	memset(wal, 0, sizeof(*wal));
+	wal->fd = -1;
+}
+
+static int wal_write(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Decode record @r of @len bytes into @rec and @ddc.
+ * Returns the operation, or -EINVAL if the record is malformed.
+ */
+static int wal_rec_decode(struct wal_rec *r, size_t len, struct port_rec *rec,
+			  struct in6_addr *ddc)
+{
+	/* Any __u8 traddr_len leaves room for the NUL in NVMF_TRADDR_SIZE */
+	if (le32toh(r->crc) != crc32c(&r->len, len - sizeof(r->crc)) ||
+	    (r->op != WAL_REC_ADD && r->op != WAL_REC_DEL) ||
+	    sizeof(*r) + r->traddr_len + r->trsvcid_len > len ||
+	    r->trsvcid_len >= sizeof(rec->trsvcid))
+		return -EINVAL;
+	memset(rec, 0, sizeof(*rec));
+	rec->trtype = r->trtype;
+	rec->adrfam = r->adrfam;
+	rec->portid = (int)le32toh(r->portid);
+	memcpy(rec->traddr, r->data, r->traddr_len);
+	memcpy(rec->trsvcid, r->data + r->traddr_len, r->trsvcid_len);
+	memcpy(ddc, r->ddc, sizeof(*ddc));
+	return r->op;
+}
+
+/*
+ * Apply the records from offset @off of the log to @reg, and cut off
+ * a torn record at the end. Returns the number of records replayed,
+ * or a negative errno value.
+ */
+static int wal_replay(struct wal *wal, struct registry *reg, off_t off)
+{
+	struct port_rec rec;
+	struct in6_addr ddc;
+	struct wal_rec *r;
+	size_t have = 0, pos, len;
+	off_t end;
+	ssize_t n;
+	char *buf;
+	int op, num = 0, ret = 0;
+
+	buf = malloc(WAL_READ_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	for (;;) {
+		n = pread(wal->fd, buf + have, WAL_READ_SIZE - have,
+			  off + have);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto out;
+		}
+		have += n;
+		for (pos = 0; have - pos >= sizeof(*r); pos += len) {
+			r = (struct wal_rec *)(buf + pos);
+			len = le16toh(r->len);
+			if (len < sizeof(*r) || len > WAL_REC_MAX || len & 3)
+				goto torn;
+			if (have - pos < len)
+				break;
+			op = wal_rec_decode(r, len, &rec, &ddc);
+			if (op < 0)
+				goto torn;
+			if (op == WAL_REC_ADD)
+				ret = registry_add(reg, &rec, &ddc);
+			else
+				ret = registry_del(reg, &rec);
+			if (ret < 0)
+				goto out;
+			num++;
+		}
+		/* What is left at the end is a torn record */
+		if (!n)
+			break;
+		off += pos;
+		have -= pos;
+		memmove(buf, buf + pos, have);
+	}
+torn:
+	off += pos;
+	end = lseek(wal->fd, 0, SEEK_END);
+	if (end > off) {
+		fprintf(stderr, "WAL: discarding %lld bytes after the last "
+			"complete record\n", (long long)(end - off));
+		if (ftruncate(wal->fd, off) < 0 || fdatasync(wal->fd) < 0) {
+			ret = -errno;
+			goto out;
+		}
+	}
+	wal->off = off;
+	ret = num;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Open or create the log at @path and replay its records into @reg.
+ * Returns the number of records replayed, or a negative errno value.
+ */
+int wal_open(struct wal *wal, const char *path, struct registry *reg)
+{
+	struct wal_file_hdr hdr;
+	ssize_t n;
+	int ret;
+
+	wal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (wal->fd < 0)
+		return -errno;
+	n = pread(wal->fd, &hdr, sizeof(hdr), 0);
+	if (n < 0) {
+		ret = -errno;
+		goto out_close;
+	}
+	if (!n) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, WAL_MAGIC, sizeof(WAL_MAGIC));
+		hdr.version = htole32(WAL_VERSION);
+		ret = wal_write(wal->fd, &hdr, sizeof(hdr), 0);
+		if (!ret && fdatasync(wal->fd) < 0)
+			ret = -errno;
+		if (ret < 0)
+			goto out_close;
+		wal->off = sizeof(hdr);
+		return 0;
+	}
+	if ((size_t)n < sizeof(hdr) ||
+	    memcmp(hdr.magic, WAL_MAGIC, sizeof(WAL_MAGIC))) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+	if (le32toh(hdr.version) != WAL_VERSION) {
+		ret = -EPROTO;
+		goto out_close;
+	}
+	ret = wal_replay(wal, reg, sizeof(hdr));
+	if (ret >= 0)
+		return ret;
+out_close:
+	close(wal->fd);
+	wal->fd = -1;
+	return ret;
+}
+
+/*
+ * Append a record for @op on @rec, sent by @ddc, to be written by
+ * the next wal_commit(). Returns 0 or -ENOMEM.
+ */
+int wal_append(struct wal *wal, enum wal_op op, const struct port_rec *rec,
+	       const struct in6_addr *ddc)
+{
+	size_t traddr_len = strnlen(rec->traddr, sizeof(rec->traddr) - 1);
+	size_t trsvcid_len = strnlen(rec->trsvcid, sizeof(rec->trsvcid) - 1);
+	size_t len = (sizeof(struct wal_rec) + traddr_len + trsvcid_len + 3) & ~3;
+	struct wal_rec *r;
+	char *buf;
+
+	if (wal->len + len > wal->size) {
+		size_t size = wal->size ? wal->size : 4096;
+
+		while (size < wal->len + len)
+			size <<= 1;
+		buf = realloc(wal->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		wal->buf = buf;
+		wal->size = size;
+	}
+	r = (struct wal_rec *)(wal->buf + wal->len);
+	memset(r, 0, len);
+	r->len = htole16(len);
+	r->op = op;
+	r->trtype = rec->trtype;
+	r->adrfam = rec->adrfam;
+	r->traddr_len = traddr_len;
+	r->trsvcid_len = trsvcid_len;
+	r->portid = htole32((__u32)rec->portid);
+	if (ddc)
+		memcpy(r->ddc, ddc, sizeof(r->ddc));
+	memcpy(r->data, rec->traddr, traddr_len);
+	memcpy(r->data + traddr_len, rec->trsvcid, trsvcid_len);
+	r->crc = htole32(crc32c(&r->len, len - sizeof(r->crc)));
+	wal->len += len;
+	wal->num_pending++;
+	return 0;
+}
+
+/*
+ * Write all records appended since the last commit and make them
+ * durable. Records which could not be written are kept, and written
+ * again at the same offset by the next commit. Returns 0 or a
+ * negative errno value.
+ */
+int wal_commit(struct wal *wal)
+{
+	int ret;
+
+	if (!wal->len)
+		return 0;
+	ret = wal_write(wal->fd, wal->buf, wal->len, wal->off);
+	if (!ret && fdatasync(wal->fd) < 0)
+		ret = -errno;
+	if (ret < 0)
+		return ret;
+	wal->off += wal->len;
+	wal->num_recs += wal->num_pending;
+	wal->num_commits++;
+	wal->len = 0;
+	wal->num_pending = 0;
+	return 0;
+}
+
+/*
+ * Drop all committed records, once a snapshot holds their changes.
+ * Returns 0 or a negative errno value.
+ */
+int wal_reset(struct wal *wal)
+{
+	if (ftruncate(wal->fd, sizeof(struct wal_file_hdr)) < 0 ||
+	    fdatasync(wal->fd) < 0)
+		return -errno;
+	wal->off = sizeof(struct wal_file_hdr);
+	return 0;
+}
+
+void wal_close(struct wal *wal)
+{
+	if (wal->fd >= 0)
+		close(wal->fd);
+	free(wal->buf);
+	wal_init(wal);
+}
+
+/*
+ * Time committing registrations to a log in @dir one by one against
+ * committing them in groups, and replaying @num_recs records.
+ */
+int wal_bench(const char *dir, int num_recs)
+{
+	static const int batches[] = { 1, 16, 256 };
+	struct in6_addr ddc = IN6ADDR_LOOPBACK_INIT;
+	struct registry reg;
+	struct port_rec rec;
+	struct timespec start, end;
+	struct wal wal;
+	char path[PATH_MAX];
+	double us;
+	int b, i, ret = 1;
+
+	snprintf(path, sizeof(path), "%s/acdc-bench.wal", dir);
+	registry_init(&reg);
+	for (b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++) {
+		unlink(path);
+		wal_init(&wal);
+		if (wal_open(&wal, path, &reg) < 0) {
+			perror(path);
+			goto out;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < WAL_BENCH_COMMIT_RECS; i++) {
+			port_rec_bench(&rec, i);
+			if (wal_append(&wal, WAL_REC_ADD, &rec, &ddc) < 0 ||
+			    ((i + 1) % batches[b] == 0 && wal_commit(&wal) < 0)) {
+				fprintf(stderr, "WAL commit failed\n");
+				wal_close(&wal);
+				goto out;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		us = timespec_diff_ns(&start, &end) / 1e3 /
+			WAL_BENCH_COMMIT_RECS;
+		printf("wal: %4d registrations per commit: %lu commits, "
+		       "%8.1f us/registration, %9.0f registrations/s\n",
+		       batches[b], wal.num_commits, us, 1e6 / us);
+		wal_close(&wal);
+	}
+
+	unlink(path);
+	wal_init(&wal);
+	if (wal_open(&wal, path, &reg) < 0) {
+		perror(path);
+		goto out;
+	}
+	for (i = 0; i < num_recs; i++) {
+		port_rec_bench(&rec, i);
+		if (wal_append(&wal, WAL_REC_ADD, &rec, &ddc) < 0 ||
+		    (wal.len >= WAL_READ_SIZE && wal_commit(&wal) < 0)) {
+			fprintf(stderr, "WAL commit failed\n");
+			wal_close(&wal);
+			goto out;
+		}
+	}
+	/* Deregister every other record again */
+	for (i = 0; i < num_recs; i += 2) {
+		port_rec_bench(&rec, i);
+		if (wal_append(&wal, WAL_REC_DEL, &rec, &ddc) < 0 ||
+		    (wal.len >= WAL_READ_SIZE && wal_commit(&wal) < 0)) {
+			fprintf(stderr, "WAL commit failed\n");
+			wal_close(&wal);
+			goto out;
+		}
+	}
+	if (wal_commit(&wal) < 0) {
+		fprintf(stderr, "WAL commit failed\n");
+		wal_close(&wal);
+		goto out;
+	}
+	wal_close(&wal);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = wal_open(&wal, path, &reg);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret < 0) {
+		fprintf(stderr, "WAL replay failed: %s\n", strerror(-ret));
+		ret = 1;
+		goto out;
+	}
+	us = timespec_diff_ns(&start, &end) / 1e3;
+	printf("wal: replayed %d records, %lld bytes, in %.1f ms, "
+	       "%.0f MB/s, %d records registered\n", ret,
+	       (long long)wal.off, us / 1000, wal.off / us,
+	       reg.num_recs);
+	ret = ret != num_recs + (num_recs + 1) / 2 ||
+		reg.num_recs != num_recs / 2;
+	wal_close(&wal);
+out:
+	unlink(path);
+	registry_free(&reg);
+	return ret;
+}
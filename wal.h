@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * wal.h - write-ahead log of registry changes
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _WAL_H
+#define _WAL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+
+#include "registry.h"
+
+#define WAL_MAGIC		"acdcwal"
+#define WAL_VERSION		1
+
+/* Size of the reads replaying the log */
+#define WAL_READ_SIZE		(1024 * 1024)
+
+/* Records of the replay benchmark, and of the group commit benchmark */
+#define WAL_BENCH_RECS		1000000
+#define WAL_BENCH_COMMIT_RECS	4096
+
+enum wal_op {
+	WAL_REC_ADD = 1,
+	WAL_REC_DEL = 2,
+};
+
+/**
+ * struct wal_file_hdr - header of a write-ahead log file
+ *
+ * @magic:         WAL_MAGIC
+ * @version:       WAL_VERSION, little endian
+ * @rsvd:          reserved
+ */
+struct wal_file_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 rsvd;
+};
+
+/**
+ * struct wal_rec - registry change in the write-ahead log
+ *
+ * @crc:           CRC32C of the record following @crc
+ * @len:           length of the record, a multiple of 4
+ * @op:            WAL_REC_ADD or WAL_REC_DEL
+ * @trtype:        transport type
+ * @adrfam:        address family
+ * @traddr_len:    length of the transport address in @data
+ * @trsvcid_len:   length of the transport service id in @data
+ * @rsvd:          reserved
+ * @portid:        port id, -1 if unset
+ * @ddc:           address of the DDC which sent the change
+ * @data:          traddr followed by trsvcid, not NUL terminated,
+ *                 zero padded
+ *
+ * All fields are little endian.
+ */
+struct wal_rec {
+	__le32 crc;
+	__le16 len;
+	__u8 op;
+	__u8 trtype;
+	__u8 adrfam;
+	__u8 traddr_len;
+	__u8 trsvcid_len;
+	__u8 rsvd;
+	__le32 portid;
+	__u8 ddc[16];
+	char data[];
+};
+
+/* Largest record, with room for both strings */
+#define WAL_REC_MAX	((sizeof(struct wal_rec) + NVMF_TRADDR_SIZE + \
+			  NVMF_TRSVCID_SIZE + 3) & ~3)
+
+/**
+ * struct wal - write-ahead log
+ *
+ * @fd:            log file, -1 if not open
+ * @off:           end of the committed records in the file
+ * @buf:           records appended since the last commit
+ * @len:           number of bytes in @buf
+ * @size:          allocated size of @buf
+ * @num_pending:   number of records in @buf
+ * @num_recs:      number of records committed
+ * @num_commits:   number of commits, each with a single fdatasync()
+ */
+struct wal {
+	int fd;
+	off_t off;
+	char *buf;
+	size_t len;
+	size_t size;
+	unsigned long num_pending;
+	unsigned long num_recs;
+	unsigned long num_commits;
+};
+
+void wal_init(struct wal *wal);
+int wal_open(struct wal *wal, const char *path, struct registry *reg);
+int wal_append(struct wal *wal, enum wal_op op, const struct port_rec *rec,
+	       const struct in6_addr *ddc);
+int wal_commit(struct wal *wal);
+int wal_reset(struct wal *wal);
+void wal_close(struct wal *wal);
+int wal_bench(const char *dir, int num_recs);
+
+#endif /* _WAL_H */
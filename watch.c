@@ -0,0 +1,446 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * watch.c - re-register nvmet port changes with the CDCs
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Keeps the set of ports last registered with each CDC and only sends
+ * the ports which were added, removed or changed since then. Changes
+ * are detected with inotify on the ports directory and on each port
+ * directory. If inotify is not available, or runs out of watches, the
+ * directory timestamps are polled instead; as configfs does not update
+ * timestamps when an attribute is written, a full rescan is done every
+ * NVMET_WATCH_RESCAN polls in that case.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "acdc.h"
+
+/* Quiet period after an inotify event before the ports are rescanned */
+#define NVMET_WATCH_SETTLE_MS	100
+
+/* Polls between full rescans if inotify is not available */
+#define NVMET_WATCH_RESCAN	10
+
+/**
+ * struct watch_set - ports registered with some of the CDCs
+ *
+ * @refs:          number of CDCs the ports are registered with
+ * @recs:          ports, sorted by port id
+ * @num_recs:      number of ports in @recs
+ */
+struct watch_set {
+	int refs;
+	struct port_rec *recs;
+	int num_recs;
+};
+
+/**
+ * struct nvmet_watch - nvmet port change detection
+ *
+ * @root:          nvmet ports directory
+ * @mode:          attribute scan mode
+ * @ifd:           inotify instance, or -1 if polling
+ * @root_wd:       inotify watch of @root
+ * @gen:           directory timestamp digest of the last poll
+ * @polls:         number of polls since the last full rescan
+ * @sets:          ports registered with each CDC; the CDCs which
+ *                 are up to date share the same set
+ */
+struct nvmet_watch {
+	const char *root;
+	enum nvmet_scan_mode mode;
+	int ifd;
+	int root_wd;
+	unsigned long gen;
+	int polls;
+	struct watch_set **sets;
+};
+
+/* Takes ownership of the malloc()ed @recs */
+static struct watch_set *watch_set_new(struct port_rec *recs, int num_recs)
+{
+	struct watch_set *set;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+	set->recs = recs;
+	set->num_recs = num_recs;
+	return set;
+}
+
+static void watch_set_put(struct watch_set *set)
+{
+	if (--set->refs > 0)
+		return;
+	free(set->recs);
+	free(set);
+}
+
+static int watch_add_port(struct nvmet_watch *w, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", w->root, name);
+	if (inotify_add_watch(w->ifd, path, IN_MODIFY | IN_CLOSE_WRITE |
+			      IN_ATTRIB | IN_CREATE | IN_DELETE |
+			      IN_ONLYDIR) < 0) {
+		/* Port directory already removed again */
+		if (errno == ENOENT)
+			return 0;
+		return -errno;
+	}
+	return 0;
+}
+
+static void watch_stop_inotify(struct nvmet_watch *w, int err)
+{
+	fprintf(stderr, "inotify on %s: %s, polling instead\n",
+		w->root, strerror(err));
+	close(w->ifd);
+	w->ifd = -1;
+}
+
+/*
+ * Watch all existing port directories; adding a watch for a directory
+ * which is already watched is a no-op.
+ */
+static void watch_add_ports(struct nvmet_watch *w)
+{
+	struct dirent *d;
+	DIR *dir;
+	int err;
+
+	dir = opendir(w->root);
+	if (!dir) {
+		watch_stop_inotify(w, errno);
+		return;
+	}
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		err = watch_add_port(w, d->d_name);
+		if (err < 0) {
+			watch_stop_inotify(w, -err);
+			break;
+		}
+	}
+	closedir(dir);
+}
+
+static void watch_init_inotify(struct nvmet_watch *w)
+{
+	w->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->ifd < 0) {
+		fprintf(stderr, "inotify_init1: %s, polling instead\n",
+			strerror(errno));
+		return;
+	}
+	w->root_wd = inotify_add_watch(w->ifd, w->root, IN_CREATE |
+				       IN_DELETE | IN_MOVED_FROM |
+				       IN_MOVED_TO | IN_ONLYDIR);
+	if (w->root_wd < 0) {
+		watch_stop_inotify(w, errno);
+		return;
+	}
+	watch_add_ports(w);
+}
+
+/*
+ * Consume all pending inotify events, adding watches for new port
+ * directories. Returns 1 if anything changed, 0 if not.
+ */
+static int watch_drain_inotify(struct nvmet_watch *w)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int changed = 0, overflow = 0, err;
+	ssize_t len;
+	char *p;
+
+	while (w->ifd >= 0) {
+		len = read(w->ifd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				watch_stop_inotify(w, errno);
+			break;
+		}
+		for (p = buf; p < buf + len;
+		     p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			changed = 1;
+			if (ev->mask & IN_Q_OVERFLOW)
+				overflow = 1;
+			if (ev->wd != w->root_wd || !ev->len ||
+			    !(ev->mask & IN_ISDIR) ||
+			    !(ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				continue;
+			err = watch_add_port(w, ev->name);
+			if (err < 0) {
+				watch_stop_inotify(w, -err);
+				break;
+			}
+		}
+	}
+	/* Events were lost, so new port directories might be missed */
+	if (overflow && w->ifd >= 0)
+		watch_add_ports(w);
+	return changed;
+}
+
+static unsigned long watch_gen_stat(unsigned long gen, struct stat *st)
+{
+	gen = gen * 31 + st->st_mtim.tv_sec;
+	gen = gen * 31 + st->st_mtim.tv_nsec;
+	gen = gen * 31 + st->st_ctim.tv_sec;
+	gen = gen * 31 + st->st_ctim.tv_nsec;
+	return gen;
+}
+
+/*
+ * Digest of the timestamps of the ports directory and of all port
+ * directories, which change when a port or one of its subdirectories
+ * is created or removed.
+ */
+static unsigned long watch_poll_gen(struct nvmet_watch *w)
+{
+	struct dirent *d;
+	struct stat st;
+	unsigned long gen = 0;
+	DIR *dir;
+
+	dir = opendir(w->root);
+	if (!dir)
+		return 0;
+	if (!fstat(dirfd(dir), &st))
+		gen = watch_gen_stat(gen, &st);
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (!fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			gen = watch_gen_stat(gen, &st);
+	}
+	closedir(dir);
+	return gen;
+}
+
+/*
+ * Wait for the next change, or at most @interval seconds if @retry
+ * is set. Returns 1 if the ports should be rescanned.
+ */
+static int watch_wait(struct nvmet_watch *w, int interval, int retry)
+{
+	struct pollfd pfd;
+	unsigned long gen;
+	int ret;
+
+	if (w->ifd >= 0) {
+		pfd.fd = w->ifd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, retry ? interval * 1000 : -1);
+		if (ret < 0 && errno != EINTR) {
+			watch_stop_inotify(w, errno);
+			return 1;
+		}
+		if (ret <= 0)
+			return retry;
+		/* Wait for a burst of changes to complete */
+		while (watch_drain_inotify(w) && w->ifd >= 0) {
+			if (poll(&pfd, 1, NVMET_WATCH_SETTLE_MS) <= 0)
+				break;
+		}
+		return 1;
+	}
+
+	sleep(interval);
+	gen = watch_poll_gen(w);
+	if (retry || gen != w->gen || ++w->polls >= NVMET_WATCH_RESCAN) {
+		w->gen = gen;
+		w->polls = 0;
+		return 1;
+	}
+	return 0;
+}
+
+static void watch_print_delta(struct port_delta *pd)
+{
+	int i;
+
+	for (i = 0; i < pd->num_del; i++)
+		printf("Deregistering port %d: %s %s %s %s\n",
+		       pd->del[i].portid, nvmf_trtype_name(pd->del[i].trtype),
+		       nvmf_adrfam_name(pd->del[i].adrfam),
+		       pd->del[i].traddr, pd->del[i].trsvcid);
+	for (i = 0; i < pd->num_add; i++)
+		printf("Registering port %d: %s %s %s %s\n",
+		       pd->add[i].portid, nvmf_trtype_name(pd->add[i].trtype),
+		       nvmf_adrfam_name(pd->add[i].adrfam),
+		       pd->add[i].traddr, pd->add[i].trsvcid);
+}
+
+/*
+ * Send the changes from @base to @set to the @num_group CDCs of
+ * @cdcs whose indices are in @group, which all have @base
+ * registered. The CDCs which acknowledged the changes have @set
+ * registered from now on. Returns the number of CDCs which failed.
+ */
+static int watch_update_group(struct nvmet_watch *w, struct cdc_ctx *cdcs,
+			      int *group, int num_group,
+			      struct watch_set *base, struct watch_set *set,
+			      struct kickstart_opts *opts)
+{
+	struct port_delta pd;
+	struct cdc_ctx *ctxs = NULL, *cdc;
+	int i, changed, failed = 0;
+
+	if (port_delta_diff(&pd, base->recs, base->num_recs,
+			    set->recs, set->num_recs) < 0)
+		return num_group;
+	changed = pd.num_add || pd.num_del;
+	if (changed) {
+		/* Kickstart the CDCs of the group only */
+		ctxs = calloc(num_group, sizeof(*ctxs));
+		if (!ctxs) {
+			port_delta_free(&pd);
+			return num_group;
+		}
+		for (i = 0; i < num_group; i++)
+			ctxs[i] = cdcs[group[i]];
+		watch_print_delta(&pd);
+		kickstart_cdcs(ctxs, num_group, &pd, opts);
+		for (i = 0; i < num_group; i++)
+			cdcs[group[i]] = ctxs[i];
+		free(ctxs);
+	}
+	for (i = 0; i < num_group; i++) {
+		cdc = &cdcs[group[i]];
+		if (changed && cdc->state != CDC_DONE) {
+			/* Sent the changes since @base again next time */
+			failed++;
+			continue;
+		}
+		if (pd.num_add)
+			kickstart_referral(w->root, cdc, group[i], pd.add,
+					   pd.num_add);
+		set->refs++;
+		watch_set_put(w->sets[group[i]]);
+		w->sets[group[i]] = set;
+	}
+	port_delta_free(&pd);
+	return failed;
+}
+
+/*
+ * Rescan the ports and send each CDC the changes since its last
+ * successful registration. Returns 0 if the CDCs are up to date, or
+ * a negative errno value if the update is to be retried.
+ */
+static int watch_update(struct nvmet_watch *w, struct cdc_ctx *cdcs,
+			int num_cdcs, struct kickstart_opts *opts)
+{
+	enum nvmet_scan_mode mode = w->mode;
+	struct watch_set *set, *base;
+	struct port_rec *recs;
+	int num_recs, num_group, failed = 0, i, j;
+	int *group;
+	char *done;
+
+	/* A failed scan says nothing about removed ports; retry it */
+	num_recs = nvmet_scan_ports(w->root, &recs, &mode);
+	if (num_recs < 0)
+		return num_recs;
+	port_rec_sort(recs, num_recs);
+	set = watch_set_new(recs, num_recs);
+	group = calloc(num_cdcs, sizeof(*group));
+	done = calloc(num_cdcs, 1);
+	if (!set || !group || !done) {
+		if (set)
+			watch_set_put(set);
+		else
+			free(recs);
+		free(group);
+		free(done);
+		return -ENOMEM;
+	}
+	/* CDCs with the same ports registered get the same changes */
+	for (i = 0; i < num_cdcs; i++) {
+		if (done[i])
+			continue;
+		base = w->sets[i];
+		num_group = 0;
+		for (j = i; j < num_cdcs; j++) {
+			if (w->sets[j] == base) {
+				group[num_group++] = j;
+				done[j] = 1;
+			}
+		}
+		failed += watch_update_group(w, cdcs, group, num_group, base,
+					     set, opts);
+	}
+	free(group);
+	free(done);
+	/* No CDC acknowledged the changes */
+	if (!set->refs)
+		watch_set_put(set);
+	return failed ? -EAGAIN : 0;
+}
+
+/*
+ * Register all nvmet ports below @root with the CDCs, then keep
+ * watching for changes and send only those. Retries failed updates
+ * every @interval seconds, which is also the polling interval if
+ * inotify is not available. Does not return.
+ */
+int nvmet_watch(const char *root, enum nvmet_scan_mode mode,
+		struct cdc_ctx *cdcs, int num_cdcs,
+		struct kickstart_opts *opts, int interval)
+{
+	struct nvmet_watch w = {
+		.root = root,
+		.mode = mode,
+		.ifd = -1,
+		.root_wd = -1,
+	};
+	struct watch_set *none;
+	int i, ret = 0;
+
+	/* Nothing is registered with any CDC yet */
+	none = watch_set_new(NULL, 0);
+	w.sets = calloc(num_cdcs, sizeof(*w.sets));
+	if (!none || !w.sets) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < num_cdcs; i++)
+		w.sets[i] = none;
+	none->refs = num_cdcs;
+
+	/* Progress is logged, so do not hold it back in a pipe buffer */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* Set up the watches first to not miss changes during the scan */
+	watch_init_inotify(&w);
+	if (w.ifd < 0)
+		w.gen = watch_poll_gen(&w);
+	ret = watch_update(&w, cdcs, num_cdcs, opts);
+	for (;;) {
+		if (watch_wait(&w, interval, ret < 0))
+			ret = watch_update(&w, cdcs, num_cdcs, opts);
+	}
+	return 0;
+}
@@ -0,0 +1,429 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * wheel.c - hashed hierarchical timer wheel
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ *
+ * Connection timeouts, keep-alives and reconnect delays of an event
+ * loop are kept in one timer wheel with 1 ms ticks, driven by a
+ * single timerfd the loop waits for along with its sockets. Timers
+ * are embedded in the objects they time, so arming, re-arming and
+ * cancelling them allocates nothing and touches one slot; when the
+ * timerfd fires, all timers due are expired in one pass and the
+ * timerfd is armed again for the next non-empty slot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "acdc.h"
+#include "wheel.h"
+
+int wheel_init(struct wheel *w, wheel_fn_t fn, void *priv)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0)
+		return -errno;
+	clock_gettime(CLOCK_MONOTONIC, &w->base);
+	w->armed = UINT64_MAX;
+	w->fn = fn;
+	w->priv = priv;
+	return 0;
+}
+
+/* Pending timers are forgotten, they are owned by their objects */
+void wheel_free(struct wheel *w)
+{
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+}
+
+/* Current tick */
+__u64 wheel_tick(struct wheel *w)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((__s64)(now.tv_sec - w->base.tv_sec) * 1000000000LL +
+		now.tv_nsec - w->base.tv_nsec) / 1000000;
+}
+
+/* Arm the timerfd for @tick */
+static void wheel_arm(struct wheel *w, __u64 tick)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = w->base.tv_sec + tick / 1000;
+	its.it_value.tv_nsec = w->base.tv_nsec + (tick % 1000) * 1000000;
+	if (its.it_value.tv_nsec >= 1000000000) {
+		its.it_value.tv_sec++;
+		its.it_value.tv_nsec -= 1000000000;
+	}
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		return;
+	}
+	w->armed = tick;
+}
+
+/* Link @t into the slot for its expiry tick */
+static void wheel_insert(struct wheel *w, struct wheel_timer *t)
+{
+	__u64 expires = t->expires, delta;
+	struct wheel_timer **head;
+	int level, idx;
+
+	/* Timers already due expire with the next tick processed */
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+	if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+		delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+		expires = w->now + delta;
+	}
+	for (level = 0; delta >> (WHEEL_BITS * (level + 1)); level++)
+		;
+	idx = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	head = &w->slots[level][idx];
+	t->next = *head;
+	if (*head)
+		(*head)->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+	t->slot = level * WHEEL_SIZE + idx;
+	w->map[level][idx / 64] |= 1ULL << (idx % 64);
+}
+
+static void wheel_unlink(struct wheel *w, struct wheel_timer *t)
+{
+	int level = t->slot / WHEEL_SIZE, idx = t->slot % WHEEL_SIZE;
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	/* Also right for timers of detached slots */
+	if (!w->slots[level][idx])
+		w->map[level][idx / 64] &= ~(1ULL << (idx % 64));
+}
+
+/*
+ * Take the timers of a slot off the wheel; they stay pending, and the
+ * caller links them again.
+ */
+static struct wheel_timer *wheel_detach(struct wheel *w, int level, int idx)
+{
+	struct wheel_timer *list = w->slots[level][idx];
+
+	w->slots[level][idx] = NULL;
+	w->map[level][idx / 64] &= ~(1ULL << (idx % 64));
+	return list;
+}
+
+/*
+ * Start @t to expire in @ms, or restart it if it is pending.
+ */
+void wheel_add(struct wheel *w, struct wheel_timer *t, unsigned long ms)
+{
+	wheel_del(w, t);
+	t->expires = wheel_tick(w) + ms;
+	wheel_insert(w, t);
+	w->num_timers++;
+	/* Timers added in order of expiry do not touch the timerfd */
+	if (t->expires < w->armed)
+		wheel_arm(w, t->expires < w->now ? w->now : t->expires);
+}
+
+void wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+	if (!t->pprev)
+		return;
+	wheel_unlink(w, t);
+	w->num_timers--;
+}
+
+/* First set bit of @map at or after @from, or -1 */
+static int wheel_find(const __u64 *map, int from)
+{
+	int i = from / 64;
+	__u64 bits;
+
+	if (from >= WHEEL_SIZE)
+		return -1;
+	bits = map[i] & (~0ULL << (from % 64));
+	for (;;) {
+		if (bits)
+			return i * 64 + __builtin_ctzll(bits);
+		if (++i == WHEEL_SIZE / 64)
+			return -1;
+		bits = map[i];
+	}
+}
+
+/*
+ * Tick of the next expiry of a level 0 timer or of the next move of
+ * higher level timers, whichever comes first; UINT64_MAX if no timer
+ * is pending.
+ */
+static __u64 wheel_next(struct wheel *w)
+{
+	__u64 next = UINT64_MAX, tick;
+	int level, shift, cur, start, idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		cur = (w->now >> shift) & WHEEL_MASK;
+		/* The slot of the current tick moves with it, if due */
+		start = cur;
+		if (level && (w->now & ((1ULL << shift) - 1)))
+			start++;
+		idx = wheel_find(w->map[level], start);
+		tick = (w->now >> shift) - cur;
+		if (idx < 0) {
+			/* Slots before @start come round again next */
+			idx = wheel_find(w->map[level], 0);
+			if (idx < 0 || idx >= start)
+				continue;
+			tick += WHEEL_SIZE;
+		}
+		tick = (tick + idx) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/* Move the timers of the slots the current tick wrapped around to */
+static void wheel_cascade(struct wheel *w)
+{
+	struct wheel_timer *list, *t;
+	int level, idx;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		idx = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		list = wheel_detach(w, level, idx);
+		while ((t = list)) {
+			list = t->next;
+			wheel_insert(w, t);
+			w->num_cascaded++;
+		}
+		if (idx)
+			break;
+	}
+}
+
+/* Expire the timers of the current tick and advance to the next one */
+static int wheel_expire(struct wheel *w)
+{
+	struct wheel_timer *list, *t;
+	int num = 0;
+
+	list = wheel_detach(w, 0, w->now & WHEEL_MASK);
+	/* wheel_del() by the handlers unlinks from @list */
+	if (list)
+		list->pprev = &list;
+	/* Timers added by the handlers expire with later ticks */
+	w->now++;
+	while ((t = list)) {
+		wheel_unlink(w, t);
+		w->num_timers--;
+		w->fn(w->priv, t);
+		num++;
+	}
+	w->num_expired += num;
+	return num;
+}
+
+/*
+ * Expire all timers due, and arm the timerfd for the next one.
+ * Returns the number of timers expired.
+ */
+int wheel_run(struct wheel *w)
+{
+	__u64 target = wheel_tick(w) + 1, next;
+	int num = 0;
+
+	w->num_runs++;
+	/* The timerfd fired or is armed for a later tick */
+	w->armed = UINT64_MAX;
+	while (w->num_timers) {
+		/* Skip the ticks without timers to expire or move */
+		next = wheel_next(w);
+		if (next >= target)
+			break;
+		w->now = next;
+		if (!(w->now & WHEEL_MASK))
+			wheel_cascade(w);
+		num += wheel_expire(w);
+	}
+	if (w->now < target)
+		w->now = target;
+	if (w->num_timers) {
+		next = wheel_next(w);
+		if (next != UINT64_MAX)
+			wheel_arm(w, next);
+	}
+	return num;
+}
+
+/* Handle the timerfd becoming readable, see wheel_run() */
+int wheel_event(struct wheel *w)
+{
+	uint64_t val;
+
+	if (read(w->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("read timerfd");
+	return wheel_run(w);
+}
+
+/**
+ * struct wheel_bench - state of the timer wheel benchmark
+ *
+ * @tick:          tick the timers are expired at
+ * @num_expired:   number of timers expired
+ * @late:          sum of the ticks the timers expired late
+ * @max_late:      most ticks a timer expired late
+ */
+struct wheel_bench {
+	__u64 tick;
+	unsigned long num_expired;
+	__u64 late;
+	__u64 max_late;
+};
+
+static void wheel_bench_fn(void *priv, struct wheel_timer *t)
+{
+	struct wheel_bench *b = priv;
+	__u64 late = b->tick > t->expires ? b->tick - t->expires : 0;
+
+	b->num_expired++;
+	b->late += late;
+	if (late > b->max_late)
+		b->max_late = late;
+}
+
+/* Keep alive timeouts between 30 and 60 s, spread over the sessions */
+static unsigned long wheel_bench_kato(int i, int round)
+{
+	return 30000 + ((unsigned long)i * 7919 + round * 104729) % 30000;
+}
+
+/*
+ * Time arming, re-arming and cancelling @num_timers keep alive
+ * timers, compare finding the next deadline with scanning the
+ * deadlines of all sessions, and expire @num_timers timers spread
+ * over WHEEL_BENCH_SPREAD_MS through the timerfd.
+ */
+int wheel_bench(int num_timers)
+{
+	struct wheel_bench b;
+	struct wheel w;
+	struct wheel_timer *timers;
+	struct timespec *deadlines, start, end, t0, t1, min;
+	struct pollfd pfd;
+	volatile __u64 sink = 0;
+	double ns, run_ns = 0;
+	int i, round, ret = 1;
+
+	timers = calloc(num_timers, sizeof(*timers));
+	deadlines = calloc(num_timers, sizeof(*deadlines));
+	if (!timers || !deadlines) {
+		perror("calloc");
+		goto out_free;
+	}
+	memset(&b, 0, sizeof(b));
+	if (wheel_init(&w, wheel_bench_fn, &b) < 0) {
+		perror("timerfd_create");
+		goto out_free;
+	}
+	printf("wheel: %d sessions, %d levels of %d slots, 1 ms ticks\n",
+	       num_timers, WHEEL_LEVELS, WHEEL_SIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_timers; i++)
+		wheel_add(&w, &timers[i], wheel_bench_kato(i, 0));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("wheel: arm:     %7.1f ns/timer\n",
+	       (double)timespec_diff_ns(&start, &end) / num_timers);
+
+	/* Each session re-arming its keep alive timer on traffic */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 1; round <= 10; round++) {
+		for (i = 0; i < num_timers; i++)
+			wheel_add(&w, &timers[i], wheel_bench_kato(i, round));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("wheel: re-arm:  %7.1f ns/timer\n",
+	       (double)timespec_diff_ns(&start, &end) / (num_timers * 10));
+
+	/* Finding the next timer, against scanning all deadlines */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 1000; i++)
+		sink += wheel_next(&w);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (double)timespec_diff_ns(&start, &end) / 1000;
+	for (i = 0; i < num_timers; i++) {
+		deadlines[i] = w.base;
+		timespec_add_ms(&deadlines[i], timers[i].expires);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < 100; round++) {
+		min = deadlines[0];
+		for (i = 1; i < num_timers; i++) {
+			if (timespec_diff_ms(&deadlines[i], &min) > 0)
+				min = deadlines[i];
+		}
+		sink += min.tv_nsec;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("wheel: next:    %7.1f ns/event, scanning all deadlines "
+	       "%.1f us/event\n", ns, timespec_diff_ns(&start, &end) / 1e5);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < num_timers; i++)
+		wheel_del(&w, &timers[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("wheel: cancel:  %7.1f ns/timer\n",
+	       (double)timespec_diff_ns(&start, &end) / num_timers);
+
+	w.num_runs = w.num_expired = w.num_cascaded = 0;
+	for (i = 0; i < num_timers; i++)
+		wheel_add(&w, &timers[i], 1 + i % WHEEL_BENCH_SPREAD_MS);
+	pfd.fd = w.fd;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (b.num_expired < num_timers) {
+		if (poll(&pfd, 1, WHEEL_BENCH_SPREAD_MS * 2) <= 0) {
+			fprintf(stderr, "wheel: %lu of %d timers expired\n",
+				b.num_expired, num_timers);
+			goto out_wheel;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		b.tick = wheel_tick(&w);
+		wheel_event(&w);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		run_ns += (double)timespec_diff_ns(&t0, &t1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("wheel: expire:  %7.1f ns/timer, %lu wakeups in %.0f ms, "
+	       "%lu moved down, %.2f ms late on average, %llu ms at most\n",
+	       run_ns / num_timers, w.num_runs,
+	       timespec_diff_ns(&start, &end) / 1e6, w.num_cascaded,
+	       (double)b.late / num_timers, (unsigned long long)b.max_late);
+	ret = 0;
+out_wheel:
+	wheel_free(&w);
+out_free:
+	free(deadlines);
+	free(timers);
+	return ret;
+}
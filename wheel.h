@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * wheel.h - hashed hierarchical timer wheel
+ *
+ * Copyright (c) 2022 Hannes Reinecke, SUSE Labs. All rights reserved.
+ */
+
+#ifndef _WHEEL_H
+#define _WHEEL_H
+
+#include <stddef.h>
+#include <time.h>
+#include <linux/types.h>
+
+/*
+ * Slots per level as a power of two, and number of levels; with 1 ms
+ * ticks timers up to 2^32 ms (49 days) ahead are kept without
+ * clamping
+ */
+#define WHEEL_BITS		8
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+
+/* Timers of the wheel benchmark, and the time they are spread over */
+#define WHEEL_BENCH_TIMERS	100000
+#define WHEEL_BENCH_SPREAD_MS	1000
+
+/* Structure embedding the timer @ptr as @member */
+#define wheel_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/**
+ * struct wheel_timer - timer embedded in the object it times
+ *
+ * @next:          next timer in the slot
+ * @pprev:         link pointing to this timer, NULL if not pending
+ * @expires:       tick the timer expires at
+ * @slot:          level * WHEEL_SIZE + index of the slot holding the
+ *                 timer
+ *
+ * A zeroed timer is not pending.
+ */
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	__u64 expires;
+	int slot;
+};
+
+/* Called with each expired timer, which is no longer pending */
+typedef void (*wheel_fn_t)(void *priv, struct wheel_timer *t);
+
+/**
+ * struct wheel - timers of one event loop
+ *
+ * @fd:            timerfd to wait for in the event loop
+ * @base:          time of tick 0
+ * @now:           next tick to be processed; all timers expiring
+ *                 before it have run
+ * @armed:         tick @fd is armed for, UINT64_MAX if none
+ * @num_timers:    number of pending timers
+ * @fn:            expiry handler of all timers
+ * @priv:          argument of @fn
+ * @map:           bitmap of the non-empty slots of each level
+ * @slots:         timers of each slot of each level
+ * @num_runs:      number of times expired timers were looked for
+ * @num_expired:   number of timers expired
+ * @num_cascaded:  number of timers moved to a lower level
+ *
+ * A timer expiring less than WHEEL_SIZE^(level + 1) ticks ahead is
+ * hashed into the lowest such level by the bits of its expiry tick
+ * for that level; each time the ticks of a level wrap around, the
+ * timers of the next slot of the level above are moved down. Adding
+ * and cancelling a timer thus costs O(1), and expiring timers O(1)
+ * per timer, however many are pending. @fd is armed for the earliest
+ * non-empty slot, so that idle loops are not woken up every tick.
+ */
+struct wheel {
+	int fd;
+	struct timespec base;
+	__u64 now;
+	__u64 armed;
+	int num_timers;
+	wheel_fn_t fn;
+	void *priv;
+	__u64 map[WHEEL_LEVELS][WHEEL_SIZE / 64];
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+	unsigned long num_runs;
+	unsigned long num_expired;
+	unsigned long num_cascaded;
+};
+
+static inline int wheel_pending(struct wheel_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+int wheel_init(struct wheel *w, wheel_fn_t fn, void *priv);
+void wheel_free(struct wheel *w);
+__u64 wheel_tick(struct wheel *w);
+void wheel_add(struct wheel *w, struct wheel_timer *t, unsigned long ms);
+void wheel_del(struct wheel *w, struct wheel_timer *t);
+int wheel_run(struct wheel *w);
+int wheel_event(struct wheel *w);
+int wheel_bench(int num_timers);
+
+#endif /* _WHEEL_H */